@@ -57,6 +57,9 @@ static GOptionContext *make_option_context(const struct common_usage_info *info)
   GOptionContext *octx = g_option_context_new(info->parameter_string);
   g_option_context_set_summary(octx, info->summary);
   g_option_context_add_main_entries(octx, options, NULL);
+  if (info->options) {
+    g_option_context_add_main_entries(octx, info->options, NULL);
+  }
   return octx;
 }
 
@@ -30,6 +30,7 @@
 struct common_usage_info {
   const char *parameter_string;
   const char *summary;
+  const GOptionEntry *options;  // tool-specific options, or NULL
 };
 
 void common_fix_argv(int *argc, char ***argv);
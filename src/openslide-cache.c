@@ -23,6 +23,7 @@
 
 #include "openslide-private.h"
 
+#include <string.h>
 #include <glib.h>
 
 #if defined(HAVE_UINTPTR_T) || defined(uintptr_t)
@@ -33,8 +34,33 @@
 #define ptr_int uint64_t
 #endif
 
+// number of independently locked segments; must be a power of 2
+#define CACHE_SHARD_BITS 4
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
+
+// share of the capacity that the segmented policy reserves for entries
+// that have been hit since they were added
+#define PROTECTED_PERCENT 80
+
+// share of the capacity that pinned entries may occupy
+#define PINNED_PERCENT 50
+
+// bytes charged for a constant entry, which holds no pixel data, so
+// that such entries still age out
+#define CONSTANT_ENTRY_SIZE 64
+
+// buffers smaller than this are left to g_slice's own magazines
+#define BUFFER_POOL_MIN_SIZE (64 * 1024)
+// bytes of free buffers kept for reuse, across all sizes
+#define BUFFER_POOL_MAX_BYTES (64 * 1024 * 1024)
+
+// private tier of a cache shared between processes, holding the tiles
+// being drawn and recent copies from the shared segment
+#define SHARED_CACHE_LOCAL_CAPACITY (16 * 1024 * 1024)
+
 // hash table key
 struct _openslide_cache_key {
+  uint64_t binding_id;  // distinguishes slides sharing the cache
   void *plane;  // cookie for coordinate plane (level, grid, etc.)
   int64_t x;
   int64_t y;
@@ -44,7 +70,11 @@ struct _openslide_cache_key {
 struct _openslide_cache_value {
   GList *link;            // direct pointer to the node in the list
   struct _openslide_cache_key *key; // for removing keys when aged out
-  struct _openslide_cache *cache; // sadly, for total_bytes and the list
+  struct cache_shard *shard; // sadly, for total_size and the list
+  bool referenced;        // CLOCK bit, set on hit; shard mutex protects
+  bool is_protected;      // in the protected list
+  bool is_pinned;         // in the pinned list, and never evicted
+  GSList *pinners;        // bindings that pinned the entry
 
   struct _openslide_cache_entry *entry;  // may outlive the value
 };
@@ -52,47 +82,89 @@ struct _openslide_cache_value {
 // datum
 struct _openslide_cache_entry {
   gint refcount;  // atomic ops only
-  void *data;
-  int size;
+  void *data;     // points to pixel for a constant entry
+  int64_t size;
+  bool constant;
+  uint32_t pixel;
 };
 
-struct _openslide_cache {
+// one lock domain: a hashtable and a CLOCK list in insertion order
+// (newest at head).  The segmented policy moves entries that are hit
+// before their turn for eviction into a second, protected list, which
+// is only evicted from when the first is empty.  Pinned entries are
+// kept in a third list that eviction doesn't look at.
+struct cache_shard {
   GMutex *mutex;
   GQueue *list;
+  GQueue *protected_list;
+  GQueue *pinned_list;
   GHashTable *hashtable;
+  int64_t total_size;
 
-  int capacity;
-  int total_size;
-
-  gint warned_overlarge_entry;
+  struct _openslide_cache *cache;
 };
 
-// eviction
-// mutex must be held
-static void possibly_evict(struct _openslide_cache *cache, int incoming_size) {
-  g_assert(incoming_size >= 0);
+// The byte budget is global, and each shard has a fair share of it:
+// 1/CACHE_SHARDS of the capacity, or one entry if that is larger, so
+// that slides with large tiles can still cache them.  A put evicts from
+// its own shard only while that shard is over its share, and takes the
+// rest from the shards that are over theirs, holding one shard lock at
+// a time.  Which entries go then depends on recency within each shard
+// rather than on where the incoming key hashes.
+struct _openslide_cache {
+  struct cache_shard shards[CACHE_SHARDS];
 
-  int size = cache->total_size + incoming_size;
-  int target = cache->capacity;
+  gint refcount;  // atomic ops only
 
-  while(size > target) {
-    // get key of last element
-    struct _openslide_cache_value *value = g_queue_peek_tail(cache->list);
-    if (value == NULL) {
-      return; // cache is empty
-    }
-    struct _openslide_cache_key *key = value->key;
+  int64_t capacity;  // atomic ops only
+  int64_t total_size;  // atomic ops only
+  int64_t protected_size;  // atomic ops only
+  int64_t pinned_size;  // included in total_size; atomic ops only
+  gint policy;  // openslide_cache_policy_t; atomic ops only
 
-    //g_debug("EVICT: size: %d", value->entry->size);
+  struct _openslide_shm_cache *shm;  // shared between processes, or NULL
+  struct _openslide_disk_cache *disk;  // on local disk, or NULL
 
-    size -= value->entry->size;
+  gint warned_overlarge_entry;
+};
 
-    // remove from hashtable, this will trigger removal from everything
-    bool result = g_hash_table_remove(cache->hashtable, key);
-    g_assert(result);
-  }
+// a slide's reference to a cache
+// Plane cookies are only unique among open slides, so each binding gets
+// an ID that is never reused.  Otherwise a new slide could be served
+// stale tiles left behind in a shared cache by a closed one.
+struct _openslide_cache_binding {
+  struct _openslide_cache *cache;
+  uint64_t id;
+  enum _openslide_counter first_counter;  // hits, misses, evictions, bytes
+  bool low_priority;  // hits don't protect entries from eviction
+  gint pinned;  // may have pinned entries; atomic ops only
+  gint pinning;  // pins in progress; atomic ops only
+
+  // the slide's key in a cache shared between processes
+  bool have_identity;
+  uint64_t identity[2];
+  struct _openslide_level **levels;
+  int32_t level_count;
+};
+
+static uint64_t next_binding_id;
+G_LOCK_DEFINE_STATIC(next_binding_id);
+
+// glib < 2.30 has no 64-bit atomics, so use the GCC builtins
+static int64_t atomic_get64(int64_t *p) {
+  return __sync_fetch_and_add(p, 0);
+}
+
+static void atomic_set64(int64_t *p, int64_t value) {
+  int64_t old;
+  do {
+    old = *p;
+  } while (!__sync_bool_compare_and_swap(p, old, value));
 }
 
+static void atomic_add64(int64_t *p, int64_t n) {
+  __sync_fetch_and_add(p, n);
+}
 
 // hash function helpers
 static guint hash_func(gconstpointer key) {
@@ -100,6 +172,7 @@ static guint hash_func(gconstpointer key) {
 
   // assume 32-bit hash
   return (guint) (((ptr_int) c_key->plane) ^
+                  (c_key->binding_id * 40503) ^
                   ((34369 * (uint64_t) c_key->y) + ((uint64_t) c_key->x)));
 }
 
@@ -108,7 +181,174 @@ static gboolean key_equal_func(gconstpointer a,
   const struct _openslide_cache_key *c_a = a;
   const struct _openslide_cache_key *c_b = b;
 
-  return (c_a->plane == c_b->plane) && (c_a->x == c_b->x) && (c_a->y == c_b->y);
+  return (c_a->binding_id == c_b->binding_id) && (c_a->plane == c_b->plane) &&
+         (c_a->x == c_b->x) && (c_a->y == c_b->y);
+}
+
+static struct cache_shard *get_shard(struct _openslide_cache *cache,
+                                     const struct _openslide_cache_key *key) {
+  // use the high bits of a multiplicative hash, so the shard index is
+  // independent of the bucket index within the shard's hashtable
+  guint32 hash = hash_func(key) * 2654435769u;
+  return &cache->shards[hash >> (32 - CACHE_SHARD_BITS)];
+}
+
+static void list_move(GQueue *from, GQueue *to,
+                      struct _openslide_cache_value *value) {
+  g_queue_unlink(from, value->link);
+  g_queue_push_head_link(to, value->link);
+}
+
+// shard mutex must be held
+static void set_protected(struct cache_shard *shard,
+                          struct _openslide_cache_value *value,
+                          bool is_protected) {
+  if (is_protected) {
+    list_move(shard->list, shard->protected_list, value);
+    atomic_add64(&shard->cache->protected_size, value->entry->size);
+  } else {
+    list_move(shard->protected_list, shard->list, value);
+    atomic_add64(&shard->cache->protected_size, -value->entry->size);
+  }
+  value->is_protected = is_protected;
+  value->referenced = false;
+}
+
+// pin the entry for cb if a pin is in progress for cb and the pinned
+// share has room.  Views of a shared slide share entries, so an
+// entry stays pinned until every binding that pinned it unpins.
+// shard mutex must be held
+static void maybe_pin(struct _openslide_cache_binding *cb,
+                      struct cache_shard *shard,
+                      struct _openslide_cache_value *value) {
+  if (!g_atomic_int_get(&cb->pinning) ||
+      g_slist_find(value->pinners, cb)) {
+    return;
+  }
+  if (!value->is_pinned) {
+    struct _openslide_cache *cache = shard->cache;
+    int64_t size = value->entry->size;
+    int64_t limit = atomic_get64(&cache->capacity) / 100 * PINNED_PERCENT;
+    if (atomic_get64(&cache->pinned_size) + size > limit) {
+      return;
+    }
+    if (value->is_protected) {
+      set_protected(shard, value, false);
+    }
+    list_move(shard->list, shard->pinned_list, value);
+    atomic_add64(&cache->pinned_size, size);
+    value->is_pinned = true;
+  }
+  value->pinners = g_slist_prepend(value->pinners, cb);
+  g_atomic_int_set(&cb->pinned, 1);
+}
+
+// drop cb's pin on the entry, unpinning it if no other binding holds one
+// shard mutex must be held
+static void unpin_value(struct _openslide_cache_binding *cb,
+                        struct cache_shard *shard,
+                        struct _openslide_cache_value *value) {
+  if (!g_slist_find(value->pinners, cb)) {
+    return;
+  }
+  value->pinners = g_slist_remove(value->pinners, cb);
+  if (value->pinners == NULL) {
+    list_move(shard->pinned_list, shard->list, value);
+    atomic_add64(&shard->cache->pinned_size, -value->entry->size);
+    value->is_pinned = false;
+  }
+}
+
+static int64_t fair_share(struct _openslide_cache *cache) {
+  return atomic_get64(&cache->capacity) / CACHE_SHARDS;
+}
+
+// eviction
+// evict while the cache is over capacity and the shard is over share
+// shard mutex must be held
+// returns the number of entries evicted
+static int possibly_evict(struct cache_shard *shard, int64_t incoming_size,
+                          int64_t share) {
+  g_assert(incoming_size >= 0);
+
+  struct _openslide_cache *cache = shard->cache;
+  int64_t target = atomic_get64(&cache->capacity);
+  bool segmented = g_atomic_int_get(&cache->policy) ==
+                   OPENSLIDE_CACHE_POLICY_SEGMENTED;
+  int64_t protected_target = target / 100 * PROTECTED_PERCENT;
+  int evicted = 0;
+
+  while (atomic_get64(&cache->total_size) + incoming_size > target &&
+         shard->total_size + incoming_size > share) {
+    // get key of last element, preferring unprotected ones
+    struct _openslide_cache_value *value = g_queue_peek_tail(shard->list);
+    if (value == NULL) {
+      value = g_queue_peek_tail(shard->protected_list);
+    }
+    if (value == NULL) {
+      break; // shard is empty
+    }
+
+    // give recently-used entries a second chance; under the segmented
+    // policy, that means protection, pushing out the oldest protected
+    // entries if the protected share is full
+    if (value->referenced) {
+      if (segmented && !value->is_protected) {
+        set_protected(shard, value, true);
+        while (atomic_get64(&cache->protected_size) > protected_target) {
+          struct _openslide_cache_value *oldest =
+            g_queue_peek_tail(shard->protected_list);
+          if (oldest == NULL) {
+            break;
+          }
+          set_protected(shard, oldest, false);
+        }
+      } else {
+        GQueue *list = value->is_protected ? shard->protected_list
+                                           : shard->list;
+        value->referenced = false;
+        list_move(list, list, value);
+      }
+      continue;
+    }
+
+    //g_debug("EVICT: size: %"PRId64, value->entry->size);
+
+    // remove from hashtable, this will trigger removal from everything
+    bool result = g_hash_table_remove(shard->hashtable, value->key);
+    g_assert(result);
+    evicted++;
+  }
+  return evicted;
+}
+
+// evict from the shards other than the given one until the cache fits
+// its capacity: first from those over their fair share, down to it,
+// then, if a large entry has grown a share past that, from any shard
+// no shard mutex may be held
+// returns the number of entries evicted
+static int evict_other_shards(struct _openslide_cache *cache,
+                              struct cache_shard *skip) {
+  int start = skip ? skip - cache->shards + 1 : 0;
+  int evicted = 0;
+  int64_t shares[] = {fair_share(cache), 0};
+  for (guint pass = 0; pass < G_N_ELEMENTS(shares); pass++) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+      if (atomic_get64(&cache->total_size) <=
+          atomic_get64(&cache->capacity)) {
+        return evicted;
+      }
+      struct cache_shard *shard =
+        &cache->shards[(start + i) % CACHE_SHARDS];
+      if (shard == skip) {
+        continue;
+      }
+      g_mutex_lock(shard->mutex);
+      evicted += possibly_evict(shard, 0, shares[pass]);
+      g_mutex_unlock(shard->mutex);
+    }
+  }
+  return evicted;
 }
 
 static void hash_destroy_key(gpointer data) {
@@ -117,168 +357,539 @@ static void hash_destroy_key(gpointer data) {
 
 static void hash_destroy_value(gpointer data) {
   struct _openslide_cache_value *value = data;
+  struct cache_shard *shard = value->shard;
 
   // remove the item from the list
-  g_queue_delete_link(value->cache->list, value->link);
+  if (value->is_pinned) {
+    g_queue_delete_link(shard->pinned_list, value->link);
+    atomic_add64(&shard->cache->pinned_size, -value->entry->size);
+  } else if (value->is_protected) {
+    g_queue_delete_link(shard->protected_list, value->link);
+    atomic_add64(&shard->cache->protected_size, -value->entry->size);
+  } else {
+    g_queue_delete_link(shard->list, value->link);
+  }
 
   // decrement the total size
-  value->cache->total_size -= value->entry->size;
-  g_assert(value->cache->total_size >= 0);
+  shard->total_size -= value->entry->size;
+  g_assert(shard->total_size >= 0);
+  atomic_add64(&shard->cache->total_size, -value->entry->size);
 
   // unref the entry
   _openslide_cache_entry_unref(value->entry);
+  g_slist_free(value->pinners);
 
   // free the value
   g_slice_free(struct _openslide_cache_value, value);
 }
 
-struct _openslide_cache *_openslide_cache_create(int capacity_in_bytes) {
+struct _openslide_cache *_openslide_cache_create(int64_t capacity_in_bytes) {
   struct _openslide_cache *cache = g_slice_new0(struct _openslide_cache);
 
-  // init mutex
-  cache->mutex = g_mutex_new();
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    struct cache_shard *shard = &cache->shards[i];
 
-  // init queue
-  cache->list = g_queue_new();
+    // init mutex
+    shard->mutex = g_mutex_new();
 
-  // init hashtable
-  cache->hashtable = g_hash_table_new_full(hash_func,
-					   key_equal_func,
-					   hash_destroy_key,
-					   hash_destroy_value);
+    // init queues
+    shard->list = g_queue_new();
+    shard->protected_list = g_queue_new();
+    shard->pinned_list = g_queue_new();
+
+    // init hashtable
+    shard->hashtable = g_hash_table_new_full(hash_func,
+                                             key_equal_func,
+                                             hash_destroy_key,
+                                             hash_destroy_value);
+
+    shard->cache = cache;
+  }
 
   // init byte_capacity
   cache->capacity = capacity_in_bytes;
 
+  // one ref for the caller
+  cache->refcount = 1;
+
   return cache;
 }
 
-void _openslide_cache_destroy(struct _openslide_cache *cache) {
-  // clear hashtable (auto-deletes all data)
-  g_mutex_lock(cache->mutex);
-  g_hash_table_unref(cache->hashtable);
-  g_mutex_unlock(cache->mutex);
+void _openslide_cache_ref(struct _openslide_cache *cache) {
+  g_atomic_int_inc(&cache->refcount);
+}
+
+void _openslide_cache_release(struct _openslide_cache *cache) {
+  if (!g_atomic_int_dec_and_test(&cache->refcount)) {
+    return;
+  }
+
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    struct cache_shard *shard = &cache->shards[i];
 
-  // clear list
-  g_queue_free(cache->list);
+    // clear hashtable (auto-deletes all data)
+    g_mutex_lock(shard->mutex);
+    g_hash_table_unref(shard->hashtable);
+    g_mutex_unlock(shard->mutex);
 
-  // free mutex
-  g_mutex_free(cache->mutex);
+    // clear lists
+    g_queue_free(shard->list);
+    g_queue_free(shard->protected_list);
+    g_queue_free(shard->pinned_list);
+
+    // free mutex
+    g_mutex_free(shard->mutex);
+  }
+  g_assert(cache->total_size == 0);
+  g_assert(cache->protected_size == 0);
+  g_assert(cache->pinned_size == 0);
+
+  if (cache->shm) {
+    _openslide_shm_cache_destroy(cache->shm);
+  }
+  if (cache->disk) {
+    _openslide_disk_cache_destroy(cache->disk);
+  }
 
   // destroy struct
   g_slice_free(struct _openslide_cache, cache);
 }
 
 
-int _openslide_cache_get_capacity(struct _openslide_cache *cache) {
-  g_mutex_lock(cache->mutex);
-  int capacity = cache->capacity;
-  g_mutex_unlock(cache->mutex);
-  return capacity;
+int64_t _openslide_cache_get_capacity(struct _openslide_cache *cache) {
+  return atomic_get64(&cache->capacity);
 }
 
 void _openslide_cache_set_capacity(struct _openslide_cache *cache,
-				   int capacity_in_bytes) {
+				   int64_t capacity_in_bytes) {
   g_assert(capacity_in_bytes >= 0);
 
-  g_mutex_lock(cache->mutex);
-  cache->capacity = capacity_in_bytes;
-  possibly_evict(cache, 0);
-  g_mutex_unlock(cache->mutex);
+  atomic_set64(&cache->capacity, capacity_in_bytes);
+  evict_other_shards(cache, NULL);
+}
+
+struct _openslide_cache_binding *
+_openslide_cache_binding_create(struct _openslide_cache *cache,
+                                enum _openslide_counter first_counter) {
+  struct _openslide_cache_binding *cb =
+    g_slice_new0(struct _openslide_cache_binding);
+  _openslide_cache_ref(cache);
+  cb->cache = cache;
+  cb->first_counter = first_counter;
+  cb->low_priority = false;
+  G_LOCK(next_binding_id);
+  cb->id = next_binding_id++;
+  G_UNLOCK(next_binding_id);
+  return cb;
+}
+
+struct _openslide_cache_binding *
+_openslide_cache_binding_create_alias(struct _openslide_cache_binding *cb) {
+  struct _openslide_cache_binding *alias =
+    g_slice_new0(struct _openslide_cache_binding);
+  _openslide_cache_ref(cb->cache);
+  alias->cache = cb->cache;
+  alias->id = cb->id;
+  alias->first_counter = cb->first_counter;
+  alias->have_identity = cb->have_identity;
+  memcpy(alias->identity, cb->identity, sizeof(alias->identity));
+  alias->levels = cb->levels;
+  alias->level_count = cb->level_count;
+  return alias;
+}
+
+// not safe against concurrent get/put on the binding
+void _openslide_cache_binding_set(struct _openslide_cache_binding *cb,
+                                  struct _openslide_cache *cache) {
+  _openslide_cache_binding_unpin(cb);
+  _openslide_cache_ref(cache);
+  _openslide_cache_release(cb->cache);
+  cb->cache = cache;
+}
+
+// not safe against concurrent get/put on the binding
+void _openslide_cache_binding_set_low_priority(struct _openslide_cache_binding *cb,
+                                               bool low_priority) {
+  cb->low_priority = low_priority;
+}
+
+// not safe against concurrent get/put on the binding
+void _openslide_cache_binding_set_identity(struct _openslide_cache_binding *cb,
+                                           const char *identity,
+                                           struct _openslide_level **levels,
+                                           int32_t level_count) {
+  guint8 digest[32];
+  gsize len = sizeof(digest);
+  GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  g_checksum_update(checksum, (const guchar *) identity, -1);
+  g_checksum_get_digest(checksum, digest, &len);
+  g_checksum_free(checksum);
+  memcpy(cb->identity, digest, sizeof(cb->identity));
+  cb->levels = levels;
+  cb->level_count = level_count;
+  cb->have_identity = true;
+}
+
+void _openslide_cache_binding_destroy(struct _openslide_cache_binding *cb) {
+  // our entries will age out of a shared cache, once they're unpinned
+  _openslide_cache_binding_unpin(cb);
+  _openslide_cache_release(cb->cache);
+  g_slice_free(struct _openslide_cache_binding, cb);
+}
+
+void _openslide_cache_binding_unpin(struct _openslide_cache_binding *cb) {
+  if (!g_atomic_int_get(&cb->pinned)) {
+    return;
+  }
+  g_atomic_int_set(&cb->pinned, 0);
+
+  struct _openslide_cache *cache = cb->cache;
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    struct cache_shard *shard = &cache->shards[i];
+    g_mutex_lock(shard->mutex);
+    GList *link = shard->pinned_list->head;
+    while (link) {
+      GList *next = link->next;
+      struct _openslide_cache_value *value = link->data;
+      if (value->key->binding_id == cb->id) {
+        unpin_value(cb, shard, value);
+      }
+      link = next;
+    }
+    g_mutex_unlock(shard->mutex);
+  }
+
+  // pinned entries may have held the cache over a lowered capacity
+  int evicted = evict_other_shards(cache, NULL);
+  _openslide_counter_add(cb->first_counter + 2, evicted);
+}
+
+void _openslide_cache_pin_begin(struct _openslide_cache_binding *cb) {
+  g_atomic_int_inc(&cb->pinning);
+}
+
+void _openslide_cache_pin_end(struct _openslide_cache_binding *cb) {
+  g_atomic_int_add(&cb->pinning, -1);
+}
+
+int64_t _openslide_cache_get_pinned_size(struct _openslide_cache *cache) {
+  return atomic_get64(&cache->pinned_size);
+}
+
+int64_t _openslide_cache_binding_get_size(struct _openslide_cache_binding *cb) {
+  int64_t size = 0;
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    struct cache_shard *shard = &cb->cache->shards[i];
+    g_mutex_lock(shard->mutex);
+    GHashTableIter iter;
+    g_hash_table_iter_init(&iter, shard->hashtable);
+    struct _openslide_cache_value *value;
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &value)) {
+      if (value->key->binding_id == cb->id) {
+        size += value->entry->size;
+      }
+    }
+    g_mutex_unlock(shard->mutex);
+  }
+  return size;
+}
+
+// entries pinned by other views of a shared slide are kept, without
+// cb's pin
+static gboolean binding_entry_clear(gpointer key,
+                                    gpointer _value,
+                                    gpointer user_data) {
+  const struct _openslide_cache_key *c_key = key;
+  struct _openslide_cache_value *value = _value;
+  struct _openslide_cache_binding *cb = user_data;
+  if (c_key->binding_id != cb->id) {
+    return false;
+  }
+  unpin_value(cb, value->shard, value);
+  return !value->is_pinned;
+}
+
+void _openslide_cache_binding_clear(struct _openslide_cache_binding *cb) {
+  // entries held by readers live on until they are unreffed
+  g_atomic_int_set(&cb->pinned, 0);
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    struct cache_shard *shard = &cb->cache->shards[i];
+    g_mutex_lock(shard->mutex);
+    g_hash_table_foreach_remove(shard->hashtable, binding_entry_clear, cb);
+    g_mutex_unlock(shard->mutex);
+  }
 }
 
 // put and get
 
-// the cache retains one reference, and the caller gets another one.  the
-// entry must be unreffed when the caller is done with it.
-void _openslide_cache_put(struct _openslide_cache *cache,
-			  void *plane,
-			  int64_t x,
-			  int64_t y,
-			  void *data,
-			  int size_in_bytes,
-			  struct _openslide_cache_entry **_entry) {
-  // always create cache entry for caller's reference
+static struct _openslide_cache_entry *entry_new(void *data,
+                                                int64_t size_in_bytes) {
   struct _openslide_cache_entry *entry =
-      g_slice_new(struct _openslide_cache_entry);
+      g_slice_new0(struct _openslide_cache_entry);
   // one ref for the caller
   g_atomic_int_set(&entry->refcount, 1);
   entry->data = data;
   entry->size = size_in_bytes;
-  *_entry = entry;
+  return entry;
+}
 
-  // lock
-  g_mutex_lock(cache->mutex);
+static struct _openslide_cache_entry *constant_entry_new(uint32_t pixel) {
+  struct _openslide_cache_entry *entry = entry_new(NULL, CONSTANT_ENTRY_SIZE);
+  entry->constant = true;
+  entry->pixel = pixel;
+  entry->data = &entry->pixel;
+  return entry;
+}
+
+// key for the tiers below the local one.  only level planes are known
+// to other processes.
+static bool get_shm_key(struct _openslide_cache_binding *cb,
+                        void *plane,
+                        int64_t x,
+                        int64_t y,
+                        struct _openslide_shm_key *key) {
+  if ((cb->cache->shm == NULL && cb->cache->disk == NULL) ||
+      !cb->have_identity) {
+    return false;
+  }
+  for (int32_t i = 0; i < cb->level_count; i++) {
+    if (plane == cb->levels[i]) {
+      memset(key, 0, sizeof(*key));
+      memcpy(key->slide, cb->identity, sizeof(key->slide));
+      key->level = i;
+      key->x = x;
+      key->y = y;
+      return true;
+    }
+  }
+  return false;
+}
+
+// write a tile to the tiers below the local one
+static void put_lower_tiers(struct _openslide_cache *cache,
+                            const struct _openslide_shm_key *key,
+                            struct _openslide_cache_entry *entry) {
+  const void *data = entry->constant ? &entry->pixel : entry->data;
+  int64_t size = entry->constant ? (int64_t) sizeof(entry->pixel) :
+                                   entry->size;
+  if (cache->shm) {
+    _openslide_shm_cache_put(cache->shm, key, data, size, entry->constant);
+  }
+  if (cache->disk) {
+    _openslide_disk_cache_put(cache->disk, key, data, size, entry->constant);
+  }
+}
+
+// share is false for entries that came from a lower tier
+static void insert_entry(struct _openslide_cache_binding *cb,
+                         void *plane,
+                         int64_t x,
+                         int64_t y,
+                         struct _openslide_cache_entry *entry,
+                         bool share) {
+  struct _openslide_cache *cache = cb->cache;
+  int64_t size_in_bytes = entry->size;
+
+  struct _openslide_shm_key shm_key;
+  if (share && get_shm_key(cb, plane, x, y, &shm_key)) {
+    put_lower_tiers(cache, &shm_key, entry);
+  }
 
   // don't try to put anything in the cache that cannot possibly fit
-  if (size_in_bytes > cache->capacity) {
+  if (size_in_bytes > atomic_get64(&cache->capacity)) {
     //g_debug("refused %p", entry);
-    g_mutex_unlock(cache->mutex);
     _openslide_performance_warn_once(&cache->warned_overlarge_entry,
                                      "Rejecting overlarge cache entry of "
-                                     "size %d bytes", size_in_bytes);
+                                     "size %"PRId64" bytes", size_in_bytes);
     return;
   }
 
-  possibly_evict(cache, size_in_bytes); // already checks for size >= 0
-
   // create key
   struct _openslide_cache_key *key = g_slice_new(struct _openslide_cache_key);
+  key->binding_id = cb->id;
   key->plane = plane;
   key->x = x;
   key->y = y;
 
+  struct cache_shard *shard = get_shard(cache, key);
+
   // create value
   struct _openslide_cache_value *value =
     g_slice_new(struct _openslide_cache_value);
   value->key = key;
-  value->cache = cache;
+  value->shard = shard;
+  value->referenced = false;
+  value->is_protected = false;
+  value->is_pinned = false;
+  value->pinners = NULL;
   value->entry = entry;
 
+  // lock
+  g_mutex_lock(shard->mutex);
+
+  // make room within our share, which grows to fit one large entry;
+  // already checks for size >= 0
+  int evicted = possibly_evict(shard, size_in_bytes,
+                               MAX(fair_share(cache), size_in_bytes));
+
   // insert at head of queue
-  g_queue_push_head(cache->list, value);
-  value->link = g_queue_peek_head_link(cache->list);
+  g_queue_push_head(shard->list, value);
+  value->link = g_queue_peek_head_link(shard->list);
 
   // insert into hash table
-  g_hash_table_replace(cache->hashtable, key, value);
+  g_hash_table_replace(shard->hashtable, key, value);
 
   // increase size
-  cache->total_size += size_in_bytes;
+  shard->total_size += size_in_bytes;
+  atomic_add64(&cache->total_size, size_in_bytes);
+
+  maybe_pin(cb, shard, value);
 
   // another ref for the cache
   g_atomic_int_inc(&entry->refcount);
 
   // unlock
-  g_mutex_unlock(cache->mutex);
+  g_mutex_unlock(shard->mutex);
+
+  // take the rest from the shards over their share
+  evicted += evict_other_shards(cache, shard);
+
+  _openslide_counter_add(cb->first_counter + 2, evicted);
+  _openslide_counter_add(cb->first_counter + 3, size_in_bytes);
 
   //g_debug("insert %p", entry);
 }
 
+// the cache retains one reference, and the caller gets another one.  the
+// entry must be unreffed when the caller is done with it.
+void _openslide_cache_put(struct _openslide_cache_binding *cb,
+			  void *plane,
+			  int64_t x,
+			  int64_t y,
+			  void *data,
+			  int64_t size_in_bytes,
+			  struct _openslide_cache_entry **_entry) {
+  // always create cache entry for caller's reference
+  struct _openslide_cache_entry *entry = entry_new(data, size_in_bytes);
+  *_entry = entry;
+  insert_entry(cb, plane, x, y, entry, true);
+}
+
+// cache a tile in which every pixel has the same value, without
+// storing the pixels.  returns the pixel, as _openslide_cache_get() would.
+void *_openslide_cache_put_constant(struct _openslide_cache_binding *cb,
+                                    void *plane,
+                                    int64_t x,
+                                    int64_t y,
+                                    uint32_t pixel,
+                                    struct _openslide_cache_entry **_entry) {
+  struct _openslide_cache_entry *entry = constant_entry_new(pixel);
+  *_entry = entry;
+  insert_entry(cb, plane, x, y, entry, true);
+  return entry->data;
+}
+
+// a tile from a lower tier must be whole pixels, or one pixel if constant
+static bool tile_size_valid(int64_t size, bool constant) {
+  if (constant) {
+    return size == sizeof(uint32_t);
+  }
+  return size > 0 && size % sizeof(uint32_t) == 0;
+}
+
+// after a local miss, look in the segment shared between processes and
+// then on disk, keeping a local copy of a hit
+static struct _openslide_cache_entry *
+get_lower_tiers(struct _openslide_cache_binding *cb,
+                void *plane,
+                int64_t x,
+                int64_t y) {
+  struct _openslide_cache *cache = cb->cache;
+  struct _openslide_shm_key key;
+  if (!get_shm_key(cb, plane, x, y, &key)) {
+    return NULL;
+  }
+
+  int64_t size;
+  bool constant;
+  void *data = NULL;
+  if (cache->shm) {
+    data = _openslide_shm_cache_get(cache->shm, &key, &size, &constant);
+    if (data && !tile_size_valid(size, constant)) {
+      _openslide_buffer_free(size, data);
+      data = NULL;
+    }
+    _openslide_counter_add(data ? OPENSLIDE_COUNTER_SHARED_CACHE_HITS :
+                                  OPENSLIDE_COUNTER_SHARED_CACHE_MISSES, 1);
+  }
+  bool from_disk = false;
+  if (data == NULL && cache->disk) {
+    data = _openslide_disk_cache_get(cache->disk, &key, &size, &constant);
+    if (data && !tile_size_valid(size, constant)) {
+      _openslide_buffer_free(size, data);
+      data = NULL;
+    }
+    _openslide_counter_add(data ? OPENSLIDE_COUNTER_DISK_CACHE_HITS :
+                                  OPENSLIDE_COUNTER_DISK_CACHE_MISSES, 1);
+    from_disk = data != NULL;
+  }
+  if (data == NULL) {
+    return NULL;
+  }
+  if (from_disk && cache->shm) {
+    // promote, so the other processes needn't read it from disk
+    _openslide_shm_cache_put(cache->shm, &key, data, size, constant);
+  }
+
+  struct _openslide_cache_entry *entry;
+  if (constant) {
+    uint32_t pixel;
+    memcpy(&pixel, data, sizeof(pixel));
+    _openslide_buffer_free(size, data);
+    entry = constant_entry_new(pixel);
+  } else {
+    entry = entry_new(data, size);
+  }
+  insert_entry(cb, plane, x, y, entry, false);
+  return entry;
+}
+
 // entry must be unreffed when the caller is done with the data
-void *_openslide_cache_get(struct _openslide_cache *cache,
+void *_openslide_cache_get(struct _openslide_cache_binding *cb,
 			   void *plane,
 			   int64_t x,
 			   int64_t y,
 			   struct _openslide_cache_entry **_entry) {
-  // lock
-  g_mutex_lock(cache->mutex);
+  struct _openslide_cache *cache = cb->cache;
+  _openslide_trace(OPENSLIDE_TRACE_CACHE, true, NULL, x, y, 0, NULL);
 
   // create key
-  struct _openslide_cache_key key = { .plane = plane, .x = x, .y = y };
+  struct _openslide_cache_key key = { .binding_id = cb->id, .plane = plane,
+                                      .x = x, .y = y };
+  struct cache_shard *shard = get_shard(cache, &key);
+
+  // lock
+  g_mutex_lock(shard->mutex);
 
   // lookup key, maybe return NULL
-  struct _openslide_cache_value *value = g_hash_table_lookup(cache->hashtable,
+  struct _openslide_cache_value *value = g_hash_table_lookup(shard->hashtable,
 							     &key);
   if (value == NULL) {
-    g_mutex_unlock(cache->mutex);
-    *_entry = NULL;
-    return NULL;
+    g_mutex_unlock(shard->mutex);
+    _openslide_counter_add(cb->first_counter + 1, 1);
+    struct _openslide_cache_entry *entry = get_lower_tiers(cb, plane, x, y);
+    _openslide_trace(OPENSLIDE_TRACE_CACHE, false, NULL, x, y,
+                     entry ? entry->size : 0, NULL);
+    *_entry = entry;
+    return entry ? entry->data : NULL;
   }
 
-  // if found, move to front of list
-  GList *link = value->link;
-  g_queue_unlink(cache->list, link);
-  g_queue_push_head_link(cache->list, link);
+  // if found, mark recently used; eviction will move it to the front.
+  // low-priority readers, such as whole-slide scans, don't count as use
+  if (!cb->low_priority) {
+    value->referenced = true;
+  }
+  maybe_pin(cb, shard, value);
 
   // acquire entry reference for the caller
   struct _openslide_cache_entry *entry = value->entry;
@@ -287,20 +898,92 @@ void *_openslide_cache_get(struct _openslide_cache *cache,
   //g_debug("cache hit! %p %p %"PRId64" %"PRId64, (void *) entry, (void *) plane, x, y);
 
   // unlock
-  g_mutex_unlock(cache->mutex);
+  g_mutex_unlock(shard->mutex);
+  _openslide_counter_add(cb->first_counter, 1);
+  _openslide_trace(OPENSLIDE_TRACE_CACHE, false, NULL, x, y,
+                   entry->size, NULL);
 
   // return data
   *_entry = entry;
   return entry->data;
 }
 
+// public API
+openslide_cache_t *openslide_cache_create(size_t capacity) {
+  return _openslide_cache_create(MIN(capacity, (uint64_t) G_MAXINT64));
+}
+
+openslide_cache_t *openslide_cache_create_shared(const char *name,
+                                                 size_t capacity,
+                                                 size_t entry_size) {
+  GError *tmp_err = NULL;
+  struct _openslide_shm_cache *shm =
+    _openslide_shm_cache_open(name, MIN(capacity, (uint64_t) G_MAXINT64),
+                              MIN(entry_size, (uint64_t) G_MAXINT32),
+                              &tmp_err);
+  if (shm == NULL) {
+    g_warning("%s", tmp_err->message);
+    g_clear_error(&tmp_err);
+    return NULL;
+  }
+  struct _openslide_cache *cache =
+    _openslide_cache_create(SHARED_CACHE_LOCAL_CAPACITY);
+  cache->shm = shm;
+  return cache;
+}
+
+bool openslide_cache_add_disk_tier(openslide_cache_t *cache,
+                                   const char *dirname,
+                                   size_t capacity) {
+  GError *tmp_err = NULL;
+  g_return_val_if_fail(cache->disk == NULL, false);
+  // attached caches hold a reference for each binding
+  g_return_val_if_fail(g_atomic_int_get(&cache->refcount) == 1, false);
+  cache->disk = _openslide_disk_cache_open(dirname,
+                                           MIN(capacity, (uint64_t) G_MAXINT64),
+                                           &tmp_err);
+  if (cache->disk == NULL) {
+    g_warning("%s", tmp_err->message);
+    g_clear_error(&tmp_err);
+    return false;
+  }
+  return true;
+}
+
+void openslide_cache_set_policy(openslide_cache_t *cache,
+                                openslide_cache_policy_t policy) {
+  g_atomic_int_set(&cache->policy, policy);
+}
+
+int64_t openslide_cache_get_pinned_size(openslide_cache_t *cache) {
+  return _openslide_cache_get_pinned_size(cache);
+}
+
+void openslide_cache_release(openslide_cache_t *cache) {
+  _openslide_cache_release(cache);
+}
+
+int64_t _openslide_cache_entry_get_size(struct _openslide_cache_entry *entry) {
+  return entry->size;
+}
+
+bool _openslide_cache_entry_get_constant(struct _openslide_cache_entry *entry,
+                                         uint32_t *pixel) {
+  if (entry->constant) {
+    *pixel = entry->pixel;
+  }
+  return entry->constant;
+}
+
 // value unref
 void _openslide_cache_entry_unref(struct _openslide_cache_entry *entry) {
   //g_debug("unref %p, refs %d", entry, g_atomic_int_get(&entry->refcount));
 
   if (g_atomic_int_dec_and_test(&entry->refcount)) {
     // free the data
-    g_slice_free1(entry->size, entry->data);
+    if (!entry->constant) {
+      _openslide_buffer_free(entry->size, entry->data);
+    }
 
     // free the entry
     g_slice_free(struct _openslide_cache_entry, entry);
@@ -308,3 +991,71 @@ void _openslide_cache_entry_unref(struct _openslide_cache_entry *entry) {
     //g_debug("free %p", entry);
   }
 }
+
+// Buffer pool
+//
+// The decoded tiles of a level all have the same size, and glib passes
+// slices that large to malloc, so evicting and decoding tiles churns
+// the heap with large blocks.  Instead, keep freed buffers of each size
+// that has been allocated through the pool, up to a fixed total, for
+// the next allocation of that size.  Pool buffers are g_slice memory,
+// so either side may be freed with g_slice_free1().
+
+// a free buffer, linked through its own first bytes
+struct free_buffer {
+  struct free_buffer *next;
+};
+
+// free buffers of one size
+struct buffer_class {
+  struct free_buffer *free;
+};
+
+static GHashTable *buffer_classes;  // size -> struct buffer_class
+static int64_t buffer_pool_bytes;
+G_LOCK_DEFINE_STATIC(buffer_pool);
+
+void *_openslide_buffer_alloc(int64_t size) {
+  if (size >= BUFFER_POOL_MIN_SIZE) {
+    G_LOCK(buffer_pool);
+    if (buffer_classes == NULL) {
+      buffer_classes = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    struct buffer_class *class =
+      g_hash_table_lookup(buffer_classes, GSIZE_TO_POINTER(size));
+    if (class == NULL) {
+      // start keeping buffers of this size
+      class = g_slice_new0(struct buffer_class);
+      g_hash_table_insert(buffer_classes, GSIZE_TO_POINTER(size), class);
+    }
+    struct free_buffer *buf = class->free;
+    if (buf) {
+      class->free = buf->next;
+      buffer_pool_bytes -= size;
+    }
+    G_UNLOCK(buffer_pool);
+    if (buf) {
+      _openslide_counter_add(OPENSLIDE_COUNTER_BUFFERS_RECYCLED, 1);
+      return buf;
+    }
+  }
+  return g_slice_alloc(size);
+}
+
+void _openslide_buffer_free(int64_t size, void *buf) {
+  if (size >= BUFFER_POOL_MIN_SIZE) {
+    G_LOCK(buffer_pool);
+    struct buffer_class *class = buffer_classes ?
+      g_hash_table_lookup(buffer_classes, GSIZE_TO_POINTER(size)) : NULL;
+    if (class && buffer_pool_bytes + size <= BUFFER_POOL_MAX_BYTES) {
+      struct free_buffer *fb = buf;
+      fb->next = class->free;
+      class->free = fb;
+      buffer_pool_bytes += size;
+      G_UNLOCK(buffer_pool);
+      return;
+    }
+    G_UNLOCK(buffer_pool);
+  }
+  g_slice_free1(size, buf);
+}
@@ -0,0 +1,449 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Pixel format conversion
+ *
+ * Each kernel has a scalar implementation, which also handles the
+ * leftover pixels of the vector ones.  SSE2 and NEON are part of the
+ * baseline x86-64 and AArch64 ABIs, so the vector code is selected at
+ * compile time and needs no runtime CPU detection.  Vector results must
+ * be bit-identical to the scalar ones.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE2
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(__ARM_BIG_ENDIAN)
+#include <arm_neon.h>
+#define USE_NEON
+#endif
+
+// in-place ABGR (as produced by TIFFRGBAImageGet) to ARGB
+void _openslide_convert_abgr_to_argb(uint32_t *buf, int64_t count) {
+  int64_t i = 0;
+
+#if defined(USE_SSE2)
+  const __m128i ag_mask = _mm_set1_epi32(0xff00ff00);
+  const __m128i rb_mask = _mm_set1_epi32(0x00ff00ff);
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+    __m128i ag = _mm_and_si128(v, ag_mask);
+    __m128i rb = _mm_and_si128(v, rb_mask);
+    rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+    _mm_storeu_si128((__m128i *) (buf + i), _mm_or_si128(ag, rb));
+  }
+#elif defined(USE_NEON)
+  const uint32x4_t ag_mask = vdupq_n_u32(0xff00ff00);
+  const uint32x4_t rb_mask = vdupq_n_u32(0x00ff00ff);
+  for (; i + 4 <= count; i += 4) {
+    uint32x4_t v = vld1q_u32(buf + i);
+    uint32x4_t ag = vandq_u32(v, ag_mask);
+    uint32x4_t rb = vandq_u32(v, rb_mask);
+    rb = vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(rb)));
+    vst1q_u32(buf + i, vorrq_u32(ag, rb));
+  }
+#endif
+
+  for (; i < count; i++) {
+    uint32_t v = buf[i];
+    buf[i] = (v & 0xff00ff00) | ((v & 0xff) << 16) | ((v >> 16) & 0xff);
+  }
+}
+
+// packed 8-bit RGB to opaque ARGB
+void _openslide_convert_rgb_to_argb(uint32_t *dest, const uint8_t *src,
+                                    int64_t count) {
+  int64_t i = 0;
+
+#if defined(USE_SSE2)
+  // SSE2 has no byte shuffle, so gather each pixel with an unaligned
+  // 32-bit load and then swap R and B.  The last load of each group
+  // reads one byte past the group, so stop while a pixel remains.
+  const __m128i ag_mask = _mm_set1_epi32(0x0000ff00);
+  const __m128i rb_mask = _mm_set1_epi32(0x00ff00ff);
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+  for (; i + 5 <= count; i += 4) {
+    uint32_t p[4];
+    memcpy(p, src + i * 3, 4);
+    memcpy(p + 1, src + i * 3 + 3, 4);
+    memcpy(p + 2, src + i * 3 + 6, 4);
+    memcpy(p + 3, src + i * 3 + 9, 4);
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i g = _mm_and_si128(v, ag_mask);
+    __m128i rb = _mm_and_si128(v, rb_mask);
+    rb = _mm_or_si128(_mm_slli_epi32(rb, 16),
+                      _mm_and_si128(_mm_srli_epi32(rb, 16),
+                                    _mm_set1_epi32(0xff)));
+    _mm_storeu_si128((__m128i *) (dest + i),
+                     _mm_or_si128(_mm_or_si128(g, rb), alpha));
+  }
+#elif defined(USE_NEON)
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x3_t rgb = vld3q_u8(src + i * 3);
+    uint8x16x4_t bgra;
+    bgra.val[0] = rgb.val[2];
+    bgra.val[1] = rgb.val[1];
+    bgra.val[2] = rgb.val[0];
+    bgra.val[3] = vdupq_n_u8(0xff);
+    vst4q_u8((uint8_t *) (dest + i), bgra);
+  }
+#endif
+
+  for (; i < count; i++) {
+    dest[i] = 0xff000000 |
+              src[i * 3 + 0] << 16 |
+              src[i * 3 + 1] << 8 |
+              src[i * 3 + 2];
+  }
+}
+
+// packed RGB of 12-bit samples in little-endian 16-bit words to opaque
+// ARGB, keeping the high 8 bits of each sample
+void _openslide_convert_rgb12_to_argb(uint32_t *dest, const uint16_t *src,
+                                      int64_t count) {
+  int64_t i = 0;
+
+#if defined(USE_SSE2)
+  // narrow a chunk of samples to packed 8-bit RGB, then reuse that kernel
+  enum { CHUNK = 64 };
+  const __m128i byte_mask = _mm_set1_epi16(0xff);
+  uint8_t rgb[3 * CHUNK];
+  for (; i + CHUNK <= count; i += CHUNK) {
+    const uint16_t *p = src + i * 3;
+    for (int k = 0; k < 3 * CHUNK; k += 16) {
+      __m128i lo = _mm_loadu_si128((const __m128i *) (p + k));
+      __m128i hi = _mm_loadu_si128((const __m128i *) (p + k + 8));
+      lo = _mm_and_si128(_mm_srli_epi16(lo, 4), byte_mask);
+      hi = _mm_and_si128(_mm_srli_epi16(hi, 4), byte_mask);
+      _mm_storeu_si128((__m128i *) (rgb + k), _mm_packus_epi16(lo, hi));
+    }
+    _openslide_convert_rgb_to_argb(dest + i, rgb, CHUNK);
+  }
+#elif defined(USE_NEON)
+  for (; i + 8 <= count; i += 8) {
+    uint16x8x3_t rgb = vld3q_u16(src + i * 3);
+    uint8x8x4_t bgra;
+    bgra.val[0] = vshrn_n_u16(rgb.val[2], 4);
+    bgra.val[1] = vshrn_n_u16(rgb.val[1], 4);
+    bgra.val[2] = vshrn_n_u16(rgb.val[0], 4);
+    bgra.val[3] = vdup_n_u8(0xff);
+    vst4_u8((uint8_t *) (dest + i), bgra);
+  }
+#endif
+
+  for (; i < count; i++) {
+    uint8_t r = GUINT16_FROM_LE(src[i * 3 + 0]) >> 4;
+    uint8_t g = GUINT16_FROM_LE(src[i * 3 + 1]) >> 4;
+    uint8_t b = GUINT16_FROM_LE(src[i * 3 + 2]) >> 4;
+    dest[i] = 0xff000000 | (r << 16) | (g << 8) | b;
+  }
+}
+
+// three 8-bit planes to opaque ARGB
+void _openslide_convert_planes_to_argb(uint32_t *dest,
+                                       const uint8_t *r,
+                                       const uint8_t *g,
+                                       const uint8_t *b,
+                                       int64_t count) {
+  int64_t i = 0;
+
+#if defined(USE_SSE2)
+  const __m128i alpha = _mm_set1_epi8((char) 0xff);
+  for (; i + 16 <= count; i += 16) {
+    __m128i rv = _mm_loadu_si128((const __m128i *) (r + i));
+    __m128i gv = _mm_loadu_si128((const __m128i *) (g + i));
+    __m128i bv = _mm_loadu_si128((const __m128i *) (b + i));
+    // little-endian ARGB is B G R A in memory
+    __m128i bg_lo = _mm_unpacklo_epi8(bv, gv);
+    __m128i bg_hi = _mm_unpackhi_epi8(bv, gv);
+    __m128i ra_lo = _mm_unpacklo_epi8(rv, alpha);
+    __m128i ra_hi = _mm_unpackhi_epi8(rv, alpha);
+    __m128i *out = (__m128i *) (dest + i);
+    _mm_storeu_si128(out, _mm_unpacklo_epi16(bg_lo, ra_lo));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(bg_lo, ra_lo));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(bg_hi, ra_hi));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(bg_hi, ra_hi));
+  }
+#elif defined(USE_NEON)
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t bgra;
+    bgra.val[0] = vld1q_u8(b + i);
+    bgra.val[1] = vld1q_u8(g + i);
+    bgra.val[2] = vld1q_u8(r + i);
+    bgra.val[3] = vdupq_n_u8(0xff);
+    vst4q_u8((uint8_t *) (dest + i), bgra);
+  }
+#endif
+
+  for (; i < count; i++) {
+    dest[i] = 0xff000000 | (r[i] << 16) | (g[i] << 8) | b[i];
+  }
+}
+
+// 8-bit gray to opaque ARGB
+void _openslide_convert_gray_to_argb(uint32_t *dest, const uint8_t *src,
+                                     int64_t count) {
+  int64_t i = 0;
+
+#if defined(USE_SSE2)
+  const __m128i alpha = _mm_set1_epi8((char) 0xff);
+  for (; i + 16 <= count; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i gg_lo = _mm_unpacklo_epi8(v, v);
+    __m128i gg_hi = _mm_unpackhi_epi8(v, v);
+    __m128i ga_lo = _mm_unpacklo_epi8(v, alpha);
+    __m128i ga_hi = _mm_unpackhi_epi8(v, alpha);
+    __m128i *out = (__m128i *) (dest + i);
+    _mm_storeu_si128(out, _mm_unpacklo_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(gg_hi, ga_hi));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(gg_hi, ga_hi));
+  }
+#elif defined(USE_NEON)
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t bgra;
+    bgra.val[0] = vld1q_u8(src + i);
+    bgra.val[1] = bgra.val[0];
+    bgra.val[2] = bgra.val[0];
+    bgra.val[3] = vdupq_n_u8(0xff);
+    vst4q_u8((uint8_t *) (dest + i), bgra);
+  }
+#endif
+
+  for (; i < count; i++) {
+    dest[i] = 0xff000000 | (src[i] << 16) | (src[i] << 8) | src[i];
+  }
+}
+
+// packed 8-bit premultiplied RGBA to ARGB
+void _openslide_convert_rgba_to_argb(uint32_t *dest, const uint8_t *src,
+                                     int64_t count) {
+  int64_t i = 0;
+
+#if defined(USE_SSE2)
+  // R G B A in memory is little-endian ABGR, so swap R and B
+  const __m128i ag_mask = _mm_set1_epi32(0xff00ff00);
+  const __m128i rb_mask = _mm_set1_epi32(0x00ff00ff);
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i * 4));
+    __m128i ag = _mm_and_si128(v, ag_mask);
+    __m128i rb = _mm_and_si128(v, rb_mask);
+    rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+    _mm_storeu_si128((__m128i *) (dest + i), _mm_or_si128(ag, rb));
+  }
+#elif defined(USE_NEON)
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t rgba = vld4q_u8(src + i * 4);
+    uint8x16x4_t bgra;
+    bgra.val[0] = rgba.val[2];
+    bgra.val[1] = rgba.val[1];
+    bgra.val[2] = rgba.val[0];
+    bgra.val[3] = rgba.val[3];
+    vst4q_u8((uint8_t *) (dest + i), bgra);
+  }
+#endif
+
+  for (; i < count; i++) {
+    dest[i] = (uint32_t) src[i * 4 + 3] << 24 |
+              src[i * 4 + 0] << 16 |
+              src[i * 4 + 1] << 8 |
+              src[i * 4 + 2];
+  }
+}
+
+static inline void write_pixel_ycbcr(uint32_t *dest, uint8_t Y,
+                                     int16_t R_chroma, int16_t G_chroma,
+                                     int16_t B_chroma) {
+  int16_t R = Y + R_chroma;
+  int16_t G = Y + G_chroma;
+  int16_t B = Y + B_chroma;
+
+  R = CLAMP(R, 0, 255);
+  G = CLAMP(G, 0, 255);
+  B = CLAMP(B, 0, 255);
+
+  *dest = 0xff000000 | ((uint8_t) R << 16) | ((uint8_t) G << 8) | ((uint8_t) B);
+}
+
+// one row of YCbCr with 2:1 horizontal chroma subsampling, one sample
+// per int32, to ARGB.  Samples are truncated to 8 bits.
+void _openslide_convert_ycbcr422_row_to_argb(uint32_t *dest,
+                                             const int32_t *y,
+                                             const int32_t *cb,
+                                             const int32_t *cr,
+                                             int32_t w) {
+  int32_t x = 0;
+
+#if defined(USE_SSE2)
+  // R and B chroma follow the tables exactly in 14-bit fixed point;
+  // G's tables round each term separately, so G is still looked up
+  const __m128i byte_mask = _mm_set1_epi32(0xff);
+  const __m128i center = _mm_set1_epi32(128);
+  const __m128i one_hi = _mm_set1_epi32(1 << 16);
+  const __m128i low_mask = _mm_set1_epi32(0xffff);
+  const __m128i r_coef = _mm_set1_epi32((8192 << 16) | 22970);
+  const __m128i b_coef = _mm_set1_epi32((8192 << 16) | 29033);
+  const __m128i alpha = _mm_set1_epi8((char) 0xff);
+  for (; x + 8 <= w; x += 8) {
+    // luma, as 8 int16
+    __m128i y_lo = _mm_and_si128(_mm_loadu_si128((const __m128i *) (y + x)),
+                                 byte_mask);
+    __m128i y_hi = _mm_and_si128(_mm_loadu_si128((const __m128i *) (y + x + 4)),
+                                 byte_mask);
+    __m128i yv = _mm_packs_epi32(y_lo, y_hi);
+
+    // chroma, as int32 offsets from center paired with 1 for rounding
+    __m128i cbv = _mm_and_si128(_mm_loadu_si128((const __m128i *) (cb + x / 2)),
+                                byte_mask);
+    __m128i crv = _mm_and_si128(_mm_loadu_si128((const __m128i *) (cr + x / 2)),
+                                byte_mask);
+    __m128i cb_pair = _mm_or_si128(_mm_and_si128(_mm_sub_epi32(cbv, center),
+                                                 low_mask),
+                                   one_hi);
+    __m128i cr_pair = _mm_or_si128(_mm_and_si128(_mm_sub_epi32(crv, center),
+                                                 low_mask),
+                                   one_hi);
+    __m128i r_chroma = _mm_srai_epi32(_mm_madd_epi16(cr_pair, r_coef), 14);
+    __m128i b_chroma = _mm_srai_epi32(_mm_madd_epi16(cb_pair, b_coef), 14);
+    int32_t g[4];
+    for (int k = 0; k < 4; k++) {
+      g[k] = (_openslide_G_Cb[(uint8_t) cb[x / 2 + k]] +
+              _openslide_G_Cr[(uint8_t) cr[x / 2 + k]]) >> 16;
+    }
+    __m128i g_chroma = _mm_loadu_si128((const __m128i *) g);
+
+    // widen each chroma sample to its two pixels and add luma
+    __m128i rg = _mm_packs_epi32(r_chroma, g_chroma);
+    __m128i bb = _mm_packs_epi32(b_chroma, b_chroma);
+    __m128i rv = _mm_add_epi16(yv, _mm_unpacklo_epi16(rg, rg));
+    __m128i gv = _mm_add_epi16(yv, _mm_unpackhi_epi16(rg, rg));
+    __m128i bv = _mm_add_epi16(yv, _mm_unpacklo_epi16(bb, bb));
+
+    // clamp to 8 bits and interleave as B G R A
+    rv = _mm_packus_epi16(rv, rv);
+    gv = _mm_packus_epi16(gv, gv);
+    bv = _mm_packus_epi16(bv, bv);
+    __m128i bg = _mm_unpacklo_epi8(bv, gv);
+    __m128i ra = _mm_unpacklo_epi8(rv, alpha);
+    __m128i *out = (__m128i *) (dest + x);
+    _mm_storeu_si128(out, _mm_unpacklo_epi16(bg, ra));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(bg, ra));
+  }
+#endif
+
+  for (; x < w; x++) {
+    uint8_t c0 = y[x];
+    uint8_t c1 = cb[x / 2];
+    uint8_t c2 = cr[x / 2];
+    int16_t R_chroma = _openslide_R_Cr[c2];
+    int16_t G_chroma = (_openslide_G_Cb[c1] + _openslide_G_Cr[c2]) >> 16;
+    int16_t B_chroma = _openslide_B_Cb[c1];
+    write_pixel_ycbcr(dest + x, c0, R_chroma, G_chroma, B_chroma);
+  }
+}
+
+static inline uint8_t unpremultiply(uint32_t c, uint32_t a) {
+  return (c * 255 + a / 2) / a;
+}
+
+static inline void write_pixel_rgba(uint8_t *d, uint32_t p, bool bgr) {
+  uint32_t a = p >> 24;
+  uint8_t r = (p >> 16) & 0xff;
+  uint8_t g = (p >> 8) & 0xff;
+  uint8_t b = p & 0xff;
+  if (a == 0) {
+    r = g = b = 0;
+  } else if (a != 255) {
+    r = unpremultiply(r, a);
+    g = unpremultiply(g, a);
+    b = unpremultiply(b, a);
+  }
+  d[0] = bgr ? b : r;
+  d[1] = g;
+  d[2] = bgr ? r : b;
+  d[3] = a;
+}
+
+// premultiplied ARGB to unpremultiplied bytes in R, G, B, A order, or
+// in B, G, R, A order if bgr
+void _openslide_convert_argb_to_rgba(uint8_t *dest, const uint32_t *src,
+                                     int64_t count, bool bgr) {
+  int64_t i = 0;
+
+#if defined(USE_SSE2)
+  // opaque pixels need no division, only a byte swap for RGBA
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+  const __m128i ag_mask = _mm_set1_epi32(0xff00ff00);
+  const __m128i rb_mask = _mm_set1_epi32(0x00ff00ff);
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i opaque = _mm_cmpeq_epi32(_mm_and_si128(v, alpha), alpha);
+    if (_mm_movemask_epi8(opaque) != 0xffff) {
+      for (int k = 0; k < 4; k++) {
+        write_pixel_rgba(dest + (i + k) * 4, src[i + k], bgr);
+      }
+      continue;
+    }
+    if (!bgr) {
+      __m128i rb = _mm_and_si128(v, rb_mask);
+      rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+      v = _mm_or_si128(_mm_and_si128(v, ag_mask), rb);
+    }
+    _mm_storeu_si128((__m128i *) (dest + i * 4), v);
+  }
+#endif
+
+  for (; i < count; i++) {
+    write_pixel_rgba(dest + i * 4, src[i], bgr);
+  }
+}
+
+// premultiplied ARGB to packed 8-bit RGB, i.e. composited onto black
+void _openslide_convert_argb_to_rgb(uint8_t *dest, const uint32_t *src,
+                                    int64_t count) {
+  int64_t i = 0;
+
+#if defined(USE_NEON)
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t bgra = vld4q_u8((const uint8_t *) (src + i));
+    uint8x16x3_t rgb;
+    rgb.val[0] = bgra.val[2];
+    rgb.val[1] = bgra.val[1];
+    rgb.val[2] = bgra.val[0];
+    vst3q_u8(dest + i * 3, rgb);
+  }
+#endif
+
+  for (; i < count; i++) {
+    uint32_t p = src[i];
+    dest[i * 3 + 0] = (p >> 16) & 0xff;
+    dest[i * 3 + 1] = (p >> 8) & 0xff;
+    dest[i * 3 + 2] = p & 0xff;
+  }
+}
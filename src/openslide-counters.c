@@ -0,0 +1,149 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2015 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <string.h>
+#include <glib.h>
+
+// public names, in enum order
+static const char * const counter_names[] = {
+  [OPENSLIDE_COUNTER_CACHE_HITS] = "cache.hits",
+  [OPENSLIDE_COUNTER_CACHE_MISSES] = "cache.misses",
+  [OPENSLIDE_COUNTER_CACHE_EVICTIONS] = "cache.evictions",
+  [OPENSLIDE_COUNTER_CACHE_BYTES] = "cache.bytes-added",
+  [OPENSLIDE_COUNTER_COMPRESSED_CACHE_HITS] = "compressed-cache.hits",
+  [OPENSLIDE_COUNTER_COMPRESSED_CACHE_MISSES] = "compressed-cache.misses",
+  [OPENSLIDE_COUNTER_COMPRESSED_CACHE_EVICTIONS] = "compressed-cache.evictions",
+  [OPENSLIDE_COUNTER_COMPRESSED_CACHE_BYTES] = "compressed-cache.bytes-added",
+  [OPENSLIDE_COUNTER_SHARED_CACHE_HITS] = "shared-cache.hits",
+  [OPENSLIDE_COUNTER_SHARED_CACHE_MISSES] = "shared-cache.misses",
+  [OPENSLIDE_COUNTER_DISK_CACHE_HITS] = "disk-cache.hits",
+  [OPENSLIDE_COUNTER_DISK_CACHE_MISSES] = "disk-cache.misses",
+  [OPENSLIDE_COUNTER_TIFF_TILES_DIRECT] = "tiff.tiles-direct",
+  [OPENSLIDE_COUNTER_TIFF_TILES_LIBTIFF] = "tiff.tiles-libtiff",
+  [OPENSLIDE_COUNTER_TIFF_HANDLE_OPENS] = "tiff.handle-opens",
+  [OPENSLIDE_COUNTER_IO_BYTES_READ] = "io.bytes-read",
+  [OPENSLIDE_COUNTER_BUFFERS_RECYCLED] = "buffers.recycled",
+  [OPENSLIDE_COUNTER_TILES_SYNTHESIZED] = "tiles.synthesized",
+  [OPENSLIDE_COUNTER_TILES_BLANK] = "tiles.blank",
+  [OPENSLIDE_COUNTER_DECODE_JPEG] = "decode.jpeg.count",
+  [OPENSLIDE_COUNTER_DECODE_JPEG_USEC] = "decode.jpeg.usec",
+  [OPENSLIDE_COUNTER_DECODE_JP2K] = "decode.jp2k.count",
+  [OPENSLIDE_COUNTER_DECODE_JP2K_USEC] = "decode.jp2k.usec",
+  [OPENSLIDE_COUNTER_DECODE_PNG] = "decode.png.count",
+  [OPENSLIDE_COUNTER_DECODE_PNG_USEC] = "decode.png.usec",
+  [OPENSLIDE_COUNTER_DECODE_GDKPIXBUF] = "decode.gdkpixbuf.count",
+  [OPENSLIDE_COUNTER_DECODE_GDKPIXBUF_USEC] = "decode.gdkpixbuf.usec",
+  [OPENSLIDE_COUNTER_DECODE_LIBTIFF] = "decode.libtiff.count",
+  [OPENSLIDE_COUNTER_DECODE_LIBTIFF_USEC] = "decode.libtiff.usec",
+  [OPENSLIDE_COUNTER_DECODE_EXTERNAL] = "decode.external.count",
+  [OPENSLIDE_COUNTER_DECODE_EXTERNAL_USEC] = "decode.external.usec",
+  [OPENSLIDE_COUNTER_COUNT] = NULL,
+};
+
+struct _openslide_counters {
+  int64_t values[OPENSLIDE_COUNTER_COUNT];
+};
+
+static struct _openslide_counters global_counters;
+
+struct _openslide_counters *_openslide_counters_create(void) {
+  return g_slice_new0(struct _openslide_counters);
+}
+
+void _openslide_counters_destroy(struct _openslide_counters *counters) {
+  g_slice_free(struct _openslide_counters, counters);
+}
+
+// glib < 2.30 has no 64-bit atomics, so use the GCC builtins
+void _openslide_counter_add(enum _openslide_counter counter, int64_t n) {
+  g_assert(counter < OPENSLIDE_COUNTER_COUNT);
+  if (n == 0) {
+    return;
+  }
+  __sync_fetch_and_add(&global_counters.values[counter], n);
+  openslide_t *osr = _openslide_slide_current();
+  if (osr) {
+    __sync_fetch_and_add(&osr->counters->values[counter], n);
+  }
+}
+
+int64_t _openslide_get_clock(void) {
+#if GLIB_CHECK_VERSION(2, 28, 0)
+  return g_get_monotonic_time();
+#else
+  GTimeVal tv;
+  g_get_current_time(&tv);
+  return (int64_t) tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+#endif
+}
+
+static const char *decode_codec(enum _openslide_counter counter) {
+  switch (counter) {
+  case OPENSLIDE_COUNTER_DECODE_JPEG:
+    return "jpeg";
+  case OPENSLIDE_COUNTER_DECODE_JP2K:
+    return "jp2k";
+  case OPENSLIDE_COUNTER_DECODE_PNG:
+    return "png";
+  case OPENSLIDE_COUNTER_DECODE_GDKPIXBUF:
+    return "gdkpixbuf";
+  case OPENSLIDE_COUNTER_DECODE_LIBTIFF:
+    return "libtiff";
+  case OPENSLIDE_COUNTER_DECODE_EXTERNAL:
+    return "external";
+  default:
+    g_assert_not_reached();
+  }
+}
+
+int64_t _openslide_decode_begin(enum _openslide_counter counter) {
+  _openslide_trace(OPENSLIDE_TRACE_DECODE, true, NULL, -1, -1, 0,
+                   decode_codec(counter));
+  return _openslide_get_clock();
+}
+
+void _openslide_decode_end(enum _openslide_counter counter, int64_t start) {
+  _openslide_counter_add(counter, 1);
+  _openslide_counter_add(counter + 1,
+                         MAX(_openslide_get_clock() - start, 0));
+  _openslide_trace(OPENSLIDE_TRACE_DECODE, false, NULL, -1, -1, 0,
+                   decode_codec(counter));
+}
+
+// public API
+const char * const *openslide_get_counter_names(void) {
+  return counter_names;
+}
+
+int64_t openslide_get_counter_value(openslide_t *osr, const char *name) {
+  struct _openslide_counters *counters =
+    osr ? osr->counters : &global_counters;
+  for (int i = 0; i < OPENSLIDE_COUNTER_COUNT; i++) {
+    if (!strcmp(name, counter_names[i])) {
+      return __sync_fetch_and_add(&counters->values[i], 0);
+    }
+  }
+  return -1;
+}
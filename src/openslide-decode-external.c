@@ -0,0 +1,110 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2015 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Decoders registered by the application
+ *
+ * Backends hand a decoder complete streams, so a tile from a TIFF
+ * directory with shared JPEG tables, or a restart interval of a
+ * Hamamatsu JPEG, is first rebuilt as a standalone file.  Jobs the
+ * decoder leaves unsuccessful are decoded by the backend as usual.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <glib.h>
+
+#define CODEC_COUNT (OPENSLIDE_CODEC_JPEG2000 + 1)
+
+struct decoder {
+  openslide_decode_fn decode;
+  void *data;
+};
+
+G_LOCK_DEFINE_STATIC(decoders);
+static struct decoder decoders[CODEC_COUNT];
+// atomic ops only; checked without the lock on every tile read
+static gint present[CODEC_COUNT];
+
+bool _openslide_decoder_present(openslide_codec_t codec) {
+  g_assert(codec < CODEC_COUNT);
+  return g_atomic_int_get(&present[codec]);
+}
+
+int32_t _openslide_decode_external_batch(openslide_codec_t codec,
+                                         openslide_decode_job_t *jobs,
+                                         int32_t count) {
+  g_assert(codec < CODEC_COUNT);
+  if (count == 0) {
+    return 0;
+  }
+
+  G_LOCK(decoders);
+  struct decoder decoder = decoders[codec];
+  G_UNLOCK(decoders);
+  if (!decoder.decode) {
+    return 0;
+  }
+
+  for (int32_t i = 0; i < count; i++) {
+    jobs[i].success = false;
+  }
+  int64_t start = _openslide_decode_begin(OPENSLIDE_COUNTER_DECODE_EXTERNAL);
+  decoder.decode(codec, jobs, count, decoder.data);
+  _openslide_decode_end(OPENSLIDE_COUNTER_DECODE_EXTERNAL, start);
+
+  int32_t decoded = 0;
+  for (int32_t i = 0; i < count; i++) {
+    if (jobs[i].success) {
+      decoded++;
+    }
+  }
+  // _openslide_decode_end() counted the batch; count its tiles instead
+  _openslide_counter_add(OPENSLIDE_COUNTER_DECODE_EXTERNAL, decoded - 1);
+  return decoded;
+}
+
+bool _openslide_decode_external(openslide_codec_t codec,
+                                const void *data, int64_t length,
+                                uint32_t *dest,
+                                int32_t w, int32_t h) {
+  openslide_decode_job_t job = {
+    .data = data,
+    .length = length,
+    .dest = dest,
+    .w = w,
+    .h = h,
+  };
+  return _openslide_decode_external_batch(codec, &job, 1) == 1;
+}
+
+void openslide_set_decoder(openslide_codec_t codec,
+                           openslide_decode_fn decode,
+                           void *data) {
+  g_return_if_fail(codec < CODEC_COUNT);
+  G_LOCK(decoders);
+  decoders[codec].decode = decode;
+  decoders[codec].data = data;
+  g_atomic_int_set(&present[codec], decode != NULL);
+  G_UNLOCK(decoders);
+}
@@ -25,7 +25,6 @@
 #include "openslide-private.h"
 #include "openslide-decode-gdkpixbuf.h"
 
-#include <stdio.h>
 #include <glib.h>
 #include <glib-object.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
@@ -81,31 +80,19 @@ static void area_prepared(GdkPixbufLoader *loader, void *data) {
   state->pixbuf = pixbuf;
 }
 
-bool _openslide_gdkpixbuf_read(const char *format,
-                               const char *filename,
-                               int64_t offset,
-                               int64_t length,
-                               uint32_t *dest,
-                               int32_t w, int32_t h,
-                               GError **err) {
+bool _openslide_gdkpixbuf_decode_buffer(const char *format,
+                                        const void *buf, int64_t length,
+                                        uint32_t *dest,
+                                        int32_t w, int32_t h,
+                                        GError **err) {
   GdkPixbufLoader *loader = NULL;
-  uint8_t *buf = g_slice_alloc(BUFSIZE);
   bool success = false;
+  int64_t start = _openslide_decode_begin(OPENSLIDE_COUNTER_DECODE_GDKPIXBUF);
   struct load_state state = {
     .w = w,
     .h = h,
   };
 
-  // open and seek
-  FILE *f = _openslide_fopen(filename, "rb", err);
-  if (!f) {
-    goto DONE;
-  }
-  if (fseeko(f, offset, SEEK_SET)) {
-    _openslide_io_error(err, "Couldn't fseek %s", filename);
-    goto DONE;
-  }
-
   // create loader
   loader = gdk_pixbuf_loader_new_with_type(format, err);
   if (!loader) {
@@ -113,21 +100,18 @@ bool _openslide_gdkpixbuf_read(const char *format,
   }
   g_signal_connect(loader, "area-prepared", G_CALLBACK(area_prepared), &state);
 
-  // read data
+  // feed data in pieces, so a bad header stops the load early
+  const uint8_t *p = buf;
   while (length) {
-    size_t count = fread(buf, 1, MIN(length, BUFSIZE), f);
-    if (!count) {
-      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                  "Short read loading pixbuf from %s", filename);
-      goto DONE;
-    }
-    if (!gdk_pixbuf_loader_write(loader, buf, count, err)) {
+    size_t count = MIN(length, BUFSIZE);
+    if (!gdk_pixbuf_loader_write(loader, p, count, err)) {
       g_prefix_error(err, "gdk-pixbuf error: ");
       goto DONE;
     }
     if (state.err) {
       goto DONE;
     }
+    p += count;
     length -= count;
   }
 
@@ -161,10 +145,6 @@ DONE:
     gdk_pixbuf_loader_close(loader, NULL);
     g_object_unref(loader);
   }
-  if (f) {
-    fclose(f);
-  }
-  g_slice_free1(BUFSIZE, buf);
 
   // now that the loader is closed, we know state.err won't be set
   // behind our back
@@ -175,5 +155,6 @@ DONE:
     // signal handler errors should have been noticed before falling through
     g_assert(!success);
   }
+  _openslide_decode_end(OPENSLIDE_COUNTER_DECODE_GDKPIXBUF, start);
   return success;
 }
@@ -29,8 +29,13 @@
 
 #include <openjpeg.h>
 
+static const char THREADS_ENV_VAR[] = "OPENSLIDE_JP2K_THREADS";
+
+// OpenJPEG worker threads per codestream
+static int32_t codec_threads = 1;
+
 struct buffer_state {
-  uint8_t *data;
+  const uint8_t *data;
   int32_t offset;
   int32_t length;
 };
@@ -54,16 +59,19 @@ static inline void write_pixel_rgb(uint32_t *dest,
   *dest = 0xff000000 | R << 16 | G << 8 | B;
 }
 
+// the w x h area is unpacked into rows of dest spaced stride pixels apart
 static void unpack_argb(enum _openslide_jp2k_colorspace space,
                         opj_image_comp_t *comps,
                         uint32_t *dest,
-                        int32_t w, int32_t h) {
-  int c0_sub_x = w / comps[0].w;
-  int c1_sub_x = w / comps[1].w;
-  int c2_sub_x = w / comps[2].w;
-  int c0_sub_y = h / comps[0].h;
-  int c1_sub_y = h / comps[1].h;
-  int c2_sub_y = h / comps[2].h;
+                        int32_t w, int32_t h, int32_t stride) {
+  // take subsampling from the components rather than from their
+  // dimensions, which are rounded up for an odd-sized area
+  int c0_sub_x = comps[0].dx;
+  int c1_sub_x = comps[1].dx;
+  int c2_sub_x = comps[2].dx;
+  int c0_sub_y = comps[0].dy;
+  int c1_sub_y = comps[1].dy;
+  int c2_sub_y = comps[2].dy;
 
   //g_debug("color space %d, subsamples x %d-%d-%d y %d-%d-%d", space, c0_sub_x, c1_sub_x, c2_sub_x, c0_sub_y, c1_sub_y, c2_sub_y);
 
@@ -72,30 +80,12 @@ static void unpack_argb(enum _openslide_jp2k_colorspace space,
       c0_sub_y == 1 && c1_sub_y == 1 && c2_sub_y == 1) {
     // Aperio 33003
     for (int32_t y = 0; y < h; y++) {
-      int32_t c0_row_base = y * comps[0].w;
-      int32_t c1_row_base = y * comps[1].w;
-      int32_t c2_row_base = y * comps[2].w;
-      int32_t x;
-      for (x = 0; x < w - 1; x += 2) {
-        uint8_t c0 = comps[0].data[c0_row_base + x];
-        uint8_t c1 = comps[1].data[c1_row_base + (x / 2)];
-        uint8_t c2 = comps[2].data[c2_row_base + (x / 2)];
-        int16_t R_chroma = _openslide_R_Cr[c2];
-        int16_t G_chroma = (_openslide_G_Cb[c1] + _openslide_G_Cr[c2]) >> 16;
-        int16_t B_chroma = _openslide_B_Cb[c1];
-        write_pixel_ycbcr(dest++, c0, R_chroma, G_chroma, B_chroma);
-        c0 = comps[0].data[c0_row_base + x + 1];
-        write_pixel_ycbcr(dest++, c0, R_chroma, G_chroma, B_chroma);
-      }
-      if (x < w) {
-        uint8_t c0 = comps[0].data[c0_row_base + x];
-        uint8_t c1 = comps[1].data[c1_row_base + (x / 2)];
-        uint8_t c2 = comps[2].data[c2_row_base + (x / 2)];
-        int16_t R_chroma = _openslide_R_Cr[c2];
-        int16_t G_chroma = (_openslide_G_Cb[c1] + _openslide_G_Cr[c2]) >> 16;
-        int16_t B_chroma = _openslide_B_Cb[c1];
-        write_pixel_ycbcr(dest++, c0, R_chroma, G_chroma, B_chroma);
-      }
+      _openslide_convert_ycbcr422_row_to_argb(dest,
+                                              comps[0].data + y * comps[0].w,
+                                              comps[1].data + y * comps[1].w,
+                                              comps[2].data + y * comps[2].w,
+                                              w);
+      dest += stride;
     }
 
   } else if (space == OPENSLIDE_JP2K_YCBCR) {
@@ -119,8 +109,9 @@ static void unpack_argb(enum _openslide_jp2k_colorspace space,
         int16_t R_chroma = _openslide_R_Cr[c2];
         int16_t G_chroma = (_openslide_G_Cb[c1] + _openslide_G_Cr[c2]) >> 16;
         int16_t B_chroma = _openslide_B_Cb[c1];
-        write_pixel_ycbcr(dest++, c0, R_chroma, G_chroma, B_chroma);
+        write_pixel_ycbcr(dest + x, c0, R_chroma, G_chroma, B_chroma);
       }
+      dest += stride;
     }
 
   } else if (space == OPENSLIDE_JP2K_RGB &&
@@ -135,8 +126,9 @@ static void unpack_argb(enum _openslide_jp2k_colorspace space,
         uint8_t c0 = comps[0].data[c0_row_base + x];
         uint8_t c1 = comps[1].data[c1_row_base + x];
         uint8_t c2 = comps[2].data[c2_row_base + x];
-        write_pixel_rgb(dest++, c0, c1, c2);
+        write_pixel_rgb(dest + x, c0, c1, c2);
       }
+      dest += stride;
     }
 
   } else if (space == OPENSLIDE_JP2K_RGB) {
@@ -157,8 +149,9 @@ static void unpack_argb(enum _openslide_jp2k_colorspace space,
         uint8_t c0 = comps[0].data[c0_row_base + (x / c0_sub_x)];
         uint8_t c1 = comps[1].data[c1_row_base + (x / c1_sub_x)];
         uint8_t c2 = comps[2].data[c2_row_base + (x / c2_sub_x)];
-        write_pixel_rgb(dest++, c0, c1, c2);
+        write_pixel_rgb(dest + x, c0, c1, c2);
       }
+      dest += stride;
     }
   }
 }
@@ -181,6 +174,28 @@ static void error_callback(const char *msg, void *data) {
   }
 }
 
+// note: g_getenv() is not reentrant
+void _openslide_jp2k_init(void) {
+  // OpenJPEG can spread the code blocks of one codestream across threads.
+  // Off by default, since tiles are already decoded concurrently when the
+  // application asks for decode threads.
+  const char *threads_str = g_getenv(THREADS_ENV_VAR);
+  if (threads_str && threads_str[0]) {
+    gchar *endptr;
+    gint64 threads = g_ascii_strtoll(threads_str, &endptr, 10);
+    if (*endptr == 0 && threads > 0) {
+      codec_threads = MIN(threads, 64);
+    }
+  }
+#ifndef HAVE_OPJ_CODEC_SET_THREADS
+  if (codec_threads > 1) {
+    g_warning("%s ignored: OpenJPEG is too old to decode with threads",
+              THREADS_ENV_VAR);
+    codec_threads = 1;
+  }
+#endif
+}
+
 #ifdef HAVE_OPENJPEG2
 
 static OPJ_SIZE_T read_callback(void *buf, OPJ_SIZE_T count, void *data) {
@@ -216,61 +231,151 @@ static OPJ_BOOL seek_callback(OPJ_OFF_T offset, void *data) {
   return OPJ_TRUE;
 }
 
-bool _openslide_jp2k_decode_buffer(uint32_t *dest,
-                                   int32_t w, int32_t h,
-                                   void *data, int32_t datalen,
-                                   enum _openslide_jp2k_colorspace space,
-                                   GError **err) {
-  opj_image_t *image = NULL;
-  GError *tmp_err = NULL;
-  bool success = false;
-
-  g_assert(data != NULL);
-  g_assert(datalen >= 0);
-
+// set up a decoder and read the codestream header
+// *stream, *codec, and *image are always set; caller must free them
+static bool read_header(struct buffer_state *state,
+                        int32_t reduce,
+                        opj_stream_t **stream,
+                        opj_codec_t **codec,
+                        opj_image_t **image,
+                        GError **tmp_err,
+                        GError **err) {
   // init stream
   // avoid tracking stream offset (and implementing skip callback) by having
   // OpenJPEG read the whole buffer at once
-  opj_stream_t *stream = opj_stream_create(datalen, true);
-  struct buffer_state state = {
-    .data = data,
-    .length = datalen,
-  };
-  opj_stream_set_user_data(stream, &state, NULL);
-  opj_stream_set_user_data_length(stream, datalen);
-  opj_stream_set_read_function(stream, read_callback);
-  opj_stream_set_skip_function(stream, skip_callback);
-  opj_stream_set_seek_function(stream, seek_callback);
+  *stream = opj_stream_create(state->length, true);
+  opj_stream_set_user_data(*stream, state, NULL);
+  opj_stream_set_user_data_length(*stream, state->length);
+  opj_stream_set_read_function(*stream, read_callback);
+  opj_stream_set_skip_function(*stream, skip_callback);
+  opj_stream_set_seek_function(*stream, seek_callback);
 
   // init codec
-  opj_codec_t *codec = opj_create_decompress(OPJ_CODEC_J2K);
+  *codec = opj_create_decompress(OPJ_CODEC_J2K);
   opj_dparameters_t parameters;
   opj_set_default_decoder_parameters(&parameters);
-  opj_setup_decoder(codec, &parameters);
+  parameters.cp_reduce = reduce;
+  opj_setup_decoder(*codec, &parameters);
+#ifdef HAVE_OPJ_CODEC_SET_THREADS
+  if (codec_threads > 1) {
+    opj_codec_set_threads(*codec, codec_threads);
+  }
+#endif
 
   // enable error handlers
   // note: don't use info_handler, it outputs lots of junk
-  opj_set_warning_handler(codec, warning_callback, &tmp_err);
-  opj_set_error_handler(codec, error_callback, &tmp_err);
+  opj_set_warning_handler(*codec, warning_callback, tmp_err);
+  opj_set_error_handler(*codec, error_callback, tmp_err);
 
   // read header
-  if (!opj_read_header(stream, codec, &image)) {
-    if (tmp_err) {
-      g_propagate_error(err, tmp_err);
+  *image = NULL;
+  if (!opj_read_header(*stream, *codec, image)) {
+    if (*tmp_err) {
+      g_propagate_error(err, *tmp_err);
+      *tmp_err = NULL;
     } else {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "opj_read_header() failed");
     }
+    return false;
+  }
+  g_clear_error(tmp_err);  // clear any spurious message
+  return true;
+}
+
+bool _openslide_jp2k_get_max_reduce(const void *data, int32_t datalen,
+                                    int32_t *max_reduce,
+                                    GError **err) {
+  opj_stream_t *stream;
+  opj_codec_t *codec;
+  opj_image_t *image;
+  GError *tmp_err = NULL;
+  bool success = false;
+
+  g_assert(data != NULL);
+  g_assert(datalen >= 0);
+
+  struct buffer_state state = {
+    .data = data,
+    .length = datalen,
+  };
+  if (!read_header(&state, 0, &stream, &codec, &image, &tmp_err, err)) {
+    goto DONE;
+  }
+
+  // the codestream can be reduced by one less than the number of
+  // resolutions in its least-decomposed component
+  opj_codestream_info_v2_t *info = opj_get_cstr_info(codec);
+  if (!info || !info->nbcomps || !info->m_default_tile_info.tccp_info) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Couldn't read JP2K coding parameters");
+    opj_destroy_cstr_info(&info);
+    goto DONE;
+  }
+  int32_t reduce = INT32_MAX;
+  for (OPJ_UINT32 i = 0; i < info->nbcomps; i++) {
+    int32_t resolutions = info->m_default_tile_info.tccp_info[i].numresolutions;
+    reduce = MIN(reduce, resolutions - 1);
+  }
+  opj_destroy_cstr_info(&info);
+  *max_reduce = MAX(reduce, 0);
+
+  success = true;
+
+DONE:
+  opj_image_destroy(image);
+  opj_destroy_codec(codec);
+  opj_stream_destroy(stream);
+  return success;
+}
+
+bool _openslide_jp2k_decode_buffer(uint32_t *dest,
+                                   int32_t w, int32_t h,
+                                   int32_t area_w, int32_t area_h,
+                                   int32_t reduce,
+                                   const void *data, int32_t datalen,
+                                   enum _openslide_jp2k_colorspace space,
+                                   GError **err) {
+  opj_stream_t *stream;
+  opj_codec_t *codec;
+  opj_image_t *image;
+  GError *tmp_err = NULL;
+  bool success = false;
+
+  g_assert(data != NULL);
+  g_assert(datalen >= 0);
+  g_assert(area_w > 0 && area_w <= w);
+  g_assert(area_h > 0 && area_h <= h);
+  g_assert(reduce >= 0 && reduce < 31);
+
+  // the application's decoder only gets full-resolution RGB codestreams
+  if (space == OPENSLIDE_JP2K_RGB && reduce == 0 &&
+      _openslide_decoder_present(OPENSLIDE_CODEC_JPEG2000) &&
+      _openslide_decode_external(OPENSLIDE_CODEC_JPEG2000, data, datalen,
+                                 dest, w, h)) {
+    return true;
+  }
+
+  int64_t start = _openslide_decode_begin(OPENSLIDE_COUNTER_DECODE_JP2K);
+
+  struct buffer_state state = {
+    .data = data,
+    .length = datalen,
+  };
+  if (!read_header(&state, reduce, &stream, &codec, &image, &tmp_err, err)) {
     goto DONE;
   }
-  g_clear_error(&tmp_err);  // clear any spurious message
 
   // sanity checks
-  if (image->x1 != (OPJ_UINT32) w || image->y1 != (OPJ_UINT32) h) {
+  // OpenJPEG rounds reduced dimensions up
+  OPJ_UINT32 scale = 1 << reduce;
+  OPJ_UINT32 image_w = (image->x1 + scale - 1) / scale;
+  OPJ_UINT32 image_h = (image->y1 + scale - 1) / scale;
+  if (image_w != (OPJ_UINT32) w || image_h != (OPJ_UINT32) h) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Dimensional mismatch reading JP2K, "
                 "expected %dx%d, got %ux%u",
-                w, h, image->x1, image->y1);
+                w, h, image_w, image_h);
     goto DONE;
   }
   if (image->numcomps != 3) {
@@ -280,10 +385,28 @@ bool _openslide_jp2k_decode_buffer(uint32_t *dest,
   }
   // TODO more checks?
 
+  // skip code blocks outside the area; the area is specified on the
+  // full-resolution grid
+  if (area_w < w || area_h < h) {
+    if (!opj_set_decode_area(codec, image, 0, 0,
+                             MIN(area_w * scale, image->x1),
+                             MIN(area_h * scale, image->y1))) {
+      if (tmp_err) {
+        g_propagate_error(err, tmp_err);
+        tmp_err = NULL;
+      } else {
+        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                    "opj_set_decode_area() failed");
+      }
+      goto DONE;
+    }
+  }
+
   // decode
   if (!opj_decode(codec, stream, image)) {
     if (tmp_err) {
       g_propagate_error(err, tmp_err);
+      tmp_err = NULL;
     } else {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "opj_decode() failed");
@@ -292,23 +415,52 @@ bool _openslide_jp2k_decode_buffer(uint32_t *dest,
   }
   g_clear_error(&tmp_err);  // clear any spurious message
 
+  // make sure every component covers the area
+  for (int i = 0; i < 3; i++) {
+    opj_image_comp_t *comp = &image->comps[i];
+    if (!comp->data || !comp->dx || !comp->dy ||
+        comp->w * comp->dx < (OPJ_UINT32) area_w ||
+        comp->h * comp->dy < (OPJ_UINT32) area_h) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "JP2K component %d decoded to unexpected size %ux%u",
+                  i, comp->w, comp->h);
+      goto DONE;
+    }
+  }
+
   // copy pixels
-  unpack_argb(space, image->comps, dest, w, h);
+  unpack_argb(space, image->comps, dest, area_w, area_h, w);
 
   success = true;
 
 DONE:
+  g_clear_error(&tmp_err);
   opj_image_destroy(image);
   opj_destroy_codec(codec);
   opj_stream_destroy(stream);
+  _openslide_decode_end(OPENSLIDE_COUNTER_DECODE_JP2K, start);
   return success;
 }
 
 #else  // HAVE_OPENJPEG2
 
+bool _openslide_jp2k_get_max_reduce(const void *data G_GNUC_UNUSED,
+                                    int32_t datalen G_GNUC_UNUSED,
+                                    int32_t *max_reduce,
+                                    GError **err G_GNUC_UNUSED) {
+  // OpenJPEG 1.x can't report the number of resolutions without decoding
+  // the whole codestream
+  *max_reduce = 0;
+  return true;
+}
+
+// OpenJPEG 1.x can't restrict decoding to an area, so we only restrict
+// the unpacking
 bool _openslide_jp2k_decode_buffer(uint32_t *dest,
                                    int32_t w, int32_t h,
-                                   void *data, int32_t datalen,
+                                   int32_t area_w, int32_t area_h,
+                                   int32_t reduce,
+                                   const void *data, int32_t datalen,
                                    enum _openslide_jp2k_colorspace space,
                                    GError **err) {
   GError *tmp_err = NULL;
@@ -316,6 +468,19 @@ bool _openslide_jp2k_decode_buffer(uint32_t *dest,
 
   // opj_cio_open interprets a NULL buffer as opening for write
   g_assert(data != NULL);
+  g_assert(area_w > 0 && area_w <= w);
+  g_assert(area_h > 0 && area_h <= h);
+  g_assert(reduce >= 0 && reduce < 31);
+
+  // the application's decoder only gets full-resolution RGB codestreams
+  if (space == OPENSLIDE_JP2K_RGB && reduce == 0 &&
+      _openslide_decoder_present(OPENSLIDE_CODEC_JPEG2000) &&
+      _openslide_decode_external(OPENSLIDE_CODEC_JPEG2000, data, datalen,
+                                 dest, w, h)) {
+    return true;
+  }
+
+  int64_t start = _openslide_decode_begin(OPENSLIDE_COUNTER_DECODE_JP2K);
 
   // init decompressor
   opj_cio_t *stream = NULL;
@@ -331,8 +496,11 @@ bool _openslide_jp2k_decode_buffer(uint32_t *dest,
   opj_dparameters_t parameters;
   dinfo = opj_create_decompress(CODEC_J2K);
   opj_set_default_decoder_parameters(&parameters);
+  parameters.cp_reduce = reduce;
   opj_setup_decoder(dinfo, &parameters);
-  stream = opj_cio_open((opj_common_ptr) dinfo, data, datalen);
+  // the buffer is only read
+  stream = opj_cio_open((opj_common_ptr) dinfo, (unsigned char *) data,
+                        datalen);
   opj_set_event_mgr((opj_common_ptr) dinfo, &event_callbacks, &tmp_err);
 
   // decode
@@ -366,11 +534,15 @@ bool _openslide_jp2k_decode_buffer(uint32_t *dest,
   }
 
   // sanity checks
-  if (image->x1 != w || image->y1 != h) {
+  // OpenJPEG rounds reduced dimensions up
+  int scale = 1 << reduce;
+  int image_w = (image->x1 + scale - 1) / scale;
+  int image_h = (image->y1 + scale - 1) / scale;
+  if (image_w != w || image_h != h) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Dimensional mismatch reading JP2K, "
                 "expected %dx%d, got %dx%d",
-                w, h, image->x1, image->y1);
+                w, h, image_w, image_h);
     goto DONE;
   }
   if (image->numcomps != 3) {
@@ -381,7 +553,7 @@ bool _openslide_jp2k_decode_buffer(uint32_t *dest,
 
   // TODO more checks?
 
-  unpack_argb(space, image->comps, dest, w, h);
+  unpack_argb(space, image->comps, dest, area_w, area_h, w);
 
   success = true;
 
@@ -395,6 +567,7 @@ DONE:
   if (dinfo) {
     opj_destroy_decompress(dinfo);
   }
+  _openslide_decode_end(OPENSLIDE_COUNTER_DECODE_JP2K, start);
   return success;
 }
 
@@ -32,10 +32,23 @@ enum _openslide_jp2k_colorspace {
   OPENSLIDE_JP2K_YCBCR,
 };
 
+// read OPENSLIDE_JP2K_THREADS
+void _openslide_jp2k_init(void);
+
+// decode into a w x h buffer, discarding the top reduce resolution levels;
+// w and h are the reduced dimensions of the codestream.  Only the
+// area_w x area_h region at the origin is written.
 bool _openslide_jp2k_decode_buffer(uint32_t *dest,
                                    int32_t w, int32_t h,
-                                   void *data, int32_t datalen,
+                                   int32_t area_w, int32_t area_h,
+                                   int32_t reduce,
+                                   const void *data, int32_t datalen,
                                    enum _openslide_jp2k_colorspace space,
                                    GError **err);
 
+// largest reduce the codestream supports; 0 if it can't be determined
+bool _openslide_jp2k_get_max_reduce(const void *data, int32_t datalen,
+                                    int32_t *max_reduce,
+                                    GError **err);
+
 #endif
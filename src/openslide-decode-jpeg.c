@@ -30,6 +30,7 @@
 #include <setjmp.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <jpeglib.h>
 #include <jerror.h>
 
@@ -162,12 +163,43 @@ struct _openslide_jpeg_decompress *_openslide_jpeg_decompress_create(struct jpeg
 }
 
 // after setjmp(), initialize error handler and start decompressing
+// a decompressor being reused only needs the new jmp_buf
 void _openslide_jpeg_decompress_init(struct _openslide_jpeg_decompress *dc,
                                      jmp_buf *env) {
+  if (dc->cinfo.err) {
+    dc->jerr.env = env;
+    return;
+  }
   dc->cinfo.err = error_handler_init(&dc->jerr, env);
   jpeg_create_decompress(&dc->cinfo);
 }
 
+// after a successful _openslide_jpeg_decompress_run(), ready the
+// decompressor for another image.  Tables loaded so far are kept, so
+// abbreviated images sharing them can skip reloading.
+void _openslide_jpeg_decompress_reset(struct _openslide_jpeg_decompress *dc) {
+  g_assert(dc->jerr.err == NULL);
+  jpeg_abort_decompress(&dc->cinfo);
+  if (dc->allocated_row_size) {
+    for (uint32_t row = 0; row < G_N_ELEMENTS(dc->rows); row++) {
+      g_slice_free1(dc->allocated_row_size, dc->rows[row]);
+    }
+    dc->allocated_row_size = 0;
+  }
+  memset(dc->rows, 0, sizeof(dc->rows));
+}
+
+static void set_out_color_space(struct jpeg_decompress_struct *cinfo,
+                                bool grayscale) {
+  bool alpha_extensions = GPOINTER_TO_INT(g_once(&jcs_alpha_extensions_detector,
+                                                 detect_jcs_alpha_extensions,
+                                                 NULL));
+  cinfo->out_color_space =
+    grayscale ? JCS_GRAYSCALE :
+    !alpha_extensions ? JCS_RGB :
+    G_BYTE_ORDER == G_LITTLE_ENDIAN ? JCS_EXT_BGRA : JCS_EXT_ARGB;
+}
+
 bool _openslide_jpeg_decompress_run(struct _openslide_jpeg_decompress *dc,
                                     // uint8_t * if grayscale, else uint32_t *
                                     void *_dest,
@@ -177,13 +209,7 @@ bool _openslide_jpeg_decompress_run(struct _openslide_jpeg_decompress *dc,
   struct jpeg_decompress_struct *cinfo = &dc->cinfo;
 
   // set color space
-  bool alpha_extensions = GPOINTER_TO_INT(g_once(&jcs_alpha_extensions_detector,
-                                                 detect_jcs_alpha_extensions,
-                                                 NULL));
-  cinfo->out_color_space =
-    grayscale ? JCS_GRAYSCALE :
-    !alpha_extensions ? JCS_RGB :
-    G_BYTE_ORDER == G_LITTLE_ENDIAN ? JCS_EXT_BGRA : JCS_EXT_ARGB;
+  set_out_color_space(cinfo, grayscale);
 
   jpeg_start_decompress(cinfo);
 
@@ -207,6 +233,10 @@ bool _openslide_jpeg_decompress_run(struct _openslide_jpeg_decompress *dc,
     uint8_t *dest = _dest;
     int bytes_per_pixel = cinfo->output_components == 1 ? 1 : 4;
     while (cinfo->output_scanline < cinfo->output_height) {
+      if (_openslide_check_interrupt(err)) {
+        return false;
+      }
+
       // set row pointers
       for (int32_t i = 0; i < cinfo->rec_outbuf_height; i++) {
         dc->rows[i] = cinfo->output_scanline + i < cinfo->output_height ?
@@ -233,18 +263,17 @@ bool _openslide_jpeg_decompress_run(struct _openslide_jpeg_decompress *dc,
     // decompress
     uint32_t *dest = _dest;
     while (cinfo->output_scanline < cinfo->output_height) {
+      if (_openslide_check_interrupt(err)) {
+        return false;
+      }
       JDIMENSION rows_read = jpeg_read_scanlines(cinfo,
                                                  dc->rows,
                                                  cinfo->rec_outbuf_height);
       int cur_row = 0;
       while (rows_read > 0) {
         // copy a row
-        for (int32_t i = 0; i < (int32_t) cinfo->output_width; i++) {
-          dest[i] = 0xFF000000 |                 // A
-            dc->rows[cur_row][i * 3 + 0] << 16 | // R
-            dc->rows[cur_row][i * 3 + 1] << 8 |  // G
-            dc->rows[cur_row][i * 3 + 2];        // B
-        }
+        _openslide_convert_rgb_to_argb(dest, dc->rows[cur_row],
+                                       cinfo->output_width);
         dest += cinfo->output_width;
 
         // advance 1 row
@@ -256,6 +285,93 @@ bool _openslide_jpeg_decompress_run(struct _openslide_jpeg_decompress *dc,
   return true;
 }
 
+// decode count windows of the output image, side by side from (x, y),
+// each w x h except that the last is clipped to the image's right edge.
+// Window i goes to dests[i], with rows as wide as the window.  With
+// libjpeg-turbo, rows above the windows are skipped without being
+// dequantized or color converted, and only the iMCU columns covering the
+// windows are decoded; otherwise the rest is decoded and discarded.
+bool _openslide_jpeg_decompress_run_windows(struct _openslide_jpeg_decompress *dc,
+                                            uint32_t **dests,
+                                            int32_t count,
+                                            int32_t x, int32_t y,
+                                            int32_t w, int32_t h,
+                                            GError **err) {
+  struct jpeg_decompress_struct *cinfo = &dc->cinfo;
+
+  set_out_color_space(cinfo, false);
+  jpeg_start_decompress(cinfo);
+
+  // ensure every window starts inside the image
+  if (count <= 0 || x < 0 || y < 0 || w <= 0 || h <= 0 ||
+      (int64_t) x + (int64_t) (count - 1) * w >= cinfo->output_width ||
+      (int64_t) y + h > cinfo->output_height) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "%d %dx%d windows at (%d, %d) outside %dx%d JPEG",
+                count, w, h, x, y, cinfo->output_width, cinfo->output_height);
+    return false;
+  }
+  int32_t span = MIN((int64_t) count * w, cinfo->output_width - x);
+
+  // verify we haven't run already
+  g_assert(dc->rows[0] == NULL);
+
+  // crop; this widens the span to iMCU boundaries
+  JDIMENSION xoffset = 0;
+#ifdef HAVE_JPEG_CROP_SCANLINE
+  JDIMENSION crop_width = span;
+  xoffset = x;
+  jpeg_crop_scanline(cinfo, &xoffset, &crop_width);
+#endif
+
+  // allocate scanline buffers
+  dc->allocated_row_size = sizeof(JSAMPLE) * cinfo->output_width *
+                           cinfo->output_components;
+  for (int i = 0; i < cinfo->rec_outbuf_height; i++) {
+    dc->rows[i] = g_slice_alloc(dc->allocated_row_size);
+  }
+
+  // skip to the windows
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+  jpeg_skip_scanlines(cinfo, y);
+#endif
+  while (cinfo->output_scanline < (JDIMENSION) y) {
+    if (_openslide_check_interrupt(err)) {
+      return false;
+    }
+    jpeg_read_scanlines(cinfo, dc->rows,
+                        MIN(cinfo->rec_outbuf_height,
+                            y - (int32_t) cinfo->output_scanline));
+  }
+
+  // decompress the windows' rows
+  int32_t bytes_per_pixel = cinfo->out_color_space == JCS_RGB ? 3 : 4;
+  while (cinfo->output_scanline < (JDIMENSION) (y + h)) {
+    if (_openslide_check_interrupt(err)) {
+      return false;
+    }
+    JDIMENSION row = cinfo->output_scanline;
+    JDIMENSION rows_read =
+      jpeg_read_scanlines(cinfo, dc->rows,
+                          MIN(cinfo->rec_outbuf_height,
+                              y + h - (int32_t) row));
+    for (JDIMENSION i = 0; i < rows_read; i++) {
+      for (int32_t n = 0; n < count; n++) {
+        int32_t col = x + n * w - xoffset;
+        int32_t width = MIN(w, span - n * w);
+        uint32_t *out = dests[n] + (int64_t) (row + i - y) * width;
+        const JSAMPLE *in = dc->rows[i] + col * bytes_per_pixel;
+        if (cinfo->out_color_space == JCS_RGB) {
+          _openslide_convert_rgb_to_argb(out, in, width);
+        } else {
+          memcpy(out, in, width * 4);
+        }
+      }
+    }
+  }
+  return true;
+}
+
 void _openslide_jpeg_propagate_error(GError **err,
                                      struct _openslide_jpeg_decompress *dc) {
   g_propagate_error(err, dc->jerr.err);
@@ -349,6 +465,7 @@ static bool jpeg_decode(FILE *f,  // or:
                         GError **err) {
   volatile bool result = false;
   jmp_buf env;
+  int64_t start = _openslide_decode_begin(OPENSLIDE_COUNTER_DECODE_JPEG);
 
   struct jpeg_decompress_struct *cinfo;
   struct _openslide_jpeg_decompress *dc =
@@ -383,6 +500,7 @@ static bool jpeg_decode(FILE *f,  // or:
 
 DONE:
   _openslide_jpeg_decompress_destroy(dc);
+  _openslide_decode_end(OPENSLIDE_COUNTER_DECODE_JPEG, start);
 
   return result;
 }
@@ -416,6 +534,10 @@ bool _openslide_jpeg_decode_buffer(const void *buf, uint32_t len,
                                    GError **err) {
   //g_debug("decode JPEG buffer: %x %u", buf, len);
 
+  if (_openslide_decoder_present(OPENSLIDE_CODEC_JPEG) &&
+      _openslide_decode_external(OPENSLIDE_CODEC_JPEG, buf, len, dest, w, h)) {
+    return true;
+  }
   return jpeg_decode(NULL, buf, len, dest, false, w, h, err);
 }
 
@@ -92,6 +92,15 @@ bool _openslide_jpeg_decompress_run(struct _openslide_jpeg_decompress *dc,
                                     int32_t w, int32_t h,
                                     GError **err);
 
+bool _openslide_jpeg_decompress_run_windows(struct _openslide_jpeg_decompress *dc,
+                                            uint32_t **dests,
+                                            int32_t count,
+                                            int32_t x, int32_t y,
+                                            int32_t w, int32_t h,
+                                            GError **err);
+
+void _openslide_jpeg_decompress_reset(struct _openslide_jpeg_decompress *dc);
+
 void _openslide_jpeg_propagate_error(GError **err,
                                      struct _openslide_jpeg_decompress *dc);
 
@@ -30,7 +30,7 @@
 
 #include <glib.h>
 #include <setjmp.h>
-#include <stdio.h>
+#include <string.h>
 
 struct png_error_ctx {
   jmp_buf env;
@@ -49,21 +49,29 @@ static void error_callback(png_struct *png, const char *message) {
   longjmp(ectx->env, 1);
 }
 
+struct png_buffer {
+  const uint8_t *buf;
+  int64_t len;
+  int64_t offset;
+};
+
 static void read_callback(png_struct *png, png_byte *buf, png_size_t len) {
-  FILE *f = png_get_io_ptr(png);
-  if (fread(buf, len, 1, f) != 1) {
+  struct png_buffer *src = png_get_io_ptr(png);
+  if ((int64_t) len > src->len - src->offset) {
     png_error(png, "Read failed");
   }
+  memcpy(buf, src->buf + src->offset, len);
+  src->offset += len;
 }
 
-bool _openslide_png_read(const char *filename,
-                         int64_t offset,
-                         uint32_t *dest,
-                         int64_t w, int64_t h,
-                         GError **err) {
+bool _openslide_png_decode_buffer(const void *buf, int64_t len,
+                                  uint32_t *dest,
+                                  int64_t w, int64_t h,
+                                  GError **err) {
   png_struct *png = NULL;
   png_info *info = NULL;
   volatile bool success = false;
+  int64_t start = _openslide_decode_begin(OPENSLIDE_COUNTER_DECODE_PNG);
 
   // allocate error context
   struct png_error_ctx *ectx = g_slice_new0(struct png_error_ctx);
@@ -74,15 +82,10 @@ bool _openslide_png_read(const char *filename,
     rows[y] = (png_byte *) &dest[y * w];
   }
 
-  // open and seek
-  FILE *f = _openslide_fopen(filename, "rb", err);
-  if (!f) {
-    goto DONE;
-  }
-  if (fseeko(f, offset, SEEK_SET)) {
-    _openslide_io_error(err, "Couldn't fseek %s", filename);
-    goto DONE;
-  }
+  struct png_buffer src = {
+    .buf = buf,
+    .len = len,
+  };
 
   // init libpng
   png = png_create_read_struct(PNG_LIBPNG_VER_STRING, ectx,
@@ -100,9 +103,7 @@ bool _openslide_png_read(const char *filename,
   }
 
   if (!setjmp(ectx->env)) {
-    // We can't use png_init_io(): passing FILE * between libraries isn't
-    // safe on Windows
-    png_set_read_fn(png, f, read_callback);
+    png_set_read_fn(png, &src, read_callback);
 
     // read header
     png_read_info(png, info);
@@ -177,10 +178,8 @@ bool _openslide_png_read(const char *filename,
 
 DONE:
   png_destroy_read_struct(&png, &info, NULL);
-  if (f) {
-    fclose(f);
-  }
   g_slice_free1(h * sizeof(*rows), rows);
   g_slice_free(struct png_error_ctx, ectx);
+  _openslide_decode_end(OPENSLIDE_COUNTER_DECODE_PNG, start);
   return success;
 }
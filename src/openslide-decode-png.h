@@ -25,10 +25,9 @@
 #include <stdint.h>
 #include <glib.h>
 
-bool _openslide_png_read(const char *filename,
-                         int64_t offset,
-                         uint32_t *dest,
-                         int64_t w, int64_t h,
-                         GError **err);
+bool _openslide_png_decode_buffer(const void *buf, int64_t len,
+                                  uint32_t *dest,
+                                  int64_t w, int64_t h,
+                                  GError **err);
 
 #endif
@@ -26,6 +26,10 @@
 #include "openslide-private.h"
 
 #define BUSY_TIMEOUT 500  // ms
+// page cache shared by a slide's long-lived connections, in KiB
+// (or pages before 3.7.10)
+#define PAGE_CACHE_BUDGET 16384
+#define MMAP_SIZE (256 * 1024 * 1024)
 #define PROFILE 0
 
 /* Can only use API supported in SQLite 3.6.20 for RHEL 6 compatibility */
@@ -89,6 +93,22 @@ sqlite3 *_openslide_sqlite_open(const char *filename, GError **err) {
   return db;
 }
 
+// Best-effort tuning for one of up to max_connections connections that
+// will serve many queries; they split the page cache budget.
+// Unknown pragmas are ignored, so mmap_size is a no-op on SQLite < 3.7.17.
+void _openslide_sqlite_tune_for_reads(sqlite3 *db, int32_t max_connections) {
+  // negative is KiB rather than pages
+  int32_t cache_size = -(PAGE_CACHE_BUDGET / MAX(max_connections, 1));
+  char *sql = g_strdup_printf("PRAGMA cache_size = %d; "
+                              "PRAGMA mmap_size = %d",
+                              cache_size, MMAP_SIZE);
+  char *errmsg = NULL;
+  if (sqlite3_exec(db, sql, NULL, NULL, &errmsg)) {
+    sqlite3_free(errmsg);
+  }
+  g_free(sql);
+}
+
 sqlite3_stmt *_openslide_sqlite_prepare(sqlite3 *db, const char *sql,
                                         GError **err) {
   sqlite3_stmt *stmt;
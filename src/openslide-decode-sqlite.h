@@ -29,6 +29,7 @@
 /* SQLite support code */
 
 sqlite3 *_openslide_sqlite_open(const char *filename, GError **err);
+void _openslide_sqlite_tune_for_reads(sqlite3 *db, int32_t max_connections);
 sqlite3_stmt *_openslide_sqlite_prepare(sqlite3 *db, const char *sql,
                                         GError **err);
 bool _openslide_sqlite_step(sqlite3_stmt *stmt, GError **err);
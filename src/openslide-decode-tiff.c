@@ -37,17 +37,34 @@
 #include "openslide-hash.h"
 
 #define HANDLE_CACHE_MAX 32
+#define DECOMPRESS_CACHE_MAX 32
 
 struct _openslide_tiffcache {
   char *filename;
   GQueue *cache;
   GMutex *lock;
   int outstanding;
+
+  // read-only mapping of the whole file, if enabled
+  GMappedFile *map;
+  bool map_attempted;
+
+  // idle JPEG decompressors, most recently used first
+  GQueue *decompressors;
+};
+
+// a JPEG decompressor holding the JPEGTABLES of one directory
+struct tiff_decompress {
+  struct _openslide_jpeg_decompress *dc;
+  struct jpeg_decompress_struct *cinfo;
+  tdir_t dir;
+  bool have_tables;
 };
 
 // not thread-safe, like libtiff
 struct tiff_file_handle {
   struct _openslide_tiffcache *tc;
+  FILE *f;  // NULL if over the persistent file limit
   int64_t offset;
   int64_t size;
 };
@@ -56,6 +73,10 @@ struct associated_image {
   struct _openslide_associated_image base;
   struct _openslide_tiffcache *tc;
   tdir_t directory;
+
+  // stripped 8-bit RGB JPEG, which we can decode without libtiff
+  bool read_direct;
+  uint16_t photometric;
 };
 
 #define SET_DIR_OR_FAIL(tiff, i)					\
@@ -127,6 +148,35 @@ bool _openslide_tiff_level_init(TIFF *tiff,
     samples_per_pixel == 3;
   //g_debug("directory %d, read_direct %d", dir, read_direct);
 
+  // otherwise, decide whether libtiff can just decompress the tiles
+  enum _openslide_tiff_layout layout = OPENSLIDE_TIFF_LAYOUT_NONE;
+  uint16_t orientation;
+  uint16_t extra_count;
+  uint16_t *extra_types;
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_ORIENTATION, &orientation);
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_EXTRASAMPLES,
+                        &extra_count, &extra_types);
+  if (!read_direct &&
+      compression != COMPRESSION_JPEG &&
+      compression != COMPRESSION_OJPEG &&
+      TIFFIsCODECConfigured(compression) &&
+      planar_config == PLANARCONFIG_CONTIG &&
+      orientation == ORIENTATION_TOPLEFT &&
+      bits_per_sample == 8) {
+    if (photometric == PHOTOMETRIC_MINISBLACK && samples_per_pixel == 1) {
+      layout = OPENSLIDE_TIFF_LAYOUT_GRAY;
+    } else if (photometric == PHOTOMETRIC_RGB && samples_per_pixel == 3) {
+      layout = OPENSLIDE_TIFF_LAYOUT_RGB;
+    } else if (photometric == PHOTOMETRIC_RGB && samples_per_pixel == 4 &&
+               extra_count == 1) {
+      // like TIFFRGBAImage, take an unspecified extra sample as
+      // premultiplied alpha
+      layout = extra_types[0] == EXTRASAMPLE_UNASSALPHA ?
+               OPENSLIDE_TIFF_LAYOUT_RGBA_UNASSOCIATED :
+               OPENSLIDE_TIFF_LAYOUT_RGBA;
+    }
+  }
+
   // safe now, start writing
   if (level) {
     level->w = iw;
@@ -148,12 +198,76 @@ bool _openslide_tiff_level_init(TIFF *tiff,
     tiffl->tiles_down = (ih / th) + !!(ih % th);
 
     tiffl->tile_read_direct = read_direct;
+    tiffl->tile_layout = layout;
     tiffl->photometric = photometric;
+
+    tiffl->scale_denom = 1;
+    tiffl->tile_data_key = tiffl;
   }
 
   return true;
 }
 
+bool _openslide_tiff_level_can_scale(const struct _openslide_tiff_level *tiffl,
+                                     int32_t scale_denom,
+                                     int64_t next_level_w) {
+  // only the libjpeg path can scale, and only to whole-pixel tiles
+  return tiffl->tile_read_direct &&
+         tiffl->scale_denom == 1 &&
+         tiffl->tile_w % scale_denom == 0 &&
+         tiffl->tile_h % scale_denom == 0 &&
+         tiffl->image_w / scale_denom > next_level_w;
+}
+
+void _openslide_tiff_level_init_scaled(const struct _openslide_level *src_level,
+                                       const struct _openslide_tiff_level *src_tiffl,
+                                       int32_t scale_denom,
+                                       struct _openslide_level *level,
+                                       struct _openslide_tiff_level *tiffl) {
+  level->w = src_level->w / scale_denom;
+  level->h = src_level->h / scale_denom;
+  if (src_level->downsample) {
+    level->downsample = src_level->downsample * scale_denom;
+  }
+  if (src_level->tile_w && src_level->tile_h) {
+    level->tile_w = src_level->tile_w / scale_denom;
+    level->tile_h = src_level->tile_h / scale_denom;
+  }
+  level->simple_grid = src_level->simple_grid;
+
+  *tiffl = *src_tiffl;
+  tiffl->image_w = src_tiffl->image_w / scale_denom;
+  tiffl->image_h = src_tiffl->image_h / scale_denom;
+  tiffl->tile_w = src_tiffl->tile_w / scale_denom;
+  tiffl->tile_h = src_tiffl->tile_h / scale_denom;
+  tiffl->warned_read_indirect = 0;
+  tiffl->scale_denom = scale_denom;
+}
+
+GPtrArray *_openslide_tiff_add_scaled_levels(openslide_t *osr,
+                                             GPtrArray *levels,
+                                             _openslide_tiff_scale_level_fn create,
+                                             void *data) {
+  GPtrArray *expanded = g_ptr_array_new();
+  for (guint n = 0; n < levels->len; n++) {
+    struct _openslide_level *l = levels->pdata[n];
+    struct _openslide_level *next = NULL;
+    if (n + 1 < levels->len) {
+      next = levels->pdata[n + 1];
+    }
+    g_ptr_array_add(expanded, l);
+
+    for (int32_t scale_denom = 2; scale_denom <= 8; scale_denom <<= 1) {
+      struct _openslide_level *sd_l = create(osr, l, next, scale_denom, data);
+      if (sd_l) {
+        g_ptr_array_add(expanded, sd_l);
+      }
+    }
+  }
+  g_ptr_array_free(levels, true);
+  return expanded;
+}
+
 // clip right/bottom edges of tile in last row/column
 bool _openslide_tiff_clip_tile(struct _openslide_tiff_level *tiffl,
                                uint32_t *tiledata,
@@ -193,10 +307,7 @@ static bool tiff_read_region(TIFF *tiff,
   // draw it
   if (TIFFRGBAImageGet(&img, dest, w, h)) {
     // convert ABGR -> ARGB
-    for (uint32_t *p = dest; p < dest + w * h; p++) {
-      uint32_t val = GUINT32_SWAP_LE_BE(*p);
-      *p = (val << 24) | (val >> 8);
-    }
+    _openslide_convert_abgr_to_argb(dest, (int64_t) w * h);
     success = true;
   } else {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -209,30 +320,108 @@ static bool tiff_read_region(TIFF *tiff,
   return success;
 }
 
-static bool decode_jpeg(const void *buf, uint32_t buflen,
-                        const void *tables, uint32_t tables_len,  // optional
+static struct tiff_decompress *decompress_get(struct _openslide_tiffcache *tc,
+                                              tdir_t dir) {
+  struct tiff_decompress *td = NULL;
+  g_mutex_lock(tc->lock);
+  for (GList *link = tc->decompressors->head; link; link = link->next) {
+    struct tiff_decompress *cur = link->data;
+    if (cur->dir == dir) {
+      td = cur;
+      g_queue_delete_link(tc->decompressors, link);
+      break;
+    }
+  }
+  g_mutex_unlock(tc->lock);
+
+  if (td == NULL) {
+    // a decompressor that has seen another directory's tables may still
+    // hold table slots this directory doesn't define, so start fresh
+    td = g_slice_new0(struct tiff_decompress);
+    td->dc = _openslide_jpeg_decompress_create(&td->cinfo);
+    td->dir = dir;
+  }
+  return td;
+}
+
+static void decompress_destroy(struct tiff_decompress *td) {
+  _openslide_jpeg_decompress_destroy(td->dc);
+  g_slice_free(struct tiff_decompress, td);
+}
+
+// reusable is false if decoding failed or replaced the directory's tables
+static void decompress_put(struct _openslide_tiffcache *tc,
+                           struct tiff_decompress *td,
+                           bool reusable) {
+  if (reusable) {
+    _openslide_jpeg_decompress_reset(td->dc);
+    g_mutex_lock(tc->lock);
+    if (g_queue_get_length(tc->decompressors) < DECOMPRESS_CACHE_MAX) {
+      g_queue_push_head(tc->decompressors, td);
+      td = NULL;
+    }
+    g_mutex_unlock(tc->lock);
+  }
+  if (td) {
+    decompress_destroy(td);
+  }
+}
+
+// true unless the abbreviated stream relies entirely on tables loaded
+// beforehand
+static bool jpeg_defines_tables(const uint8_t *buf, uint32_t buflen) {
+  uint32_t off = 2;  // SOI
+  while (off + 4 <= buflen) {
+    if (buf[off] != 0xFF) {
+      return true;  // confused; assume the worst
+    }
+    switch (buf[off + 1]) {
+    case 0xFF:  // fill byte
+      off++;
+      continue;
+    case 0xDA:  // SOS
+      return false;
+    case 0xDB:  // DQT
+    case 0xC4:  // DHT
+      return true;
+    }
+    off += 2 + (buf[off + 2] << 8 | buf[off + 3]);
+  }
+  return true;
+}
+
+static bool decode_jpeg(TIFF *tiff,
+                        tdir_t dir,
+                        const void *buf, uint32_t buflen,
                         J_COLOR_SPACE space,
+                        int32_t scale_denom,
                         uint32_t *dest,
                         int32_t w, int32_t h,
                         GError **err) {
   volatile bool result = false;
   jmp_buf env;
 
-  struct jpeg_decompress_struct *cinfo;
-  struct _openslide_jpeg_decompress *dc =
-    _openslide_jpeg_decompress_create(&cinfo);
+  // reuse a decompressor that already holds the directory's tables
+  struct tiff_file_handle *hdl = TIFFClientdata(tiff);
+  struct tiff_decompress *td = decompress_get(hdl->tc, dir);
+  struct jpeg_decompress_struct *cinfo = td->cinfo;
 
   if (setjmp(env) == 0) {
-    _openslide_jpeg_decompress_init(dc, &env);
+    _openslide_jpeg_decompress_init(td->dc, &env);
 
     // load JPEG tables
-    if (tables) {
-      _openslide_jpeg_mem_src(cinfo, tables, tables_len);
-      if (jpeg_read_header(cinfo, false) != JPEG_HEADER_TABLES_ONLY) {
-        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                    "Couldn't load JPEG tables");
-        goto DONE;
+    if (!td->have_tables) {
+      void *tables;
+      uint32_t tables_len;
+      if (TIFFGetField(tiff, TIFFTAG_JPEGTABLES, &tables_len, &tables)) {
+        _openslide_jpeg_mem_src(cinfo, tables, tables_len);
+        if (jpeg_read_header(cinfo, false) != JPEG_HEADER_TABLES_ONLY) {
+          g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                      "Couldn't load JPEG tables");
+          goto DONE;
+        }
       }
+      td->have_tables = true;
     }
 
     // set up I/O
@@ -248,23 +437,165 @@ static bool decode_jpeg(const void *buf, uint32_t buflen,
     // set color space from TIFF photometric tag (for Aperio)
     cinfo->jpeg_color_space = space;
 
+    // downscale in the DCT domain, if requested
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = scale_denom;
+
     // decompress
-    if (!_openslide_jpeg_decompress_run(dc, dest, false, w, h, err)) {
+    if (!_openslide_jpeg_decompress_run(td->dc, dest, false, w, h, err)) {
       goto DONE;
     }
     result = true;
   } else {
     // setjmp has returned again
-    _openslide_jpeg_propagate_error(err, dc);
+    _openslide_jpeg_propagate_error(err, td->dc);
   }
 
 DONE:
-  _openslide_jpeg_decompress_destroy(dc);
+  decompress_put(hdl->tc, td, result && !jpeg_defines_tables(buf, buflen));
 
   return result;
 }
 
-bool _openslide_tiff_read_tile(struct _openslide_tiff_level *tiffl,
+// An Adobe APP14 segment with transform 0, which tells decoders that the
+// components are RGB rather than YCbCr
+static const uint8_t ADOBE_RGB_MARKER[] = {
+  0xff, 0xee, 0x00, 0x0e, 'A', 'd', 'o', 'b', 'e',
+  0x00, 0x64, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+// splice the directory's shared tables into a tile's abbreviated JPEG
+// stream, giving a standalone file in a g_malloc'd buffer
+static bool make_standalone_jpeg(uint16_t photometric,
+                                 TIFF *tiff,
+                                 const void *data, int32_t len,
+                                 void **_buf, int32_t *_len,
+                                 GError **err) {
+  const uint8_t *tile = data;
+  if (len < 4 || tile[0] != 0xff || tile[1] != 0xd8) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Tile is not a JPEG stream");
+    return false;
+  }
+
+  // shared tables are a stream of their own: SOI, tables, EOI
+  const uint8_t *tables = NULL;
+  uint32_t tables_len = 0;
+  if (TIFFGetField(tiff, TIFFTAG_JPEGTABLES, &tables_len, &tables) &&
+      tables_len >= 4) {
+    if (tables[0] != 0xff || tables[1] != 0xd8 ||
+        tables[tables_len - 2] != 0xff || tables[tables_len - 1] != 0xd9) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Couldn't parse JPEG tables");
+      return false;
+    }
+    tables += 2;
+    tables_len -= 4;
+  } else {
+    tables_len = 0;
+  }
+
+  // SOI, then any color marker, tables, and the tile after its SOI
+  bool rgb = photometric == PHOTOMETRIC_RGB;
+  int32_t out_len = len + tables_len + (rgb ? sizeof(ADOBE_RGB_MARKER) : 0);
+  uint8_t *out = g_malloc(out_len);
+  uint8_t *p = out;
+  *p++ = 0xff;
+  *p++ = 0xd8;
+  if (rgb) {
+    memcpy(p, ADOBE_RGB_MARKER, sizeof(ADOBE_RGB_MARKER));
+    p += sizeof(ADOBE_RGB_MARKER);
+  }
+  memcpy(p, tables, tables_len);
+  p += tables_len;
+  memcpy(p, tile + 2, len - 2);
+
+  *_buf = out;
+  *_len = out_len;
+  return true;
+}
+
+// scaled levels share the tile grid of their directory
+static ttile_t compute_tile(struct _openslide_tiff_level *tiffl,
+                            TIFF *tiff,
+                            int64_t tile_col, int64_t tile_row) {
+  return TIFFComputeTile(tiff,
+                         tile_col * tiffl->tile_w * tiffl->scale_denom,
+                         tile_row * tiffl->tile_h * tiffl->scale_denom,
+                         0, 0);
+}
+
+// decompress a tile with libtiff and convert its samples to ARGB
+static bool decode_tile_samples(struct _openslide_tiff_level *tiffl,
+                                TIFF *tiff,
+                                uint32_t *dest,
+                                int64_t tile_col, int64_t tile_row,
+                                GError **err) {
+  g_assert(tiffl->scale_denom == 1);
+  int64_t count = tiffl->tile_w * tiffl->tile_h;
+  int32_t spp;
+  switch (tiffl->tile_layout) {
+  case OPENSLIDE_TIFF_LAYOUT_GRAY:
+    spp = 1;
+    break;
+  case OPENSLIDE_TIFF_LAYOUT_RGB:
+    spp = 3;
+    break;
+  case OPENSLIDE_TIFF_LAYOUT_RGBA:
+  case OPENSLIDE_TIFF_LAYOUT_RGBA_UNASSOCIATED:
+    spp = 4;
+    break;
+  default:
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Unsupported tile layout in directory %d", tiffl->dir);
+    return false;
+  }
+  tmsize_t size = count * spp;
+  if (TIFFTileSize(tiff) != size) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Unexpected tile size %"PRId64" in directory %d",
+                (int64_t) TIFFTileSize(tiff), tiffl->dir);
+    return false;
+  }
+
+  uint8_t *buf = g_slice_alloc(size);
+  ttile_t tile = compute_tile(tiffl, tiff, tile_col, tile_row);
+  if (TIFFReadEncodedTile(tiff, tile, buf, size) != size) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Cannot read tile %"PRId64" %"PRId64" in directory %d",
+                tile_col, tile_row, tiffl->dir);
+    g_slice_free1(size, buf);
+    return false;
+  }
+
+  switch (tiffl->tile_layout) {
+  case OPENSLIDE_TIFF_LAYOUT_GRAY:
+    _openslide_convert_gray_to_argb(dest, buf, count);
+    break;
+  case OPENSLIDE_TIFF_LAYOUT_RGB:
+    _openslide_convert_rgb_to_argb(dest, buf, count);
+    break;
+  case OPENSLIDE_TIFF_LAYOUT_RGBA_UNASSOCIATED:
+    // premultiply, rounding as TIFFRGBAImage does
+    for (int64_t i = 0; i < count; i++) {
+      uint8_t *p = buf + i * 4;
+      for (int c = 0; c < 3; c++) {
+        p[c] = (p[c] * p[3] + 127) / 255;
+      }
+    }
+    // fall through
+  case OPENSLIDE_TIFF_LAYOUT_RGBA:
+    _openslide_convert_rgba_to_argb(dest, buf, count);
+    break;
+  default:
+    g_assert_not_reached();
+  }
+  g_slice_free1(size, buf);
+  return true;
+}
+
+bool _openslide_tiff_read_tile(openslide_t *osr,
+                               struct _openslide_tiff_level *tiffl,
                                TIFF *tiff,
                                uint32_t *dest,
                                int64_t tile_col, int64_t tile_row,
@@ -280,41 +611,73 @@ bool _openslide_tiff_read_tile(struct _openslide_tiff_level *tiffl,
     // decoding JPEG tiles, we can reduce this to one optimized pass in
     // libjpeg-turbo.
 
-    // read tables
-    void *tables;
-    uint32_t tables_len;
-    if (!TIFFGetField(tiff, TIFFTAG_JPEGTABLES, &tables_len, &tables)) {
-      // no separate tables
-      tables = NULL;
-      tables_len = 0;
-    }
-
     // read data
-    void *buf;
+    const void *buf;
     int32_t buflen;
-    if (!_openslide_tiff_read_tile_data(tiffl, tiff,
-                                        &buf, &buflen,
-                                        tile_col, tile_row,
-                                        err)) {
+    struct _openslide_cache_entry *entry;
+    if (!_openslide_tiff_get_tile_data(osr, tiffl, tiff,
+                                       &buf, &buflen, &entry,
+                                       tile_col, tile_row,
+                                       err)) {
       return false;
     }
 
     // decompress
-    bool ret = decode_jpeg(buf, buflen, tables, tables_len,
+    _openslide_counter_add(OPENSLIDE_COUNTER_TIFF_TILES_DIRECT, 1);
+    if (tiffl->scale_denom == 1 &&
+        _openslide_decoder_present(OPENSLIDE_CODEC_JPEG)) {
+      void *stream;
+      int32_t stream_len;
+      bool decoded = false;
+      if (make_standalone_jpeg(tiffl->photometric, tiff, buf, buflen,
+                               &stream, &stream_len, NULL)) {
+        decoded = _openslide_decode_external(OPENSLIDE_CODEC_JPEG,
+                                             stream, stream_len, dest,
+                                             tiffl->tile_w, tiffl->tile_h);
+        g_free(stream);
+      }
+      if (decoded) {
+        if (entry) {
+          _openslide_cache_entry_unref(entry);
+        }
+        return true;
+      }
+    }
+    int64_t start = _openslide_decode_begin(OPENSLIDE_COUNTER_DECODE_JPEG);
+    bool ret = decode_jpeg(tiff, tiffl->dir, buf, buflen,
                            tiffl->photometric == PHOTOMETRIC_YCBCR ? JCS_YCbCr : JCS_RGB,
+                           tiffl->scale_denom,
                            dest,
                            tiffl->tile_w, tiffl->tile_h,
                            err);
-    g_free(buf);
+    _openslide_decode_end(OPENSLIDE_COUNTER_DECODE_JPEG, start);
+    if (entry) {
+      _openslide_cache_entry_unref(entry);
+    }
+    return ret;
+  } else if (tiffl->tile_layout != OPENSLIDE_TIFF_LAYOUT_NONE) {
+    // Let libtiff decompress, then convert in one pass.  This skips
+    // TIFFRGBAImage's per-pixel put routines and our ABGR swizzle.
+    _openslide_counter_add(OPENSLIDE_COUNTER_TIFF_TILES_DIRECT, 1);
+    int64_t start = _openslide_decode_begin(OPENSLIDE_COUNTER_DECODE_LIBTIFF);
+    bool ret = decode_tile_samples(tiffl, tiff, dest, tile_col, tile_row,
+                                   err);
+    _openslide_decode_end(OPENSLIDE_COUNTER_DECODE_LIBTIFF, start);
     return ret;
   } else {
     // Fallback: read tile through libtiff
+    g_assert(tiffl->scale_denom == 1);
     _openslide_performance_warn_once(&tiffl->warned_read_indirect,
                                      "Using slow libtiff read path for "
                                      "directory %d", tiffl->dir);
-    return tiff_read_region(tiff, dest,
-                            tile_col * tiffl->tile_w, tile_row * tiffl->tile_h,
-                            tiffl->tile_w, tiffl->tile_h, err);
+    _openslide_counter_add(OPENSLIDE_COUNTER_TIFF_TILES_LIBTIFF, 1);
+    int64_t start = _openslide_decode_begin(OPENSLIDE_COUNTER_DECODE_LIBTIFF);
+    bool ret = tiff_read_region(tiff, dest,
+                                tile_col * tiffl->tile_w,
+                                tile_row * tiffl->tile_h,
+                                tiffl->tile_w, tiffl->tile_h, err);
+    _openslide_decode_end(OPENSLIDE_COUNTER_DECODE_LIBTIFF, start);
+    return ret;
   }
 }
 
@@ -327,10 +690,7 @@ bool _openslide_tiff_read_tile_data(struct _openslide_tiff_level *tiffl,
   SET_DIR_OR_FAIL(tiff, tiffl->dir);
 
   // get tile number
-  ttile_t tile_no = TIFFComputeTile(tiff,
-                                    tile_col * tiffl->tile_w,
-                                    tile_row * tiffl->tile_h,
-                                    0, 0);
+  ttile_t tile_no = compute_tile(tiffl, tiff, tile_col, tile_row);
 
   //g_debug("_openslide_tiff_read_tile_data reading tile %d", tile_no);
 
@@ -359,6 +719,238 @@ bool _openslide_tiff_read_tile_data(struct _openslide_tiff_level *tiffl,
   return true;
 }
 
+// returns the file mapping, or NULL if mapped reads are disabled or failed
+static GMappedFile *tiffcache_get_map(struct _openslide_tiffcache *tc) {
+  g_mutex_lock(tc->lock);
+  if (!tc->map_attempted) {
+    tc->map_attempted = true;
+    if (_openslide_mmap_enabled()) {
+      GError *tmp_err = NULL;
+      tc->map = g_mapped_file_new(tc->filename, false, &tmp_err);
+      if (tc->map == NULL) {
+        _openslide_performance_warn("Couldn't map %s: %s",
+                                    tc->filename, tmp_err->message);
+        g_clear_error(&tmp_err);
+      }
+    }
+  }
+  GMappedFile *map = tc->map;
+  g_mutex_unlock(tc->lock);
+  return map;
+}
+
+// if tiles are being read in order, queue the tiles after this one in
+// its row, coalesced in TIFFTAG_TILEOFFSETS order
+static void tiff_readahead(openslide_t *osr,
+                           struct _openslide_tiff_level *tiffl,
+                           TIFF *tiff,
+                           int64_t tile_col, int64_t tile_row) {
+  int64_t start;
+  int64_t end;
+  if (!_openslide_readahead_check(osr, &tiffl->readahead,
+                                  tile_row * tiffl->tiles_across + tile_col,
+                                  (tile_row + 1) * tiffl->tiles_across,
+                                  &start, &end)) {
+    return;
+  }
+
+  toff_t *offsets;
+  toff_t *sizes;
+  if (!_openslide_tiff_set_dir(tiff, tiffl->dir, NULL) ||
+      !TIFFGetField(tiff, TIFFTAG_TILEOFFSETS, &offsets) ||
+      !TIFFGetField(tiff, TIFFTAG_TILEBYTECOUNTS, &sizes)) {
+    return;
+  }
+
+  struct _openslide_readahead_item *items =
+    g_new(struct _openslide_readahead_item, end - start);
+  int32_t count = 0;
+  for (int64_t col = start - tile_row * tiffl->tiles_across;
+       col < end - tile_row * tiffl->tiles_across; col++) {
+    ttile_t tile_no = compute_tile(tiffl, tiff, col, tile_row);
+    if (sizes[tile_no] == 0 || sizes[tile_no] > INT32_MAX) {
+      continue;
+    }
+    struct _openslide_readahead_item *item = &items[count++];
+    item->offset = offsets[tile_no];
+    item->length = sizes[tile_no];
+    item->x = col;
+    item->y = tile_row;
+  }
+
+  struct tiff_file_handle *hdl = TIFFClientdata(tiff);
+  _openslide_readahead_submit(osr, hdl->tc->filename, tiffl->tile_data_key,
+                              items, count);
+}
+
+// *buf may point into a read-only mapping of the file, in which case
+// *entry is NULL.  Otherwise it is held in osr's compressed-data cache
+// and the caller must unref *entry.
+bool _openslide_tiff_get_tile_data(openslide_t *osr,
+                                   struct _openslide_tiff_level *tiffl,
+                                   TIFF *tiff,
+                                   const void **_buf, int32_t *_len,
+                                   struct _openslide_cache_entry **_entry,
+                                   int64_t tile_col, int64_t tile_row,
+                                   GError **err) {
+  struct tiff_file_handle *hdl = TIFFClientdata(tiff);
+  GMappedFile *map = tiffcache_get_map(hdl->tc);
+  if (map) {
+    SET_DIR_OR_FAIL(tiff, tiffl->dir);
+
+    ttile_t tile_no = compute_tile(tiffl, tiff, tile_col, tile_row);
+    toff_t *offsets;
+    toff_t *sizes;
+    if (TIFFGetField(tiff, TIFFTAG_TILEOFFSETS, &offsets) &&
+        TIFFGetField(tiff, TIFFTAG_TILEBYTECOUNTS, &sizes)) {
+      uint64_t map_len = g_mapped_file_get_length(map);
+      uint64_t offset = offsets[tile_no];
+      uint64_t size = sizes[tile_no];
+      if (offset <= map_len && size <= map_len - offset &&
+          size <= INT32_MAX) {
+        *_buf = g_mapped_file_get_contents(map) + offset;
+        *_len = size;
+        *_entry = NULL;
+        return true;
+      }
+    }
+    // let the read path report the problem
+  }
+
+  tiff_readahead(osr, tiffl, tiff, tile_col, tile_row);
+
+  // the page cache already holds mapped data, so only cache reads
+  struct _openslide_cache_entry *entry;
+  void *cached = _openslide_cache_get(osr->compressed_cache,
+                                      tiffl->tile_data_key,
+                                      tile_col, tile_row,
+                                      &entry);
+  if (cached) {
+    *_buf = cached;
+    *_len = _openslide_cache_entry_get_size(entry);
+    *_entry = entry;
+    return true;
+  }
+
+  void *buf;
+  int32_t len;
+  if (!_openslide_tiff_read_tile_data(tiffl, tiff, &buf, &len,
+                                      tile_col, tile_row, err)) {
+    return false;
+  }
+  // cache entries are slice-allocated
+  void *data = g_slice_copy(len, buf);
+  g_free(buf);
+  _openslide_cache_put(osr->compressed_cache,
+                       tiffl->tile_data_key, tile_col, tile_row,
+                       data, len,
+                       &entry);
+  *_buf = data;
+  *_len = len;
+  *_entry = entry;
+  return true;
+}
+
+// the tile's JPEG stream as a standalone file, in a g_malloc'd buffer.
+// sets OPENSLIDE_ERROR_NO_VALUE if the level has no such stream.
+bool _openslide_tiff_read_raw_tile(openslide_t *osr,
+                                   struct _openslide_tiff_level *tiffl,
+                                   TIFF *tiff,
+                                   int64_t tile_col, int64_t tile_row,
+                                   void **buf, int32_t *len,
+                                   GError **err) {
+  // the direct read path has already checked for 8-bit RGB JPEG
+  if (!tiffl->tile_read_direct || tiffl->scale_denom != 1) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE,
+                "Tiles are not stored as JPEG");
+    return false;
+  }
+  bool is_missing;
+  if (!_openslide_tiff_check_missing_tile(tiffl, tiff, tile_col, tile_row,
+                                          &is_missing, err)) {
+    return false;
+  }
+  if (is_missing) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE,
+                "Tile is missing");
+    return false;
+  }
+
+  const void *data;
+  int32_t data_len;
+  struct _openslide_cache_entry *entry;
+  if (!_openslide_tiff_get_tile_data(osr, tiffl, tiff, &data, &data_len,
+                                     &entry, tile_col, tile_row, err)) {
+    return false;
+  }
+  bool success = make_standalone_jpeg(tiffl->photometric, tiff, data, data_len,
+                                      buf, len, err);
+  if (entry) {
+    _openslide_cache_entry_unref(entry);
+  }
+  return success;
+}
+
+// Best effort: tiles that are cached, missing, or not decoded by the
+// application are left for the normal read path
+void _openslide_tiff_decode_tiles(openslide_t *osr,
+                                  struct _openslide_level *level,
+                                  struct _openslide_tiff_level *tiffl,
+                                  TIFF *tiff,
+                                  const int64_t *tiles,
+                                  int32_t count) {
+  if (!tiffl->tile_read_direct || tiffl->scale_denom != 1 ||
+      !_openslide_decoder_present(OPENSLIDE_CODEC_JPEG)) {
+    return;
+  }
+
+  int64_t tile_size = tiffl->tile_w * tiffl->tile_h * 4;
+  openslide_decode_job_t *jobs = g_new0(openslide_decode_job_t, count);
+  const int64_t **coords = g_new(const int64_t *, count);
+  int32_t n = 0;
+  for (int32_t i = 0; i < count; i++) {
+    const int64_t *tile = tiles + 2 * i;
+    struct _openslide_cache_entry *entry;
+    if (_openslide_cache_get(osr->cache, level, tile[0], tile[1], &entry)) {
+      _openslide_cache_entry_unref(entry);
+      continue;
+    }
+    void *buf;
+    int32_t len;
+    if (!_openslide_tiff_read_raw_tile(osr, tiffl, tiff, tile[0], tile[1],
+                                       &buf, &len, NULL)) {
+      continue;
+    }
+    jobs[n].data = buf;
+    jobs[n].length = len;
+    jobs[n].dest = _openslide_buffer_alloc(tile_size);
+    jobs[n].w = tiffl->tile_w;
+    jobs[n].h = tiffl->tile_h;
+    coords[n] = tile;
+    n++;
+  }
+
+  int32_t decoded = _openslide_decode_external_batch(OPENSLIDE_CODEC_JPEG,
+                                                     jobs, n);
+  _openslide_counter_add(OPENSLIDE_COUNTER_TIFF_TILES_DIRECT, decoded);
+  for (int32_t i = 0; i < n; i++) {
+    openslide_decode_job_t *job = &jobs[i];
+    if (job->success &&
+        _openslide_tiff_clip_tile(tiffl, job->dest,
+                                  coords[i][0], coords[i][1], NULL)) {
+      struct _openslide_cache_entry *entry;
+      _openslide_cache_put(osr->cache, level, coords[i][0], coords[i][1],
+                           job->dest, tile_size, &entry);
+      _openslide_cache_entry_unref(entry);
+    } else {
+      _openslide_buffer_free(tile_size, job->dest);
+    }
+    g_free((void *) job->data);
+  }
+  g_free(coords);
+  g_free(jobs);
+}
+
 // sets out-argument to indicate whether the tile data is zero bytes long
 // returns false on error
 bool _openslide_tiff_check_missing_tile(struct _openslide_tiff_level *tiffl,
@@ -372,10 +964,7 @@ bool _openslide_tiff_check_missing_tile(struct _openslide_tiff_level *tiffl,
   }
 
   // get tile number
-  ttile_t tile_no = TIFFComputeTile(tiff,
-                                    tile_col * tiffl->tile_w,
-                                    tile_row * tiffl->tile_h,
-                                    0, 0);
+  ttile_t tile_no = compute_tile(tiffl, tiff, tile_col, tile_row);
 
   //g_debug("_openslide_tiff_check_missing_tile: tile %d", tile_no);
 
@@ -393,6 +982,110 @@ bool _openslide_tiff_check_missing_tile(struct _openslide_tiff_level *tiffl,
   return true;
 }
 
+bool _openslide_tiff_clear_missing_tiles(struct _openslide_tiff_level *tiffl,
+                                         TIFF *tiff,
+                                         uint8_t *nonempty,
+                                         GError **err) {
+  // set directory
+  if (!_openslide_tiff_set_dir(tiff, tiffl->dir, err)) {
+    return false;
+  }
+
+  // get tile sizes
+  toff_t *sizes;
+  if (!TIFFGetField(tiff, TIFFTAG_TILEBYTECOUNTS, &sizes)) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Cannot get tile size");
+    return false;
+  }
+
+  for (int64_t row = 0; row < tiffl->tiles_down; row++) {
+    for (int64_t col = 0; col < tiffl->tiles_across; col++) {
+      if (sizes[compute_tile(tiffl, tiff, col, row)] == 0) {
+        nonempty[row * tiffl->tiles_across + col] = 0;
+      }
+    }
+  }
+  return true;
+}
+
+bool _openslide_tiff_clear_empty_tiles(struct _openslide_tiff_level *tiffl,
+                                       struct _openslide_tiffcache *tc,
+                                       uint8_t *nonempty,
+                                       int64_t tiles_across,
+                                       int64_t tiles_down,
+                                       GError **err) {
+  // the grid's tiles are not the directory's
+  if (tiles_across != tiffl->tiles_across ||
+      tiles_down != tiffl->tiles_down) {
+    return true;
+  }
+
+  TIFF *tiff = _openslide_tiffcache_get(tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+  bool success = _openslide_tiff_clear_missing_tiles(tiffl, tiff,
+                                                     nonempty, err);
+  _openslide_tiffcache_put(tc, tiff);
+  return success;
+}
+
+// decode each strip of a stripped JPEG directly into its rows of dest,
+// bypassing TIFFRGBAImage and its conversion
+static bool read_associated_direct(TIFF *tiff,
+                                   struct associated_image *img,
+                                   uint32_t *dest,
+                                   GError **err) {
+  int64_t rows_per_strip;
+  GET_FIELD_OR_FAIL(tiff, TIFFTAG_ROWSPERSTRIP, uint32_t, rows_per_strip);
+  toff_t *sizes;
+  if (!TIFFGetField(tiff, TIFFTAG_STRIPBYTECOUNTS, &sizes)) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Cannot get strip sizes");
+    return false;
+  }
+  rows_per_strip = MIN(rows_per_strip, img->base.h);
+
+  tstrip_t strips = TIFFNumberOfStrips(tiff);
+  for (tstrip_t strip = 0; strip < strips; strip++) {
+    int64_t y = strip * rows_per_strip;
+    if (y >= img->base.h) {
+      break;
+    }
+    int64_t rows = MIN(rows_per_strip, img->base.h - y);
+    tsize_t size = sizes[strip];
+    if (size <= 0 || size > G_MAXINT32) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Bad size for strip %u", strip);
+      return false;
+    }
+    void *buf = g_malloc(size);
+    if (TIFFReadRawStrip(tiff, strip, buf, size) != size) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Cannot read raw strip %u", strip);
+      g_free(buf);
+      return false;
+    }
+    void *jpeg;
+    int32_t jpeg_len;
+    bool success = make_standalone_jpeg(img->photometric, tiff, buf, size,
+                                        &jpeg, &jpeg_len, err);
+    g_free(buf);
+    if (!success) {
+      return false;
+    }
+    success = _openslide_jpeg_decode_buffer(jpeg, jpeg_len,
+                                            dest + y * img->base.w,
+                                            img->base.w, rows, err);
+    g_free(jpeg);
+    if (!success) {
+      return false;
+    }
+  }
+  return true;
+}
+
 static bool _get_associated_image_data(TIFF *tiff,
                                        struct associated_image *img,
                                        uint32_t *dest,
@@ -415,6 +1108,14 @@ static bool _get_associated_image_data(TIFF *tiff,
   }
 
   // load the image
+  if (img->read_direct) {
+    GError *tmp_err = NULL;
+    if (read_associated_direct(tiff, img, dest, &tmp_err)) {
+      return true;
+    }
+    // let libtiff try, and report its error if it fails too
+    g_clear_error(&tmp_err);
+  }
   return tiff_read_region(tiff, dest, 0, 0, width, height, err);
 }
 
@@ -465,6 +1166,20 @@ static bool _add_associated_image(openslide_t *osr,
     return false;
   }
 
+  // decide whether we can bypass libtiff
+  uint16_t planar_config, photometric, bits_per_sample, samples_per_pixel;
+  GET_FIELD_OR_FAIL(tiff, TIFFTAG_PLANARCONFIG, uint16_t, planar_config);
+  GET_FIELD_OR_FAIL(tiff, TIFFTAG_PHOTOMETRIC, uint16_t, photometric);
+  GET_FIELD_OR_FAIL(tiff, TIFFTAG_BITSPERSAMPLE, uint16_t, bits_per_sample);
+  GET_FIELD_OR_FAIL(tiff, TIFFTAG_SAMPLESPERPIXEL, uint16_t, samples_per_pixel);
+  bool read_direct =
+    !TIFFIsTiled(tiff) &&
+    compression == COMPRESSION_JPEG &&
+    planar_config == PLANARCONFIG_CONTIG &&
+    (photometric == PHOTOMETRIC_RGB || photometric == PHOTOMETRIC_YCBCR) &&
+    bits_per_sample == 8 &&
+    samples_per_pixel == 3;
+
   // load into struct
   struct associated_image *img = g_slice_new0(struct associated_image);
   img->base.ops = &tiff_associated_ops;
@@ -472,6 +1187,8 @@ static bool _add_associated_image(openslide_t *osr,
   img->base.h = h;
   img->tc = tc;
   img->directory = dir;
+  img->read_direct = read_direct;
+  img->photometric = photometric;
 
   // save
   g_hash_table_insert(osr->associated_images, g_strdup(name), img);
@@ -499,7 +1216,15 @@ bool _openslide_tiff_add_associated_image(openslide_t *osr,
 static tsize_t tiff_do_read(thandle_t th, tdata_t buf, tsize_t size) {
   struct tiff_file_handle *hdl = th;
 
-  // don't leave the file handle open between calls
+  if (hdl->f) {
+    // persistent descriptor: one positioned read, no open/seek/close
+    int64_t rsize = _openslide_fread_at(hdl->f, buf, size, hdl->offset);
+    hdl->offset += rsize;
+    return rsize;
+  }
+
+  // over the persistent file limit; don't leave the file handle open
+  // between calls
   // also ensures FD_CLOEXEC is set
   FILE *f = _openslide_fopen(hdl->tc->filename, "rb", NULL);
   if (f == NULL) {
@@ -509,8 +1234,11 @@ static tsize_t tiff_do_read(thandle_t th, tdata_t buf, tsize_t size) {
     fclose(f);
     return 0;
   }
+  _openslide_trace(OPENSLIDE_TRACE_READ, true, NULL, -1, -1, 0, NULL);
   int64_t rsize = fread(buf, 1, size, f);
   hdl->offset += rsize;
+  _openslide_counter_add(OPENSLIDE_COUNTER_IO_BYTES_READ, rsize);
+  _openslide_trace(OPENSLIDE_TRACE_READ, false, NULL, -1, -1, rsize, NULL);
   fclose(f);
   return rsize;
 }
@@ -544,6 +1272,10 @@ static toff_t tiff_do_seek(thandle_t th, toff_t offset, int whence) {
 static int tiff_do_close(thandle_t th) {
   struct tiff_file_handle *hdl = th;
 
+  if (hdl->f) {
+    fclose(hdl->f);
+    _openslide_persistent_file_release();
+  }
   g_slice_free(struct tiff_file_handle, hdl);
   return 0;
 }
@@ -584,7 +1316,11 @@ static TIFF *tiff_open(struct _openslide_tiffcache *tc, GError **err) {
     fclose(f);
     return NULL;
   }
-  fclose(f);
+  // keep the file open for the life of the handle, if we can
+  if (!_openslide_persistent_file_acquire()) {
+    fclose(f);
+    f = NULL;
+  }
 
   // check magic
   // TODO: remove if libtiff gets private error/warning callbacks
@@ -610,12 +1346,13 @@ static TIFF *tiff_open(struct _openslide_tiffcache *tc, GError **err) {
   if (version == 43 && sizeof(toff_t) == 4) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "BigTIFF support requires libtiff >= 4");
-    return NULL;
+    goto FAIL;
   }
 
   // allocate
   struct tiff_file_handle *hdl = g_slice_new0(struct tiff_file_handle);
   hdl->tc = tc;
+  hdl->f = f;
   hdl->size = size;
 
   // TIFFOpen
@@ -633,6 +1370,11 @@ static TIFF *tiff_open(struct _openslide_tiffcache *tc, GError **err) {
 NOT_TIFF:
   g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
               "Not a TIFF file: %s", tc->filename);
+FAIL:
+  if (f) {
+    fclose(f);
+    _openslide_persistent_file_release();
+  }
   return NULL;
 }
 #define TIFFClientOpen _OPENSLIDE_POISON(_openslide_tiffcache_get)
@@ -642,6 +1384,7 @@ struct _openslide_tiffcache *_openslide_tiffcache_create(const char *filename) {
   tc->filename = g_strdup(filename);
   tc->cache = g_queue_new();
   tc->lock = g_mutex_new();
+  tc->decompressors = g_queue_new();
   return tc;
 }
 
@@ -656,6 +1399,7 @@ TIFF *_openslide_tiffcache_get(struct _openslide_tiffcache *tc, GError **err) {
     //g_debug("create TIFF");
     // Does not check that we have the same file.  Then again, neither does
     // tiff_do_read.
+    _openslide_counter_add(OPENSLIDE_COUNTER_TIFF_HANDLE_OPENS, 1);
     tiff = tiff_open(tc, err);
   }
   if (tiff == NULL) {
@@ -687,6 +1431,34 @@ void _openslide_tiffcache_put(struct _openslide_tiffcache *tc, TIFF *tiff) {
   }
 }
 
+int32_t _openslide_tiffcache_get_idle_count(struct _openslide_tiffcache *tc) {
+  g_mutex_lock(tc->lock);
+  int32_t count = g_queue_get_length(tc->cache);
+  g_mutex_unlock(tc->lock);
+  return count;
+}
+
+void _openslide_tiffcache_release_idle(struct _openslide_tiffcache *tc) {
+  // close outside the lock, so concurrent reads don't wait on it
+  g_mutex_lock(tc->lock);
+  GQueue *handles = tc->cache;
+  GQueue *decompressors = tc->decompressors;
+  tc->cache = g_queue_new();
+  tc->decompressors = g_queue_new();
+  g_mutex_unlock(tc->lock);
+
+  TIFF *tiff;
+  while ((tiff = g_queue_pop_head(handles)) != NULL) {
+    TIFFClose(tiff);
+  }
+  g_queue_free(handles);
+  struct tiff_decompress *td;
+  while ((td = g_queue_pop_head(decompressors)) != NULL) {
+    decompress_destroy(td);
+  }
+  g_queue_free(decompressors);
+}
+
 void _openslide_tiffcache_destroy(struct _openslide_tiffcache *tc) {
   if (tc == NULL) {
     return;
@@ -697,8 +1469,16 @@ void _openslide_tiffcache_destroy(struct _openslide_tiffcache *tc) {
     TIFFClose(tiff);
   }
   g_assert(tc->outstanding == 0);
+  struct tiff_decompress *td;
+  while ((td = g_queue_pop_head(tc->decompressors)) != NULL) {
+    decompress_destroy(td);
+  }
   g_mutex_unlock(tc->lock);
+  if (tc->map) {
+    g_mapped_file_unref(tc->map);
+  }
   g_queue_free(tc->cache);
+  g_queue_free(tc->decompressors);
   g_mutex_free(tc->lock);
   g_free(tc->filename);
   g_slice_free(struct _openslide_tiffcache, tc);
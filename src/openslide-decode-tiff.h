@@ -29,6 +29,16 @@
 #include <glib.h>
 #include <tiffio.h>
 
+// sample layouts that libtiff can decompress for us to convert, without
+// going through TIFFRGBAImage
+enum _openslide_tiff_layout {
+  OPENSLIDE_TIFF_LAYOUT_NONE,
+  OPENSLIDE_TIFF_LAYOUT_GRAY,
+  OPENSLIDE_TIFF_LAYOUT_RGB,
+  OPENSLIDE_TIFF_LAYOUT_RGBA,  // premultiplied
+  OPENSLIDE_TIFF_LAYOUT_RGBA_UNASSOCIATED,
+};
+
 struct _openslide_tiff_level {
   tdir_t dir;
   int64_t image_w;
@@ -39,8 +49,17 @@ struct _openslide_tiff_level {
   int64_t tiles_down;
 
   bool tile_read_direct;
+  enum _openslide_tiff_layout tile_layout;  // if not tile_read_direct
   gint warned_read_indirect;
   uint16_t photometric;
+
+  // 1, or 2/4/8 if the directory's tiles are downscaled by libjpeg while
+  // decoding.  Image and tile sizes are those of the scaled level.
+  int32_t scale_denom;
+  // compressed-data cache plane, shared by levels scaled from one directory
+  void *tile_data_key;
+
+  struct _openslide_readahead readahead;
 };
 
 struct _openslide_tiffcache;
@@ -51,13 +70,61 @@ bool _openslide_tiff_level_init(TIFF *tiff,
                                 struct _openslide_tiff_level *tiffl,
                                 GError **err);
 
+// true if tiffl's tiles can be decoded at 1/scale_denom size, yielding a
+// level larger than the next smaller physical level (0 if none)
+bool _openslide_tiff_level_can_scale(const struct _openslide_tiff_level *tiffl,
+                                     int32_t scale_denom,
+                                     int64_t next_level_w);
+
+// initialize a virtual level decoded from src's tiles at reduced size
+void _openslide_tiff_level_init_scaled(const struct _openslide_level *src_level,
+                                       const struct _openslide_tiff_level *src_tiffl,
+                                       int32_t scale_denom,
+                                       struct _openslide_level *level,
+                                       struct _openslide_tiff_level *tiffl);
+
+// create a level decoded from level's tiles at 1/scale_denom size, or
+// return NULL if it can't be.  next is the next smaller physical level,
+// or NULL if none.
+typedef struct _openslide_level *(*_openslide_tiff_scale_level_fn)(
+  openslide_t *osr,
+  struct _openslide_level *level,
+  struct _openslide_level *next,
+  int32_t scale_denom,
+  void *data);
+
+// add the levels create() makes at 1/2, 1/4 and 1/8 scale after each
+// level of levels, which is sorted largest first.  Returns the expanded
+// array and frees levels.
+GPtrArray *_openslide_tiff_add_scaled_levels(openslide_t *osr,
+                                             GPtrArray *levels,
+                                             _openslide_tiff_scale_level_fn create,
+                                             void *data);
+
 bool _openslide_tiff_check_missing_tile(struct _openslide_tiff_level *tiffl,
                                         TIFF *tiff,
                                         int64_t tile_col, int64_t tile_row,
                                         bool *is_missing,
                                         GError **err);
 
-bool _openslide_tiff_read_tile(struct _openslide_tiff_level *tiffl,
+// clear the entries of nonempty, in row-major tile order, for tiles
+// with no data
+bool _openslide_tiff_clear_missing_tiles(struct _openslide_tiff_level *tiffl,
+                                         TIFF *tiff,
+                                         uint8_t *nonempty,
+                                         GError **err);
+
+// _openslide_ops.clear_empty_tiles for a level of one TIFF directory,
+// with a handle from tc
+bool _openslide_tiff_clear_empty_tiles(struct _openslide_tiff_level *tiffl,
+                                       struct _openslide_tiffcache *tc,
+                                       uint8_t *nonempty,
+                                       int64_t tiles_across,
+                                       int64_t tiles_down,
+                                       GError **err);
+
+bool _openslide_tiff_read_tile(openslide_t *osr,
+                               struct _openslide_tiff_level *tiffl,
                                TIFF *tiff,
                                uint32_t *dest,
                                int64_t tile_col, int64_t tile_row,
@@ -69,6 +136,30 @@ bool _openslide_tiff_read_tile_data(struct _openslide_tiff_level *tiffl,
                                     int64_t tile_col, int64_t tile_row,
                                     GError **err);
 
+bool _openslide_tiff_get_tile_data(openslide_t *osr,
+                                   struct _openslide_tiff_level *tiffl,
+                                   TIFF *tiff,
+                                   const void **buf, int32_t *len,
+                                   struct _openslide_cache_entry **entry,
+                                   int64_t tile_col, int64_t tile_row,
+                                   GError **err);
+
+bool _openslide_tiff_read_raw_tile(openslide_t *osr,
+                                   struct _openslide_tiff_level *tiffl,
+                                   TIFF *tiff,
+                                   int64_t tile_col, int64_t tile_row,
+                                   void **buf, int32_t *len,
+                                   GError **err);
+
+// decode tiles listed as (col, row) pairs in one batch through the
+// application's JPEG decoder, adding them to osr's tile cache under level
+void _openslide_tiff_decode_tiles(openslide_t *osr,
+                                  struct _openslide_level *level,
+                                  struct _openslide_tiff_level *tiffl,
+                                  TIFF *tiff,
+                                  const int64_t *tiles,
+                                  int32_t count);
+
 bool _openslide_tiff_clip_tile(struct _openslide_tiff_level *tiffl,
                                uint32_t *tiledata,
                                int64_t tile_col, int64_t tile_row,
@@ -93,6 +184,13 @@ TIFF *_openslide_tiffcache_get(struct _openslide_tiffcache *tc, GError **err);
 
 void _openslide_tiffcache_put(struct _openslide_tiffcache *tc, TIFF *tiff);
 
+// handles in the cache, not counting those checked out
+int32_t _openslide_tiffcache_get_idle_count(struct _openslide_tiffcache *tc);
+
+// close the cached handles and JPEG decompressors; they're recreated
+// on demand
+void _openslide_tiffcache_release_idle(struct _openslide_tiffcache *tc);
+
 void _openslide_tiffcache_destroy(struct _openslide_tiffcache *tc);
 
 #endif
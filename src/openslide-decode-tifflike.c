@@ -45,6 +45,9 @@
 
 #define NDPI_TAG 65420
 
+// more than enough for 65536 distinct BigTIFF tags
+#define MAX_DIRECTORY_SIZE (16 << 20)
+
 
 struct _openslide_tifflike {
   char *filename;
@@ -52,15 +55,20 @@ struct _openslide_tifflike {
   bool ndpi;
   GPtrArray *directories;
   GMutex *value_lock;
+  FILE *value_file;  // if we hold a persistent file; protected by value_lock
+  struct _openslide_arena *arena;  // values stored in the directory entries
 };
 
 struct tiff_directory {
-  GHashTable *items;
+  struct tiff_item *items;  // sorted by tag
+  int32_t count;
   uint64_t offset;  // only for NDPI fixups
 };
 
 struct tiff_item {
+  uint16_t tag;
   uint16_t type;
+  bool arena_values;
   int64_t count;
   uint64_t offset;
 
@@ -71,6 +79,13 @@ struct tiff_item {
   void *buffer;
 };
 
+// a directory read into memory
+struct ifd_cursor {
+  const uint8_t *p;
+  size_t left;
+  bool big_endian;
+};
+
 
 static void fix_byte_order(void *data, int32_t size, int64_t count,
                            bool big_endian) {
@@ -105,16 +120,8 @@ static void fix_byte_order(void *data, int32_t size, int64_t count,
   }
 }
 
-// only sets *ok on failure
-static uint64_t read_uint(FILE *f, int32_t size, bool big_endian, bool *ok) {
-  g_assert(ok != NULL);
-
-  uint8_t buf[size];
-  if (fread(buf, size, 1, f) != 1) {
-    *ok = false;
-    return 0;
-  }
-  fix_byte_order(buf, sizeof(buf), 1, big_endian);
+static uint64_t decode_uint(uint8_t *buf, int32_t size, bool big_endian) {
+  fix_byte_order(buf, size, 1, big_endian);
   switch (size) {
   case 1: {
     uint8_t result;
@@ -141,6 +148,44 @@ static uint64_t read_uint(FILE *f, int32_t size, bool big_endian, bool *ok) {
   }
 }
 
+// only sets *ok on failure
+static uint64_t read_uint(FILE *f, int32_t size, bool big_endian, bool *ok) {
+  g_assert(ok != NULL);
+
+  uint8_t buf[size];
+  if (fread(buf, size, 1, f) != 1) {
+    *ok = false;
+    return 0;
+  }
+  return decode_uint(buf, size, big_endian);
+}
+
+// only sets *ok on failure
+static bool cursor_read(struct ifd_cursor *c, void *buf, size_t size,
+                        bool *ok) {
+  if (c->left < size) {
+    c->left = 0;
+    *ok = false;
+    return false;
+  }
+  memcpy(buf, c->p, size);
+  c->p += size;
+  c->left -= size;
+  return true;
+}
+
+// only sets *ok on failure
+static uint64_t cursor_read_uint(struct ifd_cursor *c, int32_t size,
+                                 bool *ok) {
+  g_assert(ok != NULL);
+
+  uint8_t buf[size];
+  if (!cursor_read(c, buf, size, ok)) {
+    return 0;
+  }
+  return decode_uint(buf, size, c->big_endian);
+}
+
 static uint32_t get_value_size(uint16_t type, uint64_t *count) {
   switch (type) {
   case TIFF_BYTE:
@@ -188,7 +233,11 @@ static uint64_t fix_offset_ndpi(uint64_t diroff, uint64_t offset) {
 }
 
 #define ALLOC_VALUES_OR_FAIL(OUT, TYPE, COUNT) do {			\
-    OUT = g_try_new(TYPE, COUNT);					\
+    if (arena && COUNT) {						\
+      OUT = _openslide_arena_alloc(arena, sizeof(TYPE) * (COUNT));	\
+    } else {								\
+      OUT = g_try_new(TYPE, COUNT);					\
+    }									\
     if (!OUT) {								\
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,		\
                   "Cannot allocate TIFF value array");			\
@@ -210,11 +259,14 @@ static uint64_t fix_offset_ndpi(uint64_t diroff, uint64_t offset) {
     }									\
   } while (0)
 
-// value_lock must be held
+// value_lock must be held.  If arena is non-NULL, the values are
+// allocated from it.
 static bool set_item_values(struct tiff_item *item,
                             const void *buf,
+                            struct _openslide_arena *arena,
                             GError **err) {
   //g_debug("setting values for item type %d", item->type);
+  item->arena_values = arena != NULL;
 
   switch (item->type) {
   // uints
@@ -340,9 +392,19 @@ static bool populate_item(struct _openslide_tifflike *tl,
     return true;
   }
 
-  FILE *f = _openslide_fopen(tl->filename, "rb", err);
+  FILE *f = tl->value_file;
+  bool close_file = false;
   if (!f) {
-    goto FAIL;
+    f = _openslide_fopen(tl->filename, "rb", err);
+    if (!f) {
+      goto FAIL;
+    }
+    if (_openslide_persistent_file_acquire()) {
+      // keep it for the next value
+      tl->value_file = f;
+    } else {
+      close_file = true;
+    }
   }
 
   uint64_t count = item->count;
@@ -358,18 +420,15 @@ static bool populate_item(struct _openslide_tifflike *tl,
   }
 
   //g_debug("reading tiff value: len: %"PRId64", offset %"PRIu64, len, item->offset);
-  if (fseeko(f, item->offset, SEEK_SET)) {
-    _openslide_io_error(err, "Couldn't seek to read TIFF value");
-    goto FAIL;
-  }
-  if (fread(buf, len, 1, f) != 1) {
+  if (item->offset > INT64_MAX ||
+      _openslide_fread_at(f, buf, len, item->offset) != (size_t) len) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Couldn't read TIFF value");
     goto FAIL;
   }
 
   fix_byte_order(buf, value_size, count, tl->big_endian);
-  if (!set_item_values(item, buf, err)) {
+  if (!set_item_values(item, buf, NULL, err)) {
     goto FAIL;
   }
 
@@ -378,33 +437,81 @@ static bool populate_item(struct _openslide_tifflike *tl,
 FAIL:
   g_mutex_unlock(tl->value_lock);
   g_free(buf);
-  if (f) {
+  if (close_file) {
     fclose(f);
   }
   return success;
 }
 
+static void tiff_item_clear(struct tiff_item *item) {
+  if (!item->arena_values) {
+    g_free(item->uints);
+    g_free(item->sints);
+    g_free(item->floats);
+    g_free(item->buffer);
+  }
+}
+
 static void tiff_directory_destroy(struct tiff_directory *d) {
   if (d == NULL) {
     return;
   }
-  g_hash_table_unref(d->items);
+  for (int32_t i = 0; i < d->count; i++) {
+    tiff_item_clear(&d->items[i]);
+  }
+  g_free(d->items);
   g_slice_free(struct tiff_directory, d);
 }
 
-static void tiff_item_destroy(gpointer data) {
-  struct tiff_item *item = data;
+// index of the first item with a tag >= tag
+static int32_t find_item_index(struct tiff_directory *d, uint16_t tag) {
+  int32_t lo = 0;
+  int32_t hi = d->count;
+  while (lo < hi) {
+    int32_t mid = lo + (hi - lo) / 2;
+    if (d->items[mid].tag < tag) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static struct tiff_item *find_item(struct tiff_directory *d, int32_t tag) {
+  if (tag < 0 || tag > UINT16_MAX) {
+    return NULL;
+  }
+  int32_t i = find_item_index(d, tag);
+  if (i < d->count && d->items[i].tag == tag) {
+    return &d->items[i];
+  }
+  return NULL;
+}
 
-  g_free(item->uints);
-  g_free(item->sints);
-  g_free(item->floats);
-  g_free(item->buffer);
-  g_slice_free(struct tiff_item, item);
+// the caller sized d->items for every entry in the directory
+static struct tiff_item *add_item(struct tiff_directory *d, uint16_t tag) {
+  // entries are normally sorted already, so this rarely moves anything
+  int32_t i = find_item_index(d, tag);
+  if (i < d->count && d->items[i].tag == tag) {
+    // repeated tag; the last one wins
+    tiff_item_clear(&d->items[i]);
+  } else {
+    memmove(&d->items[i + 1], &d->items[i],
+            (d->count - i) * sizeof(*d->items));
+    d->count++;
+  }
+  struct tiff_item *item = &d->items[i];
+  memset(item, 0, sizeof(*item));
+  item->tag = tag;
+  return item;
 }
 
 static struct tiff_directory *read_directory(FILE *f, int64_t *diroff,
+                                             int64_t file_size,
                                              struct tiff_directory *first_dir,
                                              GHashTable *loop_detector,
+                                             struct _openslide_arena *arena,
                                              bool bigtiff,
                                              bool ndpi,
                                              bool big_endian,
@@ -412,6 +519,7 @@ static struct tiff_directory *read_directory(FILE *f, int64_t *diroff,
   int64_t off = *diroff;
   *diroff = 0;
   struct tiff_directory *d = NULL;
+  uint8_t *buf = NULL;
   bool ok = true;
 
   //  g_debug("diroff: %"PRId64, off);
@@ -433,34 +541,55 @@ static struct tiff_directory *read_directory(FILE *f, int64_t *diroff,
   *key = off;
   g_hash_table_insert(loop_detector, key, NULL);
 
-  // no loop, let's seek
-  if (fseeko(f, off, SEEK_SET) != 0) {
-    _openslide_io_error(err, "Cannot seek to offset");
-    goto FAIL;
-  }
-
   // read directory count
-  uint64_t dircount = read_uint(f, bigtiff ? 8 : 2, big_endian, &ok);
-  if (!ok) {
+  int32_t dircount_size = bigtiff ? 8 : 2;
+  uint8_t dircount_buf[8];
+  if (_openslide_fread_at(f, dircount_buf, dircount_size, off) !=
+      (size_t) dircount_size) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Cannot read dircount");
     goto FAIL;
   }
+  uint64_t dircount = decode_uint(dircount_buf, dircount_size, big_endian);
 
   //  g_debug("dircount: %"PRIu64, dircount);
 
+  // read the entries and the next dir offset in one go.  Don't read past
+  // EOF or an implausible directory size; a truncated directory is
+  // diagnosed by the parser below.
+  int64_t entries_off = off + dircount_size;
+  int32_t entry_size = bigtiff ? 20 : 12;
+  int32_t nextdiroff_size = (bigtiff || ndpi) ? 8 : 4;
+  uint64_t len = MIN(MAX(file_size - entries_off, 0), MAX_DIRECTORY_SIZE);
+  if (dircount <= len / entry_size) {
+    len = MIN(len, dircount * entry_size + nextdiroff_size);
+  }
+  if (len) {
+    buf = g_try_malloc(len);
+    if (buf == NULL) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Cannot allocate TIFF directory");
+      goto FAIL;
+    }
+  }
+  struct ifd_cursor c = {
+    .p = buf,
+    .left = len ? _openslide_fread_at(f, buf, len, entries_off) : 0,
+    .big_endian = big_endian,
+  };
 
   // initial checks passed, initialize the directory
+  // a truncated directory has fewer complete entries than dircount
+  uint64_t capacity = MIN(dircount, c.left / entry_size);
   d = g_slice_new0(struct tiff_directory);
-  d->items = g_hash_table_new_full(g_direct_hash, g_direct_equal,
-                                   NULL, tiff_item_destroy);
+  d->items = g_new(struct tiff_item, capacity);
   d->offset = off;
 
   // read all directory entries
   for (uint64_t n = 0; n < dircount; n++) {
-    uint16_t tag = read_uint(f, 2, big_endian, &ok);
-    uint16_t type = read_uint(f, 2, big_endian, &ok);
-    uint64_t count = read_uint(f, bigtiff ? 8 : 4, big_endian, &ok);
+    uint16_t tag = cursor_read_uint(&c, 2, &ok);
+    uint16_t type = cursor_read_uint(&c, 2, &ok);
+    uint64_t count = cursor_read_uint(&c, bigtiff ? 8 : 4, &ok);
 
     if (!ok) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -470,11 +599,17 @@ static struct tiff_directory *read_directory(FILE *f, int64_t *diroff,
 
     //    g_debug(" tag: %d, type: %d, count: %"PRId64, tag, type, count);
 
-    // allocate the item
-    struct tiff_item *item = g_slice_new0(struct tiff_item);
+    // an entry past the last complete one can't hold its value/offset
+    if (n == capacity) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Cannot read value/offset");
+      goto FAIL;
+    }
+
+    // add the item
+    struct tiff_item *item = add_item(d, tag);
     item->type = type;
     item->count = count;
-    g_hash_table_insert(d->items, GINT_TO_POINTER(tag), item);
 
     // compute value size
     uint32_t value_size = get_value_size(type, &count);
@@ -493,7 +628,7 @@ static struct tiff_directory *read_directory(FILE *f, int64_t *diroff,
 
     // read in the value/offset
     uint8_t value[bigtiff ? 8 : 4];
-    if (fread(value, sizeof(value), 1, f) != 1) {
+    if (!cursor_read(&c, value, sizeof(value), &ok)) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Cannot read value/offset");
       goto FAIL;
@@ -503,7 +638,7 @@ static struct tiff_directory *read_directory(FILE *f, int64_t *diroff,
     if (value_size * count <= sizeof(value)) {
       // yes
       fix_byte_order(value, value_size, count, big_endian);
-      if (!set_item_values(item, value, err)) {
+      if (!set_item_values(item, value, arena, err)) {
         goto FAIL;
       }
 
@@ -524,8 +659,7 @@ static struct tiff_directory *read_directory(FILE *f, int64_t *diroff,
         // if this tag has the same offset in the first IFD, reuse that value
         struct tiff_item *first_dir_item = NULL;
         if (first_dir) {
-          first_dir_item = g_hash_table_lookup(first_dir->items,
-                                               GINT_TO_POINTER(tag));
+          first_dir_item = find_item(first_dir, tag);
         }
         if (!first_dir_item || first_dir_item->offset != item->offset) {
           item->offset = fix_offset_ndpi(off, item->offset);
@@ -535,8 +669,7 @@ static struct tiff_directory *read_directory(FILE *f, int64_t *diroff,
   }
 
   // read the next dir offset
-  int64_t nextdiroff = read_uint(f, (bigtiff || ndpi) ? 8 : 4,
-                                 big_endian, &ok);
+  int64_t nextdiroff = cursor_read_uint(&c, nextdiroff_size, &ok);
   if (!ok) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Cannot read next directory offset");
@@ -545,10 +678,12 @@ static struct tiff_directory *read_directory(FILE *f, int64_t *diroff,
   *diroff = nextdiroff;
 
   // success
+  g_free(buf);
   return d;
 
 
 FAIL:
+  g_free(buf);
   tiff_directory_destroy(d);
   return NULL;
 }
@@ -614,12 +749,24 @@ struct _openslide_tifflike *_openslide_tifflike_create(const char *filename,
     goto FAIL;
   }
 
+  // get file size, to bound directory reads
+  if (fseeko(f, 0, SEEK_END)) {
+    _openslide_io_error(err, "Couldn't seek to end of TIFF");
+    goto FAIL;
+  }
+  int64_t file_size = ftello(f);
+  if (file_size == -1) {
+    _openslide_io_error(err, "Couldn't get size of TIFF");
+    goto FAIL;
+  }
+
   // allocate struct
   tl = g_slice_new0(struct _openslide_tifflike);
   tl->filename = g_strdup(filename);
   tl->big_endian = big_endian;
   tl->directories = g_ptr_array_new();
   tl->value_lock = g_mutex_new();
+  tl->arena = _openslide_arena_create();
 
   // initialize directory reading
   loop_detector = g_hash_table_new_full(_openslide_int64_hash,
@@ -635,13 +782,14 @@ struct _openslide_tifflike *_openslide_tifflike_create(const char *filename,
   if (!bigtiff && diroff != 0) {
     int64_t trial_diroff = diroff;
     struct tiff_directory *d = read_directory(f, &trial_diroff,
+                                              file_size,
                                               NULL,
                                               loop_detector,
+                                              tl->arena,
                                               bigtiff, true, big_endian,
                                               NULL);
     if (d) {
-      struct tiff_item *item =
-        g_hash_table_lookup(d->items, GINT_TO_POINTER(NDPI_TAG));
+      struct tiff_item *item = find_item(d, NDPI_TAG);
       if (item && item->count) {
         // NDPI
         //g_debug("NDPI detected");
@@ -669,8 +817,10 @@ struct _openslide_tifflike *_openslide_tifflike_create(const char *filename,
   while (diroff != 0) {
     // read a directory
     struct tiff_directory *d = read_directory(f, &diroff,
+                                              file_size,
                                               first_dir,
                                               loop_detector,
+                                              tl->arena,
                                               bigtiff, tl->ndpi, big_endian,
                                               err);
 
@@ -719,6 +869,11 @@ void _openslide_tifflike_destroy(struct _openslide_tifflike *tl) {
   }
   g_mutex_unlock(tl->value_lock);
   g_ptr_array_free(tl->directories, true);
+  if (tl->value_file) {
+    fclose(tl->value_file);
+    _openslide_persistent_file_release();
+  }
+  _openslide_arena_destroy(tl->arena);
   g_free(tl->filename);
   g_mutex_free(tl->value_lock);
   g_slice_free(struct _openslide_tifflike, tl);
@@ -730,7 +885,7 @@ static struct tiff_item *get_item(struct _openslide_tifflike *tl,
     return NULL;
   }
   struct tiff_directory *d = tl->directories->pdata[dir];
-  return g_hash_table_lookup(d->items, GINT_TO_POINTER(tag));
+  return find_item(d, tag);
 }
 
 static void print_tag(struct _openslide_tifflike *tl,
@@ -804,28 +959,12 @@ static void print_tag(struct _openslide_tifflike *tl,
   printf("\n");
 }
 
-static int tag_compare(gconstpointer a, gconstpointer b) {
-  int32_t aa = GPOINTER_TO_INT(a);
-  int32_t bb = GPOINTER_TO_INT(b);
-
-  if (aa < bb) {
-    return -1;
-  } else if (aa > bb) {
-    return 1;
-  } else {
-    return 0;
-  }
-}
-
 static void print_directory(struct _openslide_tifflike *tl,
                             int64_t dir) {
   struct tiff_directory *d = tl->directories->pdata[dir];
-  GList *keys = g_hash_table_get_keys(d->items);
-  keys = g_list_sort(keys, tag_compare);
-  for (GList *el = keys; el; el = el->next) {
-    print_tag(tl, dir, GPOINTER_TO_INT(el->data));
+  for (int32_t i = 0; i < d->count; i++) {
+    print_tag(tl, dir, d->items[i].tag);
   }
-  g_list_free(keys);
 
   printf("\n");
 }
@@ -1151,14 +1290,13 @@ static bool hash_tiff_level(struct _openslide_hash *hash,
   }
 
   // hash raw data of each tile/strip
+  struct _openslide_hash_batch *batch = _openslide_hash_batch_create(hash);
   for (int64_t i = 0; i < count; i++) {
-    if (!_openslide_hash_file_part(hash, tl->filename, offsets[i], lengths[i],
-                                   err)) {
-      return false;
-    }
+    _openslide_hash_batch_add(batch, tl->filename, offsets[i], lengths[i]);
   }
-
-  return true;
+  bool success = _openslide_hash_batch_run(batch, err);
+  _openslide_hash_batch_destroy(batch);
+  return success;
 }
 
 bool _openslide_tifflike_init_properties_and_hash(openslide_t *osr,
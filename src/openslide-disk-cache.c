@@ -0,0 +1,356 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2015 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Decoded tiles in a local directory, as the lowest tier of a cache,
+ * so a restarted process starts with a warm cache
+ *
+ * Each tile is a file named by its key, holding a header and the tile.
+ * Files are written to a temporary name and renamed into place, so a
+ * crash can't leave a partial tile behind.  Writes are queued to a
+ * background thread, and dropped if the queue is full.  The directory
+ * is indexed when the tier is opened, and files are evicted least
+ * recently used first to stay within the byte budget.  Every tile file
+ * in the directory when it is indexed counts toward the budget and may
+ * be evicted, whichever process wrote it; files that other processes
+ * write later are not counted until the next open, and their evictions
+ * are seen as misses.  Files written by another version of the library
+ * are never read, since its decoders may produce different tiles, but
+ * still count toward the budget.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#define DISK_MAGIC G_GUINT64_CONSTANT(0x4f53444b43303032)  // "OSDKC002"
+#define DISK_SUFFIX ".tile"
+// queued writes; more are dropped
+#define DISK_WRITE_QUEUE_MAX 64
+// temporary files older than this were left by a crash
+#define DISK_STALE_TEMP_SEC 3600
+
+#define FILE_CONSTANT 1
+
+struct disk_header {
+  uint64_t magic;
+  // that wrote the file; another version may decode different tiles
+  char version[32];
+  struct _openslide_shm_key key;
+  int64_t size;
+  uint32_t flags;
+  uint32_t pad;
+  // followed by the tile
+};
+
+struct disk_file {
+  char *name;  // also the key in files
+  int64_t size;  // including the header
+  int64_t mtime;  // only while indexing
+  GList *link;  // in lru
+};
+
+struct _openslide_disk_cache {
+  char *dir;
+  int64_t capacity;
+
+  GMutex *lock;
+  GHashTable *files;  // name -> struct disk_file
+  GQueue *lru;  // most recently used at head
+  int64_t total_size;
+
+  GThreadPool *writer;
+};
+
+struct write_job {
+  char *name;
+  void *buf;  // header and tile
+  int64_t len;
+};
+
+static char *key_name(const struct _openslide_shm_key *key) {
+  return g_strdup_printf("%016"PRIx64"%016"PRIx64"-%"PRId64"-%"PRId64
+                         "-%"PRId64 DISK_SUFFIX,
+                         key->slide[0], key->slide[1],
+                         key->level, key->x, key->y);
+}
+
+static void file_free(gpointer data) {
+  struct disk_file *file = data;
+  g_free(file->name);
+  g_slice_free(struct disk_file, file);
+}
+
+// lock must be held
+static void index_remove(struct _openslide_disk_cache *disk,
+                         struct disk_file *file) {
+  g_queue_delete_link(disk->lru, file->link);
+  disk->total_size -= file->size;
+  g_hash_table_remove(disk->files, file->name);
+}
+
+// lock must be held.  returns the names of evicted files, to be
+// unlinked and freed after unlocking.
+static GSList *index_evict(struct _openslide_disk_cache *disk) {
+  GSList *evicted = NULL;
+  while (disk->total_size > disk->capacity && disk->lru->tail) {
+    struct disk_file *file = disk->lru->tail->data;
+    evicted = g_slist_prepend(evicted, g_strdup(file->name));
+    index_remove(disk, file);
+  }
+  return evicted;
+}
+
+static void unlink_files(struct _openslide_disk_cache *disk,
+                         GSList *names) {
+  for (GSList *cur = names; cur; cur = cur->next) {
+    char *path = g_build_filename(disk->dir, cur->data, NULL);
+    g_unlink(path);
+    g_free(path);
+    g_free(cur->data);
+  }
+  g_slist_free(names);
+}
+
+static void write_tile(gpointer data, gpointer user_data) {
+  struct write_job *job = data;
+  struct _openslide_disk_cache *disk = user_data;
+
+  char *path = g_build_filename(disk->dir, job->name, NULL);
+  bool success = g_file_set_contents(path, job->buf, job->len, NULL);
+  g_free(path);
+  g_free(job->buf);
+
+  GSList *evicted = NULL;
+  if (success) {
+    g_mutex_lock(disk->lock);
+    struct disk_file *file = g_hash_table_lookup(disk->files, job->name);
+    if (file) {
+      // rewritten
+      index_remove(disk, file);
+    }
+    file = g_slice_new0(struct disk_file);
+    file->name = job->name;
+    file->size = job->len;
+    g_queue_push_head(disk->lru, file);
+    file->link = disk->lru->head;
+    g_hash_table_insert(disk->files, file->name, file);
+    disk->total_size += file->size;
+    evicted = index_evict(disk);
+    g_mutex_unlock(disk->lock);
+  } else {
+    // disk full or gone; just don't cache the tile
+    g_free(job->name);
+  }
+  unlink_files(disk, evicted);
+  g_slice_free(struct write_job, job);
+}
+
+// oldest first
+static int file_compare_mtime(const void *a, const void *b) {
+  const struct disk_file *f_a = *(struct disk_file * const *) a;
+  const struct disk_file *f_b = *(struct disk_file * const *) b;
+  if (f_a->mtime < f_b->mtime) {
+    return -1;
+  }
+  return f_a->mtime > f_b->mtime;
+}
+
+static bool index_dir(struct _openslide_disk_cache *disk, GError **err) {
+  GDir *dir = g_dir_open(disk->dir, 0, err);
+  if (!dir) {
+    return false;
+  }
+
+  GPtrArray *found = g_ptr_array_new();
+  int64_t now = time(NULL);
+  const char *name;
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    char *path = g_build_filename(disk->dir, name, NULL);
+    struct stat st;
+    if (!g_stat(path, &st)) {
+      if (g_str_has_suffix(name, DISK_SUFFIX)) {
+        struct disk_file *file = g_slice_new0(struct disk_file);
+        file->name = g_strdup(name);
+        file->size = st.st_size;
+        file->mtime = st.st_mtime;
+        g_ptr_array_add(found, file);
+      } else if (strstr(name, DISK_SUFFIX ".") &&
+                 now - (int64_t) st.st_mtime > DISK_STALE_TEMP_SEC) {
+        // temporary file from g_file_set_contents()
+        g_unlink(path);
+      }
+    }
+    g_free(path);
+  }
+  g_dir_close(dir);
+
+  // most recently written at head
+  qsort(found->pdata, found->len, sizeof(void *), file_compare_mtime);
+  for (guint i = 0; i < found->len; i++) {
+    struct disk_file *file = found->pdata[i];
+    g_queue_push_head(disk->lru, file);
+    file->link = disk->lru->head;
+    g_hash_table_insert(disk->files, file->name, file);
+    disk->total_size += file->size;
+  }
+  g_ptr_array_free(found, true);
+
+  // the budget may have shrunk since the last run
+  unlink_files(disk, index_evict(disk));
+  return true;
+}
+
+struct _openslide_disk_cache *_openslide_disk_cache_open(const char *dirname,
+                                                         int64_t capacity,
+                                                         GError **err) {
+  if (capacity <= 0) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Invalid disk cache capacity");
+    return NULL;
+  }
+  if (g_mkdir_with_parents(dirname, 0700)) {
+    _openslide_io_error(err, "Couldn't create disk cache directory %s",
+                        dirname);
+    return NULL;
+  }
+
+  struct _openslide_disk_cache *disk =
+    g_slice_new0(struct _openslide_disk_cache);
+  disk->dir = g_strdup(dirname);
+  disk->capacity = capacity;
+  disk->lock = g_mutex_new();
+  disk->files = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                      NULL, file_free);
+  disk->lru = g_queue_new();
+  if (!index_dir(disk, err)) {
+    g_prefix_error(err, "Couldn't read disk cache directory %s: ", dirname);
+    _openslide_disk_cache_destroy(disk);
+    return NULL;
+  }
+  disk->writer = g_thread_pool_new(write_tile, disk, 1, false, NULL);
+  return disk;
+}
+
+void _openslide_disk_cache_destroy(struct _openslide_disk_cache *disk) {
+  if (disk->writer) {
+    // finish the queued writes
+    g_thread_pool_free(disk->writer, false, true);
+  }
+  g_queue_free(disk->lru);
+  g_hash_table_destroy(disk->files);
+  g_mutex_free(disk->lock);
+  g_free(disk->dir);
+  g_slice_free(struct _openslide_disk_cache, disk);
+}
+
+void *_openslide_disk_cache_get(struct _openslide_disk_cache *disk,
+                                const struct _openslide_shm_key *key,
+                                int64_t *size,
+                                bool *constant) {
+  // only look for files we know about, so cold misses cost no I/O
+  char *name = key_name(key);
+  g_mutex_lock(disk->lock);
+  struct disk_file *file = g_hash_table_lookup(disk->files, name);
+  if (file) {
+    g_queue_unlink(disk->lru, file->link);
+    g_queue_push_head_link(disk->lru, file->link);
+  }
+  g_mutex_unlock(disk->lock);
+  if (!file) {
+    g_free(name);
+    return NULL;
+  }
+
+  char *path = g_build_filename(disk->dir, name, NULL);
+  gchar *contents = NULL;
+  gsize len = 0;
+  bool valid = false;
+  struct disk_header hdr;
+  if (g_file_get_contents(path, &contents, &len, NULL) &&
+      len > sizeof(hdr)) {
+    memcpy(&hdr, contents, sizeof(hdr));
+    valid = hdr.magic == DISK_MAGIC &&
+            !strncmp(hdr.version, SUFFIXED_VERSION, sizeof(hdr.version)) &&
+            !memcmp(&hdr.key, key, sizeof(*key)) &&
+            hdr.size == (int64_t) (len - sizeof(hdr)) &&
+            (hdr.flags & FILE_CONSTANT ? hdr.size == sizeof(uint32_t) :
+                                         hdr.size % sizeof(uint32_t) == 0);
+  }
+  if (!valid) {
+    // evicted by another process, or damaged
+    g_mutex_lock(disk->lock);
+    file = g_hash_table_lookup(disk->files, name);
+    if (file) {
+      index_remove(disk, file);
+    }
+    g_mutex_unlock(disk->lock);
+    if (contents) {
+      g_unlink(path);
+    }
+    g_free(contents);
+    g_free(path);
+    g_free(name);
+    return NULL;
+  }
+  g_free(path);
+  g_free(name);
+
+  void *buf = _openslide_buffer_alloc(hdr.size);
+  memcpy(buf, contents + sizeof(hdr), hdr.size);
+  g_free(contents);
+  *size = hdr.size;
+  *constant = hdr.flags & FILE_CONSTANT;
+  return buf;
+}
+
+void _openslide_disk_cache_put(struct _openslide_disk_cache *disk,
+                               const struct _openslide_shm_key *key,
+                               const void *data,
+                               int64_t size,
+                               bool constant) {
+  int64_t len = sizeof(struct disk_header) + size;
+  if (size <= 0 || len > disk->capacity ||
+      g_thread_pool_unprocessed(disk->writer) >= DISK_WRITE_QUEUE_MAX) {
+    return;
+  }
+
+  struct disk_header hdr = {
+    .magic = DISK_MAGIC,
+    .key = *key,
+    .size = size,
+    .flags = constant ? FILE_CONSTANT : 0,
+  };
+  g_strlcpy(hdr.version, SUFFIXED_VERSION, sizeof(hdr.version));
+  struct write_job *job = g_slice_new(struct write_job);
+  job->name = key_name(key);
+  job->len = len;
+  job->buf = g_malloc(len);
+  memcpy(job->buf, &hdr, sizeof(hdr));
+  memcpy((uint8_t *) job->buf + sizeof(hdr), data, size);
+  g_thread_pool_push(disk->writer, job, NULL);
+}
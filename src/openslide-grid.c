@@ -20,13 +20,20 @@
  */
 
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <glib.h>
 #include <cairo.h>
 #include "openslide-private.h"
 
-#define RANGE_BIN_SIZE_MULTIPLIER 3
+#define RANGE_NODE_SIZE 16
+#define RANGE_QUERY_RESULTS 256
+// tiles prepared together by a simple grid's batch function
+#define SIMPLE_BATCH_TILES 64
+
+// estimated bytes of a hash table entry, including its share of buckets
+#define HASH_ENTRY_SIZE (4 * sizeof(void *))
 #define COLOR_TILE 0.6, 0,   0,   0.3
 #define COLOR_BIN  0,   0,   0.6, 0.15
 
@@ -52,9 +59,21 @@ struct bounds {
   double h;
 };
 
+// cells of a caller's tile grid, set where grid tiles cover them
+struct tile_mask {
+  uint8_t *covered;
+  int64_t tiles_across;
+  int64_t tiles_down;
+  double tile_w;
+  double tile_h;
+};
+
 struct grid_ops {
   void (*get_bounds)(struct _openslide_grid *grid,
                      struct bounds *bounds);
+  // optional; grids without one cover every cell
+  void (*mark_tiles)(struct _openslide_grid *grid,
+                     struct tile_mask *mask);
   bool (*paint_region)(struct _openslide_grid *grid,
                        cairo_t *cr, void *arg,
                        double x, double y,
@@ -78,6 +97,8 @@ struct _openslide_grid {
 
   double tile_advance_x;
   double tile_advance_y;
+
+  int64_t size;  // bytes charged to osr->grid_size
 };
 
 struct simple_grid {
@@ -86,6 +107,7 @@ struct simple_grid {
   int64_t tiles_across;
   int64_t tiles_down;
   _openslide_grid_simple_read_fn read_tile;
+  _openslide_grid_simple_batch_fn batch;
 };
 
 struct tilemap_grid {
@@ -126,12 +148,14 @@ struct tilemap_tile {
 struct range_grid {
   struct _openslide_grid base;
 
-  int bin_width;
-  int bin_height;
+  GPtrArray *tiles;  // in order of addition
 
-  GPtrArray *tiles;
-  GHashTable *bins_init;  // address -> GPtrArray<tile>
-  GHashTable *bins_runtime;  // address -> [tile]
+  // static R-tree, packed bottom-up: one leaf entry per tile, then
+  // each level of internal nodes, with the root last
+  struct range_node *nodes;
+  int32_t node_count;
+  struct range_tile **paint_order;  // tiles by leaf rank
+  bool finished;
 
   _openslide_grid_range_read_fn read_tile;
   GDestroyNotify destroy_tile;
@@ -143,9 +167,16 @@ struct range_grid {
   double right;
 };
 
-struct range_bin_address {
-  int64_t col;
-  int64_t row;
+struct range_node {
+  // bounding box
+  double x0;
+  double y0;
+  double x1;
+  double y1;
+  // leaf: rank of the tile in paint order, count 0
+  // internal: index of the first child, number of children
+  int32_t first;
+  int32_t count;
 };
 
 struct range_tile {
@@ -158,6 +189,18 @@ struct range_tile {
   double h;
 };
 
+// count memory outside the arena toward the slide's footprint
+static void charge_size(struct _openslide_grid *grid, int64_t bytes) {
+  grid->size += bytes;
+  __sync_fetch_and_add(&grid->osr->grid_size, bytes);
+}
+
+// the slide being read, which may be a view sharing the grid's slide
+static openslide_t *get_reader(struct _openslide_grid *grid) {
+  openslide_t *osr = _openslide_slide_current();
+  return osr ? osr : grid->osr;
+}
+
 static void compute_region(struct _openslide_grid *grid,
                            double x, double y,
                            int32_t w, int32_t h,
@@ -216,10 +259,17 @@ static bool read_tiles(cairo_t *cr,
       double translate_x = ((tile_x - region->start_tile_x) *
                             grid->tile_advance_x) - region->offset_x;
       //      g_debug("read_tiles %"PRId64" %"PRId64, tile_x, tile_y);
+      if (_openslide_check_interrupt(err)) {
+        return false;
+      }
       cairo_translate(cr, translate_x, translate_y);
+      _openslide_trace(OPENSLIDE_TRACE_TILE, true, level, tile_x, tile_y,
+                       0, NULL);
       bool success = callback(grid, region, cr,
                               level, tile_x, tile_y,
                               arg, err);
+      _openslide_trace(OPENSLIDE_TRACE_TILE, false, level, tile_x, tile_y,
+                       0, NULL);
       cairo_set_matrix(cr, &matrix);
       if (!success) {
         return false;
@@ -258,6 +308,18 @@ static void label_tile(cairo_t *cr,
 
 
 
+static void mark_rect(struct tile_mask *mask,
+                      double x, double y, double w, double h) {
+  int64_t col0 = MAX(floor(x / mask->tile_w), 0);
+  int64_t row0 = MAX(floor(y / mask->tile_h), 0);
+  int64_t col1 = MIN(ceil((x + w) / mask->tile_w), mask->tiles_across);
+  int64_t row1 = MIN(ceil((y + h) / mask->tile_h), mask->tiles_down);
+  for (int64_t row = row0; row < row1; row++) {
+    memset(mask->covered + row * mask->tiles_across + col0, 1,
+           MAX(col1 - col0, 0));
+  }
+}
+
 static void simple_get_bounds(struct _openslide_grid *_grid,
                               struct bounds *bounds) {
   struct simple_grid *grid = (struct simple_grid *) _grid;
@@ -275,8 +337,21 @@ static bool simple_read_tile(struct _openslide_grid *_grid,
                              GError **err) {
   struct simple_grid *grid = (struct simple_grid *) _grid;
 
-  if (!grid->read_tile(grid->base.osr, cr, level,
-                       tile_col, tile_row, arg, err)) {
+  // when painting directly, CAIRO_OPERATOR_SOURCE makes the paint a
+  // plain copy, but it is unbounded; confine it to this tile
+  bool clip = cairo_get_operator(cr) == CAIRO_OPERATOR_SOURCE;
+  if (clip) {
+    cairo_save(cr);
+    cairo_rectangle(cr, 0, 0,
+                    grid->base.tile_advance_x, grid->base.tile_advance_y);
+    cairo_clip(cr);
+  }
+  bool success = grid->read_tile(get_reader(&grid->base), cr, level,
+                                 tile_col, tile_row, arg, err);
+  if (clip) {
+    cairo_restore(cr);
+  }
+  if (!success) {
     return false;
   }
   if (_openslide_debug(OPENSLIDE_DEBUG_TILES)) {
@@ -327,9 +402,43 @@ static bool simple_paint_region(struct _openslide_grid *_grid,
   region.end_tile_x = MIN(region.end_tile_x, grid->tiles_across);
   region.end_tile_y = MIN(region.end_tile_y, grid->tiles_down);
 
-  // read
-  bool result = read_tiles(cr, level, _grid, &region,
-                           simple_read_tile, arg, err);
+  // read, in bands of rows that are each prepared as one batch
+  int64_t tiles_across = region.end_tile_x - region.start_tile_x;
+  int64_t band_rows = region.end_tile_y - region.start_tile_y;
+  if (grid->batch) {
+    band_rows = MAX(SIMPLE_BATCH_TILES / tiles_across, 1);
+  }
+  bool result = true;
+  for (int64_t row = region.start_tile_y;
+       result && row < region.end_tile_y;
+       row += band_rows) {
+    struct region band = region;
+    band.start_tile_y = row;
+    band.end_tile_y = MIN(row + band_rows, region.end_tile_y);
+
+    if (grid->batch) {
+      int64_t count = tiles_across * (band.end_tile_y - band.start_tile_y);
+      int64_t *tiles = g_new(int64_t, 2 * count);
+      int64_t *p = tiles;
+      for (int64_t tile_y = band.start_tile_y; tile_y < band.end_tile_y;
+           tile_y++) {
+        for (int64_t tile_x = band.start_tile_x; tile_x < band.end_tile_x;
+             tile_x++) {
+          *p++ = tile_x;
+          *p++ = tile_y;
+        }
+      }
+      grid->batch(get_reader(&grid->base), level, tiles, count, arg);
+      g_free(tiles);
+    }
+
+    cairo_save(cr);
+    cairo_translate(cr, 0,
+                    (row - region.start_tile_y) * grid->base.tile_advance_y);
+    result = read_tiles(cr, level, _grid, &band,
+                        simple_read_tile, arg, err);
+    cairo_restore(cr);
+  }
 
   // restore
   cairo_set_matrix(cr, &matrix);
@@ -340,6 +449,7 @@ static bool simple_paint_region(struct _openslide_grid *_grid,
 static void simple_destroy(struct _openslide_grid *_grid) {
   struct simple_grid *grid = (struct simple_grid *) _grid;
 
+  charge_size(_grid, -_grid->size);
   g_slice_free(struct simple_grid, grid);
 }
 
@@ -363,9 +473,17 @@ struct _openslide_grid *_openslide_grid_create_simple(openslide_t *osr,
   grid->tiles_across = tiles_across;
   grid->tiles_down = tiles_down;
   grid->read_tile = read_tile;
+  charge_size(&grid->base, sizeof(*grid));
   return (struct _openslide_grid *) grid;
 }
 
+void _openslide_grid_simple_set_batch(struct _openslide_grid *_grid,
+                                      _openslide_grid_simple_batch_fn batch) {
+  g_assert(_grid->ops == &simple_grid_ops);
+  struct simple_grid *grid = (struct simple_grid *) _grid;
+  grid->batch = batch;
+}
+
 
 
 static guint tilemap_tile_hash_func(gconstpointer key) {
@@ -387,7 +505,7 @@ static void tilemap_tile_hash_destroy_value(gpointer data) {
   if (tile->grid->destroy_tile && tile->data) {
     tile->grid->destroy_tile(tile->data);
   }
-  g_slice_free(struct tilemap_tile, tile);
+  // tile itself is in the slide's arena
 }
 
 static void tilemap_get_bounds(struct _openslide_grid *_grid,
@@ -439,7 +557,7 @@ static bool tilemap_read_tile(struct _openslide_grid *_grid,
   cairo_matrix_t matrix;
   cairo_get_matrix(cr, &matrix);
   cairo_translate(cr, tile->offset_x, tile->offset_y);
-  bool success = grid->read_tile(grid->base.osr, cr, level,
+  bool success = grid->read_tile(get_reader(&grid->base), cr, level,
                                  tile->col, tile->row, tile->data,
                                  arg, err);
   if (success && _openslide_debug(OPENSLIDE_DEBUG_TILES)) {
@@ -495,11 +613,28 @@ static void tilemap_destroy(struct _openslide_grid *_grid) {
   struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
 
   g_hash_table_destroy(grid->tiles);
+  charge_size(_grid, -_grid->size);
   g_slice_free(struct tilemap_grid, grid);
 }
 
+static void tilemap_mark_tiles(struct _openslide_grid *_grid,
+                               struct tile_mask *mask) {
+  struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
+
+  GHashTableIter iter;
+  g_hash_table_iter_init(&iter, grid->tiles);
+  struct tilemap_tile *tile;
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &tile)) {
+    mark_rect(mask,
+              tile->col * grid->base.tile_advance_x + tile->offset_x,
+              tile->row * grid->base.tile_advance_y + tile->offset_y,
+              tile->w, tile->h);
+  }
+}
+
 static const struct grid_ops tilemap_grid_ops = {
   .get_bounds = tilemap_get_bounds,
+  .mark_tiles = tilemap_mark_tiles,
   .paint_region = tilemap_paint_region,
   .destroy = tilemap_destroy,
 };
@@ -512,7 +647,8 @@ void _openslide_grid_tilemap_add_tile(struct _openslide_grid *_grid,
   struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
   g_assert(grid->base.ops == &tilemap_grid_ops);
 
-  struct tilemap_tile *tile = g_slice_new0(struct tilemap_tile);
+  struct tilemap_tile *tile =
+    _openslide_arena_alloc(grid->base.osr->arena, sizeof(*tile));
   tile->grid = grid;
   tile->col = col;
   tile->row = row;
@@ -522,7 +658,11 @@ void _openslide_grid_tilemap_add_tile(struct _openslide_grid *_grid,
   tile->h = h;
   tile->data = data;
 
+  guint count = g_hash_table_size(grid->tiles);
   g_hash_table_replace(grid->tiles, tile, tile);
+  if (g_hash_table_size(grid->tiles) > count) {
+    charge_size(&grid->base, HASH_ENTRY_SIZE);
+  }
 
   grid->left = MIN(col * grid->base.tile_advance_x + offset_x,
                    grid->left);
@@ -581,38 +721,17 @@ struct _openslide_grid *_openslide_grid_create_tilemap(openslide_t *osr,
                                       tilemap_tile_hash_key_equal,
                                       NULL,
                                       tilemap_tile_hash_destroy_value);
+  charge_size(&grid->base, sizeof(*grid));
 
   return (struct _openslide_grid *) grid;
 }
 
 
 
-static guint range_bin_address_hash_func(gconstpointer key) {
-  const struct range_bin_address *addr = key;
-
-  // assume 32-bit hash
-  return (guint) ((34369 * (uint64_t) addr->row) + ((uint64_t) addr->col));
-}
-
-static gboolean range_bin_address_hash_key_equal(gconstpointer a,
-                                                 gconstpointer b) {
-  const struct range_bin_address *c_a = a;
-  const struct range_bin_address *c_b = b;
-
-  return (c_a->col == c_b->col) && (c_a->row == c_b->row);
-}
-
-static void range_bin_address_free(void *data) {
-  g_slice_free(struct range_bin_address, data);
-}
-
-static void range_ptr_array_free(void *data) {
-  g_ptr_array_free(data, true);
-}
-
-static int range_compare_tiles(gconstpointer a, gconstpointer b) {
-  const struct range_tile *c_a = a;
-  const struct range_tile *c_b = b;
+// descending y, then descending x, then insertion order
+static int range_compare_tiles(const void *a, const void *b) {
+  const struct range_tile *c_a = *(struct range_tile * const *) a;
+  const struct range_tile *c_b = *(struct range_tile * const *) b;
 
   if (c_a->y < c_b->y) {
     return 1;
@@ -622,11 +741,44 @@ static int range_compare_tiles(gconstpointer a, gconstpointer b) {
     return 1;
   } else if (c_a->x > c_b->x) {
     return -1;
+  } else if (c_a->id < c_b->id) {
+    return -1;
   } else {
-    return 0;
+    return c_a->id > c_b->id;
   }
 }
 
+static int range_compare_nodes_x(const void *a, const void *b) {
+  const struct range_node *c_a = a;
+  const struct range_node *c_b = b;
+  double ca = c_a->x0 + c_a->x1;
+  double cb = c_b->x0 + c_b->x1;
+  return (ca > cb) - (ca < cb);
+}
+
+static int range_compare_nodes_y(const void *a, const void *b) {
+  const struct range_node *c_a = a;
+  const struct range_node *c_b = b;
+  double ca = c_a->y0 + c_a->y1;
+  double cb = c_b->y0 + c_b->y1;
+  return (ca > cb) - (ca < cb);
+}
+
+static int range_compare_ranks(const void *a, const void *b) {
+  int32_t c_a = *(const int32_t *) a;
+  int32_t c_b = *(const int32_t *) b;
+  return (c_a > c_b) - (c_a < c_b);
+}
+
+static bool range_node_intersects(const struct range_node *node,
+                                  double x, double y,
+                                  int32_t w, int32_t h) {
+  return !(node->x1 <= x ||
+           node->y1 <= y ||
+           node->x0 >= x + w ||
+           node->y0 >= y + h);
+}
+
 static void range_get_bounds(struct _openslide_grid *_grid,
                              struct bounds *bounds) {
   struct range_grid *grid = (struct range_grid *) _grid;
@@ -647,73 +799,82 @@ static bool range_paint_region(struct _openslide_grid *_grid,
                                int32_t w, int32_t h,
                                GError **err) {
   struct range_grid *grid = (struct range_grid *) _grid;
-  GList *tiles = NULL;
+  int32_t stack_ranks[RANGE_QUERY_RESULTS];
+  int32_t *ranks = stack_ranks;
+  int32_t rank_capacity = G_N_ELEMENTS(stack_ranks);
+  int32_t rank_count = 0;
   bool result = false;
 
   // ensure _openslide_grid_range_finish_adding_tiles() was called
-  g_assert(grid->bins_runtime);
+  g_assert(grid->finished);
 
   // save
   cairo_matrix_t matrix;
   cairo_get_matrix(cr, &matrix);
 
-  // accumulate relevant tiles
-  struct range_bin_address addr;
-  for (addr.row = y / grid->bin_height;
-       addr.row < (int64_t) (y + h + grid->bin_height - 1) / grid->bin_height;
-       addr.row++) {
-    for (addr.col = x / grid->bin_width;
-         addr.col < (int64_t) (x + w + grid->bin_width - 1) / grid->bin_width;
-         addr.col++) {
-      struct range_tile **cur = g_hash_table_lookup(grid->bins_runtime,
-                                                    &addr);
-      if (cur) {
-        for (; *cur; cur++) {
-          struct range_tile *tile = *cur;
-          // skip tile if it's outside the requested region
-          if (tile->x + tile->w <= x ||
-              tile->y + tile->h <= y ||
-              tile->x >= x + w ||
-              tile->y >= y + h) {
-            //g_debug("skip x %g w %g y %g h %g, region x %g w %d y %g h %d", tile->x, tile->w, tile->y, tile->h, x, w, y, h);
-            continue;
-          }
-          tiles = g_list_prepend(tiles, tile);
+  // collect the ranks of relevant tiles.  The tree is at most a few
+  // levels deep, so each level contributes at most one node's children
+  // to the stack.
+  int32_t stack[RANGE_NODE_SIZE * 16];
+  int32_t depth = 0;
+  if (grid->node_count) {
+    stack[depth++] = grid->node_count - 1;
+  }
+  while (depth) {
+    const struct range_node *node = &grid->nodes[stack[--depth]];
+    if (!range_node_intersects(node, x, y, w, h)) {
+      continue;
+    }
+    if (node->count == 0) {
+      // leaf
+      if (rank_count == rank_capacity) {
+        rank_capacity *= 2;
+        if (ranks == stack_ranks) {
+          ranks = g_new(int32_t, rank_capacity);
+          memcpy(ranks, stack_ranks, sizeof(stack_ranks));
+        } else {
+          ranks = g_renew(int32_t, ranks, rank_capacity);
         }
       }
-      if (_openslide_debug(OPENSLIDE_DEBUG_TILES)) {
-        char *coordinates = g_strdup_printf("%"PRId64", %"PRId64,
-                                            addr.col, addr.row);
-        cairo_translate(cr,
-                        addr.col * grid->bin_width - x,
-                        addr.row * grid->bin_height - y);
-        label_tile(cr, COLOR_BIN,
-                   grid->bin_width, grid->bin_height,
-                   coordinates);
-        cairo_set_matrix(cr, &matrix);
-        g_free(coordinates);
-      }
+      ranks[rank_count++] = node->first;
+      continue;
+    }
+    if (_openslide_debug(OPENSLIDE_DEBUG_TILES) &&
+        grid->nodes[node->first].count == 0) {
+      // outline the lowest internal nodes we visit
+      char *label = g_strdup_printf("%"PRId32, (int32_t) (node - grid->nodes));
+      cairo_translate(cr, node->x0 - x, node->y0 - y);
+      label_tile(cr, COLOR_BIN,
+                 node->x1 - node->x0, node->y1 - node->y0,
+                 label);
+      cairo_set_matrix(cr, &matrix);
+      g_free(label);
+    }
+    for (int32_t i = 0; i < node->count; i++) {
+      g_assert(depth < (int32_t) G_N_ELEMENTS(stack));
+      stack[depth++] = node->first + i;
     }
   }
-  tiles = g_list_sort(tiles, range_compare_tiles);
+  qsort(ranks, rank_count, sizeof(*ranks), range_compare_ranks);
 
   // draw tiles
-  struct range_tile *prev_tile = NULL;
-  for (GList *cur = tiles; cur; cur = cur->next) {
+  for (int32_t i = 0; i < rank_count; i++) {
     // get tile struct
-    struct range_tile *tile = cur->data;
-    if (tile == prev_tile) {
-      //g_debug("skipping repeated tile");
-      continue;
-    }
-    prev_tile = tile;
+    struct range_tile *tile = grid->paint_order[ranks[i]];
 
     // draw
     //g_debug("tile x %g y %g", tile->x, tile->y);
+    if (_openslide_check_interrupt(err)) {
+      goto DONE;
+    }
     cairo_translate(cr, tile->x - x, tile->y - y);
-    bool success = grid->read_tile(grid->base.osr, cr, level,
+    _openslide_trace(OPENSLIDE_TRACE_TILE, true, level, tile->id, -1,
+                     0, NULL);
+    bool success = grid->read_tile(get_reader(&grid->base), cr, level,
                                    tile->id, tile->data,
                                    arg, err);
+    _openslide_trace(OPENSLIDE_TRACE_TILE, false, level, tile->id, -1,
+                     0, NULL);
     if (success && _openslide_debug(OPENSLIDE_DEBUG_TILES)) {
       char *coordinates = g_strdup_printf("%"PRId64, tile->id);
       label_tile(cr, COLOR_TILE, tile->w, tile->h, coordinates);
@@ -729,32 +890,41 @@ static bool range_paint_region(struct _openslide_grid *_grid,
   result = true;
 
 DONE:
-  g_list_free(tiles);
+  if (ranks != stack_ranks) {
+    g_free(ranks);
+  }
   return result;
 }
 
 static void range_destroy(struct _openslide_grid *_grid) {
   struct range_grid *grid = (struct range_grid *) _grid;
 
-  if (grid->bins_init) {
-    g_hash_table_destroy(grid->bins_init);
-  }
-  if (grid->bins_runtime) {
-    g_hash_table_destroy(grid->bins_runtime);
-  }
   for (uint64_t cur = 0; cur < grid->tiles->len; cur++) {
     struct range_tile *tile = grid->tiles->pdata[cur];
     if (grid->destroy_tile && tile->data) {
       grid->destroy_tile(tile->data);
     }
-    g_slice_free(struct range_tile, tile);
   }
   g_ptr_array_free(grid->tiles, true);
+  g_free(grid->nodes);
+  g_free(grid->paint_order);
+  charge_size(_grid, -_grid->size);
   g_slice_free(struct range_grid, grid);
 }
 
+static void range_mark_tiles(struct _openslide_grid *_grid,
+                             struct tile_mask *mask) {
+  struct range_grid *grid = (struct range_grid *) _grid;
+
+  for (uint64_t cur = 0; cur < grid->tiles->len; cur++) {
+    struct range_tile *tile = grid->tiles->pdata[cur];
+    mark_rect(mask, tile->x, tile->y, tile->w, tile->h);
+  }
+}
+
 static const struct grid_ops range_grid_ops = {
   .get_bounds = range_get_bounds,
+  .mark_tiles = range_mark_tiles,
   .paint_region = range_paint_region,
   .destroy = range_destroy,
 };
@@ -765,9 +935,10 @@ void _openslide_grid_range_add_tile(struct _openslide_grid *_grid,
                                     void *data) {
   struct range_grid *grid = (struct range_grid *) _grid;
   g_assert(grid->base.ops == &range_grid_ops);
-  g_assert(grid->bins_init);
+  g_assert(!grid->finished);
 
-  struct range_tile *tile = g_slice_new0(struct range_tile);
+  struct range_tile *tile =
+    _openslide_arena_alloc(grid->base.osr->arena, sizeof(*tile));
   tile->id = grid->tiles->len;
   tile->data = data;
   tile->x = x;
@@ -775,26 +946,7 @@ void _openslide_grid_range_add_tile(struct _openslide_grid *_grid,
   tile->w = w;
   tile->h = h;
   g_ptr_array_add(grid->tiles, tile);
-
-  struct range_bin_address addr;
-  for (addr.row = y / grid->bin_height;
-       addr.row < (int64_t) (y + h + grid->bin_height - 1) / grid->bin_height;
-       addr.row++) {
-    for (addr.col = x / grid->bin_width;
-         addr.col < (int64_t) (x + w + grid->bin_width - 1) / grid->bin_width;
-         addr.col++) {
-      GPtrArray *bin = g_hash_table_lookup(grid->bins_init, &addr);
-      if (!bin) {
-        bin = g_ptr_array_new();
-        struct range_bin_address *addr2 =
-          g_slice_new(struct range_bin_address);
-        addr2->col = addr.col;
-        addr2->row = addr.row;
-        g_hash_table_insert(grid->bins_init, addr2, bin);
-      }
-      g_ptr_array_add(bin, tile);
-    }
-  }
+  charge_size(&grid->base, sizeof(tile));
 
   grid->left = MIN(x, grid->left);
   grid->top = MIN(y, grid->top);
@@ -802,36 +954,91 @@ void _openslide_grid_range_add_tile(struct _openslide_grid *_grid,
   grid->bottom = MAX(y + h, grid->bottom);
 }
 
-static void range_postprocess_bin(void *key, void *value, void *data) {
-  struct range_grid *grid = data;
-  GPtrArray *tiles = value;
-
-  struct range_tile **tile_array = g_new(struct range_tile *, tiles->len + 1);
-  memcpy(tile_array, tiles->pdata, tiles->len * sizeof(struct range_tile *));
-  tile_array[tiles->len] = NULL;
-  g_ptr_array_free(tiles, true);
-
-  g_hash_table_replace(grid->bins_runtime, key, tile_array);
+// Sort-Tile-Recursive packing: cut the entries into vertical slices by x,
+// then sort each slice by y, so runs of RANGE_NODE_SIZE entries are
+// compact rectangles
+static void range_pack_level(struct range_node *entries, int32_t count) {
+  int32_t parents = (count + RANGE_NODE_SIZE - 1) / RANGE_NODE_SIZE;
+  int32_t slices = ceil(sqrt(parents));
+  int32_t slice_len = RANGE_NODE_SIZE * ((parents + slices - 1) / slices);
+
+  qsort(entries, count, sizeof(*entries), range_compare_nodes_x);
+  for (int32_t start = 0; start < count; start += slice_len) {
+    qsort(entries + start, MIN(slice_len, count - start), sizeof(*entries),
+          range_compare_nodes_y);
+  }
 }
 
 void _openslide_grid_range_finish_adding_tiles(struct _openslide_grid *_grid) {
   struct range_grid *grid = (struct range_grid *) _grid;
   g_assert(grid->base.ops == &range_grid_ops);
-  g_assert(grid->bins_init);
+  g_assert(!grid->finished);
+  grid->finished = true;
+
+  int32_t tile_count = grid->tiles->len;
+  if (!tile_count) {
+    return;
+  }
 
-  grid->bins_runtime = g_hash_table_new_full(range_bin_address_hash_func,
-                                             range_bin_address_hash_key_equal,
-                                             range_bin_address_free,
-                                             g_free);
-  g_hash_table_foreach(grid->bins_init, range_postprocess_bin, grid);
-  g_hash_table_steal_all(grid->bins_init);
-  g_hash_table_destroy(grid->bins_init);
-  grid->bins_init = NULL;
+  // rank tiles in paint order
+  grid->paint_order = g_new(struct range_tile *, tile_count);
+  memcpy(grid->paint_order, grid->tiles->pdata,
+         tile_count * sizeof(*grid->paint_order));
+  qsort(grid->paint_order, tile_count, sizeof(*grid->paint_order),
+        range_compare_tiles);
+
+  // size the tree
+  int32_t node_count = tile_count;
+  int32_t level_count = tile_count;
+  while (level_count > 1) {
+    level_count = (level_count + RANGE_NODE_SIZE - 1) / RANGE_NODE_SIZE;
+    node_count += level_count;
+  }
+  grid->nodes = g_new(struct range_node, node_count);
+  grid->node_count = node_count;
+  charge_size(&grid->base,
+              tile_count * sizeof(*grid->paint_order) +
+              node_count * sizeof(*grid->nodes));
+
+  // leaves
+  for (int32_t i = 0; i < tile_count; i++) {
+    struct range_tile *tile = grid->paint_order[i];
+    struct range_node *node = &grid->nodes[i];
+    node->x0 = tile->x;
+    node->y0 = tile->y;
+    node->x1 = tile->x + tile->w;
+    node->y1 = tile->y + tile->h;
+    node->first = i;
+    node->count = 0;
+  }
+
+  // internal levels
+  int32_t level_start = 0;
+  level_count = tile_count;
+  int32_t next = tile_count;
+  while (level_count > 1) {
+    range_pack_level(grid->nodes + level_start, level_count);
+    for (int32_t i = 0; i < level_count; i += RANGE_NODE_SIZE) {
+      struct range_node *parent = &grid->nodes[next++];
+      parent->first = level_start + i;
+      parent->count = MIN(RANGE_NODE_SIZE, level_count - i);
+      parent->x0 = parent->y0 = INFINITY;
+      parent->x1 = parent->y1 = -INFINITY;
+      for (int32_t j = 0; j < parent->count; j++) {
+        struct range_node *child = &grid->nodes[parent->first + j];
+        parent->x0 = MIN(parent->x0, child->x0);
+        parent->y0 = MIN(parent->y0, child->y0);
+        parent->x1 = MAX(parent->x1, child->x1);
+        parent->y1 = MAX(parent->y1, child->y1);
+      }
+    }
+    level_start += level_count;
+    level_count = next - level_start;
+  }
+  g_assert(next == node_count);
 }
 
 struct _openslide_grid *_openslide_grid_create_range(openslide_t *osr,
-                                                     int typical_tile_width,
-                                                     int typical_tile_height,
                                                      _openslide_grid_range_read_fn read_tile,
                                                      GDestroyNotify destroy_tile) {
   struct range_grid *grid = g_slice_new0(struct range_grid);
@@ -839,13 +1046,7 @@ struct _openslide_grid *_openslide_grid_create_range(openslide_t *osr,
   grid->base.ops = &range_grid_ops;
   grid->base.tile_advance_x = NAN;  // unused
   grid->base.tile_advance_y = NAN;  // unused
-  grid->bin_width = typical_tile_width * RANGE_BIN_SIZE_MULTIPLIER;
-  grid->bin_height = typical_tile_height * RANGE_BIN_SIZE_MULTIPLIER;
   grid->tiles = g_ptr_array_new();
-  grid->bins_init = g_hash_table_new_full(range_bin_address_hash_func,
-                                          range_bin_address_hash_key_equal,
-                                          range_bin_address_free,
-                                          range_ptr_array_free);
   grid->read_tile = read_tile;
   grid->destroy_tile = destroy_tile;
 
@@ -853,6 +1054,7 @@ struct _openslide_grid *_openslide_grid_create_range(openslide_t *osr,
   grid->bottom = -INFINITY;
   grid->left = INFINITY;
   grid->right = -INFINITY;
+  charge_size(&grid->base, sizeof(*grid));
 
   return (struct _openslide_grid *) grid;
 }
@@ -879,6 +1081,28 @@ void _openslide_grid_get_bounds(struct _openslide_grid *grid,
   }
 }
 
+void _openslide_grid_clear_empty_tiles(struct _openslide_grid *grid,
+                                       uint8_t *nonempty,
+                                       int64_t tiles_across,
+                                       int64_t tiles_down,
+                                       double tile_w, double tile_h) {
+  if (!grid->ops->mark_tiles) {
+    return;
+  }
+  struct tile_mask mask = {
+    .covered = g_new0(uint8_t, tiles_across * tiles_down),
+    .tiles_across = tiles_across,
+    .tiles_down = tiles_down,
+    .tile_w = tile_w,
+    .tile_h = tile_h,
+  };
+  grid->ops->mark_tiles(grid, &mask);
+  for (int64_t i = 0; i < tiles_across * tiles_down; i++) {
+    nonempty[i] &= mask.covered[i];
+  }
+  g_free(mask.covered);
+}
+
 bool _openslide_grid_paint_region(struct _openslide_grid *grid,
                                   cairo_t *cr,
                                   void *arg,
@@ -886,7 +1110,11 @@ bool _openslide_grid_paint_region(struct _openslide_grid *grid,
                                   struct _openslide_level *level,
                                   int32_t w, int32_t h,
                                   GError **err) {
-  return grid->ops->paint_region(grid, cr, arg, x, y, level, w, h, err);
+  _openslide_trace(OPENSLIDE_TRACE_GRID, true, level, -1, -1, 0, NULL);
+  bool success = grid->ops->paint_region(grid, cr, arg, x, y, level, w, h,
+                                         err);
+  _openslide_trace(OPENSLIDE_TRACE_GRID, false, level, -1, -1, 0, NULL);
+  return success;
 }
 
 void _openslide_grid_destroy(struct _openslide_grid *grid) {
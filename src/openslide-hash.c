@@ -26,14 +26,34 @@
 #include "openslide-hash.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <glib.h>
 
+#define HASH_BUF_SIZE (64 * 1024)
+// most bytes a batch holds in memory at once
+#define HASH_BATCH_BYTES (16 * 1024 * 1024)
+// holes smaller than this are read through rather than split the read
+#define HASH_BATCH_MAX_GAP (64 * 1024)
+
 struct _openslide_hash {
   GChecksum *checksum;
   bool enabled;
 };
 
+struct hash_part {
+  int32_t file;
+  int64_t offset;
+  int64_t size;
+  const uint8_t *data;
+};
+
+struct _openslide_hash_batch {
+  struct _openslide_hash *hash;
+  GPtrArray *filenames;
+  GArray *parts;
+};
+
 struct _openslide_hash *_openslide_hash_quickhash1_create(void) {
   struct _openslide_hash *hash = g_slice_new(struct _openslide_hash);
   hash->checksum = g_checksum_new(G_CHECKSUM_SHA256);
@@ -65,6 +85,11 @@ bool _openslide_hash_file_part(struct _openslide_hash *hash,
 			       GError **err) {
   bool success = false;
 
+  if (hash == NULL) {
+    // hash deferred or not wanted; skip the I/O
+    return true;
+  }
+
   FILE *f = _openslide_fopen(filename, "rb", err);
   if (f == NULL) {
     return false;
@@ -84,7 +109,7 @@ bool _openslide_hash_file_part(struct _openslide_hash *hash,
     size = len - offset;
   }
 
-  uint8_t buf[4096];
+  uint8_t *buf = g_malloc(HASH_BUF_SIZE);
 
   if (fseeko(f, offset, SEEK_SET) == -1) {
     _openslide_io_error(err, "Can't seek in %s", filename);
@@ -93,7 +118,7 @@ bool _openslide_hash_file_part(struct _openslide_hash *hash,
 
   int64_t bytes_left = size;
   while (bytes_left > 0) {
-    int64_t bytes_to_read = MIN((int64_t) sizeof buf, bytes_left);
+    int64_t bytes_to_read = MIN((int64_t) HASH_BUF_SIZE, bytes_left);
     int64_t bytes_read = fread(buf, 1, bytes_to_read, f);
 
     if (bytes_read != bytes_to_read) {
@@ -112,10 +137,176 @@ bool _openslide_hash_file_part(struct _openslide_hash *hash,
   success = true;
 
 DONE:
+  g_free(buf);
   fclose(f);
   return success;
 }
 
+struct _openslide_hash_batch *_openslide_hash_batch_create(struct _openslide_hash *hash) {
+  struct _openslide_hash_batch *batch =
+    g_slice_new0(struct _openslide_hash_batch);
+  batch->hash = hash;
+  batch->filenames = g_ptr_array_new();
+  batch->parts = g_array_new(false, false, sizeof(struct hash_part));
+  return batch;
+}
+
+void _openslide_hash_batch_add(struct _openslide_hash_batch *batch,
+                               const char *filename,
+                               int64_t offset, int64_t size) {
+  if (!batch->hash || !batch->hash->enabled || size <= 0) {
+    return;
+  }
+
+  // slides have few files, and consecutive parts usually share one
+  int32_t file = batch->filenames->len - 1;
+  while (file >= 0 &&
+         strcmp(batch->filenames->pdata[file], filename)) {
+    file--;
+  }
+  if (file < 0) {
+    file = batch->filenames->len;
+    g_ptr_array_add(batch->filenames, g_strdup(filename));
+  }
+
+  struct hash_part part = {
+    .file = file,
+    .offset = offset,
+    .size = size,
+  };
+  g_array_append_val(batch->parts, part);
+}
+
+static int compare_parts(const void *a, const void *b) {
+  const struct hash_part *pa = *(const struct hash_part **) a;
+  const struct hash_part *pb = *(const struct hash_part **) b;
+  if (pa->file != pb->file) {
+    return pa->file < pb->file ? -1 : 1;
+  } else if (pa->offset != pb->offset) {
+    return pa->offset < pb->offset ? -1 : 1;
+  }
+  return 0;
+}
+
+// read parts [first, last) in file order, then hash them in queued order
+static bool hash_window(struct _openslide_hash_batch *batch,
+                        guint first, guint last,
+                        GError **err) {
+  guint count = last - first;
+  struct hash_part **sorted = g_new(struct hash_part *, count);
+  for (guint i = 0; i < count; i++) {
+    sorted[i] = &g_array_index(batch->parts, struct hash_part, first + i);
+  }
+  qsort(sorted, count, sizeof(*sorted), compare_parts);
+
+  GSList *bufs = NULL;
+  FILE *f = NULL;
+  int32_t cur_file = -1;
+  bool success = false;
+
+  guint i = 0;
+  while (i < count) {
+    // coalesce neighbouring byte ranges into one read
+    int32_t file = sorted[i]->file;
+    int64_t start = sorted[i]->offset;
+    int64_t end = start + sorted[i]->size;
+    guint j = i + 1;
+    while (j < count && sorted[j]->file == file &&
+           sorted[j]->offset - end <= HASH_BATCH_MAX_GAP) {
+      end = MAX(end, sorted[j]->offset + sorted[j]->size);
+      j++;
+    }
+
+    const char *filename = batch->filenames->pdata[file];
+    if (file != cur_file) {
+      if (f) {
+        fclose(f);
+      }
+      f = _openslide_fopen(filename, "rb", err);
+      if (f == NULL) {
+        goto DONE;
+      }
+      cur_file = file;
+    }
+
+    uint8_t *buf = g_malloc(end - start);
+    bufs = g_slist_prepend(bufs, buf);
+    if (start < 0 ||
+        _openslide_fread_at(f, buf, end - start, start) !=
+        (size_t) (end - start)) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Can't read from %s", filename);
+      goto DONE;
+    }
+    for (guint k = i; k < j; k++) {
+      sorted[k]->data = buf + (sorted[k]->offset - start);
+    }
+    i = j;
+  }
+
+  for (guint k = first; k < last; k++) {
+    struct hash_part *part = &g_array_index(batch->parts, struct hash_part, k);
+    _openslide_hash_data(batch->hash, part->data, part->size);
+  }
+  success = true;
+
+DONE:
+  if (f) {
+    fclose(f);
+  }
+  for (GSList *cur = bufs; cur; cur = cur->next) {
+    g_free(cur->data);
+  }
+  g_slist_free(bufs);
+  g_free(sorted);
+  return success;
+}
+
+bool _openslide_hash_batch_run(struct _openslide_hash_batch *batch,
+                               GError **err) {
+  GArray *parts = batch->parts;
+  bool success = true;
+
+  guint first = 0;
+  while (success && first < parts->len) {
+    struct hash_part *part = &g_array_index(parts, struct hash_part, first);
+    if (part->size > HASH_BATCH_BYTES) {
+      // too big to buffer; stream it
+      success = _openslide_hash_file_part(batch->hash,
+                                          batch->filenames->pdata[part->file],
+                                          part->offset, part->size, err);
+      first++;
+      continue;
+    }
+
+    // take parts in queued order up to the memory budget
+    guint last = first;
+    int64_t bytes = 0;
+    while (last < parts->len) {
+      part = &g_array_index(parts, struct hash_part, last);
+      if (part->size > HASH_BATCH_BYTES - bytes) {
+        break;
+      }
+      bytes += part->size;
+      last++;
+    }
+    success = hash_window(batch, first, last, err);
+    first = last;
+  }
+
+  g_array_set_size(parts, 0);
+  return success;
+}
+
+void _openslide_hash_batch_destroy(struct _openslide_hash_batch *batch) {
+  for (guint i = 0; i < batch->filenames->len; i++) {
+    g_free(batch->filenames->pdata[i]);
+  }
+  g_ptr_array_free(batch->filenames, true);
+  g_array_free(batch->parts, true);
+  g_slice_free(struct _openslide_hash_batch, batch);
+}
+
 // Invalidate this hash.  Use if this slide is unhashable for some reason.
 void _openslide_hash_disable(struct _openslide_hash *hash) {
   if (hash) {
@@ -47,6 +47,17 @@ bool _openslide_hash_file_part(struct _openslide_hash *hash,
 			       int64_t offset, int64_t size,
 			       GError **err);
 
+// batched hashing of file parts: parts are read in file order with
+// neighbouring ranges coalesced, but hashed in the order they were added
+struct _openslide_hash_batch;
+struct _openslide_hash_batch *_openslide_hash_batch_create(struct _openslide_hash *hash);
+void _openslide_hash_batch_add(struct _openslide_hash_batch *batch,
+                               const char *filename,
+                               int64_t offset, int64_t size);
+bool _openslide_hash_batch_run(struct _openslide_hash_batch *batch,
+                               GError **err);
+void _openslide_hash_batch_destroy(struct _openslide_hash_batch *batch);
+
 // lockout
 void _openslide_hash_disable(struct _openslide_hash *hash);
 
@@ -105,6 +105,7 @@ static boolean fill_input_buffer (j_decompress_ptr cinfo)
   size_t nbytes;
 
   nbytes = fread(src->buffer, 1, INPUT_BUF_SIZE, src->infile);
+  _openslide_counter_add(OPENSLIDE_COUNTER_IO_BYTES_READ, nbytes);
 
   if (nbytes <= 0) {
     if (src->start_of_file)	/* Treat empty input file as fatal error */
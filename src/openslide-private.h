@@ -58,6 +58,24 @@ struct _openslide {
   void *data;
   int32_t level_count;
 
+  // focal planes per level; more than 1 only with paint_region_planes()
+  int32_t focal_plane_count;
+
+  // OPENSLIDE_OPEN_* flags
+  uint32_t open_flags;
+
+  // for OPENSLIDE_OPEN_SHARED, the slide whose levels, vendor data and
+  // tables this one borrows
+  struct _openslide_shared_slide *shared;  // NULL if not a view
+
+  // files besides the opened one that the slide was read from, so
+  // OPENSLIDE_OPEN_SHARED can tell when any of them has changed
+  GPtrArray *source_files;  // of char *; created automatically
+
+  // for OPENSLIDE_OPEN_LAZY, the quickhash is computed on first request
+  char *lazy_filename;  // NULL if not deferred
+  GOnce quickhash1_once;
+
   // associated images
   GHashTable *associated_images;  // created automatically
   const char **associated_image_names; // filled in automatically from hashtable
@@ -67,7 +85,34 @@ struct _openslide {
   const char **property_names; // filled in automatically from hashtable
 
   // cache
-  struct _openslide_cache *cache;
+  struct _openslide_cache_binding *cache;
+
+  // compressed tile data, for reads that miss the decoded cache
+  struct _openslide_cache_binding *compressed_cache;
+
+  // per-tile structures built at open time, freed after ops->destroy
+  struct _openslide_arena *arena;
+
+  // bytes of grid tables allocated outside the arena; atomic ops only
+  int64_t grid_size;
+
+  // tile decode workers, NULL if disabled
+  GThreadPool *decode_pool;
+
+  // workers for openslide_read_region_async()
+  GThreadPool *async_pool;
+
+  // whether to read ahead; atomic ops only
+  gint readahead_enabled;
+  // workers for sequential readahead, created on first use
+  GThreadPool *readahead_pool;
+
+  // performance counters
+  struct _openslide_counters *counters;
+
+  // tracing, NULL if disabled
+  openslide_trace_callback_fn trace_callback;
+  void *trace_data;
 
   // error handling, NULL if no error
   gpointer error; // must use g_atomic_pointer!
@@ -83,19 +128,59 @@ struct _openslide_level {
   // all levels must set these, or none
   int64_t tile_w;
   int64_t tile_h;
+
+  // set if paint_region() paints nothing but one simple grid, so tiles
+  // can be copied straight into openslide_read_region()'s buffer
+  bool simple_grid;
 };
 
 /* the function pointer structure for backends */
+struct _openslide_cache_entry;
 struct _openslide_ops {
   bool (*paint_region)(openslide_t *osr, cairo_t *cr,
 		       int64_t x, int64_t y,
 		       struct _openslide_level *level,
 		       int32_t w, int32_t h,
 		       GError **err);
+  // optional.  *buf is g_malloc'd.  sets OPENSLIDE_ERROR_NO_VALUE if the
+  // tile isn't stored in a form that can be returned as is.
+  bool (*read_raw_tile)(openslide_t *osr,
+                        struct _openslide_level *level,
+                        int64_t tile_col, int64_t tile_row,
+                        void **buf, int32_t *len,
+                        const char **codec,
+                        GError **err);
+  // optional.  the decoded, clipped tile_w x tile_h tile, held by
+  // *cache_entry, which may be a constant entry.
+  bool (*acquire_tile)(openslide_t *osr,
+                       struct _openslide_level *level,
+                       int64_t tile_col, int64_t tile_row,
+                       uint32_t **tiledata,
+                       struct _openslide_cache_entry **cache_entry,
+                       GError **err);
+  // optional.  clear the entries of nonempty, the level's tiles in
+  // row-major order, for tiles the format knows to be empty.
+  bool (*clear_empty_tiles)(openslide_t *osr,
+                            struct _openslide_level *level,
+                            uint8_t *nonempty,
+                            int64_t tiles_across, int64_t tiles_down,
+                            GError **err);
+  // optional.  paint every focal plane, each onto its own context in
+  // crs, as paint_region() paints the default plane.
+  bool (*paint_region_planes)(openslide_t *osr, cairo_t **crs,
+                              int64_t x, int64_t y,
+                              struct _openslide_level *level,
+                              int32_t w, int32_t h,
+                              GError **err);
+  // optional.  the number of idle file handles kept open for reuse.
+  int32_t (*get_idle_handle_count)(openslide_t *osr);
+  // optional.  close the idle file handles; later reads reopen them.
+  void (*release_idle_handles)(openslide_t *osr);
   void (*destroy)(openslide_t *osr);
 };
 
 struct _openslide_tifflike;
+struct _openslide_detect_context;
 
 /* vendor detection and parsing */
 
@@ -117,9 +202,10 @@ struct _openslide_format {
   const char *name;
   const char *vendor;
   bool (*detect)(const char *filename, struct _openslide_tifflike *tl,
-                 GError **err);
+                 struct _openslide_detect_context *dc, GError **err);
   bool (*open)(openslide_t *osr, const char *filename,
                struct _openslide_tifflike *tl,
+               struct _openslide_detect_context *dc,
                struct _openslide_hash *quickhash1, GError **err);
 };
 
@@ -146,6 +232,46 @@ GKeyFile *_openslide_read_key_file(const char *filename, int32_t max_size,
 /* fopen() wrapper which properly sets FD_CLOEXEC */
 FILE *_openslide_fopen(const char *path, const char *mode, GError **err);
 
+/* Read from an absolute file offset, with pread() where available.
+   Returns the number of bytes read, like fread(). */
+size_t _openslide_fread_at(FILE *f, void *buf, size_t size, int64_t offset);
+
+/* Read several ranges of one file, through the application's vectored
+   read callback if it has one, and one range at a time if that fails.
+   Sets ok[i] if range i was read in full, and returns true if every
+   range was. */
+bool _openslide_fread_ranges(FILE *f, const openslide_io_range_t *ranges,
+                             int32_t count, bool *ok);
+
+/* g_file_test(G_FILE_TEST_EXISTS) wrapper which honors custom I/O */
+bool _openslide_fexists(const char *path);
+
+/* Budget for files kept open between reads.  Callers that get false
+   should open the file for each access instead. */
+bool _openslide_persistent_file_acquire(void);
+void _openslide_persistent_file_release(void);
+
+/* Bump allocator for small structures that live as long as the slide.
+   Memory is zero-filled and is only released when the arena is
+   destroyed, so individual allocations must not be freed. */
+struct _openslide_arena *_openslide_arena_create(void);
+void *_openslide_arena_alloc(struct _openslide_arena *arena, gsize size);
+int64_t _openslide_arena_get_size(struct _openslide_arena *arena);
+void _openslide_arena_destroy(struct _openslide_arena *arena);
+
+/* Objects that a format's detect function has already opened or parsed,
+   handed to its open function so the work isn't repeated.  A NULL
+   context is allowed: put destroys the value and steal returns NULL.
+   Stolen values belong to the caller. */
+struct _openslide_detect_context *_openslide_detect_context_create(void);
+void _openslide_detect_context_put(struct _openslide_detect_context *dc,
+                                   const char *key, void *value,
+                                   GDestroyNotify destroy);
+void *_openslide_detect_context_steal(struct _openslide_detect_context *dc,
+                                      const char *key);
+void _openslide_detect_context_clear(struct _openslide_detect_context *dc);
+void _openslide_detect_context_destroy(struct _openslide_detect_context *dc);
+
 /* Parse string to double, returning NAN on failure.  Accept both comma
    and period as decimal separator. */
 double _openslide_parse_double(const char *value);
@@ -163,12 +289,34 @@ void _openslide_duplicate_double_prop(openslide_t *osr, const char *src,
 void _openslide_set_background_color_prop(openslide_t *osr,
                                           uint8_t r, uint8_t g, uint8_t b);
 
+// record a file the slide was read from, besides the one that was opened
+void _openslide_add_source_file(openslide_t *osr, const char *filename);
+
 // clip right/bottom edges of tile
 bool _openslide_clip_tile(uint32_t *tiledata,
                           int64_t tile_w, int64_t tile_h,
                           int64_t clip_w, int64_t clip_h,
                           GError **err);
 
+// copy the w x h region at (x, y) of a src_w x src_h image whose rows are
+// stride pixels apart, clearing the part of dest outside the image
+void _openslide_crop_tile(uint32_t *dest, int64_t w, int64_t h,
+                          const uint32_t *src, int64_t stride,
+                          int64_t src_w, int64_t src_h,
+                          int64_t x, int64_t y);
+
+// paint a w x h tile of one premultiplied ARGB pixel at the origin of cr
+void _openslide_paint_constant(cairo_t *cr, uint32_t pixel,
+                               double w, double h);
+
+// paint the w x h region at (x, y) of an image at the origin of cr,
+// without copying the region out of the image
+void _openslide_paint_subimage(cairo_t *cr,
+                               uint32_t *data, cairo_format_t format,
+                               int64_t data_w, int64_t data_h,
+                               double x, double y,
+                               double w, double h);
+
 
 // Grid helpers
 struct _openslide_grid;
@@ -180,6 +328,14 @@ typedef bool (*_openslide_grid_simple_read_fn)(openslide_t *osr,
                                                void *arg,
                                                GError **err);
 
+// prepare a batch of the tiles to be read, as (col, row) pairs, e.g. by
+// decoding them together into the cache; errors are left to read_tile
+typedef void (*_openslide_grid_simple_batch_fn)(openslide_t *osr,
+                                                struct _openslide_level *level,
+                                                const int64_t *tiles,
+                                                int32_t count,
+                                                void *arg);
+
 typedef bool (*_openslide_grid_tilemap_read_fn)(openslide_t *osr,
                                                 cairo_t *cr,
                                                 struct _openslide_level *level,
@@ -203,6 +359,9 @@ struct _openslide_grid *_openslide_grid_create_simple(openslide_t *osr,
                                                       int32_t tile_h,
                                                       _openslide_grid_simple_read_fn read_tile);
 
+void _openslide_grid_simple_set_batch(struct _openslide_grid *grid,
+                                      _openslide_grid_simple_batch_fn batch);
+
 struct _openslide_grid *_openslide_grid_create_tilemap(openslide_t *osr,
                                                        double tile_advance_x,
                                                        double tile_advance_y,
@@ -216,8 +375,6 @@ void _openslide_grid_tilemap_add_tile(struct _openslide_grid *grid,
                                       void *data);
 
 struct _openslide_grid *_openslide_grid_create_range(openslide_t *osr,
-                                                     int typical_tile_width,
-                                                     int typical_tile_height,
                                                      _openslide_grid_range_read_fn read_tile,
                                                      GDestroyNotify destroy_tile);
 
@@ -232,6 +389,14 @@ void _openslide_grid_get_bounds(struct _openslide_grid *grid,
                                 double *x, double *y,
                                 double *w, double *h);
 
+// clear the entries of nonempty, a row-major tiles_across x tiles_down
+// grid of tile_w x tile_h cells, that no tile of the grid overlaps
+void _openslide_grid_clear_empty_tiles(struct _openslide_grid *grid,
+                                       uint8_t *nonempty,
+                                       int64_t tiles_across,
+                                       int64_t tiles_down,
+                                       double tile_w, double tile_h);
+
 bool _openslide_grid_paint_region(struct _openslide_grid *grid,
                                   cairo_t *cr,
                                   void *arg,
@@ -245,45 +410,347 @@ void _openslide_grid_draw_tile_info(cairo_t *cr, const char *fmt, ...) G_GNUC_PR
 void _openslide_grid_destroy(struct _openslide_grid *grid);
 
 
+/* Pixel format conversion, vectorized where possible */
+void _openslide_convert_abgr_to_argb(uint32_t *buf, int64_t count);
+
+void _openslide_convert_rgb_to_argb(uint32_t *dest, const uint8_t *src,
+                                    int64_t count);
+
+void _openslide_convert_rgb12_to_argb(uint32_t *dest, const uint16_t *src,
+                                      int64_t count);
+
+void _openslide_convert_planes_to_argb(uint32_t *dest,
+                                       const uint8_t *r,
+                                       const uint8_t *g,
+                                       const uint8_t *b,
+                                       int64_t count);
+
+void _openslide_convert_gray_to_argb(uint32_t *dest, const uint8_t *src,
+                                     int64_t count);
+
+void _openslide_convert_rgba_to_argb(uint32_t *dest, const uint8_t *src,
+                                     int64_t count);
+
+void _openslide_convert_ycbcr422_row_to_argb(uint32_t *dest,
+                                             const int32_t *y,
+                                             const int32_t *cb,
+                                             const int32_t *cr,
+                                             int32_t w);
+
+void _openslide_convert_argb_to_rgba(uint8_t *dest, const uint32_t *src,
+                                     int64_t count, bool bgr);
+
+void _openslide_convert_argb_to_rgb(uint8_t *dest, const uint32_t *src,
+                                    int64_t count);
+
 /* Bounds properties helper */
 void _openslide_set_bounds_props_from_grid(openslide_t *osr,
                                            struct _openslide_grid *grid);
 
 
+/* Performance counters, read through openslide_get_counter_value() */
+enum _openslide_counter {
+  // each cache's four counters are consecutive, in this order
+  OPENSLIDE_COUNTER_CACHE_HITS,
+  OPENSLIDE_COUNTER_CACHE_MISSES,
+  OPENSLIDE_COUNTER_CACHE_EVICTIONS,
+  OPENSLIDE_COUNTER_CACHE_BYTES,
+  OPENSLIDE_COUNTER_COMPRESSED_CACHE_HITS,
+  OPENSLIDE_COUNTER_COMPRESSED_CACHE_MISSES,
+  OPENSLIDE_COUNTER_COMPRESSED_CACHE_EVICTIONS,
+  OPENSLIDE_COUNTER_COMPRESSED_CACHE_BYTES,
+  OPENSLIDE_COUNTER_SHARED_CACHE_HITS,
+  OPENSLIDE_COUNTER_SHARED_CACHE_MISSES,
+  OPENSLIDE_COUNTER_DISK_CACHE_HITS,
+  OPENSLIDE_COUNTER_DISK_CACHE_MISSES,
+  OPENSLIDE_COUNTER_TIFF_TILES_DIRECT,
+  OPENSLIDE_COUNTER_TIFF_TILES_LIBTIFF,
+  OPENSLIDE_COUNTER_TIFF_HANDLE_OPENS,
+  OPENSLIDE_COUNTER_IO_BYTES_READ,
+  OPENSLIDE_COUNTER_BUFFERS_RECYCLED,
+  OPENSLIDE_COUNTER_TILES_SYNTHESIZED,
+  OPENSLIDE_COUNTER_TILES_BLANK,
+  // each codec's count is followed by its time in microseconds
+  OPENSLIDE_COUNTER_DECODE_JPEG,
+  OPENSLIDE_COUNTER_DECODE_JPEG_USEC,
+  OPENSLIDE_COUNTER_DECODE_JP2K,
+  OPENSLIDE_COUNTER_DECODE_JP2K_USEC,
+  OPENSLIDE_COUNTER_DECODE_PNG,
+  OPENSLIDE_COUNTER_DECODE_PNG_USEC,
+  OPENSLIDE_COUNTER_DECODE_GDKPIXBUF,
+  OPENSLIDE_COUNTER_DECODE_GDKPIXBUF_USEC,
+  OPENSLIDE_COUNTER_DECODE_LIBTIFF,
+  OPENSLIDE_COUNTER_DECODE_LIBTIFF_USEC,
+  OPENSLIDE_COUNTER_DECODE_EXTERNAL,
+  OPENSLIDE_COUNTER_DECODE_EXTERNAL_USEC,
+  OPENSLIDE_COUNTER_COUNT,
+};
+
+struct _openslide_counters *_openslide_counters_create(void);
+
+void _openslide_counters_destroy(struct _openslide_counters *counters);
+
+// adds to the global counters and to those of the current slide
+void _openslide_counter_add(enum _openslide_counter counter, int64_t n);
+
+// bracket one decode by a codec's DECODE counter; begin returns the
+// start time to pass to end
+int64_t _openslide_decode_begin(enum _openslide_counter counter);
+
+void _openslide_decode_end(enum _openslide_counter counter, int64_t start);
+
+// monotonic time in microseconds
+int64_t _openslide_get_clock(void);
+
+/* The slide and read the current thread is working for, and tracing */
+void _openslide_trace_init(void);
+
+// osr may be NULL; returns the previous slide for _openslide_slide_leave()
+openslide_t *_openslide_slide_enter(openslide_t *osr);
+
+void _openslide_slide_leave(openslide_t *prev);
+
+// NULL outside library calls
+openslide_t *_openslide_slide_current(void);
+
+// when the current thread's read should stop
+struct _openslide_interrupt {
+  int64_t deadline;  // _openslide_get_clock() time, or -1
+  volatile int32_t *cancel;  // nonzero to stop; may be NULL
+};
+
+// intr may be NULL; returns the previous interrupt for
+// _openslide_interrupt_leave()
+struct _openslide_interrupt *_openslide_interrupt_enter(struct _openslide_interrupt *intr);
+
+void _openslide_interrupt_leave(struct _openslide_interrupt *prev);
+
+struct _openslide_interrupt *_openslide_interrupt_current(void);
+
+// sets OPENSLIDE_ERROR_CANCELLED and returns true if the current read
+// should stop
+bool _openslide_check_interrupt(GError **err);
+
+// number of slides with a trace callback; atomic ops only
+extern gint _openslide_trace_count;
+
+// report an event to the current slide's trace callback, if any.  level
+// may be NULL, tile coordinates -1, and codec NULL.
+#define _openslide_trace(stage, begin, level, tile_col, tile_row, bytes, codec) \
+  do {									\
+    if (G_UNLIKELY(g_atomic_int_get(&_openslide_trace_count))) {	\
+      _openslide_trace_emit(stage, begin, level, tile_col, tile_row,	\
+                            bytes, codec);				\
+    }									\
+  } while (0)
+
+void _openslide_trace_emit(openslide_trace_stage_t stage, bool begin,
+                           struct _openslide_level *level,
+                           int64_t tile_col, int64_t tile_row,
+                           int64_t bytes, const char *codec);
+
 /* Cache */
 #define _OPENSLIDE_USEFUL_CACHE_SIZE 1024*1024*32
+#define _OPENSLIDE_USEFUL_COMPRESSED_CACHE_SIZE 1024*1024*32
 
 struct _openslide_cache_entry;
 
-// constructor/destructor
-struct _openslide_cache *_openslide_cache_create(int capacity_in_bytes);
+// constructor/refcounting; the caller owns the initial reference
+struct _openslide_cache *_openslide_cache_create(int64_t capacity_in_bytes);
+
+void _openslide_cache_ref(struct _openslide_cache *cache);
+
+void _openslide_cache_release(struct _openslide_cache *cache);
+
+// per-slide binding to a possibly shared cache; holds a cache reference
+// first_counter is the first of the binding's four cache counters
+struct _openslide_cache_binding *
+_openslide_cache_binding_create(struct _openslide_cache *cache,
+                                enum _openslide_counter first_counter);
+
+void _openslide_cache_binding_set(struct _openslide_cache_binding *cb,
+                                  struct _openslide_cache *cache);
+
+// a binding to the same cache whose entries are cb's, for another slide
+// with the same levels and vendor data.  Each binding unpins only the
+// entries it pinned.
+struct _openslide_cache_binding *
+_openslide_cache_binding_create_alias(struct _openslide_cache_binding *cb);
+
+// hits through a low-priority binding don't protect entries from eviction
+void _openslide_cache_binding_set_low_priority(struct _openslide_cache_binding *cb,
+                                               bool low_priority);
+
+// identify the slide's tiles to a cache shared between processes;
+// identity must be the same in every process that opens the slide
+void _openslide_cache_binding_set_identity(struct _openslide_cache_binding *cb,
+                                           const char *identity,
+                                           struct _openslide_level **levels,
+                                           int32_t level_count);
+
+void _openslide_cache_binding_destroy(struct _openslide_cache_binding *cb);
+
+// while a pin is in progress, entries put or hit through cb by any
+// thread, including decode and readahead workers, are pinned within a
+// share of the capacity until the binding is unpinned
+void _openslide_cache_pin_begin(struct _openslide_cache_binding *cb);
+
+void _openslide_cache_pin_end(struct _openslide_cache_binding *cb);
+
+void _openslide_cache_binding_unpin(struct _openslide_cache_binding *cb);
 
-void _openslide_cache_destroy(struct _openslide_cache *cache);
+int64_t _openslide_cache_get_pinned_size(struct _openslide_cache *cache);
+
+// the bytes of the binding's entries in the cache's local tier, and
+// removing them; both scan every shard, and include the entries of
+// aliases.  Removing keeps entries pinned by other aliases.
+int64_t _openslide_cache_binding_get_size(struct _openslide_cache_binding *cb);
+
+void _openslide_cache_binding_clear(struct _openslide_cache_binding *cb);
 
 // cache size
-int _openslide_cache_get_capacity(struct _openslide_cache *cache);
+int64_t _openslide_cache_get_capacity(struct _openslide_cache *cache);
 
 void _openslide_cache_set_capacity(struct _openslide_cache *cache,
-				   int capacity_in_bytes);
+				   int64_t capacity_in_bytes);
 
 // put and get
-void _openslide_cache_put(struct _openslide_cache *cache,
+void _openslide_cache_put(struct _openslide_cache_binding *cb,
 			  void *plane,  // coordinate plane (level or grid)
 			  int64_t x,
 			  int64_t y,
-			  void *data,
-			  int size_in_bytes,
+			  void *data,  // g_slice or _openslide_buffer_alloc()
+			  int64_t size_in_bytes,
 			  struct _openslide_cache_entry **entry);
 
-void *_openslide_cache_get(struct _openslide_cache *cache,
+// a tile with one repeated ARGB pixel, which takes no pixel storage
+void *_openslide_cache_put_constant(struct _openslide_cache_binding *cb,
+                                    void *plane,
+                                    int64_t x,
+                                    int64_t y,
+                                    uint32_t pixel,
+                                    struct _openslide_cache_entry **entry);
+
+void *_openslide_cache_get(struct _openslide_cache_binding *cb,
 			   void *plane,
 			   int64_t x,
 			   int64_t y,
 			   struct _openslide_cache_entry **entry);
 
+int64_t _openslide_cache_entry_get_size(struct _openslide_cache_entry *entry);
+
+// callers that put constant tiles must check their hits with this
+bool _openslide_cache_entry_get_constant(struct _openslide_cache_entry *entry,
+                                         uint32_t *pixel);
+
 // value unref
 void _openslide_cache_entry_unref(struct _openslide_cache_entry *entry);
 
+// g_slice-compatible allocation that recycles large buffers of sizes
+// seen before, such as decoded tiles
+void *_openslide_buffer_alloc(int64_t size);
+
+void _openslide_buffer_free(int64_t size, void *buf);
+
+/* Decoded tiles in a named shared-memory segment, as a second tier of
+   a cache shared between processes */
+struct _openslide_shm_key {
+  uint64_t slide[2];  // digest of the slide identity
+  int64_t level;
+  int64_t x;
+  int64_t y;
+};
+
+struct _openslide_shm_cache *_openslide_shm_cache_open(const char *name,
+                                                       int64_t capacity,
+                                                       int64_t entry_size,
+                                                       GError **err);
+
+void _openslide_shm_cache_destroy(struct _openslide_shm_cache *shm);
+
+// returns a copy from _openslide_buffer_alloc(), or NULL on a miss
+void *_openslide_shm_cache_get(struct _openslide_shm_cache *shm,
+                               const struct _openslide_shm_key *key,
+                               int64_t *size,
+                               bool *constant);
+
+// tiles larger than the segment's entry size are not stored
+void _openslide_shm_cache_put(struct _openslide_shm_cache *shm,
+                              const struct _openslide_shm_key *key,
+                              const void *data,
+                              int64_t size,
+                              bool constant);
+
+/* Decoded tiles in files in a local directory, as the lowest tier of
+   a cache, keyed like the shared-memory tier */
+struct _openslide_disk_cache *_openslide_disk_cache_open(const char *dirname,
+                                                         int64_t capacity,
+                                                         GError **err);
+
+void _openslide_disk_cache_destroy(struct _openslide_disk_cache *disk);
+
+// returns a copy from _openslide_buffer_alloc(), or NULL on a miss
+void *_openslide_disk_cache_get(struct _openslide_disk_cache *disk,
+                                const struct _openslide_shm_key *key,
+                                int64_t *size,
+                                bool *constant);
+
+// written in the background; dropped if too many writes are queued
+void _openslide_disk_cache_put(struct _openslide_disk_cache *disk,
+                               const struct _openslide_shm_key *key,
+                               const void *data,
+                               int64_t size,
+                               bool constant);
+
+/* Application decoders */
+bool _openslide_decoder_present(openslide_codec_t codec);
+
+// decode with the application's decoder, setting each job's success;
+// returns the number decoded
+int32_t _openslide_decode_external_batch(openslide_codec_t codec,
+                                         openslide_decode_job_t *jobs,
+                                         int32_t count);
+
+// true if the application's decoder decoded the stream into dest
+bool _openslide_decode_external(openslide_codec_t codec,
+                                const void *data, int64_t length,
+                                uint32_t *dest,
+                                int32_t w, int32_t h);
+
+
+/* Readahead into the compressed-data cache for sequential scans */
+struct _openslide_readahead {
+  // atomic ops only; zero-initialize
+  gint last;       // index of the latest read
+  gint run;        // forward reads in a row, ending at last
+  gint scheduled;  // end of the latest window
+};
+
+struct _openslide_readahead_item {
+  int64_t offset;
+  int32_t length;
+  // compressed-data cache coordinates
+  int64_t x;
+  int64_t y;
+};
+
+// record a read of item index of a sequence [0, limit) stored in file
+// order.  If readahead is enabled and the read continues a sequential
+// run, return true and the range of items to fetch ahead.
+bool _openslide_readahead_check(openslide_t *osr,
+                                struct _openslide_readahead *ra,
+                                int64_t index, int64_t limit,
+                                int64_t *start, int64_t *end);
+
+// read items from path into the compressed-data cache plane in the
+// background, coalescing nearby byte ranges.  Takes ownership of the
+// g_malloc'd items, which should be in the order they will be needed.
+void _openslide_readahead_submit(openslide_t *osr,
+                                 const char *path,
+                                 void *plane,
+                                 struct _openslide_readahead_item *items,
+                                 int32_t count);
+
 
 /* Internal error propagation */
 enum OpenSlideError {
@@ -293,6 +760,8 @@ enum OpenSlideError {
   OPENSLIDE_ERROR_CAIRO_ERROR,
   // no such value (e.g. for tifflike accessors)
   OPENSLIDE_ERROR_NO_VALUE,
+  // read stopped at its deadline or by its cancellation flag
+  OPENSLIDE_ERROR_CANCELLED,
 };
 #define OPENSLIDE_ERROR _openslide_error_quark()
 GQuark _openslide_error_quark(void);
@@ -313,6 +782,25 @@ void _openslide_debug_init(void);
 
 bool _openslide_debug(enum _openslide_debug_flag flag);
 
+/* Memory-mapped tile reads, enabled by OPENSLIDE_MMAP=1 */
+void _openslide_mmap_init(void);
+
+bool _openslide_mmap_enabled(void);
+
+/* On-disk cache of parsed slide indexes, enabled by OPENSLIDE_INDEX_CACHE=dir */
+void _openslide_index_cache_init(void);
+
+// returns NULL if the cache is disabled or a file can't be examined
+char *_openslide_index_cache_path(const char *format, const char *id,
+                                  const char * const *filenames);
+
+// returns NULL on a miss
+GMappedFile *_openslide_index_cache_load(const char *path);
+
+// failures are not reported
+void _openslide_index_cache_store(const char *path,
+                                  const void *data, gsize len);
+
 #define _openslide_performance_warn(...) \
       _openslide_performance_warn_once(NULL, __VA_ARGS__)
 
@@ -358,6 +846,7 @@ void openslide_cancel_prefetch_hint(openslide_t *osr, int prefetch_id);
 #define fopen _OPENSLIDE_POISON(_openslide_fopen)
 #define fseek _OPENSLIDE_POISON(fseeko)
 #define ftell _OPENSLIDE_POISON(ftello)
+#define g_file_test _OPENSLIDE_POISON(_openslide_fexists)
 #define strtod _OPENSLIDE_POISON(_openslide_parse_double)
 #define g_ascii_strtod _OPENSLIDE_POISON(_openslide_parse_double_)
 #define sqlite3_open _OPENSLIDE_POISON(_openslide_sqlite_open)
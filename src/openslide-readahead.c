@@ -0,0 +1,261 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2015 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+
+// forward reads in a row before we start reading ahead
+#define READAHEAD_RUN 3
+// concurrent decoding reorders nearby reads, so a read this far past
+// the previous one still continues the run
+#define READAHEAD_SLACK 4
+// limits on one window
+#define READAHEAD_ITEMS 32
+#define READAHEAD_BYTES (4 * 1024 * 1024)
+// holes smaller than this are read through rather than split the read
+#define READAHEAD_MAX_GAP (64 * 1024)
+
+#define READAHEAD_THREADS 2
+// beyond this, the consumer has caught up and readahead can't help
+#define READAHEAD_MAX_QUEUED 8
+
+// creation of readahead pools
+G_LOCK_DEFINE_STATIC(readahead_pool);
+
+struct readahead_job {
+  openslide_t *osr;
+  char *path;
+  void *plane;
+  struct _openslide_readahead_item *items;
+  int32_t count;
+};
+
+static int compare_items(const void *a, const void *b) {
+  const struct _openslide_readahead_item *ia = a;
+  const struct _openslide_readahead_item *ib = b;
+  if (ia->offset < ib->offset) {
+    return -1;
+  } else if (ia->offset > ib->offset) {
+    return 1;
+  }
+  return 0;
+}
+
+static void job_free(struct readahead_job *job) {
+  g_free(job->path);
+  g_free(job->items);
+  g_slice_free(struct readahead_job, job);
+}
+
+static void run_readahead_job(gpointer data,
+                              gpointer user_data G_GNUC_UNUSED) {
+  struct readahead_job *job = data;
+  openslide_t *osr = job->osr;
+  struct _openslide_readahead_item *items = job->items;
+
+  // drop items the consumer read while the job was queued
+  int32_t count = 0;
+  for (int32_t i = 0; i < job->count; i++) {
+    struct _openslide_cache_entry *entry;
+    if (_openslide_cache_get(osr->compressed_cache, job->plane,
+                             items[i].x, items[i].y, &entry)) {
+      _openslide_cache_entry_unref(entry);
+    } else {
+      items[count++] = items[i];
+    }
+  }
+  if (count == 0) {
+    job_free(job);
+    return;
+  }
+
+  // readahead is best-effort; the consumer reports any I/O errors
+  FILE *f = _openslide_fopen(job->path, "rb", NULL);
+  if (f == NULL) {
+    job_free(job);
+    return;
+  }
+
+  openslide_t *prev = _openslide_slide_enter(osr);
+  qsort(items, count, sizeof(*items), compare_items);
+
+  // coalesce neighbouring byte ranges into runs, then read all the
+  // runs together so custom I/O can fetch them in one request
+  openslide_io_range_t *runs = g_new(openslide_io_range_t, count);
+  int32_t *run_items = g_new(int32_t, count + 1);
+  int32_t run_count = 0;
+  int32_t first = 0;
+  while (first < count) {
+    int64_t start = items[first].offset;
+    int64_t end = start + items[first].length;
+    int32_t last = first + 1;
+    while (last < count && items[last].offset - end <= READAHEAD_MAX_GAP) {
+      end = MAX(end, items[last].offset + items[last].length);
+      last++;
+    }
+    runs[run_count].offset = start;
+    runs[run_count].length = end - start;
+    runs[run_count].buf = g_malloc(end - start);
+    run_items[run_count++] = first;
+    first = last;
+  }
+  run_items[run_count] = count;
+
+  // keep the runs that were read, even if others failed
+  bool *ok = g_new(bool, run_count);
+  _openslide_fread_ranges(f, runs, run_count, ok);
+  for (int32_t r = 0; r < run_count; r++) {
+    if (!ok[r]) {
+      continue;
+    }
+    const uint8_t *buf = runs[r].buf;
+    for (int32_t i = run_items[r]; i < run_items[r + 1]; i++) {
+      struct _openslide_readahead_item *item = &items[i];
+      // cache entries are slice-allocated
+      void *tile = g_slice_copy(item->length,
+                                buf + (item->offset - runs[r].offset));
+      struct _openslide_cache_entry *entry;
+      _openslide_cache_put(osr->compressed_cache, job->plane,
+                           item->x, item->y,
+                           tile, item->length,
+                           &entry);
+      _openslide_cache_entry_unref(entry);
+    }
+  }
+  for (int32_t r = 0; r < run_count; r++) {
+    g_free(runs[r].buf);
+  }
+  g_free(ok);
+  g_free(run_items);
+  g_free(runs);
+  _openslide_slide_leave(prev);
+
+  fclose(f);
+  job_free(job);
+}
+
+bool _openslide_readahead_check(openslide_t *osr,
+                                struct _openslide_readahead *ra,
+                                int64_t index, int64_t limit,
+                                int64_t *start, int64_t *end) {
+  if (!g_atomic_int_get(&osr->readahead_enabled) ||
+      index >= G_MAXINT - READAHEAD_ITEMS) {
+    return false;
+  }
+
+  // no locking; a lost update between concurrent readers only delays
+  // or repeats a window
+  gint last = g_atomic_int_get(&ra->last);
+  if (index == last) {
+    return false;
+  }
+  gint run = g_atomic_int_get(&ra->run);
+  if (index > last && index <= last + READAHEAD_SLACK) {
+    run++;
+  } else {
+    run = 1;
+  }
+  g_atomic_int_set(&ra->last, index);
+  g_atomic_int_set(&ra->run, run);
+  if (run < READAHEAD_RUN) {
+    return false;
+  }
+
+  // start where the previous window ended, unless that was elsewhere
+  gint scheduled = g_atomic_int_get(&ra->scheduled);
+  if (scheduled <= index || scheduled > index + READAHEAD_ITEMS) {
+    scheduled = index + 1;
+  }
+  // wait until the consumer is halfway through the previous window
+  if (scheduled - index > READAHEAD_ITEMS / 2) {
+    return false;
+  }
+  *start = scheduled;
+  *end = MIN(index + 1 + READAHEAD_ITEMS, limit);
+  if (*start >= *end) {
+    return false;
+  }
+  g_atomic_int_set(&ra->scheduled, *end);
+  return true;
+}
+
+// the pool is created by the first reader to submit a window, since
+// readers may be running on several threads
+static GThreadPool *get_pool(openslide_t *osr) {
+  GThreadPool *pool = g_atomic_pointer_get(&osr->readahead_pool);
+  if (pool == NULL) {
+    G_LOCK(readahead_pool);
+    pool = osr->readahead_pool;
+    if (pool == NULL) {
+      pool = g_thread_pool_new(run_readahead_job, NULL,
+                               READAHEAD_THREADS, false, NULL);
+      g_atomic_pointer_set(&osr->readahead_pool, pool);
+    }
+    G_UNLOCK(readahead_pool);
+  }
+  return pool;
+}
+
+void _openslide_readahead_submit(openslide_t *osr,
+                                 const char *path,
+                                 void *plane,
+                                 struct _openslide_readahead_item *items,
+                                 int32_t count) {
+  // keep the nearest items within the byte budget
+  int64_t total = 0;
+  int32_t kept = 0;
+  while (kept < count && total + items[kept].length <= READAHEAD_BYTES) {
+    total += items[kept++].length;
+  }
+
+  GThreadPool *pool = kept ? get_pool(osr) : NULL;
+  if (pool == NULL ||
+      g_thread_pool_unprocessed(pool) >= READAHEAD_MAX_QUEUED) {
+    g_free(items);
+    return;
+  }
+
+  struct readahead_job *job = g_slice_new0(struct readahead_job);
+  job->osr = osr;
+  job->path = g_strdup(path);
+  job->plane = plane;
+  job->items = items;
+  job->count = kept;
+  g_thread_pool_push(pool, job, NULL);
+}
+
+void openslide_set_readahead(openslide_t *osr, bool enabled) {
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  g_atomic_int_set(&osr->readahead_enabled, enabled);
+  if (!enabled && osr->readahead_pool) {
+    // finish queued jobs, which own their items
+    g_thread_pool_free(osr->readahead_pool, false, true);
+    osr->readahead_pool = NULL;
+  }
+}
@@ -0,0 +1,281 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2015 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Reads at arbitrary downsamples
+ *
+ * The region is read from the nearest level with a smaller downsample
+ * and reduced with an area (box) filter: each output pixel is the mean
+ * of the source pixels it covers, weighted by how much of each it
+ * covers.  Averaging premultiplied pixels keeps them premultiplied.
+ * The filter is separable, so each chunk of source rows is first
+ * reduced horizontally into float rows, then those are accumulated
+ * vertically.
+ *
+ * The output is produced in blocks, each covering at most
+ * RESAMPLE_CHUNK_PIXELS source pixels on a side.  At very large
+ * reductions a block is a single output pixel, and its source is read
+ * in several chunks whose contributions are summed, so the source
+ * buffer never exceeds a chunk.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+#include "openslide-error.h"
+
+#include <math.h>
+#include <string.h>
+#include <glib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+
+// level pixels on a side of each source chunk
+#define RESAMPLE_CHUNK_PIXELS 2048
+
+// the source pixels covering one output pixel
+struct span {
+  int64_t start;
+  int32_t count;
+  int32_t weights;  // index of the first weight
+};
+
+struct filter {
+  struct span *spans;
+  float *weights;
+  int64_t src_len;  // source pixels covered by all spans
+};
+
+// output pixel i covers source [offset + i * scale, offset + (i + 1) * scale),
+// of which only the part within [lo_clip, hi_clip) is counted
+static void filter_init(struct filter *filter, int64_t len,
+                        double offset, double scale,
+                        double lo_clip, double hi_clip) {
+  filter->spans = g_new(struct span, len);
+  filter->weights = g_new(float, len * ((int64_t) ceil(scale) + 2));
+  filter->src_len = 0;
+  int32_t n = 0;
+  for (int64_t i = 0; i < len; i++) {
+    double lo = MAX(offset + i * scale, lo_clip);
+    double hi = MIN(offset + (i + 1) * scale, hi_clip);
+    struct span *span = &filter->spans[i];
+    span->start = lo < hi ? floor(lo) : 0;
+    span->count = 0;
+    span->weights = n;
+    for (int64_t k = span->start; k < hi; k++) {
+      double cover = MIN(hi, k + 1) - MAX(lo, k);
+      if (cover > 0) {
+        filter->weights[n + span->count++] = cover / scale;
+      }
+    }
+    n += span->count;
+    filter->src_len = MAX(filter->src_len, span->start + span->count);
+  }
+}
+
+static void filter_destroy(struct filter *filter) {
+  g_free(filter->spans);
+  g_free(filter->weights);
+}
+
+// reduce a row of ARGB pixels to w float pixels, in memory byte order
+static void resample_row(float *dest, const uint32_t *src,
+                         const struct filter *filter, int64_t w) {
+  for (int64_t i = 0; i < w; i++) {
+    const struct span *span = &filter->spans[i];
+    const uint32_t *p = src + span->start;
+    const float *weight = filter->weights + span->weights;
+#if defined(USE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128 acc = _mm_setzero_ps();
+    for (int32_t k = 0; k < span->count; k++) {
+      __m128i px = _mm_cvtsi32_si128(p[k]);
+      px = _mm_unpacklo_epi16(_mm_unpacklo_epi8(px, zero), zero);
+      acc = _mm_add_ps(acc, _mm_mul_ps(_mm_cvtepi32_ps(px),
+                                       _mm_set1_ps(weight[k])));
+    }
+    _mm_storeu_ps(dest + i * 4, acc);
+#else
+    float acc[4] = {0, 0, 0, 0};
+    for (int32_t k = 0; k < span->count; k++) {
+      uint32_t px = GUINT32_TO_LE(p[k]);
+      for (int c = 0; c < 4; c++) {
+        acc[c] += ((px >> (8 * c)) & 0xff) * weight[k];
+      }
+    }
+    memcpy(dest + i * 4, acc, sizeof(acc));
+#endif
+  }
+}
+
+// add count weighted float rows into one accumulated row
+static void accumulate_rows(float *dest, const float *src, int64_t w,
+                            const float *weights, int32_t count) {
+  for (int64_t i = 0; i < w; i++) {
+#if defined(USE_SSE2)
+    __m128 acc = _mm_loadu_ps(dest + i * 4);
+    for (int32_t k = 0; k < count; k++) {
+      acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(src + (k * w + i) * 4),
+                                       _mm_set1_ps(weights[k])));
+    }
+    _mm_storeu_ps(dest + i * 4, acc);
+#else
+    for (int c = 0; c < 4; c++) {
+      float acc = dest[i * 4 + c];
+      for (int32_t k = 0; k < count; k++) {
+        acc += src[(k * w + i) * 4 + c] * weights[k];
+      }
+      dest[i * 4 + c] = acc;
+    }
+#endif
+  }
+}
+
+// round an accumulated row to ARGB
+static void finish_row(uint32_t *dest, const float *src, int64_t w) {
+  for (int64_t i = 0; i < w; i++) {
+#if defined(USE_SSE2)
+    __m128i px = _mm_cvtps_epi32(_mm_loadu_ps(src + i * 4));
+    px = _mm_packs_epi32(px, px);
+    dest[i] = _mm_cvtsi128_si32(_mm_packus_epi16(px, px));
+#else
+    uint32_t px = 0;
+    for (int c = 0; c < 4; c++) {
+      px |= (uint32_t) CLAMP(lrintf(src[i * 4 + c]), 0, 255) << (8 * c);
+    }
+    dest[i] = GUINT32_FROM_LE(px);
+#endif
+  }
+}
+
+// output pixels per block along an axis, so that a block's source fits
+// in one chunk unless a single output pixel needs more
+static int64_t block_len(int64_t len, double scale) {
+  int64_t n = RESAMPLE_CHUNK_PIXELS / scale;
+  return MAX(MIN(MIN(n, RESAMPLE_CHUNK_PIXELS), len), 1);
+}
+
+void openslide_read_region_scaled(openslide_t *osr,
+                                  uint32_t *dest,
+                                  int64_t x, int64_t y,
+                                  double downsample,
+                                  int64_t w, int64_t h) {
+  if (w < 0 || h < 0 || !(downsample > 0)) {
+    GError *tmp_err = g_error_new(OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                                  "Invalid downsample (%g) or "
+                                  "negative dimensions not allowed",
+                                  downsample);
+    _openslide_propagate_error(osr, tmp_err);
+    return;
+  }
+
+  // clear the dest
+  if (dest) {
+    memset(dest, 0, w * h * 4);
+  }
+
+  // now that it's cleared, return if an error occurred
+  if (openslide_get_error(osr) || w == 0 || h == 0) {
+    return;
+  }
+
+  // read from the level that needs the least reduction
+  int32_t level = openslide_get_best_level_for_downsample(osr, downsample);
+  double level_ds = openslide_get_level_downsample(osr, level);
+  double scale = downsample / level_ds;
+  if (fabs(scale - 1) < 1e-9) {
+    openslide_read_region(osr, dest, x, y, level, w, h);
+    return;
+  }
+
+  int64_t block_w = block_len(w, scale);
+  int64_t block_h = block_len(h, scale);
+  const int64_t chunk = RESAMPLE_CHUNK_PIXELS;
+  uint32_t *src = g_new(uint32_t, (chunk + 2) * (chunk + 2));
+  float *hbuf = g_new(float, block_w * 4 * (chunk + 2));
+  float *acc = g_new(float, block_w * 4 * block_h);
+
+  for (int64_t j0 = 0; j0 < h; j0 += block_h) {
+    int64_t bh = MIN(block_h, h - j0);
+    double top = y + j0 * downsample;  // level 0 plane
+    for (int64_t i0 = 0; i0 < w; i0 += block_w) {
+      int64_t bw = MIN(block_w, w - i0);
+      double left = x + i0 * downsample;  // level 0 plane
+      memset(acc, 0, bw * bh * 4 * sizeof(float));
+
+      // each chunk starts on a whole level 0 pixel at or before its
+      // part of the block, and counts only that part
+      for (double cy = 0; cy < bh * scale; cy += chunk) {
+        int64_t chunk_y = floor(top + cy * level_ds);
+        double oy = (top - chunk_y) / level_ds;
+        struct filter rows;
+        filter_init(&rows, bh, oy, scale, oy + cy, oy + cy + chunk);
+        for (double cx = 0; cx < bw * scale; cx += chunk) {
+          int64_t chunk_x = floor(left + cx * level_ds);
+          double ox = (left - chunk_x) / level_ds;
+          struct filter cols;
+          filter_init(&cols, bw, ox, scale, ox + cx, ox + cx + chunk);
+          g_assert(cols.src_len <= chunk + 2 && rows.src_len <= chunk + 2);
+
+          openslide_read_region(osr, dest ? src : NULL, chunk_x, chunk_y,
+                                level, cols.src_len, rows.src_len);
+          if (dest && !openslide_get_error(osr)) {
+            for (int64_t r = 0; r < rows.src_len; r++) {
+              resample_row(hbuf + r * bw * 4, src + r * cols.src_len,
+                           &cols, bw);
+            }
+            for (int64_t j = 0; j < bh; j++) {
+              const struct span *span = &rows.spans[j];
+              accumulate_rows(acc + j * bw * 4,
+                              hbuf + span->start * bw * 4, bw,
+                              rows.weights + span->weights, span->count);
+            }
+          }
+          filter_destroy(&cols);
+          if (openslide_get_error(osr)) {
+            break;
+          }
+        }
+        filter_destroy(&rows);
+        if (openslide_get_error(osr)) {
+          goto DONE;
+        }
+      }
+
+      if (dest) {
+        for (int64_t j = 0; j < bh; j++) {
+          finish_row(dest + (j0 + j) * w + i0, acc + j * bw * 4, bw);
+        }
+      }
+    }
+  }
+
+DONE:
+  if (dest && openslide_get_error(osr)) {
+    memset(dest, 0, w * h * 4);
+  }
+  g_free(acc);
+  g_free(hbuf);
+  g_free(src);
+}
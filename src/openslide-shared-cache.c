@@ -0,0 +1,321 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2015 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Decoded tiles shared between processes
+ *
+ * The segment is a header followed by fixed-size buckets, each holding
+ * a few fixed-size slots.  A tile hashes to one bucket and may occupy
+ * any of its slots.  Writers take the bucket's spinlock; readers take
+ * no lock, but check the slot's sequence number, which is odd while
+ * the slot is being written, before and after copying the tile out.
+ * A process that dies holding a bucket lock leaves that bucket
+ * unwritable, and lock attempts are bounded, so this degrades to
+ * misses rather than hanging the other processes.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+#ifdef HAVE_SHM_OPEN
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define SHM_MAGIC G_GUINT64_CONSTANT(0x4f53534843303031)  // "OSSHC001"
+#define SHM_ALIGN 64
+// slots per bucket
+#define SHM_WAYS 4
+// bounded so a dead process can't block the others
+#define SHM_LOCK_SPINS 1000
+#define SHM_ATTACH_WAIT_USEC 1000
+#define SHM_ATTACH_TRIES 1000
+
+#define SLOT_USED 1
+#define SLOT_CONSTANT 2
+
+#define ALIGN(n) (((n) + SHM_ALIGN - 1) / SHM_ALIGN * SHM_ALIGN)
+
+struct shm_header {
+  uint64_t magic;  // written last by the creator
+  uint64_t bucket_count;
+  uint64_t slot_size;  // including struct shm_slot
+  uint64_t len;
+};
+
+struct shm_bucket {
+  uint32_t lock;
+  uint32_t clock;  // approximate last-use ticks of the slots
+};
+
+struct shm_slot {
+  uint32_t seq;  // odd while being written
+  uint32_t flags;
+  uint32_t tick;
+  uint32_t pad;
+  int64_t size;
+  struct _openslide_shm_key key;
+  // followed by the tile
+};
+
+struct _openslide_shm_cache {
+  uint8_t *base;
+  uint64_t len;
+  uint64_t bucket_count;
+  uint64_t slot_size;
+  uint64_t bucket_size;
+};
+
+static uint64_t key_hash(const struct _openslide_shm_key *key) {
+  uint64_t h = key->slide[0] ^ (key->slide[1] * 31);
+  h ^= (uint64_t) key->level * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+  h ^= (uint64_t) key->x * G_GUINT64_CONSTANT(0xc2b2ae3d27d4eb4f);
+  h ^= (uint64_t) key->y * G_GUINT64_CONSTANT(0x165667b19e3779f9);
+  h ^= h >> 33;
+  h *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  return h;
+}
+
+static struct shm_bucket *get_bucket(struct _openslide_shm_cache *shm,
+                                     const struct _openslide_shm_key *key) {
+  uint64_t i = key_hash(key) % shm->bucket_count;
+  return (struct shm_bucket *) (shm->base + ALIGN(sizeof(struct shm_header)) +
+                                i * shm->bucket_size);
+}
+
+static struct shm_slot *get_slot(struct _openslide_shm_cache *shm,
+                                 struct shm_bucket *bucket, int way) {
+  return (struct shm_slot *) ((uint8_t *) bucket +
+                              ALIGN(sizeof(struct shm_bucket)) +
+                              way * shm->slot_size);
+}
+
+static uint8_t *slot_data(struct shm_slot *slot) {
+  return (uint8_t *) slot + sizeof(struct shm_slot);
+}
+
+static bool bucket_lock(struct shm_bucket *bucket) {
+  for (int i = 0; i < SHM_LOCK_SPINS; i++) {
+    if (!__sync_lock_test_and_set(&bucket->lock, 1)) {
+      return true;
+    }
+    g_thread_yield();
+  }
+  return false;
+}
+
+static void bucket_unlock(struct shm_bucket *bucket) {
+  __sync_lock_release(&bucket->lock);
+}
+
+struct _openslide_shm_cache *_openslide_shm_cache_open(const char *name,
+                                                       int64_t capacity,
+                                                       int64_t entry_size,
+                                                       GError **err) {
+#ifdef HAVE_SHM_OPEN
+  if (capacity <= 0 || entry_size <= 0) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Invalid shared cache geometry");
+    return NULL;
+  }
+  uint64_t slot_size = ALIGN(sizeof(struct shm_slot) + entry_size);
+  uint64_t bucket_size = ALIGN(sizeof(struct shm_bucket)) +
+                         SHM_WAYS * slot_size;
+  uint64_t bucket_count = MAX(capacity / bucket_size, 1);
+  uint64_t len = ALIGN(sizeof(struct shm_header)) +
+                 bucket_count * bucket_size;
+
+  // the creator sizes and initializes the segment; everyone else waits
+  // for its header and checks that they agree on the geometry
+  bool creator = true;
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1 && errno == EEXIST) {
+    creator = false;
+    fd = shm_open(name, O_RDWR, 0600);
+  }
+  if (fd == -1) {
+    _openslide_io_error(err, "Couldn't open shared memory %s", name);
+    return NULL;
+  }
+  if (creator && ftruncate(fd, len)) {
+    _openslide_io_error(err, "Couldn't size shared memory %s", name);
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  if (!creator) {
+    struct stat st;
+    for (int i = 0; i < SHM_ATTACH_TRIES; i++) {
+      if (fstat(fd, &st)) {
+        _openslide_io_error(err, "Couldn't examine shared memory %s", name);
+        close(fd);
+        return NULL;
+      }
+      if ((uint64_t) st.st_size >= len) {
+        break;
+      }
+      g_usleep(SHM_ATTACH_WAIT_USEC);
+    }
+    if ((uint64_t) st.st_size != len) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Shared memory %s has a different size", name);
+      close(fd);
+      return NULL;
+    }
+  }
+
+  void *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    _openslide_io_error(err, "Couldn't map shared memory %s", name);
+    if (creator) {
+      shm_unlink(name);
+    }
+    return NULL;
+  }
+
+  struct shm_header *hdr = base;
+  if (creator) {
+    // the new segment is zero-filled, so every slot is empty
+    hdr->bucket_count = bucket_count;
+    hdr->slot_size = slot_size;
+    hdr->len = len;
+    __sync_synchronize();
+    hdr->magic = SHM_MAGIC;
+  } else {
+    for (int i = 0; i < SHM_ATTACH_TRIES; i++) {
+      if (__sync_fetch_and_add(&hdr->magic, 0) == SHM_MAGIC) {
+        break;
+      }
+      g_usleep(SHM_ATTACH_WAIT_USEC);
+    }
+    if (hdr->magic != SHM_MAGIC || hdr->bucket_count != bucket_count ||
+        hdr->slot_size != slot_size || hdr->len != len) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Shared memory %s has a different geometry", name);
+      munmap(base, len);
+      return NULL;
+    }
+  }
+
+  struct _openslide_shm_cache *shm = g_slice_new0(struct _openslide_shm_cache);
+  shm->base = base;
+  shm->len = len;
+  shm->bucket_count = bucket_count;
+  shm->slot_size = slot_size;
+  shm->bucket_size = bucket_size;
+  return shm;
+#else
+  g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+              "Shared memory %s not supported on this platform", name);
+  (void) capacity;
+  (void) entry_size;
+  return NULL;
+#endif
+}
+
+void _openslide_shm_cache_destroy(struct _openslide_shm_cache *shm) {
+#ifdef HAVE_SHM_OPEN
+  munmap(shm->base, shm->len);
+#endif
+  g_slice_free(struct _openslide_shm_cache, shm);
+}
+
+void *_openslide_shm_cache_get(struct _openslide_shm_cache *shm,
+                               const struct _openslide_shm_key *key,
+                               int64_t *size,
+                               bool *constant) {
+  struct shm_bucket *bucket = get_bucket(shm, key);
+  for (int way = 0; way < SHM_WAYS; way++) {
+    struct shm_slot *slot = get_slot(shm, bucket, way);
+    uint32_t seq = __sync_fetch_and_add(&slot->seq, 0);
+    if ((seq & 1) || !(slot->flags & SLOT_USED) ||
+        memcmp(&slot->key, key, sizeof(*key))) {
+      continue;
+    }
+    int64_t len = slot->size;
+    if (len <= 0 || (uint64_t) len > shm->slot_size - sizeof(*slot)) {
+      continue;  // torn read
+    }
+    bool is_constant = slot->flags & SLOT_CONSTANT;
+    void *buf = _openslide_buffer_alloc(len);
+    memcpy(buf, slot_data(slot), len);
+    __sync_synchronize();
+    if (slot->seq != seq) {
+      // rewritten while we copied it
+      _openslide_buffer_free(len, buf);
+      return NULL;
+    }
+    slot->tick = __sync_add_and_fetch(&bucket->clock, 1);
+    *size = len;
+    *constant = is_constant;
+    return buf;
+  }
+  return NULL;
+}
+
+void _openslide_shm_cache_put(struct _openslide_shm_cache *shm,
+                              const struct _openslide_shm_key *key,
+                              const void *data,
+                              int64_t size,
+                              bool constant) {
+  if (size <= 0 || (uint64_t) size > shm->slot_size - sizeof(struct shm_slot)) {
+    return;
+  }
+  struct shm_bucket *bucket = get_bucket(shm, key);
+  if (!bucket_lock(bucket)) {
+    return;
+  }
+
+  // replace the same tile, an empty slot, or the least recently used
+  struct shm_slot *victim = NULL;
+  for (int way = 0; way < SHM_WAYS; way++) {
+    struct shm_slot *slot = get_slot(shm, bucket, way);
+    if (!(slot->flags & SLOT_USED) ||
+        !memcmp(&slot->key, key, sizeof(*key))) {
+      victim = slot;
+      break;
+    }
+    if (victim == NULL ||
+        (int32_t) (slot->tick - victim->tick) < 0) {
+      victim = slot;
+    }
+  }
+
+  __sync_add_and_fetch(&victim->seq, 1);
+  victim->flags = SLOT_USED | (constant ? SLOT_CONSTANT : 0);
+  victim->size = size;
+  victim->key = *key;
+  memcpy(slot_data(victim), data, size);
+  victim->tick = __sync_add_and_fetch(&bucket->clock, 1);
+  __sync_add_and_fetch(&victim->seq, 1);
+
+  bucket_unlock(bucket);
+}
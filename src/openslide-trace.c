@@ -0,0 +1,130 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2015 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <glib.h>
+
+gint _openslide_trace_count;
+
+// the slide whose work the current thread is doing, or NULL
+static GPrivate *current_slide;
+// the deadline and cancellation flag of the current thread's read, or NULL
+static GPrivate *current_interrupt;
+
+void _openslide_trace_init(void) {
+  current_slide = g_private_new(NULL);
+  current_interrupt = g_private_new(NULL);
+}
+
+openslide_t *_openslide_slide_enter(openslide_t *osr) {
+  openslide_t *prev = g_private_get(current_slide);
+  g_private_set(current_slide, osr);
+  return prev;
+}
+
+void _openslide_slide_leave(openslide_t *prev) {
+  g_private_set(current_slide, prev);
+}
+
+openslide_t *_openslide_slide_current(void) {
+  return g_private_get(current_slide);
+}
+
+struct _openslide_interrupt *_openslide_interrupt_enter(struct _openslide_interrupt *intr) {
+  struct _openslide_interrupt *prev = g_private_get(current_interrupt);
+  g_private_set(current_interrupt, intr);
+  return prev;
+}
+
+void _openslide_interrupt_leave(struct _openslide_interrupt *prev) {
+  g_private_set(current_interrupt, prev);
+}
+
+struct _openslide_interrupt *_openslide_interrupt_current(void) {
+  return g_private_get(current_interrupt);
+}
+
+bool _openslide_check_interrupt(GError **err) {
+  struct _openslide_interrupt *intr = g_private_get(current_interrupt);
+  if (G_LIKELY(intr == NULL)) {
+    return false;
+  }
+  if (intr->cancel && g_atomic_int_get(intr->cancel)) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_CANCELLED,
+                "Read cancelled");
+    return true;
+  }
+  if (intr->deadline >= 0 && _openslide_get_clock() >= intr->deadline) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_CANCELLED,
+                "Read deadline passed");
+    return true;
+  }
+  return false;
+}
+
+void _openslide_trace_emit(openslide_trace_stage_t stage, bool begin,
+                           struct _openslide_level *level,
+                           int64_t tile_col, int64_t tile_row,
+                           int64_t bytes, const char *codec) {
+  openslide_t *osr = _openslide_slide_current();
+  if (osr == NULL || osr->trace_callback == NULL) {
+    return;
+  }
+
+  int32_t level_num = -1;
+  for (int32_t i = 0; level && i < osr->level_count; i++) {
+    if (osr->levels[i] == level) {
+      level_num = i;
+      break;
+    }
+  }
+
+  openslide_trace_event_t event = {
+    .osr = osr,
+    .stage = stage,
+    .begin = begin,
+    .level = level_num,
+    .tile_col = tile_col,
+    .tile_row = tile_row,
+    .bytes = bytes,
+    .codec = codec,
+  };
+  osr->trace_callback(&event, osr->trace_data);
+}
+
+void openslide_set_trace_callback(openslide_t *osr,
+                                  openslide_trace_callback_fn callback,
+                                  void *data) {
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  if (callback && !osr->trace_callback) {
+    g_atomic_int_inc(&_openslide_trace_count);
+  } else if (!callback && osr->trace_callback) {
+    g_atomic_int_add(&_openslide_trace_count, -1);
+  }
+  osr->trace_callback = callback;
+  osr->trace_data = data;
+}
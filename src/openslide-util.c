@@ -30,16 +30,28 @@
 #include <math.h>
 #include <errno.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <cairo.h>
 
-#ifdef HAVE_FCNTL
+#if defined(HAVE_FCNTL) || defined(HAVE_PREAD)
 #include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL
 #include <fcntl.h>
 #endif
 
 #define KEY_FILE_HARD_MAX_SIZE (100 << 20)
+#define DEFAULT_PERSISTENT_FILE_LIMIT 256
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+#define HAVE_CUSTOM_IO
+// stdio buffer for custom streams; each refill is one callback read
+#define CUSTOM_IO_BUFFER_SIZE (64 * 1024)
+#endif
 
 static const char DEBUG_ENV_VAR[] = "OPENSLIDE_DEBUG";
+static const char MMAP_ENV_VAR[] = "OPENSLIDE_MMAP";
+static const char INDEX_CACHE_ENV_VAR[] = "OPENSLIDE_INDEX_CACHE";
 
 static const struct debug_option {
   const char *kw;
@@ -57,6 +69,29 @@ static const struct debug_option {
 
 static uint32_t debug_flags;
 
+static bool mmap_enabled;
+
+static char *index_cache_dir;
+
+// persistent file descriptors held across all slides; atomic ops only
+static gint persistent_file_limit = DEFAULT_PERSISTENT_FILE_LIMIT;
+static gint persistent_file_count;
+
+// application I/O callbacks; open is NULL for the local filesystem
+static openslide_io_t custom_io;
+static void *custom_io_data;
+// open custom streams, FILE * -> struct custom_file *
+static GHashTable *custom_files;
+G_LOCK_DEFINE_STATIC(custom_io);
+
+struct custom_file {
+  openslide_io_t io;
+  void *data;
+  void *handle;
+  FILE *stream;
+  int64_t pos;
+};
+
 
 guint _openslide_int64_hash(gconstpointer v) {
   int64_t i = *((const int64_t *) v);
@@ -194,8 +229,158 @@ static FILE *do_fopen(const char *path, const char *mode, GError **err) {
 }
 #define fopen _OPENSLIDE_POISON(_openslide_fopen)
 
+static bool custom_io_active(void) {
+  G_LOCK(custom_io);
+  bool active = custom_io.open != NULL;
+  G_UNLOCK(custom_io);
+  return active;
+}
+
+#ifdef HAVE_CUSTOM_IO
+static int64_t custom_seek(struct custom_file *cf, int64_t offset,
+                           int whence) {
+  switch (whence) {
+  case SEEK_SET:
+    break;
+  case SEEK_CUR:
+    offset += cf->pos;
+    break;
+  case SEEK_END: {
+    int64_t size = cf->io.size(cf->handle, cf->data);
+    if (size < 0) {
+      return -1;
+    }
+    offset += size;
+    break;
+  }
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  cf->pos = offset;
+  return offset;
+}
+
+static int64_t custom_read(struct custom_file *cf, char *buf, size_t size) {
+  int64_t count = cf->io.pread(cf->handle, buf, size, cf->pos, cf->data);
+  if (count > 0) {
+    cf->pos += count;
+  }
+  return count;
+}
+
+static int custom_close(void *cookie) {
+  struct custom_file *cf = cookie;
+  G_LOCK(custom_io);
+  g_hash_table_remove(custom_files, cf->stream);
+  G_UNLOCK(custom_io);
+  cf->io.close(cf->handle, cf->data);
+  g_slice_free(struct custom_file, cf);
+  return 0;
+}
+
+#ifdef HAVE_FOPENCOOKIE
+static ssize_t cookie_read(void *cookie, char *buf, size_t size) {
+  return custom_read(cookie, buf, size);
+}
+
+static int cookie_seek(void *cookie, off64_t *offset, int whence) {
+  int64_t pos = custom_seek(cookie, *offset, whence);
+  if (pos < 0) {
+    return -1;
+  }
+  *offset = pos;
+  return 0;
+}
+#else
+static int funopen_read(void *cookie, char *buf, int size) {
+  return custom_read(cookie, buf, size);
+}
+
+static fpos_t funopen_seek(void *cookie, fpos_t offset, int whence) {
+  return custom_seek(cookie, offset, whence);
+}
+#endif
+
+// a read-only stream over the application's callbacks, so that code
+// written against stdio works unchanged
+static FILE *custom_fopen(const char *path, const openslide_io_t *io,
+                          void *data, GError **err) {
+  void *handle = io->open(path, data);
+  if (handle == NULL) {
+    _openslide_io_error(err, "Couldn't open %s", path);
+    return NULL;
+  }
+
+  struct custom_file *cf = g_slice_new0(struct custom_file);
+  cf->io = *io;
+  cf->data = data;
+  cf->handle = handle;
+#ifdef HAVE_FOPENCOOKIE
+  cookie_io_functions_t funcs = {
+    .read = cookie_read,
+    .seek = cookie_seek,
+    .close = custom_close,
+  };
+  FILE *f = fopencookie(cf, "r", funcs);
+#else
+  FILE *f = funopen(cf, funopen_read, NULL, funopen_seek, custom_close);
+#endif
+  if (f == NULL) {
+    _openslide_io_error(err, "Couldn't create stream for %s", path);
+    io->close(handle, data);
+    g_slice_free(struct custom_file, cf);
+    return NULL;
+  }
+  // sequential parsers make fewer, larger requests
+  setvbuf(f, NULL, _IOFBF, CUSTOM_IO_BUFFER_SIZE);
+
+  cf->stream = f;
+  G_LOCK(custom_io);
+  if (custom_files == NULL) {
+    custom_files = g_hash_table_new(g_direct_hash, g_direct_equal);
+  }
+  g_hash_table_insert(custom_files, f, cf);
+  G_UNLOCK(custom_io);
+  return f;
+}
+#endif
+
+// the callbacks behind a custom stream, or NULL for a local file
+static struct custom_file *custom_file_lookup(FILE *f G_GNUC_UNUSED) {
+#ifdef HAVE_CUSTOM_IO
+  // custom streams have no descriptor
+  if (fileno(f) != -1) {
+    return NULL;
+  }
+  G_LOCK(custom_io);
+  struct custom_file *cf =
+    custom_files ? g_hash_table_lookup(custom_files, f) : NULL;
+  G_UNLOCK(custom_io);
+  return cf;
+#else
+  return NULL;
+#endif
+}
+
 FILE *_openslide_fopen(const char *path, const char *mode, GError **err)
 {
+#ifdef HAVE_CUSTOM_IO
+  if (mode[0] == 'r') {
+    G_LOCK(custom_io);
+    openslide_io_t io = custom_io;
+    void *data = custom_io_data;
+    G_UNLOCK(custom_io);
+    if (io.open) {
+      return custom_fopen(path, &io, data, err);
+    }
+  }
+#endif
+
   char *m = g_strconcat(mode, FOPEN_CLOEXEC_FLAG, NULL);
   FILE *f = do_fopen(path, m, err);
   g_free(m);
@@ -229,6 +414,272 @@ FILE *_openslide_fopen(const char *path, const char *mode, GError **err)
   return f;
 }
 
+size_t _openslide_fread_at(FILE *f, void *buf, size_t size, int64_t offset) {
+  _openslide_trace(OPENSLIDE_TRACE_READ, true, NULL, -1, -1, 0, NULL);
+  struct custom_file *cf = custom_file_lookup(f);
+  if (cf) {
+    // bypass the stream buffer and its position
+    size_t total = 0;
+    while (total < size) {
+      int64_t count = cf->io.pread(cf->handle, (char *) buf + total,
+                                   size - total, offset + total, cf->data);
+      if (count <= 0) {
+        break;
+      }
+      total += count;
+    }
+    _openslide_counter_add(OPENSLIDE_COUNTER_IO_BYTES_READ, total);
+    _openslide_trace(OPENSLIDE_TRACE_READ, false, NULL, -1, -1, total, NULL);
+    return total;
+  }
+#ifdef HAVE_PREAD
+  // doesn't touch the stdio file position, so several readers could
+  // share the descriptor
+  int fd = fileno(f);
+  size_t total = 0;
+  while (total < size) {
+    ssize_t count = pread(fd, (char *) buf + total, size - total,
+                          offset + total);
+    if (count == -1 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      break;
+    }
+    total += count;
+  }
+#else
+  size_t total = 0;
+  if (!fseeko(f, offset, SEEK_SET)) {
+    total = fread(buf, 1, size, f);
+  }
+#endif
+  _openslide_counter_add(OPENSLIDE_COUNTER_IO_BYTES_READ, total);
+  _openslide_trace(OPENSLIDE_TRACE_READ, false, NULL, -1, -1, total, NULL);
+  return total;
+}
+
+bool _openslide_fread_ranges(FILE *f, const openslide_io_range_t *ranges,
+                             int32_t count, bool *ok) {
+  struct custom_file *cf = custom_file_lookup(f);
+  if (cf && cf->io.preadv) {
+    _openslide_trace(OPENSLIDE_TRACE_READ, true, NULL, -1, -1, 0, NULL);
+    int64_t total = 0;
+    bool all = cf->io.preadv(cf->handle, ranges, count, cf->data);
+    if (all) {
+      for (int32_t i = 0; i < count; i++) {
+        total += ranges[i].length;
+        ok[i] = true;
+      }
+    }
+    _openslide_counter_add(OPENSLIDE_COUNTER_IO_BYTES_READ, total);
+    _openslide_trace(OPENSLIDE_TRACE_READ, false, NULL, -1, -1, total, NULL);
+    if (all) {
+      return true;
+    }
+    // we don't know which ranges failed; retry each of them
+  }
+
+  bool all = true;
+  for (int32_t i = 0; i < count; i++) {
+    ok[i] = _openslide_fread_at(f, ranges[i].buf, ranges[i].length,
+                                ranges[i].offset) ==
+            (size_t) ranges[i].length;
+    all = all && ok[i];
+  }
+  return all;
+}
+
+#undef g_file_test
+bool _openslide_fexists(const char *path) {
+  if (custom_io_active()) {
+    FILE *f = _openslide_fopen(path, "rb", NULL);
+    if (f == NULL) {
+      return false;
+    }
+    fclose(f);
+    return true;
+  }
+  return g_file_test(path, G_FILE_TEST_EXISTS);
+}
+#define g_file_test _OPENSLIDE_POISON(_openslide_fexists)
+
+bool openslide_set_io(const openslide_io_t *io, void *data) {
+#ifdef HAVE_CUSTOM_IO
+  g_return_val_if_fail(io == NULL || (io->open && io->size &&
+                                      io->pread && io->close), false);
+  G_LOCK(custom_io);
+  if (io) {
+    custom_io = *io;
+    custom_io_data = data;
+  } else {
+    memset(&custom_io, 0, sizeof(custom_io));
+    custom_io_data = NULL;
+  }
+  G_UNLOCK(custom_io);
+  return true;
+#else
+  // no way to wrap the callbacks in a stdio stream
+  return io == NULL;
+#endif
+}
+
+bool _openslide_persistent_file_acquire(void) {
+  while (true) {
+    int count = g_atomic_int_get(&persistent_file_count);
+    if (count >= g_atomic_int_get(&persistent_file_limit)) {
+      return false;
+    }
+    if (g_atomic_int_compare_and_exchange(&persistent_file_count,
+                                          count, count + 1)) {
+      return true;
+    }
+  }
+}
+
+void _openslide_persistent_file_release(void) {
+  int count = g_atomic_int_exchange_and_add(&persistent_file_count, -1);
+  g_assert(count > 0);
+}
+
+void openslide_set_persistent_file_limit(int32_t limit) {
+  g_return_if_fail(limit >= 0);
+  // descriptors already open stay open until their handles are closed
+  g_atomic_int_set(&persistent_file_limit, limit);
+}
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct _openslide_arena {
+  GMutex *mutex;
+  GSList *blocks;
+  char *next;  // free space in the newest block
+  gsize remaining;
+  int64_t size;  // bytes in all blocks
+};
+
+struct _openslide_arena *_openslide_arena_create(void) {
+  struct _openslide_arena *arena = g_slice_new0(struct _openslide_arena);
+  arena->mutex = g_mutex_new();
+  return arena;
+}
+
+void *_openslide_arena_alloc(struct _openslide_arena *arena, gsize size) {
+  size = (MAX(size, 1) + ARENA_ALIGN - 1) & ~(gsize) (ARENA_ALIGN - 1);
+
+  g_mutex_lock(arena->mutex);
+  void *result;
+  if (size > ARENA_BLOCK_SIZE / 4) {
+    // large allocation; give it its own block behind the current one
+    // so the free space in the current one isn't wasted
+    result = g_malloc0(size);
+    arena->size += size;
+    if (arena->blocks) {
+      arena->blocks->next = g_slist_prepend(arena->blocks->next, result);
+    } else {
+      arena->blocks = g_slist_prepend(arena->blocks, result);
+    }
+  } else {
+    if (size > arena->remaining) {
+      // g_malloc() results are aligned for any type
+      arena->next = g_malloc0(ARENA_BLOCK_SIZE);
+      arena->remaining = ARENA_BLOCK_SIZE;
+      arena->size += ARENA_BLOCK_SIZE;
+      arena->blocks = g_slist_prepend(arena->blocks, arena->next);
+    }
+    result = arena->next;
+    arena->next += size;
+    arena->remaining -= size;
+  }
+  g_mutex_unlock(arena->mutex);
+  return result;
+}
+
+int64_t _openslide_arena_get_size(struct _openslide_arena *arena) {
+  g_mutex_lock(arena->mutex);
+  int64_t size = arena->size;
+  g_mutex_unlock(arena->mutex);
+  return size;
+}
+
+void _openslide_arena_destroy(struct _openslide_arena *arena) {
+  for (GSList *cur = arena->blocks; cur; cur = cur->next) {
+    g_free(cur->data);
+  }
+  g_slist_free(arena->blocks);
+  g_mutex_free(arena->mutex);
+  g_slice_free(struct _openslide_arena, arena);
+}
+
+struct _openslide_detect_context {
+  GHashTable *entries;
+};
+
+struct detect_entry {
+  void *value;
+  GDestroyNotify destroy;
+};
+
+static void detect_entry_free(gpointer data) {
+  struct detect_entry *entry = data;
+  entry->destroy(entry->value);
+  g_slice_free(struct detect_entry, entry);
+}
+
+struct _openslide_detect_context *_openslide_detect_context_create(void) {
+  struct _openslide_detect_context *dc =
+    g_slice_new0(struct _openslide_detect_context);
+  dc->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                      g_free, detect_entry_free);
+  return dc;
+}
+
+void _openslide_detect_context_put(struct _openslide_detect_context *dc,
+                                   const char *key, void *value,
+                                   GDestroyNotify destroy) {
+  if (!dc) {
+    destroy(value);
+    return;
+  }
+  struct detect_entry *entry = g_slice_new0(struct detect_entry);
+  entry->value = value;
+  entry->destroy = destroy;
+  g_hash_table_replace(dc->entries, g_strdup(key), entry);
+}
+
+void *_openslide_detect_context_steal(struct _openslide_detect_context *dc,
+                                      const char *key) {
+  if (!dc) {
+    return NULL;
+  }
+  gpointer orig_key;
+  gpointer data;
+  if (!g_hash_table_lookup_extended(dc->entries, key, &orig_key, &data)) {
+    return NULL;
+  }
+  g_hash_table_steal(dc->entries, key);
+  g_free(orig_key);
+  struct detect_entry *entry = data;
+  void *value = entry->value;
+  g_slice_free(struct detect_entry, entry);
+  return value;
+}
+
+void _openslide_detect_context_clear(struct _openslide_detect_context *dc) {
+  if (dc) {
+    g_hash_table_remove_all(dc->entries);
+  }
+}
+
+void _openslide_detect_context_destroy(struct _openslide_detect_context *dc) {
+  if (!dc) {
+    return;
+  }
+  g_hash_table_destroy(dc->entries);
+  g_slice_free(struct _openslide_detect_context, dc);
+}
+
 #undef g_ascii_strtod
 double _openslide_parse_double(const char *value) {
   // Canonicalize comma to decimal point, since the locale of the
@@ -299,6 +750,10 @@ void _openslide_set_background_color_prop(openslide_t *osr,
                       g_strdup_printf("%.02X%.02X%.02X", r, g, b));
 }
 
+void _openslide_add_source_file(openslide_t *osr, const char *filename) {
+  g_ptr_array_add(osr->source_files, g_strdup(filename));
+}
+
 void _openslide_set_bounds_props_from_grid(openslide_t *osr,
                                            struct _openslide_grid *grid) {
   g_return_if_fail(g_hash_table_lookup(osr->properties,
@@ -355,6 +810,74 @@ bool _openslide_clip_tile(uint32_t *tiledata,
   return success;
 }
 
+void _openslide_crop_tile(uint32_t *dest, int64_t w, int64_t h,
+                          const uint32_t *src, int64_t stride,
+                          int64_t src_w, int64_t src_h,
+                          int64_t x, int64_t y) {
+  int64_t copy_w = CLAMP(src_w - x, 0, w);
+  int64_t copy_h = CLAMP(src_h - y, 0, h);
+  for (int64_t row = 0; row < copy_h; row++) {
+    memcpy(dest + row * w, src + (y + row) * stride + x, copy_w * 4);
+    memset(dest + row * w + copy_w, 0, (w - copy_w) * 4);
+  }
+  memset(dest + copy_h * w, 0, (h - copy_h) * w * 4);
+}
+
+void _openslide_paint_constant(cairo_t *cr, uint32_t pixel,
+                               double w, double h) {
+  // transparent paints nothing; a direct paint targets a cleared surface
+  uint8_t a = pixel >> 24;
+  if (a == 0) {
+    return;
+  }
+  cairo_set_source_rgba(cr,
+                        ((pixel >> 16) & 0xff) / (double) a,
+                        ((pixel >> 8) & 0xff) / (double) a,
+                        (pixel & 0xff) / (double) a,
+                        a / 255.0);
+  cairo_rectangle(cr, 0, 0, w, h);
+  cairo_fill(cr);
+}
+
+void _openslide_paint_subimage(cairo_t *cr,
+                               uint32_t *data, cairo_format_t format,
+                               int64_t data_w, int64_t data_h,
+                               double x, double y,
+                               double w, double h) {
+  cairo_surface_t *surface;
+
+  if (x >= 0 && y >= 0 && x == floor(x) && y == floor(y)) {
+    // point a surface at the subimage, so that nothing outside it can
+    // be sampled
+    int64_t view_w = MIN((int64_t) ceil(w), data_w - (int64_t) x);
+    int64_t view_h = MIN((int64_t) ceil(h), data_h - (int64_t) y);
+    if (view_w <= 0 || view_h <= 0) {
+      return;
+    }
+    uint32_t *origin = data + (int64_t) y * data_w + (int64_t) x;
+    surface = cairo_image_surface_create_for_data((unsigned char *) origin,
+                                                  format,
+                                                  view_w, view_h,
+                                                  data_w * 4);
+    cairo_set_source_surface(cr, surface, 0, 0);
+    cairo_surface_destroy(surface);
+    cairo_paint(cr);
+  } else {
+    // fractional offset; clip the destination instead
+    surface = cairo_image_surface_create_for_data((unsigned char *) data,
+                                                  format,
+                                                  data_w, data_h,
+                                                  data_w * 4);
+    cairo_save(cr);
+    cairo_rectangle(cr, 0, 0, ceil(w), ceil(h));
+    cairo_clip(cr);
+    cairo_set_source_surface(cr, surface, -x, -y);
+    cairo_surface_destroy(surface);
+    cairo_paint(cr);
+    cairo_restore(cr);
+  }
+}
+
 // note: g_getenv() is not reentrant
 void _openslide_debug_init(void) {
   const char *debug_str = g_getenv(DEBUG_ENV_VAR);
@@ -385,6 +908,78 @@ void _openslide_debug_init(void) {
   g_strfreev(keywords);
 }
 
+// note: g_getenv() is not reentrant
+void _openslide_mmap_init(void) {
+  // Mapped reads hand tile data to the decoders without a copy, but a
+  // slide file truncated while mapped will raise SIGBUS in the reading
+  // thread, so this is opt-in.
+  const char *mmap_str = g_getenv(MMAP_ENV_VAR);
+  mmap_enabled = mmap_str && mmap_str[0] && !g_str_equal(mmap_str, "0");
+}
+
+bool _openslide_mmap_enabled(void) {
+  // custom I/O has nothing to map
+  return mmap_enabled && !custom_io_active();
+}
+
+// note: g_getenv() is not reentrant
+void _openslide_index_cache_init(void) {
+  const char *dir = g_getenv(INDEX_CACHE_ENV_VAR);
+  if (dir && dir[0]) {
+    index_cache_dir = g_strdup(dir);
+  }
+}
+
+char *_openslide_index_cache_path(const char *format, const char *id,
+                                  const char * const *filenames) {
+  // custom I/O offers no modification times to key on
+  if (!index_cache_dir || custom_io_active()) {
+    return NULL;
+  }
+
+  // key on the identity of every file the index is derived from, so
+  // that a modified slide misses rather than reading stale geometry
+  GString *key = g_string_new(format);
+  g_string_append_c(key, '\n');
+  g_string_append(key, id);
+  for (const char * const *name = filenames; *name; name++) {
+    struct stat st;
+    if (g_stat(*name, &st)) {
+      g_string_free(key, true);
+      return NULL;
+    }
+    g_string_append_printf(key, "\n%"PRId64" %"PRId64,
+                           (int64_t) st.st_size, (int64_t) st.st_mtime);
+  }
+  char *digest = g_compute_checksum_for_data(G_CHECKSUM_SHA256,
+                                             (const guchar *) key->str,
+                                             key->len);
+  g_string_free(key, true);
+
+  char *basename = g_strdup_printf("%s-%s.idx", format, digest);
+  char *path = g_build_filename(index_cache_dir, basename, NULL);
+  g_free(basename);
+  g_free(digest);
+  return path;
+}
+
+GMappedFile *_openslide_index_cache_load(const char *path) {
+  // a missing or unreadable entry is just a miss
+  return g_mapped_file_new(path, false, NULL);
+}
+
+void _openslide_index_cache_store(const char *path,
+                                  const void *data, gsize len) {
+  // g_file_set_contents() writes a temporary file and renames it into
+  // place, so concurrent openers never see a partial entry
+  GError *tmp_err = NULL;
+  if (!g_file_set_contents(path, data, len, &tmp_err)) {
+    _openslide_performance_warn("Couldn't write index cache: %s",
+                                tmp_err->message);
+    g_clear_error(&tmp_err);
+  }
+}
+
 bool _openslide_debug(enum _openslide_debug_flag flag) {
   return !!(debug_flags & (1 << flag));
 }
@@ -46,6 +46,10 @@ static const char APERIO_DESCRIPTION[] = "Aperio";
 #define APERIO_COMPRESSION_JP2K_YCBCR 33003
 #define APERIO_COMPRESSION_JP2K_RGB   33005
 
+// value in missing_tiles for a missing tile that renders as entirely
+// transparent, because nothing under it in larger levels has data
+#define MISSING_TILE_BLANK GINT_TO_POINTER(1)
+
 struct aperio_ops_data {
   struct _openslide_tiffcache *tc;
 };
@@ -70,7 +74,7 @@ static void destroy_data(struct aperio_ops_data *data,
     for (int32_t i = 0; i < level_count; i++) {
       if (levels[i]) {
         if (levels[i]->missing_tiles) {
-          g_hash_table_destroy(levels[i]->missing_tiles);
+          g_hash_table_unref(levels[i]->missing_tiles);
         }
         _openslide_grid_destroy(levels[i]->grid);
         g_slice_free(struct level, levels[i]);
@@ -101,6 +105,7 @@ static bool render_missing_tile(struct level *l,
 
   if (l->prev) {
     // recurse into previous level
+    _openslide_counter_add(OPENSLIDE_COUNTER_TILES_SYNTHESIZED, 1);
     double relative_ds = l->prev->base.downsample / l->base.downsample;
 
     cairo_surface_t *surface =
@@ -133,7 +138,8 @@ static bool render_missing_tile(struct level *l,
   return success;
 }
 
-static bool decode_tile(struct level *l,
+static bool decode_tile(openslide_t *osr,
+                        struct level *l,
                         TIFF *tiff,
                         uint32_t *dest,
                         int64_t tile_col, int64_t tile_row,
@@ -159,43 +165,60 @@ static bool decode_tile(struct level *l,
     break;
   default:
     // not for us? fallback
-    return _openslide_tiff_read_tile(tiffl, tiff, dest,
+    return _openslide_tiff_read_tile(osr, tiffl, tiff, dest,
                                      tile_col, tile_row,
                                      err);
   }
 
   // read raw tile
-  void *buf;
+  const void *buf;
   int32_t buflen;
-  if (!_openslide_tiff_read_tile_data(tiffl, tiff,
-                                      &buf, &buflen,
-                                      tile_col, tile_row,
-                                      err)) {
+  struct _openslide_cache_entry *entry;
+  if (!_openslide_tiff_get_tile_data(osr, tiffl, tiff,
+                                     &buf, &buflen, &entry,
+                                     tile_col, tile_row,
+                                     err)) {
     return false;  // ok, haven't allocated anything yet
   }
 
-  // decompress
+  // decompress, skipping the part of an edge tile that will be clipped,
+  // and reducing the resolution of a level synthesized from this one
+  int32_t reduce = 0;
+  while ((1 << reduce) < tiffl->scale_denom) {
+    reduce++;
+  }
+  int64_t area_w = MIN(tiffl->tile_w, tiffl->image_w - tile_col * tiffl->tile_w);
+  int64_t area_h = MIN(tiffl->tile_h, tiffl->image_h - tile_row * tiffl->tile_h);
   bool success = _openslide_jp2k_decode_buffer(dest,
                                                tiffl->tile_w, tiffl->tile_h,
+                                               area_w, area_h,
+                                               reduce,
                                                buf, buflen,
                                                space,
                                                err);
 
   // clean up
-  g_free(buf);
+  if (entry) {
+    _openslide_cache_entry_unref(entry);
+  }
 
   return success;
 }
 
-static bool read_tile(openslide_t *osr,
-		      cairo_t *cr,
-		      struct _openslide_level *level,
-		      int64_t tile_col, int64_t tile_row,
-		      void *arg,
-		      GError **err) {
+static bool is_blank_tile(struct level *l, int64_t tile_col, int64_t tile_row) {
+  int64_t tile_no = tile_row * l->tiffl.tiles_across + tile_col;
+  return g_hash_table_lookup(l->missing_tiles, &tile_no) == MISSING_TILE_BLANK;
+}
+
+// the decoded, clipped tile, held by *_cache_entry; NULL on error
+static uint32_t *get_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          TIFF *tiff,
+                          int64_t tile_col, int64_t tile_row,
+                          struct _openslide_cache_entry **_cache_entry,
+                          GError **err) {
   struct level *l = (struct level *) level;
   struct _openslide_tiff_level *tiffl = &l->tiffl;
-  TIFF *tiff = arg;
 
   // tile size
   int64_t tw = tiffl->tile_w;
@@ -207,18 +230,18 @@ static bool read_tile(openslide_t *osr,
                                             level, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
-    if (!decode_tile(l, tiff, tiledata, tile_col, tile_row, err)) {
-      g_slice_free1(tw * th * 4, tiledata);
-      return false;
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
+    if (!decode_tile(osr, l, tiff, tiledata, tile_col, tile_row, err)) {
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return NULL;
     }
 
     // clip, if necessary
     if (!_openslide_tiff_clip_tile(tiffl, tiledata,
                                    tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
-      return false;
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return NULL;
     }
 
     // put it in the cache
@@ -227,6 +250,37 @@ static bool read_tile(openslide_t *osr,
 			 &cache_entry);
   }
 
+  *_cache_entry = cache_entry;
+  return tiledata;
+}
+
+static bool read_tile(openslide_t *osr,
+		      cairo_t *cr,
+		      struct _openslide_level *level,
+		      int64_t tile_col, int64_t tile_row,
+		      void *arg,
+		      GError **err) {
+  struct level *l = (struct level *) level;
+  TIFF *tiff = arg;
+
+  // a blank tile paints nothing, so skip the cache and the decode
+  if (is_blank_tile(l, tile_col, tile_row)) {
+    _openslide_counter_add(OPENSLIDE_COUNTER_TILES_BLANK, 1);
+    return true;
+  }
+
+  // tile size
+  int64_t tw = l->tiffl.tile_w;
+  int64_t th = l->tiffl.tile_h;
+
+  // get the tile, possibly from cache
+  struct _openslide_cache_entry *cache_entry;
+  uint32_t *tiledata = get_tile(osr, level, tiff, tile_col, tile_row,
+                                &cache_entry, err);
+  if (!tiledata) {
+    return false;
+  }
+
   // draw it
   cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiledata,
 								 CAIRO_FORMAT_ARGB32,
@@ -242,6 +296,30 @@ static bool read_tile(openslide_t *osr,
   return true;
 }
 
+static void decode_tiles(openslide_t *osr,
+                         struct _openslide_level *level,
+                         const int64_t *tiles,
+                         int32_t count,
+                         void *arg) {
+  struct level *l = (struct level *) level;
+  TIFF *tiff = arg;
+
+  // missing tiles are rendered from the previous level by decode_tile()
+  int64_t *present = g_new(int64_t, 2 * count);
+  int32_t n = 0;
+  for (int32_t i = 0; i < count; i++) {
+    int64_t tile_no = tiles[2 * i + 1] * l->tiffl.tiles_across + tiles[2 * i];
+    if (!g_hash_table_lookup_extended(l->missing_tiles, &tile_no,
+                                      NULL, NULL)) {
+      present[2 * n] = tiles[2 * i];
+      present[2 * n + 1] = tiles[2 * i + 1];
+      n++;
+    }
+  }
+  _openslide_tiff_decode_tiles(osr, level, &l->tiffl, tiff, present, n);
+  g_free(present);
+}
+
 static bool paint_region(openslide_t *osr, cairo_t *cr,
 			 int64_t x, int64_t y,
 			 struct _openslide_level *level,
@@ -265,13 +343,115 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static bool read_raw_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          int64_t tile_col, int64_t tile_row,
+                          void **buf, int32_t *len,
+                          const char **codec,
+                          GError **err) {
+  struct aperio_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  // tiles next to a missing one may be corrupt
+  int64_t tile_no = tile_row * l->tiffl.tiles_across + tile_col;
+  if (g_hash_table_lookup_extended(l->missing_tiles, &tile_no, NULL, NULL)) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE,
+                "Tile is missing");
+    return false;
+  }
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+  bool success = _openslide_tiff_read_raw_tile(osr, &l->tiffl, tiff,
+                                               tile_col, tile_row,
+                                               buf, len, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+  *codec = "jpeg";
+  return success;
+}
+
+static bool acquire_tile(openslide_t *osr,
+                         struct _openslide_level *level,
+                         int64_t tile_col, int64_t tile_row,
+                         uint32_t **tiledata,
+                         struct _openslide_cache_entry **cache_entry,
+                         GError **err) {
+  struct aperio_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  // blank tiles are transparent, without pixel storage
+  if (is_blank_tile(l, tile_col, tile_row)) {
+    _openslide_counter_add(OPENSLIDE_COUNTER_TILES_BLANK, 1);
+    *tiledata = _openslide_cache_get(osr->cache, level, tile_col, tile_row,
+                                     cache_entry);
+    if (!*tiledata) {
+      *tiledata = _openslide_cache_put_constant(osr->cache, level,
+                                                tile_col, tile_row,
+                                                0, cache_entry);
+    }
+    return true;
+  }
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+  *tiledata = get_tile(osr, level, tiff, tile_col, tile_row,
+                       cache_entry, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+  return *tiledata != NULL;
+}
+
+static bool clear_empty_tiles(openslide_t *osr G_GNUC_UNUSED,
+                              struct _openslide_level *level,
+                              uint8_t *nonempty,
+                              int64_t tiles_across, int64_t tiles_down,
+                              GError **err G_GNUC_UNUSED) {
+  struct level *l = (struct level *) level;
+  if (tiles_across != l->tiffl.tiles_across ||
+      tiles_down != l->tiffl.tiles_down) {
+    return true;
+  }
+
+  // other missing tiles are rendered from the next larger level
+  GHashTableIter iter;
+  g_hash_table_iter_init(&iter, l->missing_tiles);
+  int64_t *tile_no;
+  gpointer value;
+  while (g_hash_table_iter_next(&iter, (gpointer *) &tile_no, &value)) {
+    if (value == MISSING_TILE_BLANK) {
+      nonempty[*tile_no] = 0;
+    }
+  }
+  return true;
+}
+
+static int32_t get_idle_handle_count(openslide_t *osr) {
+  struct aperio_ops_data *data = osr->data;
+  return _openslide_tiffcache_get_idle_count(data->tc);
+}
+
+static void release_idle_handles(openslide_t *osr) {
+  struct aperio_ops_data *data = osr->data;
+  _openslide_tiffcache_release_idle(data->tc);
+}
+
 static const struct _openslide_ops aperio_ops = {
   .paint_region = paint_region,
+  .read_raw_tile = read_raw_tile,
+  .acquire_tile = acquire_tile,
+  .clear_empty_tiles = clear_empty_tiles,
+  .get_idle_handle_count = get_idle_handle_count,
+  .release_idle_handles = release_idle_handles,
   .destroy = destroy,
 };
 
 static bool aperio_detect(const char *filename G_GNUC_UNUSED,
-                          struct _openslide_tifflike *tl, GError **err) {
+                          struct _openslide_tifflike *tl,
+                          struct _openslide_detect_context *dc G_GNUC_UNUSED,
+                          GError **err) {
   // ensure we have a TIFF
   if (!tl) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -407,30 +587,195 @@ static void propagate_missing_tile(void *key, void *value G_GNUC_UNUSED,
   g_hash_table_insert(next_l->missing_tiles, next_tile_no, NULL);
 }
 
+// whether render_missing_tile() would paint only blank tiles, or
+// nothing at all
+static bool missing_tile_is_blank(struct level *l, int64_t tile_no) {
+  struct level *prev = l->prev;
+  if (!prev) {
+    return true;
+  }
+  struct _openslide_tiff_level *tiffl = &l->tiffl;
+  struct _openslide_tiff_level *prev_tiffl = &prev->tiffl;
+
+  // the region painted from the previous level, widened by a tile on
+  // each side to cover rounding in the grid
+  double relative_ds = prev->base.downsample / l->base.downsample;
+  int64_t tile_col = tile_no % tiffl->tiles_across;
+  int64_t tile_row = tile_no / tiffl->tiles_across;
+  double x = (tile_col * tiffl->tile_w - 1) / relative_ds;
+  double y = (tile_row * tiffl->tile_h - 1) / relative_ds;
+  double w = ceil((tiffl->tile_w + 2) / relative_ds);
+  double h = ceil((tiffl->tile_h + 2) / relative_ds);
+  int64_t col0 = MAX(floor(x / prev_tiffl->tile_w) - 1, 0);
+  int64_t row0 = MAX(floor(y / prev_tiffl->tile_h) - 1, 0);
+  int64_t col1 = MIN(floor((x + w) / prev_tiffl->tile_w) + 1,
+                     prev_tiffl->tiles_across - 1);
+  int64_t row1 = MIN(floor((y + h) / prev_tiffl->tile_h) + 1,
+                     prev_tiffl->tiles_down - 1);
+
+  for (int64_t row = row0; row <= row1; row++) {
+    for (int64_t col = col0; col <= col1; col++) {
+      int64_t prev_tile_no = row * prev_tiffl->tiles_across + col;
+      if (g_hash_table_lookup(prev->missing_tiles, &prev_tile_no) !=
+          MISSING_TILE_BLANK) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// must be called on each level after its previous level
+static void mark_blank_tiles(struct level *l) {
+  GSList *blank = NULL;
+  GHashTableIter iter;
+  void *key;
+  g_hash_table_iter_init(&iter, l->missing_tiles);
+  while (g_hash_table_iter_next(&iter, &key, NULL)) {
+    if (missing_tile_is_blank(l, *(int64_t *) key)) {
+      blank = g_slist_prepend(blank, key);
+    }
+  }
+
+  // inserting over an existing key frees the new key, not the old one
+  for (GSList *cur = blank; cur; cur = cur->next) {
+    int64_t *tile_no = g_new(int64_t, 1);
+    *tile_no = *(int64_t *) cur->data;
+    g_hash_table_insert(l->missing_tiles, tile_no, MISSING_TILE_BLANK);
+  }
+  g_slist_free(blank);
+}
+
+static bool is_jp2k(struct level *l) {
+  return l->compression == APERIO_COMPRESSION_JP2K_YCBCR ||
+         l->compression == APERIO_COMPRESSION_JP2K_RGB;
+}
+
+// largest power-of-two downsample at which a JP2K level's tiles can be
+// decoded, judged from the first tile present
+static int32_t get_jp2k_max_scale_denom(openslide_t *osr,
+                                        struct level *l,
+                                        TIFF *tiff) {
+  struct _openslide_tiff_level *tiffl = &l->tiffl;
+  int64_t tile_count = tiffl->tiles_across * tiffl->tiles_down;
+  int64_t tile_no;
+  for (tile_no = 0; tile_no < tile_count; tile_no++) {
+    if (!g_hash_table_lookup_extended(l->missing_tiles, &tile_no,
+                                      NULL, NULL)) {
+      break;
+    }
+  }
+  if (tile_no == tile_count) {
+    return 1;
+  }
+
+  const void *buf;
+  int32_t buflen;
+  struct _openslide_cache_entry *entry = NULL;
+  int32_t max_reduce = 0;
+  GError *tmp_err = NULL;
+  if (!_openslide_tiff_get_tile_data(osr, tiffl, tiff,
+                                     &buf, &buflen, &entry,
+                                     tile_no % tiffl->tiles_across,
+                                     tile_no / tiffl->tiles_across,
+                                     &tmp_err) ||
+      !_openslide_jp2k_get_max_reduce(buf, buflen, &max_reduce, &tmp_err)) {
+    //g_debug("can't check JP2K resolutions: %s", tmp_err->message);
+    g_clear_error(&tmp_err);
+    max_reduce = 0;
+  }
+  if (entry) {
+    _openslide_cache_entry_unref(entry);
+  }
+  return 1 << MIN(max_reduce, 3);
+}
+
+static bool level_can_scale(struct level *l, int32_t max_scale_denom,
+                            int32_t scale_denom, int64_t next_level_w) {
+  struct _openslide_tiff_level *tiffl = &l->tiffl;
+  if (is_jp2k(l)) {
+    // OpenJPEG discards whole resolution levels
+    return scale_denom <= max_scale_denom &&
+           tiffl->scale_denom == 1 &&
+           tiffl->tile_w % scale_denom == 0 &&
+           tiffl->tile_h % scale_denom == 0 &&
+           tiffl->image_w / scale_denom > next_level_w;
+  }
+  return _openslide_tiff_level_can_scale(tiffl, scale_denom, next_level_w);
+}
+
+// create_scaled_level() is called for each scale of one level in turn,
+// so a JP2K level's codestream is only checked once
+struct scale_state {
+  TIFF *tiff;
+  struct level *level;  // the level max_scale_denom is for
+  int32_t max_scale_denom;
+};
+
+// a level decoded at reduced scale between the physical ones
+static struct _openslide_level *create_scaled_level(openslide_t *osr,
+                                                    struct _openslide_level *level,
+                                                    struct _openslide_level *next,
+                                                    int32_t scale_denom,
+                                                    void *data) {
+  struct scale_state *state = data;
+  struct level *l = (struct level *) level;
+  if (state->level != l) {
+    state->level = l;
+    state->max_scale_denom = 8;
+    if (is_jp2k(l)) {
+      state->max_scale_denom = get_jp2k_max_scale_denom(osr, l, state->tiff);
+    }
+  }
+  int64_t next_w = next ? ((struct level *) next)->tiffl.image_w : 0;
+  if (!level_can_scale(l, state->max_scale_denom, scale_denom, next_w)) {
+    return NULL;
+  }
+
+  struct level *sd_l = g_slice_new0(struct level);
+  struct _openslide_tiff_level *tiffl = &sd_l->tiffl;
+  _openslide_tiff_level_init_scaled(level, &l->tiffl, scale_denom,
+                                    (struct _openslide_level *) sd_l,
+                                    tiffl);
+  sd_l->grid = _openslide_grid_create_simple(osr,
+                                             tiffl->tiles_across,
+                                             tiffl->tiles_down,
+                                             tiffl->tile_w,
+                                             tiffl->tile_h,
+                                             read_tile);
+  sd_l->compression = l->compression;
+  // a tile missing from the directory is rendered from the parent,
+  // which in turn renders it from the next larger level
+  sd_l->prev = l;
+  sd_l->missing_tiles = g_hash_table_ref(l->missing_tiles);
+  return (struct _openslide_level *) sd_l;
+}
+
 // check for OpenJPEG CVE-2013-6045 breakage
 // (see openslide-decode-jp2k.c)
-static bool test_tile_decoding(struct level *l,
+static bool test_tile_decoding(openslide_t *osr,
+                               struct level *l,
                                TIFF *tiff,
                                GError **err) {
   // only for JP2K slides.
   // shouldn't affect RGB, but check anyway out of caution
-  if (l->compression != APERIO_COMPRESSION_JP2K_YCBCR &&
-      l->compression != APERIO_COMPRESSION_JP2K_RGB) {
+  if (!is_jp2k(l)) {
     return true;
   }
 
   int64_t tw = l->tiffl.tile_w;
   int64_t th = l->tiffl.tile_h;
 
-  uint32_t *dest = g_slice_alloc(tw * th * 4);
-  bool ok = decode_tile(l, tiff, dest, 0, 0, err);
-  g_slice_free1(tw * th * 4, dest);
+  uint32_t *dest = _openslide_buffer_alloc(tw * th * 4);
+  bool ok = decode_tile(osr, l, tiff, dest, 0, 0, err);
+  _openslide_buffer_free(tw * th * 4, dest);
   return ok;
 }
 
 static bool aperio_open(openslide_t *osr,
                         const char *filename,
                         struct _openslide_tifflike *tl,
+                        struct _openslide_detect_context *dc G_GNUC_UNUSED,
                         struct _openslide_hash *quickhash1, GError **err) {
   struct aperio_ops_data *data = NULL;
   struct level **levels = NULL;
@@ -529,6 +874,8 @@ static bool aperio_open(openslide_t *osr,
                                               tiffl->tile_w,
                                               tiffl->tile_h,
                                               read_tile);
+      _openslide_grid_simple_set_batch(l->grid, decode_tiles);
+      l->base.simple_grid = true;
 
       // get compression
       if (!TIFFGetField(tiff, TIFFTAG_COMPRESSION, &l->compression)) {
@@ -572,8 +919,13 @@ static bool aperio_open(openslide_t *osr,
                          levels[i + 1]);
   }
 
+  // find the missing tiles that would render as fully transparent
+  for (i = 0; i < level_count; i++) {
+    mark_blank_tiles(levels[i]);
+  }
+
   // check for OpenJPEG CVE-2013-6045 breakage
-  if (!test_tile_decoding(levels[0], tiff, err)) {
+  if (!test_tile_decoding(osr, levels[0], tiff, err)) {
     goto FAIL;
   }
 
@@ -599,6 +951,19 @@ static bool aperio_open(openslide_t *osr,
     goto FAIL;
   }
 
+  // synthesize levels from the JPEG DCT or the JP2K wavelet pyramid
+  GPtrArray *level_array = g_ptr_array_new();
+  for (i = 0; i < level_count; i++) {
+    g_ptr_array_add(level_array, levels[i]);
+  }
+  g_free(levels);
+  struct scale_state scale_state = { .tiff = tiff };
+  level_array = _openslide_tiff_add_scaled_levels(osr, level_array,
+                                                  create_scaled_level,
+                                                  &scale_state);
+  level_count = level_array->len;
+  levels = (struct level **) g_ptr_array_free(level_array, false);
+
   // store osr data
   g_assert(osr->data == NULL);
   g_assert(osr->levels == NULL);
@@ -61,15 +61,15 @@ static void destroy(openslide_t *osr) {
   g_free(osr->levels);
 }
 
-static bool read_tile(openslide_t *osr,
-                      cairo_t *cr,
-                      struct _openslide_level *level,
-                      int64_t tile_col, int64_t tile_row,
-                      void *arg,
-                      GError **err) {
+// the decoded, clipped tile, held by *cache_entry; NULL on error
+static uint32_t *get_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          TIFF *tiff,
+                          int64_t tile_col, int64_t tile_row,
+                          struct _openslide_cache_entry **_cache_entry,
+                          GError **err) {
   struct level *l = (struct level *) level;
   struct _openslide_tiff_level *tiffl = &l->tiffl;
-  TIFF *tiff = arg;
 
   // tile size
   int64_t tw = tiffl->tile_w;
@@ -81,20 +81,20 @@ static bool read_tile(openslide_t *osr,
                                             level, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
-    if (!_openslide_tiff_read_tile(tiffl, tiff,
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
+    if (!_openslide_tiff_read_tile(osr, tiffl, tiff,
                                    tiledata, tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
-      return false;
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return NULL;
     }
 
     // clip, if necessary
     if (!_openslide_tiff_clip_tile(tiffl, tiledata,
                                    tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
-      return false;
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return NULL;
     }
 
     // put it in the cache
@@ -103,6 +103,31 @@ static bool read_tile(openslide_t *osr,
                          &cache_entry);
   }
 
+  *_cache_entry = cache_entry;
+  return tiledata;
+}
+
+static bool read_tile(openslide_t *osr,
+                      cairo_t *cr,
+                      struct _openslide_level *level,
+                      int64_t tile_col, int64_t tile_row,
+                      void *arg,
+                      GError **err) {
+  struct level *l = (struct level *) level;
+  TIFF *tiff = arg;
+
+  // tile size
+  int64_t tw = l->tiffl.tile_w;
+  int64_t th = l->tiffl.tile_h;
+
+  // get the tile, possibly from cache
+  struct _openslide_cache_entry *cache_entry;
+  uint32_t *tiledata = get_tile(osr, level, tiff, tile_col, tile_row,
+                                &cache_entry, err);
+  if (!tiledata) {
+    return false;
+  }
+
   // draw it
   cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiledata,
                                                                  CAIRO_FORMAT_ARGB32,
@@ -118,6 +143,17 @@ static bool read_tile(openslide_t *osr,
   return true;
 }
 
+static void decode_tiles(openslide_t *osr,
+                         struct _openslide_level *level,
+                         const int64_t *tiles,
+                         int32_t count,
+                         void *arg) {
+  struct level *l = (struct level *) level;
+  TIFF *tiff = arg;
+
+  _openslide_tiff_decode_tiles(osr, level, &l->tiffl, tiff, tiles, count);
+}
+
 static bool paint_region(openslide_t *osr, cairo_t *cr,
                          int64_t x, int64_t y,
                          struct _openslide_level *level,
@@ -141,13 +177,79 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static bool read_raw_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          int64_t tile_col, int64_t tile_row,
+                          void **buf, int32_t *len,
+                          const char **codec,
+                          GError **err) {
+  struct generic_tiff_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+  bool success = _openslide_tiff_read_raw_tile(osr, &l->tiffl, tiff,
+                                               tile_col, tile_row,
+                                               buf, len, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+  *codec = "jpeg";
+  return success;
+}
+
+static bool acquire_tile(openslide_t *osr,
+                         struct _openslide_level *level,
+                         int64_t tile_col, int64_t tile_row,
+                         uint32_t **tiledata,
+                         struct _openslide_cache_entry **cache_entry,
+                         GError **err) {
+  struct generic_tiff_ops_data *data = osr->data;
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+  *tiledata = get_tile(osr, level, tiff, tile_col, tile_row,
+                       cache_entry, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+  return *tiledata != NULL;
+}
+
+static bool clear_empty_tiles(openslide_t *osr,
+                              struct _openslide_level *level,
+                              uint8_t *nonempty,
+                              int64_t tiles_across, int64_t tiles_down,
+                              GError **err) {
+  struct generic_tiff_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+  return _openslide_tiff_clear_empty_tiles(&l->tiffl, data->tc, nonempty,
+                                           tiles_across, tiles_down, err);
+}
+
+static int32_t get_idle_handle_count(openslide_t *osr) {
+  struct generic_tiff_ops_data *data = osr->data;
+  return _openslide_tiffcache_get_idle_count(data->tc);
+}
+
+static void release_idle_handles(openslide_t *osr) {
+  struct generic_tiff_ops_data *data = osr->data;
+  _openslide_tiffcache_release_idle(data->tc);
+}
+
 static const struct _openslide_ops generic_tiff_ops = {
   .paint_region = paint_region,
+  .read_raw_tile = read_raw_tile,
+  .acquire_tile = acquire_tile,
+  .clear_empty_tiles = clear_empty_tiles,
+  .get_idle_handle_count = get_idle_handle_count,
+  .release_idle_handles = release_idle_handles,
   .destroy = destroy,
 };
 
 static bool generic_tiff_detect(const char *filename G_GNUC_UNUSED,
                                 struct _openslide_tifflike *tl,
+                                struct _openslide_detect_context *dc G_GNUC_UNUSED,
                                 GError **err) {
   // ensure we have a TIFF
   if (!tl) {
@@ -179,9 +281,35 @@ static int width_compare(gconstpointer a, gconstpointer b) {
   }
 }
 
+// a level decoded at reduced scale between the physical ones
+static struct _openslide_level *create_scaled_level(openslide_t *osr,
+                                                    struct _openslide_level *level,
+                                                    struct _openslide_level *next,
+                                                    int32_t scale_denom,
+                                                    void *data G_GNUC_UNUSED) {
+  struct level *l = (struct level *) level;
+  int64_t next_w = next ? ((struct level *) next)->tiffl.image_w : 0;
+  if (!_openslide_tiff_level_can_scale(&l->tiffl, scale_denom, next_w)) {
+    return NULL;
+  }
+  struct level *sd_l = g_slice_new0(struct level);
+  struct _openslide_tiff_level *tiffl = &sd_l->tiffl;
+  _openslide_tiff_level_init_scaled(level, &l->tiffl, scale_denom,
+                                    (struct _openslide_level *) sd_l,
+                                    tiffl);
+  sd_l->grid = _openslide_grid_create_simple(osr,
+                                             tiffl->tiles_across,
+                                             tiffl->tiles_down,
+                                             tiffl->tile_w,
+                                             tiffl->tile_h,
+                                             read_tile);
+  return (struct _openslide_level *) sd_l;
+}
+
 static bool generic_tiff_open(openslide_t *osr,
                               const char *filename,
                               struct _openslide_tifflike *tl,
+                              struct _openslide_detect_context *dc G_GNUC_UNUSED,
                               struct _openslide_hash *quickhash1,
                               GError **err) {
   GPtrArray *level_array = g_ptr_array_new();
@@ -242,6 +370,8 @@ static bool generic_tiff_open(openslide_t *osr,
                                             tiffl->tile_w,
                                             tiffl->tile_h,
                                             read_tile);
+    _openslide_grid_simple_set_batch(l->grid, decode_tiles);
+    l->base.simple_grid = true;
 
     // add to array
     g_ptr_array_add(level_array, l);
@@ -259,6 +389,10 @@ static bool generic_tiff_open(openslide_t *osr,
     goto FAIL;
   }
 
+  // synthesize JPEG levels from the DCT
+  level_array = _openslide_tiff_add_scaled_levels(osr, level_array,
+                                                  create_scaled_level, NULL);
+
   // unwrap level array
   int32_t level_count = level_array->len;
   struct level **levels =
@@ -58,9 +58,23 @@
 
 #define NGR_TILE_HEIGHT 64
 
+// background restart marker search
+#define RESTART_MARKER_THREADS 4
+#define RESTART_MARKER_STEP 64
+
+// idle file handles kept per JPEG
+#define JPEG_FILE_CACHE_MAX 4
+
+// tile size of a level made of one JPEG without restart markers, each
+// tile decoded as a window of the whole image
+#define JPEG_WINDOW_SIZE 1024
+// most bytes of a window row decoded in one pass over the JPEG
+#define JPEG_WINDOW_PASS_BYTES (16 * 1024 * 1024)
+
 // VMS/VMU
 static const char GROUP_VMS[] = "Virtual Microscope Specimen";
 static const char GROUP_VMU[] = "Uncompressed Virtual Microscope Specimen";
+static const char VMS_DETECT_KEY_FILE[] = "hamamatsu-key-file";
 static const char KEY_MAP_FILE[] = "MapFile";
 static const char KEY_IMAGE_FILE[] = "ImageFile";
 static const char KEY_NUM_JPEG_COLS[] = "NoJpegColumns";
@@ -109,11 +123,22 @@ struct jpeg {
   int32_t tile_height;
 
   int32_t tile_count;
-  int64_t *mcu_starts;
+  int64_t *mcu_starts;  // mcu_starts_mutex protects
   int64_t *unreliable_mcu_starts;
+  GMutex *mcu_starts_mutex;
+
+  // for ordering the background restart marker search
+  gint wanted;  // atomic ops only; stamp of the latest read
+  bool index_claimed;  // restart_marker_mutex protects
 
   int64_t sof_position;
   int64_t header_stop_position;
+
+  // file_mutex protects
+  GQueue *files;  // idle file handles, most recently used first
+  uint8_t *header;  // through SOS, SOF fixed up; NULL until first read
+  int32_t header_length;
+  GMutex *file_mutex;
 };
 
 struct jpeg_level {
@@ -130,6 +155,9 @@ struct jpeg_level {
   int32_t tile_height;
 
   int32_t scale_denom;
+
+  // tiles are windows of one non-tiled JPEG
+  bool windowed;
 };
 
 struct hamamatsu_jpeg_ops_data {
@@ -137,14 +165,14 @@ struct hamamatsu_jpeg_ops_data {
   struct jpeg **all_jpegs;
 
   // thread stuff, for background search of restart markers
-  GTimer *restart_marker_timer;
-  GMutex *restart_marker_mutex;
-  GThread *restart_marker_thread;
+  GThread *restart_marker_threads[RESTART_MARKER_THREADS];
+  gint restart_marker_want_counter;  // atomic ops only
+  // with OPENSLIDE_OPEN_LAZY, the threads start on the first read
+  bool restart_marker_threads_deferred;
+  GOnce restart_marker_threads_once;
 
-  GCond *restart_marker_cond;
-  GMutex *restart_marker_cond_mutex;
-  uint32_t restart_marker_users;
-  bool restart_marker_thread_throttle;
+  // protects the fields below and jpeg->index_claimed
+  GMutex *restart_marker_mutex;
   bool restart_marker_thread_stop;
   GError *restart_marker_thread_error;
 };
@@ -158,6 +186,9 @@ struct ngr_level {
   int64_t start_in_file;
 
   int32_t column_width;
+
+  // read-only mapping of the file, if enabled
+  GMappedFile *map;
 };
 
 enum OpenSlideHamamatsuError {
@@ -169,39 +200,88 @@ static GQuark _openslide_hamamatsu_error_quark(void) {
 }
 #define OPENSLIDE_HAMAMATSU_ERROR _openslide_hamamatsu_error_quark()
 
+// read the JPEG header, up to the start of the bitstream, into a
+// g_malloc'd buffer
+static uint8_t *read_jpeg_header(FILE *f,
+                                 int64_t header_start_position,
+                                 int64_t sof_position,
+                                 int64_t header_stop_position,
+                                 int32_t *header_length,
+                                 GError **err) {
+  // check for problems
+  if ((0 > header_start_position) ||
+      (header_start_position >= sof_position) ||
+      (sof_position + 9 >= header_stop_position) ||
+      (header_stop_position - header_start_position > INT32_MAX)) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+               "Can't read JPEG header: "
+	       "header_start_position: %"PRId64", "
+	       "sof_position: %"PRId64", "
+	       "header_stop_position: %"PRId64,
+	       header_start_position, sof_position, header_stop_position);
+    return NULL;
+  }
+
+  int32_t length = header_stop_position - header_start_position;
+  uint8_t *buffer = g_malloc(length);
+  //  g_debug("reading header from %"PRId64, header_start_position);
+  if (_openslide_fread_at(f, buffer, length,
+                          header_start_position) != (size_t) length) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Cannot read header in JPEG at %"PRId64,
+                header_start_position);
+    g_free(buffer);
+    return NULL;
+  }
+
+  // check for overlarge or 0 X/Y in SOF (some NDPI JPEGs have this)
+  // change them to a value libjpeg will accept
+  int64_t size_offset = sof_position - header_start_position + 5;
+  uint16_t y = (buffer[size_offset + 0] << 8) +
+                buffer[size_offset + 1];
+  if (y > JPEG_MAX_DIMENSION || y == 0) {
+    //g_debug("fixing up SOF Y");
+    buffer[size_offset + 0] = JPEG_MAX_DIMENSION_HIGH;
+    buffer[size_offset + 1] = JPEG_MAX_DIMENSION_LOW;
+  }
+  uint16_t x = (buffer[size_offset + 2] << 8) +
+                buffer[size_offset + 3];
+  if (x > JPEG_MAX_DIMENSION || x == 0) {
+    //g_debug("fixing up SOF X");
+    buffer[size_offset + 2] = JPEG_MAX_DIMENSION_HIGH;
+    buffer[size_offset + 3] = JPEG_MAX_DIMENSION_LOW;
+  }
+
+  *header_length = length;
+  return buffer;
+}
+
 /*
  * Source manager for reading a run of MCUs between two restart markers
  * as a complete JPEG.  Originally based on jdatasrc.c from IJG libjpeg.
  */
 static bool jpeg_random_access_src(j_decompress_ptr cinfo,
                                    FILE *infile,
-                                   int64_t header_start_position,
-                                   int64_t sof_position,
+                                   const uint8_t *header,
+                                   int32_t header_length,
                                    int64_t header_stop_position,
                                    int64_t start_position,
                                    int64_t stop_position,
                                    GError **err) {
   // check for problems
-  if ((0 > header_start_position) ||
-      (header_start_position >= sof_position) ||
-      (sof_position + 9 >= header_stop_position) ||
-      (start_position != -1 &&
-       ((header_stop_position > start_position) ||
-        (start_position >= stop_position)))) {
+  if (start_position != -1 &&
+      ((header_stop_position > start_position) ||
+       (start_position >= stop_position))) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                "Can't do random access JPEG read: "
-	       "header_start_position: %"PRId64", "
-	       "sof_position: %"PRId64", "
 	       "header_stop_position: %"PRId64", "
 	       "start_position: %"PRId64", "
 	       "stop_position: %"PRId64,
-	       header_start_position, sof_position, header_stop_position,
-	       start_position, stop_position);
+	       header_stop_position, start_position, stop_position);
     return false;
   }
 
   // compute size of buffer and allocate
-  int header_length = header_stop_position - header_start_position;
   int data_length = 0;
   if (start_position != -1) {
     data_length = stop_position - start_position;
@@ -211,26 +291,12 @@ static bool jpeg_random_access_src(j_decompress_ptr cinfo,
   JOCTET *buffer = (*cinfo->mem->alloc_large)((j_common_ptr) cinfo,
                                               JPOOL_IMAGE, buffer_size);
 
-  // read in the 2 parts
-  //  g_debug("reading header from %"PRId64, header_start_position);
-  if (fseeko(infile, header_start_position, SEEK_SET)) {
-    _openslide_io_error(err, "Couldn't seek to header start");
-    return false;
-  }
-  if (!fread(buffer, header_length, 1, infile)) {
-    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                "Cannot read header in JPEG at %"PRId64,
-                header_start_position);
-    return false;
-  }
-
+  // the header was read once, in advance; read the MCUs
+  memcpy(buffer, header, header_length);
   if (data_length) {
     //  g_debug("reading from %"PRId64, start_position);
-    if (fseeko(infile, start_position, SEEK_SET)) {
-      _openslide_io_error(err, "Couldn't seek to data start");
-      return false;
-    }
-    if (!fread(buffer + header_length, data_length, 1, infile)) {
+    if (_openslide_fread_at(infile, buffer + header_length, data_length,
+                            start_position) != (size_t) data_length) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Cannot read data in JPEG at %"PRId64, start_position);
       return false;
@@ -245,30 +311,60 @@ static bool jpeg_random_access_src(j_decompress_ptr cinfo,
     buffer[buffer_size - 1] = JPEG_EOI;
   }
 
-  // check for overlarge or 0 X/Y in SOF (some NDPI JPEGs have this)
-  // change them to a value libjpeg will accept
-  int64_t size_offset = sof_position - header_start_position + 5;
-  uint16_t y = (buffer[size_offset + 0] << 8) +
-                buffer[size_offset + 1];
-  if (y > JPEG_MAX_DIMENSION || y == 0) {
-    //g_debug("fixing up SOF Y");
-    buffer[size_offset + 0] = JPEG_MAX_DIMENSION_HIGH;
-    buffer[size_offset + 1] = JPEG_MAX_DIMENSION_LOW;
-  }
-  uint16_t x = (buffer[size_offset + 2] << 8) +
-                buffer[size_offset + 3];
-  if (x > JPEG_MAX_DIMENSION || x == 0) {
-    //g_debug("fixing up SOF X");
-    buffer[size_offset + 2] = JPEG_MAX_DIMENSION_HIGH;
-    buffer[size_offset + 3] = JPEG_MAX_DIMENSION_LOW;
-  }
-
   // pass the buffer off to mem_src
   _openslide_jpeg_mem_src(cinfo, buffer, buffer_size);
 
   return true;
 }
 
+// get an idle handle for the JPEG's file, or open a new one
+static FILE *jpeg_file_get(struct jpeg *jpeg, GError **err) {
+  g_mutex_lock(jpeg->file_mutex);
+  FILE *f = g_queue_pop_head(jpeg->files);
+  g_mutex_unlock(jpeg->file_mutex);
+
+  if (f) {
+    _openslide_persistent_file_release();
+  } else {
+    f = _openslide_fopen(jpeg->filename, "rb", err);
+  }
+  return f;
+}
+
+// keep the handle for the next read, within the persistent file budget
+static void jpeg_file_put(struct jpeg *jpeg, FILE *f) {
+  g_mutex_lock(jpeg->file_mutex);
+  if (g_queue_get_length(jpeg->files) < JPEG_FILE_CACHE_MAX &&
+      _openslide_persistent_file_acquire()) {
+    g_queue_push_head(jpeg->files, f);
+    f = NULL;
+  }
+  g_mutex_unlock(jpeg->file_mutex);
+
+  if (f) {
+    fclose(f);
+  }
+}
+
+// read and fix up the header on first use
+static const uint8_t *jpeg_get_header(struct jpeg *jpeg, FILE *f,
+                                      int32_t *header_length,
+                                      GError **err) {
+  g_mutex_lock(jpeg->file_mutex);
+  if (jpeg->header == NULL) {
+    jpeg->header = read_jpeg_header(f,
+                                    jpeg->start_in_file,
+                                    jpeg->sof_position,
+                                    jpeg->header_stop_position,
+                                    &jpeg->header_length,
+                                    err);
+  }
+  const uint8_t *header = jpeg->header;
+  *header_length = jpeg->header_length;
+  g_mutex_unlock(jpeg->file_mutex);
+  return header;
+}
+
 static void jpeg_level_free(gpointer data) {
   //g_debug("level_free: %p", data);
   struct jpeg_level *l = data;
@@ -286,7 +382,20 @@ static void jpeg_destroy_data(int32_t num_jpegs, struct jpeg **jpegs,
     g_free(jpeg->filename);
     g_free(jpeg->mcu_starts);
     g_free(jpeg->unreliable_mcu_starts);
-    g_slice_free(struct jpeg, jpeg);
+    if (jpeg->mcu_starts_mutex) {
+      g_mutex_free(jpeg->mcu_starts_mutex);
+    }
+    if (jpeg->files) {
+      FILE *f;
+      while ((f = g_queue_pop_head(jpeg->files)) != NULL) {
+        fclose(f);
+        _openslide_persistent_file_release();
+      }
+      g_queue_free(jpeg->files);
+      g_mutex_free(jpeg->file_mutex);
+    }
+    g_free(jpeg->header);
+    // the struct itself is in the slide's arena
   }
 
   // the JPEG array
@@ -494,6 +603,11 @@ static bool _compute_mcu_start(struct jpeg *jpeg,
   uint8_t *buf = buf_start;
   int bytes_in_buf = 0;
   while (first_good < target) {
+    // the markers found so far stay recorded, so a later search resumes
+    if (_openslide_check_interrupt(err)) {
+      return false;
+    }
+
     uint8_t marker_byte;
     int64_t after_marker_pos;
     if (!find_next_ff_marker(f, buf_start, &buf, sizeof(buf_start),
@@ -515,14 +629,12 @@ static bool _compute_mcu_start(struct jpeg *jpeg,
   return true;
 }
 
-static bool compute_mcu_start(openslide_t *osr,
-			      struct jpeg *jpeg,
+static bool compute_mcu_start(struct jpeg *jpeg,
 			      FILE *f,
 			      int64_t tileno,
 			      int64_t *start_position,
 			      int64_t *stop_position,
 			      GError **err) {
-  struct hamamatsu_jpeg_ops_data *data = osr->data;
   bool success = false;
 
   if (tileno < 0 || tileno >= jpeg->tile_count) {
@@ -531,7 +643,7 @@ static bool compute_mcu_start(openslide_t *osr,
     return false;
   }
 
-  g_mutex_lock(data->restart_marker_mutex);
+  g_mutex_lock(jpeg->mcu_starts_mutex);
 
   if (!_compute_mcu_start(jpeg, f, tileno, err)) {
     goto OUT;
@@ -560,14 +672,13 @@ static bool compute_mcu_start(openslide_t *osr,
   success = true;
 
 OUT:
-  g_mutex_unlock(data->restart_marker_mutex);
+  g_mutex_unlock(jpeg->mcu_starts_mutex);
   return success;
 }
 
 // wrapper that takes out-pointers to volatile, to avoid spurious longjmp
 // clobber warnings in read_from_jpeg() on gcc 4.9
-static bool compute_mcu_start_volatile(openslide_t *osr,
-                                       struct jpeg *jpeg,
+static bool compute_mcu_start_volatile(struct jpeg *jpeg,
                                        FILE *f,
                                        int64_t tileno,
                                        volatile int64_t *start_position,
@@ -575,7 +686,7 @@ static bool compute_mcu_start_volatile(openslide_t *osr,
                                        GError **err) {
   int64_t start;
   int64_t stop;
-  if (!compute_mcu_start(osr, jpeg, f, tileno, &start, &stop, err)) {
+  if (!compute_mcu_start(jpeg, f, tileno, &start, &stop, err)) {
     return false;
   }
   *start_position = start;
@@ -583,20 +694,98 @@ static bool compute_mcu_start_volatile(openslide_t *osr,
   return true;
 }
 
+static gpointer restart_marker_thread_func(gpointer d);
+
+static gpointer start_restart_marker_threads(gpointer d) {
+  openslide_t *osr = d;
+  struct hamamatsu_jpeg_ops_data *data = osr->data;
+  for (int i = 0; i < RESTART_MARKER_THREADS; i++) {
+    data->restart_marker_threads[i] =
+      g_thread_create(restart_marker_thread_func, osr, TRUE, NULL);
+  }
+  return NULL;
+}
+
+// decode one restart interval with the application's decoder, as a
+// standalone JPEG the size of the tile
+static bool decode_external(struct jpeg *jpeg, FILE *f,
+                            const uint8_t *header, int32_t header_length,
+                            int64_t start_position, int64_t stop_position,
+                            uint32_t *dest) {
+  int64_t data_length = stop_position - start_position;
+  if (header_length < 2 || data_length < 2 ||
+      header_length + data_length > INT32_MAX) {
+    return false;
+  }
+  uint8_t *buffer = g_malloc(header_length + data_length);
+  memcpy(buffer, header, header_length);
+  bool success = false;
+  if (_openslide_fread_at(f, buffer + header_length, data_length,
+                          start_position) != (size_t) data_length) {
+    goto DONE;
+  }
+
+  // the interval's final restart marker becomes EOI
+  uint8_t *end = buffer + header_length + data_length;
+  if (end[-2] != 0xFF) {
+    goto DONE;
+  }
+  end[-1] = JPEG_EOI;
+
+  // the header describes the whole image; describe the tile instead
+  int64_t size_offset = jpeg->sof_position - jpeg->start_in_file + 5;
+  buffer[size_offset + 0] = jpeg->tile_height >> 8;
+  buffer[size_offset + 1] = jpeg->tile_height & 0xff;
+  buffer[size_offset + 2] = jpeg->tile_width >> 8;
+  buffer[size_offset + 3] = jpeg->tile_width & 0xff;
+
+  success = _openslide_decode_external(OPENSLIDE_CODEC_JPEG,
+                                       buffer, header_length + data_length,
+                                       dest,
+                                       jpeg->tile_width, jpeg->tile_height);
+
+DONE:
+  g_free(buffer);
+  return success;
+}
+
+// decode count w x h windows, side by side from (x, y), of a scaled JPEG
+// tile, as _openslide_jpeg_decompress_run_windows() does
 static bool read_from_jpeg(openslide_t *osr,
                            struct jpeg *jpeg,
                            int32_t tileno,
                            int32_t scale_denom,
-                           uint32_t *dest,
+                           uint32_t **dests,
+                           int32_t count,
+                           int32_t x, int32_t y,
                            int32_t w, int32_t h,
                            GError **err) {
+  struct hamamatsu_jpeg_ops_data *data = osr->data;
   volatile bool success = false;
+  bool whole = count == 1 && !x && !y &&
+               w * scale_denom == jpeg->tile_width &&
+               h * scale_denom == jpeg->tile_height;
 
-  // open file
-  FILE *f = _openslide_fopen(jpeg->filename, "rb", err);
+  if (data->restart_marker_threads_deferred) {
+    g_once(&data->restart_marker_threads_once,
+           start_restart_marker_threads, osr);
+  }
+
+  // move this JPEG to the front of the background search
+  g_atomic_int_set(&jpeg->wanted,
+                   g_atomic_int_exchange_and_add(&data->restart_marker_want_counter, 1) + 1);
+
+  // get file handle and header
+  FILE *f = jpeg_file_get(jpeg, err);
   if (f == NULL) {
     return false;
   }
+  int32_t header_length;
+  const uint8_t *header = jpeg_get_header(jpeg, f, &header_length, err);
+  if (header == NULL) {
+    jpeg_file_put(jpeg, f);
+    return false;
+  }
 
   // begin decompress
   struct jpeg_decompress_struct *cinfo;
@@ -608,20 +797,27 @@ static bool read_from_jpeg(openslide_t *osr,
   // volatile to avoid spurious longjmp clobber warnings
   volatile int64_t start_position;
   volatile int64_t stop_position;
-  if (!compute_mcu_start_volatile(osr, jpeg, f, tileno,
+  if (!compute_mcu_start_volatile(jpeg, f, tileno,
                                   &start_position,
                                   &stop_position,
                                   err)) {
     goto OUT;
   }
 
+  if (whole && scale_denom == 1 &&
+      _openslide_decoder_present(OPENSLIDE_CODEC_JPEG) &&
+      decode_external(jpeg, f, header, header_length,
+                      start_position, stop_position, dests[0])) {
+    success = true;
+    goto OUT;
+  }
+
   if (setjmp(env) == 0) {
     // start decompressing
     _openslide_jpeg_decompress_init(dc, &env);
 
     if (!jpeg_random_access_src(cinfo, f,
-                                jpeg->start_in_file,
-                                jpeg->sof_position,
+                                header, header_length,
                                 jpeg->header_stop_position,
                                 start_position,
                                 stop_position,
@@ -642,7 +838,12 @@ static bool read_from_jpeg(openslide_t *osr,
     //    g_debug("output_width: %d", cinfo->output_width);
     //    g_debug("output_height: %d", cinfo->output_height);
 
-    if (!_openslide_jpeg_decompress_run(dc, dest, false, w, h, err)) {
+    if (whole) {
+      if (!_openslide_jpeg_decompress_run(dc, dests[0], false, w, h, err)) {
+        goto OUT;
+      }
+    } else if (!_openslide_jpeg_decompress_run_windows(dc, dests, count,
+                                                       x, y, w, h, err)) {
       goto OUT;
     }
     success = true;
@@ -653,10 +854,56 @@ static bool read_from_jpeg(openslide_t *osr,
 
 OUT:
   _openslide_jpeg_decompress_destroy(dc);
-  fclose(f);
+  jpeg_file_put(jpeg, f);
   return success;
 }
 
+// decode the windows of a windowed level's tile row in groups, each in
+// one pass over the JPEG's rows, and cache the group containing the
+// tile.  Returns the tile's data and cache entry.
+static uint32_t *read_jpeg_windows(openslide_t *osr,
+                                   struct jpeg_level *l,
+                                   struct jpeg *jp,
+                                   int64_t tile_col, int64_t tile_row,
+                                   struct _openslide_cache_entry **cache_entry,
+                                   GError **err) {
+  int32_t tw = l->tile_width;
+  int32_t th = l->tile_height;
+  int64_t tile_size = (int64_t) tw * th * 4;
+  int64_t per_pass = MAX(JPEG_WINDOW_PASS_BYTES / tile_size, 1);
+  int64_t first_col = tile_col / per_pass * per_pass;
+  int32_t count = MIN(per_pass, l->tiles_across - first_col);
+
+  uint32_t **bufs = g_new(uint32_t *, count);
+  for (int32_t i = 0; i < count; i++) {
+    bufs[i] = _openslide_buffer_alloc(tile_size);
+  }
+  int32_t y = tile_row * th;
+  if (!read_from_jpeg(osr, jp, 0, l->scale_denom, bufs, count,
+                      first_col * tw, y, tw, MIN(th, l->base.h - y), err)) {
+    for (int32_t i = 0; i < count; i++) {
+      _openslide_buffer_free(tile_size, bufs[i]);
+    }
+    g_free(bufs);
+    return NULL;
+  }
+
+  uint32_t *tiledata = NULL;
+  for (int32_t i = 0; i < count; i++) {
+    struct _openslide_cache_entry *entry;
+    _openslide_cache_put(osr->cache, l, first_col + i, tile_row,
+                         bufs[i], tile_size, &entry);
+    if (first_col + i == tile_col) {
+      tiledata = bufs[i];
+      *cache_entry = entry;
+    } else {
+      _openslide_cache_entry_unref(entry);
+    }
+  }
+  g_free(bufs);
+  return tiledata;
+}
+
 static bool read_jpeg_tile(openslide_t *osr,
                            cairo_t *cr,
                            struct _openslide_level *level,
@@ -665,10 +912,13 @@ static bool read_jpeg_tile(openslide_t *osr,
                            GError **err) {
   struct jpeg_level *l = (struct jpeg_level *) level;
 
-  int32_t jpeg_col = tile_col / l->jpegs[0]->tiles_across;
-  int32_t jpeg_row = tile_row / l->jpegs[0]->tiles_down;
-  int32_t local_tile_col = tile_col % l->jpegs[0]->tiles_across;
-  int32_t local_tile_row = tile_row % l->jpegs[0]->tiles_down;
+  // a windowed level's tiles are all in JPEG tile 0
+  int64_t jpeg_tile_col = l->windowed ? 0 : tile_col;
+  int64_t jpeg_tile_row = l->windowed ? 0 : tile_row;
+  int32_t jpeg_col = jpeg_tile_col / l->jpegs[0]->tiles_across;
+  int32_t jpeg_row = jpeg_tile_row / l->jpegs[0]->tiles_down;
+  int32_t local_tile_col = jpeg_tile_col % l->jpegs[0]->tiles_across;
+  int32_t local_tile_row = jpeg_tile_row % l->jpegs[0]->tiles_down;
 
   // grid should ensure tile col/row are in bounds
   g_assert(jpeg_col >= 0 && jpeg_col < l->jpegs_across);
@@ -680,6 +930,14 @@ static bool read_jpeg_tile(openslide_t *osr,
   int32_t tw = l->tile_width;
   int32_t th = l->tile_height;
 
+  // the part of the tile inside the level
+  int32_t w = tw;
+  int32_t h = th;
+  if (l->windowed) {
+    w = MIN(tw, l->base.w - tile_col * tw);
+    h = MIN(th, l->base.h - tile_row * th);
+  }
+
   //g_debug("hamamatsu read_tile: jpeg %d %d, local %d %d, tile %d, dim %d %d", jpeg_col, jpeg_row, local_tile_col, local_tile_row, tileno, tw, th);
 
   // get the jpeg data, possibly from cache
@@ -688,14 +946,20 @@ static bool read_jpeg_tile(openslide_t *osr,
                                             level, tile_col, tile_row,
                                             &cache_entry);
 
-  if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
+  if (!tiledata && l->windowed) {
+    tiledata = read_jpeg_windows(osr, l, jp, tile_col, tile_row,
+                                 &cache_entry, err);
+    if (!tiledata) {
+      return false;
+    }
+  } else if (!tiledata) {
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
     if (!read_from_jpeg(osr,
                         jp, tileno,
                         l->scale_denom,
-                        tiledata, tw, th,
+                        &tiledata, 1, 0, 0, w, h,
                         err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -709,8 +973,8 @@ static bool read_jpeg_tile(openslide_t *osr,
   // draw it
   cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiledata,
 								 CAIRO_FORMAT_RGB24,
-								 tw, th,
-								 tw * 4);
+								 w, h,
+								 w * 4);
 
   cairo_set_source_surface(cr, surface, 0, 0);
   cairo_surface_destroy(surface);
@@ -731,78 +995,98 @@ static bool jpeg_paint_region(openslide_t *osr, cairo_t *cr,
   struct hamamatsu_jpeg_ops_data *data = osr->data;
   struct jpeg_level *l = (struct jpeg_level *) level;
 
-  g_mutex_lock(data->restart_marker_cond_mutex);
+  g_mutex_lock(data->restart_marker_mutex);
   // check for background errors
   if (data->restart_marker_thread_error) {
     // propagate error
     g_propagate_error(err, data->restart_marker_thread_error);
     data->restart_marker_thread_error = NULL;
-    g_mutex_unlock(data->restart_marker_cond_mutex);
+    g_mutex_unlock(data->restart_marker_mutex);
     return false;
   }
-  // tell the background thread to pause
-  data->restart_marker_users++;
-  //  g_debug("telling thread to pause");
-  g_mutex_unlock(data->restart_marker_cond_mutex);
+  g_mutex_unlock(data->restart_marker_mutex);
 
   // paint
-  bool success = _openslide_grid_paint_region(l->grid, cr, NULL,
-                                              x / level->downsample,
-                                              y / level->downsample,
-                                              level, w, h,
-                                              err);
+  return _openslide_grid_paint_region(l->grid, cr, NULL,
+                                      x / level->downsample,
+                                      y / level->downsample,
+                                      level, w, h,
+                                      err);
+}
 
-  // maybe tell the background thread to resume
-  g_mutex_lock(data->restart_marker_cond_mutex);
-  if (!--data->restart_marker_users) {
-    g_timer_start(data->restart_marker_timer);
-    //  g_debug("telling thread to awaken");
-    g_cond_signal(data->restart_marker_cond);
+static void join_restart_marker_threads(struct hamamatsu_jpeg_ops_data *data) {
+  for (int i = 0; i < RESTART_MARKER_THREADS; i++) {
+    if (data->restart_marker_threads[i]) {
+      g_thread_join(data->restart_marker_threads[i]);
+      data->restart_marker_threads[i] = NULL;
+    }
   }
-  g_mutex_unlock(data->restart_marker_cond_mutex);
-
-  return success;
 }
 
 static void jpeg_do_destroy(openslide_t *osr) {
   struct hamamatsu_jpeg_ops_data *data = osr->data;
 
-  // tell the thread to finish and wait
-  g_mutex_lock(data->restart_marker_cond_mutex);
-  g_warn_if_fail(data->restart_marker_users == 0);
+  // tell the threads to finish and wait
+  g_mutex_lock(data->restart_marker_mutex);
   data->restart_marker_thread_stop = true;
-  g_cond_signal(data->restart_marker_cond);
-  g_mutex_unlock(data->restart_marker_cond_mutex);
-  if (data->restart_marker_thread) {
-    g_thread_join(data->restart_marker_thread);
-  }
+  g_mutex_unlock(data->restart_marker_mutex);
+  join_restart_marker_threads(data);
 
   // jpegs and levels
   jpeg_destroy_data(data->jpeg_count, data->all_jpegs,
                     osr->level_count, (struct jpeg_level **) osr->levels);
 
   // the background stuff
-  g_mutex_lock(data->restart_marker_cond_mutex);
+  g_mutex_lock(data->restart_marker_mutex);
   if (data->restart_marker_thread_error) {
     g_error_free(data->restart_marker_thread_error);
   }
-  g_mutex_unlock(data->restart_marker_cond_mutex);
+  g_mutex_unlock(data->restart_marker_mutex);
   g_mutex_free(data->restart_marker_mutex);
-  g_timer_destroy(data->restart_marker_timer);
-  g_cond_free(data->restart_marker_cond);
-  g_mutex_free(data->restart_marker_cond_mutex);
 
   // the structure
   g_slice_free(struct hamamatsu_jpeg_ops_data, data);
 }
 
+static int32_t jpeg_get_idle_handle_count(openslide_t *osr) {
+  struct hamamatsu_jpeg_ops_data *data = osr->data;
+  int32_t count = 0;
+  for (int32_t i = 0; i < data->jpeg_count; i++) {
+    struct jpeg *jpeg = data->all_jpegs[i];
+    g_mutex_lock(jpeg->file_mutex);
+    count += g_queue_get_length(jpeg->files);
+    g_mutex_unlock(jpeg->file_mutex);
+  }
+  return count;
+}
+
+static void jpeg_release_idle_handles(openslide_t *osr) {
+  struct hamamatsu_jpeg_ops_data *data = osr->data;
+  for (int32_t i = 0; i < data->jpeg_count; i++) {
+    struct jpeg *jpeg = data->all_jpegs[i];
+    g_mutex_lock(jpeg->file_mutex);
+    GList *idle = jpeg->files->head;
+    g_queue_init(jpeg->files);
+    g_mutex_unlock(jpeg->file_mutex);
+
+    for (GList *cur = idle; cur; cur = cur->next) {
+      fclose(cur->data);
+      _openslide_persistent_file_release();
+    }
+    g_list_free(idle);
+  }
+}
+
 static const struct _openslide_ops hamamatsu_jpeg_ops = {
   .paint_region = jpeg_paint_region,
+  .get_idle_handle_count = jpeg_get_idle_handle_count,
+  .release_idle_handles = jpeg_release_idle_handles,
   .destroy = jpeg_do_destroy,
 };
 
 static bool hamamatsu_vms_vmu_detect(const char *filename,
                                      struct _openslide_tifflike *tl,
+                                     struct _openslide_detect_context *dc,
                                      GError **err) {
   // reject TIFFs
   if (tl) {
@@ -844,7 +1128,9 @@ static bool hamamatsu_vms_vmu_detect(const char *filename,
     return false;
   }
 
-  g_key_file_free(key_file);
+  // keep the key file for hamamatsu_vms_vmu_open
+  _openslide_detect_context_put(dc, VMS_DETECT_KEY_FILE, key_file,
+                                (GDestroyNotify) g_key_file_free);
   return true;
 }
 
@@ -900,96 +1186,80 @@ static bool verify_mcu_starts(int32_t num_jpegs, struct jpeg **jpegs,
   return true;
 }
 
-static gpointer restart_marker_thread_func(gpointer d) {
-  openslide_t *osr = d;
-  struct hamamatsu_jpeg_ops_data *data = osr->data;
-
-  int32_t current_jpeg = 0;
-  int32_t current_mcu_start = 0;
-
-  FILE *current_file = NULL;
-
-  GError *tmp_err = NULL;
-
-  while(current_jpeg < data->jpeg_count) {
-    g_mutex_lock(data->restart_marker_cond_mutex);
+// pick the unindexed JPEG that was most recently read from, or else the
+// first unindexed one
+static struct jpeg *claim_next_jpeg(struct hamamatsu_jpeg_ops_data *data) {
+  struct jpeg *best = NULL;
+  gint best_wanted = 0;
 
-    // should we pause?
-    while (data->restart_marker_users && !data->restart_marker_thread_stop) {
-      //      g_debug("thread paused");
-      g_cond_wait(data->restart_marker_cond,
-		  data->restart_marker_cond_mutex); // zzz
-      //      g_debug("thread awoken");
+  g_mutex_lock(data->restart_marker_mutex);
+  if (!data->restart_marker_thread_stop) {
+    for (int32_t i = 0; i < data->jpeg_count; i++) {
+      struct jpeg *jp = data->all_jpegs[i];
+      if (jp->index_claimed || jp->tile_count <= 1) {
+        continue;
+      }
+      gint wanted = g_atomic_int_get(&jp->wanted);
+      if (best == NULL || wanted > best_wanted) {
+        best = jp;
+        best_wanted = wanted;
+      }
     }
-
-    // should we stop?
-    if (data->restart_marker_thread_stop) {
-      //      g_debug("thread stopping");
-      g_mutex_unlock(data->restart_marker_cond_mutex);
-      break;
+    if (best) {
+      best->index_claimed = true;
     }
+  }
+  g_mutex_unlock(data->restart_marker_mutex);
+  return best;
+}
 
-    // should we sleep?
-    double time_to_sleep = 1.0 - g_timer_elapsed(data->restart_marker_timer,
-						 NULL);
-    if (data->restart_marker_thread_throttle &&
-        time_to_sleep > 0) {
-      GTimeVal abstime;
-      gulong sleep_time = G_USEC_PER_SEC * time_to_sleep;
+static bool should_stop(struct hamamatsu_jpeg_ops_data *data) {
+  g_mutex_lock(data->restart_marker_mutex);
+  bool stop = data->restart_marker_thread_stop;
+  g_mutex_unlock(data->restart_marker_mutex);
+  return stop;
+}
 
-      g_get_current_time(&abstime);
-      g_time_val_add(&abstime, sleep_time);
+static gpointer restart_marker_thread_func(gpointer d) {
+  openslide_t *osr = d;
+  struct hamamatsu_jpeg_ops_data *data = osr->data;
+  GError *tmp_err = NULL;
 
-      //      g_debug("zz: %lu", sleep_time);
-      g_cond_timed_wait(data->restart_marker_cond,
-			data->restart_marker_cond_mutex,
-			&abstime);
-      //      g_debug("running again");
-      g_mutex_unlock(data->restart_marker_cond_mutex);
-      continue;
+  struct jpeg *jp;
+  while (!tmp_err && (jp = claim_next_jpeg(data)) != NULL) {
+    FILE *f = _openslide_fopen(jp->filename, "rb", &tmp_err);
+    if (f == NULL) {
+      //g_debug("restart_marker_thread_func fopen failed");
+      break;
     }
 
-    // we are finally able to run
-    g_mutex_unlock(data->restart_marker_cond_mutex);
-
-    //g_debug("current_jpeg: %d, current_mcu_start: %d",
-    //        current_jpeg, current_mcu_start);
-
-    struct jpeg *jp = data->all_jpegs[current_jpeg];
-    if (jp->tile_count > 1) {
-      if (current_file == NULL) {
-	current_file = _openslide_fopen(jp->filename, "rb", &tmp_err);
-	if (current_file == NULL) {
-	  //g_debug("restart_marker_thread_func fopen failed");
-	  break;
-	}
+    // search in steps, so readers of this JPEG don't wait for all of it
+    for (int64_t target = 0; target < jp->tile_count;
+         target += RESTART_MARKER_STEP) {
+      if (should_stop(data)) {
+        break;
       }
-
-      if (!compute_mcu_start(osr, jp, current_file, current_mcu_start,
-                             NULL, NULL, &tmp_err)) {
+      int64_t tileno = MIN(target + RESTART_MARKER_STEP, jp->tile_count) - 1;
+      if (!compute_mcu_start(jp, f, tileno, NULL, NULL, &tmp_err)) {
         //g_debug("restart_marker_thread_func compute_mcu_start failed");
-        fclose(current_file);
         break;
       }
-
-      current_mcu_start++;
-      if (current_mcu_start >= jp->tile_count) {
-	current_mcu_start = 0;
-	current_jpeg++;
-	fclose(current_file);
-	current_file = NULL;
-      }
-    } else {
-      current_jpeg++;
     }
+    fclose(f);
   }
 
   // store error, if any
   if (tmp_err) {
     //g_debug("restart_marker_thread_func failed: %s", tmp_err->message);
-    g_mutex_lock(data->restart_marker_cond_mutex);
-    data->restart_marker_thread_error = tmp_err;
-    g_mutex_unlock(data->restart_marker_cond_mutex);
+    g_mutex_lock(data->restart_marker_mutex);
+    if (!data->restart_marker_thread_error) {
+      data->restart_marker_thread_error = tmp_err;
+    } else {
+      g_error_free(tmp_err);
+    }
+    // no point in continuing
+    data->restart_marker_thread_stop = true;
+    g_mutex_unlock(data->restart_marker_mutex);
   }
 
   //  g_debug("restart_marker_thread_func done!");
@@ -1016,14 +1286,21 @@ static bool validate_jpeg_header(FILE *f, bool use_jpeg_dimensions,
     return false;
   }
 
+  int32_t header_length;
+  uint8_t *header = read_jpeg_header(f, header_start, *sof_position,
+                                     *header_stop_position,
+                                     &header_length, err);
+  if (header == NULL) {
+    return false;
+  }
+
   struct jpeg_decompress_struct *cinfo;
   struct _openslide_jpeg_decompress *dc =
     _openslide_jpeg_decompress_create(&cinfo);
 
   if (setjmp(env) == 0) {
     _openslide_jpeg_decompress_init(dc, &env);
-    if (!jpeg_random_access_src(cinfo, f,
-                                header_start, *sof_position,
+    if (!jpeg_random_access_src(cinfo, f, header, header_length,
                                 *header_stop_position, -1, -1, err)) {
       goto DONE;
     }
@@ -1107,6 +1384,7 @@ static bool validate_jpeg_header(FILE *f, bool use_jpeg_dimensions,
 
 DONE:
   _openslide_jpeg_decompress_destroy(dc);
+  g_free(header);
   return success;
 }
 
@@ -1227,15 +1505,16 @@ static void create_scaled_jpeg_levels(openslide_t *osr,
 
     // try adding scale_denom levels
     for (int scale_denom = 2; scale_denom <= 8; scale_denom <<= 1) {
-      // check to make sure we get an even division
-      if ((l->tile_width % scale_denom) ||
-          (l->tile_height % scale_denom)) {
+      // check to make sure we get an even division of the JPEG tiles
+      if ((l->jpegs[0]->tile_width % scale_denom) ||
+          (l->jpegs[0]->tile_height % scale_denom)) {
         continue;
       }
 
       // create a derived level
       struct jpeg_level *sd_l = g_slice_new0(struct jpeg_level);
       sd_l->scale_denom = scale_denom;
+      sd_l->windowed = l->windowed;
 
       sd_l->base.w = l->base.w / scale_denom;
       sd_l->base.h = l->base.h / scale_denom;
@@ -1263,6 +1542,7 @@ static void create_scaled_jpeg_levels(openslide_t *osr,
                                                  sd_l->tile_width,
                                                  sd_l->tile_height,
                                                  read_jpeg_tile);
+      sd_l->base.simple_grid = true;
 
       key = g_slice_new(int64_t);
       *key = sd_l->base.w;
@@ -1327,41 +1607,45 @@ static bool init_jpeg_ops(openslide_t *osr,
   osr->level_count = level_count;
   osr->levels = (struct _openslide_level **) levels;
 
-  // init background thread for finding restart markers
-  data->restart_marker_timer = g_timer_new();
+  // init background threads for finding restart markers
+  for (int32_t i = 0; i < num_jpegs; i++) {
+    jpegs[i]->mcu_starts_mutex = g_mutex_new();
+    jpegs[i]->files = g_queue_new();
+    jpegs[i]->file_mutex = g_mutex_new();
+  }
   data->restart_marker_mutex = g_mutex_new();
-  data->restart_marker_cond = g_cond_new();
-  data->restart_marker_cond_mutex = g_mutex_new();
-  data->restart_marker_thread_throttle =
-    !_openslide_debug(OPENSLIDE_DEBUG_JPEG_MARKERS);
+  bool debug = _openslide_debug(OPENSLIDE_DEBUG_JPEG_MARKERS);
+  bool full_index = debug || (osr->open_flags & OPENSLIDE_OPEN_FULL_INDEX);
   if (background_thread) {
-    data->restart_marker_thread = g_thread_create(restart_marker_thread_func,
-                                                  osr,
-                                                  TRUE,
-                                                  NULL);
+    if ((osr->open_flags & OPENSLIDE_OPEN_LAZY) && !full_index) {
+      data->restart_marker_threads_deferred = true;
+    } else {
+      start_restart_marker_threads(osr);
+    }
   }
 
-  // for debugging
-  if (_openslide_debug(OPENSLIDE_DEBUG_JPEG_MARKERS)) {
-    // run background thread to completion
+  if (full_index) {
+    // run background threads to completion
     if (background_thread) {
-      g_thread_join(data->restart_marker_thread);
-      data->restart_marker_thread = NULL;
+      join_restart_marker_threads(data);
     } else {
       restart_marker_thread_func(osr);
     }
 
     // check for errors
-    g_mutex_lock(data->restart_marker_cond_mutex);
+    g_mutex_lock(data->restart_marker_mutex);
     if (data->restart_marker_thread_error) {
       g_propagate_error(err, data->restart_marker_thread_error);
       data->restart_marker_thread_error = NULL;
-      g_mutex_unlock(data->restart_marker_cond_mutex);
+      g_mutex_unlock(data->restart_marker_mutex);
       jpeg_do_destroy(osr);
       return false;
     }
-    g_mutex_unlock(data->restart_marker_cond_mutex);
+    g_mutex_unlock(data->restart_marker_mutex);
+  }
 
+  // for debugging
+  if (debug) {
     // verify results
     if (!verify_mcu_starts(num_jpegs, jpegs, err)) {
       jpeg_do_destroy(osr);
@@ -1400,6 +1684,17 @@ static struct jpeg_level *create_jpeg_level(openslide_t *osr,
   l->tile_height = jpegs[0]->tile_height;
   l->scale_denom = 1;
 
+  // decoding a large non-tiled JPEG whole would produce a tile too large
+  // to cache, so read it in windows
+  if (jpeg_cols == 1 && jpeg_rows == 1 && jpegs[0]->tile_count == 1 &&
+      (l->base.w > JPEG_WINDOW_SIZE || l->base.h > JPEG_WINDOW_SIZE)) {
+    l->windowed = true;
+    l->tile_width = JPEG_WINDOW_SIZE;
+    l->tile_height = JPEG_WINDOW_SIZE;
+    l->tiles_across = (l->base.w + JPEG_WINDOW_SIZE - 1) / JPEG_WINDOW_SIZE;
+    l->tiles_down = (l->base.h + JPEG_WINDOW_SIZE - 1) / JPEG_WINDOW_SIZE;
+  }
+
   // jpeg array
   int32_t num_jpegs = l->jpegs_across * l->jpegs_down;
   l->jpegs = g_new(struct jpeg *, num_jpegs);
@@ -1416,6 +1711,7 @@ static struct jpeg_level *create_jpeg_level(openslide_t *osr,
                                           l->tiles_across, l->tiles_down,
                                           l->tile_width, l->tile_height,
                                           read_jpeg_tile);
+  l->base.simple_grid = true;
 
   return l;
 }
@@ -1431,7 +1727,7 @@ static bool hamamatsu_vms_part2(openslide_t *osr,
   // initialize individual jpeg structs
   struct jpeg **jpegs = g_new0(struct jpeg *, num_jpegs);
   for (int i = 0; i < num_jpegs; i++) {
-    jpegs[i] = g_slice_new0(struct jpeg);
+    jpegs[i] = _openslide_arena_alloc(osr->arena, sizeof(struct jpeg));
   }
 
   // process jpegs
@@ -1582,6 +1878,9 @@ static void ngr_destroy(openslide_t *osr) {
   for (int i = 0; i < osr->level_count; i++) {
     struct ngr_level *l = (struct ngr_level *) osr->levels[i];
     g_free(l->filename);
+    if (l->map) {
+      g_mapped_file_unref(l->map);
+    }
     _openslide_grid_destroy(l->grid);
     g_slice_free(struct ngr_level, l);
   }
@@ -1605,47 +1904,45 @@ static bool ngr_read_tile(openslide_t *osr,
                                             &cache_entry);
 
   if (!tiledata) {
-    // read the tile data
-    FILE *f = _openslide_fopen(l->filename, "rb", err);
-    if (!f) {
-      return false;
-    }
-
     // compute offset to read
     int64_t offset = l->start_in_file +
       (tile_y * NGR_TILE_HEIGHT * l->column_width * 6) +
       (tile_x * l->base.h * l->column_width * 6);
     //g_debug("tile_x: %"PRId64", tile_y: %"PRId64", seeking to %"PRId64, tile_x, tile_y, offset);
-    if (fseeko(f, offset, SEEK_SET)) {
-      _openslide_io_error(err, "Couldn't seek to tile offset");
-      fclose(f);
-      return false;
-    }
-
-    // alloc and read
     int buf_size = tw * th * 6;
-    uint16_t *buf = g_slice_alloc(buf_size);
 
-    if (fread(buf, buf_size, 1, f) != 1) {
-      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                  "Cannot read file %s", l->filename);
+    // the tile is uncompressed, so convert straight from the mapping
+    // when the samples are aligned
+    const uint16_t *src = NULL;
+    uint16_t *buf = NULL;
+    if (l->map && offset % 2 == 0 &&
+        offset + buf_size <= (int64_t) g_mapped_file_get_length(l->map)) {
+      src = (const uint16_t *) (g_mapped_file_get_contents(l->map) + offset);
+    } else {
+      FILE *f = _openslide_fopen(l->filename, "rb", err);
+      if (!f) {
+        return false;
+      }
+
+      // alloc and read
+      buf = g_slice_alloc(buf_size);
+      if (_openslide_fread_at(f, buf, buf_size, offset) != (size_t) buf_size) {
+        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                    "Cannot read file %s", l->filename);
+        fclose(f);
+        g_slice_free1(buf_size, buf);
+        return false;
+      }
       fclose(f);
-      g_slice_free1(buf_size, buf);
-      return false;
+      src = buf;
     }
-    fclose(f);
 
-    // got the data, now convert to 8-bit xRGB
-    tiledata = g_slice_alloc(tilesize);
-    for (int i = 0; i < tw * th; i++) {
-      // scale down from 12 bits
-      uint8_t r = GINT16_FROM_LE(buf[(i * 3)]) >> 4;
-      uint8_t g = GINT16_FROM_LE(buf[(i * 3) + 1]) >> 4;
-      uint8_t b = GINT16_FROM_LE(buf[(i * 3) + 2]) >> 4;
-
-      tiledata[i] = (r << 16) | (g << 8) | b;
+    // got the data, now scale down from 12 bits to 8-bit xRGB
+    tiledata = _openslide_buffer_alloc(tilesize);
+    _openslide_convert_rgb12_to_argb(tiledata, src, tw * th);
+    if (buf) {
+      g_slice_free1(buf_size, buf);
     }
-    g_slice_free1(buf_size, buf);
 
     // put it in the cache
     _openslide_cache_put(osr->cache, level, tile_x, tile_y,
@@ -1771,12 +2068,24 @@ static bool hamamatsu_vmu_part2(openslide_t *osr,
                                             l->column_width,
                                             NGR_TILE_HEIGHT,
                                             ngr_read_tile);
+    l->base.simple_grid = true;
 
     // tile size hints
     l->base.tile_w = l->column_width;
     l->base.tile_h = NGR_TILE_HEIGHT;
 
     fclose(f);
+
+    // a file truncated while mapped raises SIGBUS, so this is opt-in
+    if (_openslide_mmap_enabled()) {
+      GError *tmp_err = NULL;
+      l->map = g_mapped_file_new(l->filename, false, &tmp_err);
+      if (l->map == NULL) {
+        _openslide_performance_warn("Couldn't map %s: %s",
+                                    l->filename, tmp_err->message);
+        g_clear_error(&tmp_err);
+      }
+    }
   }
 
   // set osr data
@@ -1792,6 +2101,9 @@ static bool hamamatsu_vmu_part2(openslide_t *osr,
   for (int i = 0; i < num_levels; i++) {
     _openslide_grid_destroy(levels[i]->grid);
     g_free(levels[i]->filename);
+    if (levels[i]->map) {
+      g_mapped_file_unref(levels[i]->map);
+    }
     g_slice_free(struct ngr_level, levels[i]);
   }
   g_free(levels);
@@ -1802,6 +2114,7 @@ static bool hamamatsu_vmu_part2(openslide_t *osr,
 
 static bool hamamatsu_vms_vmu_open(openslide_t *osr, const char *filename,
                                    struct _openslide_tifflike *tl G_GNUC_UNUSED,
+                                   struct _openslide_detect_context *dc,
                                    struct _openslide_hash *quickhash1,
                                    GError **err) {
   // initialize any variables destroyed/used in DONE
@@ -1811,8 +2124,12 @@ static bool hamamatsu_vms_vmu_open(openslide_t *osr, const char *filename,
   bool success = false;
 
   // first, see if it's a VMS/VMU file
-  GKeyFile *key_file = _openslide_read_key_file(filename, KEY_FILE_MAX_SIZE,
-                                                G_KEY_FILE_NONE, err);
+  GKeyFile *key_file = _openslide_detect_context_steal(dc,
+                                                       VMS_DETECT_KEY_FILE);
+  if (!key_file) {
+    key_file = _openslide_read_key_file(filename, KEY_FILE_MAX_SIZE,
+                                        G_KEY_FILE_NONE, err);
+  }
   if (!key_file) {
     g_prefix_error(err, "Can't load key file: ");
     goto DONE;
@@ -2021,6 +2338,7 @@ static bool hamamatsu_vms_vmu_open(openslide_t *osr, const char *filename,
     if (tmp) {
       char *optimisation_filename = g_build_filename(dirname, tmp, NULL);
       g_free(tmp);
+      _openslide_add_source_file(osr, optimisation_filename);
 
       optimisation_file = _openslide_fopen(optimisation_filename, "rb", NULL);
 
@@ -2077,6 +2395,9 @@ static bool hamamatsu_vms_vmu_open(openslide_t *osr, const char *filename,
   // now that we have the level 0 dimensions, add properties
   if (success) {
     add_properties(osr, key_file, groupname, osr->levels[0]);
+    for (int i = 0; i < num_images; i++) {
+      _openslide_add_source_file(osr, image_filenames[i]);
+    }
   }
 
  DONE:
@@ -2104,6 +2425,7 @@ const struct _openslide_format _openslide_format_hamamatsu_vms_vmu = {
 
 static bool hamamatsu_ndpi_detect(const char *filename G_GNUC_UNUSED,
                                   struct _openslide_tifflike *tl,
+                                  struct _openslide_detect_context *dc G_GNUC_UNUSED,
                                   GError **err) {
   // ensure we have a tifflike
   if (!tl) {
@@ -2229,6 +2551,7 @@ static void ndpi_set_props(openslide_t *osr,
 
 static bool hamamatsu_ndpi_open(openslide_t *osr, const char *filename,
                                 struct _openslide_tifflike *tl,
+                                struct _openslide_detect_context *dc G_GNUC_UNUSED,
                                 struct _openslide_hash *quickhash1,
                                 GError **err) {
   GPtrArray *jpeg_array = g_ptr_array_new();
@@ -2340,7 +2663,7 @@ static bool hamamatsu_ndpi_open(openslide_t *osr, const char *filename,
       }
 
       // init jpeg
-      struct jpeg *jp = g_slice_new0(struct jpeg);
+      struct jpeg *jp = _openslide_arena_alloc(osr->arena, sizeof(*jp));
       jp->filename = g_strdup(filename);
       jp->start_in_file = start_in_file;
       jp->end_in_file = start_in_file + num_bytes;
@@ -44,6 +44,7 @@
 
 static const char LEICA_XMLNS_1[] = "http://www.leica-microsystems.com/scn/2010/03/10";
 static const char LEICA_XMLNS_2[] = "http://www.leica-microsystems.com/scn/2010/10/01";
+static const char LEICA_DETECT_XML[] = "leica-xml";
 static const char LEICA_ATTR_SIZE_X[] = "sizeX";
 static const char LEICA_ATTR_SIZE_Y[] = "sizeY";
 static const char LEICA_ATTR_OFFSET_X[] = "offsetX";
@@ -64,6 +65,7 @@ static const char LEICA_VALUE_BRIGHTFIELD[] = "brightfield";
 
 struct leica_ops_data {
   struct _openslide_tiffcache *tc;
+  int32_t plane_count;
 };
 
 struct level {
@@ -77,6 +79,9 @@ struct area {
   struct _openslide_tiff_level tiffl;
   struct _openslide_grid *grid;
 
+  // z-planes 1 and up, with the same geometry as tiffl
+  struct _openslide_tiff_level *extra_planes;
+
   int64_t offset_x;
   int64_t offset_y;
 };
@@ -84,6 +89,9 @@ struct area {
 struct read_tile_args {
   TIFF *tiff;
   struct area *area;
+  // if painting every z-plane
+  cairo_t **plane_crs;
+  int32_t plane_count;
 };
 
 /* structs representing data parsed from ImageDescription XML */
@@ -107,15 +115,18 @@ struct image {
   char *aperture;
 
   bool is_macro;
+  int32_t z_count;
   int64_t nm_across;
   int64_t nm_down;
   int64_t nm_offset_x;
   int64_t nm_offset_y;
 
-  GPtrArray *dimensions;
+  GPtrArray *dimensions;  // z-plane 0
+  GPtrArray *planes;  // other z-planes
 };
 
 struct dimension {
+  int64_t z;
   int64_t dir;
   int64_t width;
   int64_t height;
@@ -126,6 +137,7 @@ static void destroy_level(struct level *l) {
   for (uint32_t n = 0; n < l->areas->len; n++) {
     struct area *area = l->areas->pdata[n];
     _openslide_grid_destroy(area->grid);
+    g_free(area->extra_planes);
     g_slice_free(struct area, area);
   }
   g_ptr_array_free(l->areas, true);
@@ -143,15 +155,13 @@ static void destroy(openslide_t *osr) {
   g_free(osr->levels);
 }
 
-static bool read_tile(openslide_t *osr,
-                      cairo_t *cr,
-                      struct _openslide_level *level G_GNUC_UNUSED,
-                      int64_t tile_col, int64_t tile_row,
-                      void *arg,
-                      GError **err) {
-  struct read_tile_args *args = arg;
-  struct _openslide_tiff_level *tiffl = &args->area->tiffl;
-
+// plane 0 is keyed by its area, since plane 0's tiffl is its first member
+static bool paint_plane_tile(openslide_t *osr,
+                             cairo_t *cr,
+                             TIFF *tiff,
+                             struct _openslide_tiff_level *tiffl,
+                             int64_t tile_col, int64_t tile_row,
+                             GError **err) {
   // tile size
   int64_t tw = tiffl->tile_w;
   int64_t th = tiffl->tile_h;
@@ -159,14 +169,14 @@ static bool read_tile(openslide_t *osr,
   // cache
   struct _openslide_cache_entry *cache_entry;
   uint32_t *tiledata = _openslide_cache_get(osr->cache,
-                                            args->area, tile_col, tile_row,
+                                            tiffl, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
-    if (!_openslide_tiff_read_tile(tiffl, args->tiff,
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
+    if (!_openslide_tiff_read_tile(osr, tiffl, tiff,
                                    tiledata, tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -174,13 +184,13 @@ static bool read_tile(openslide_t *osr,
     if (!_openslide_tiff_clip_tile(tiffl, tiledata,
                                    tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
     // put it in the cache
     _openslide_cache_put(osr->cache,
-			 args->area, tile_col, tile_row,
+			 tiffl, tile_col, tile_row,
 			 tiledata, tw * th * 4,
 			 &cache_entry);
   }
@@ -200,11 +210,46 @@ static bool read_tile(openslide_t *osr,
   return true;
 }
 
-static bool paint_region(openslide_t *osr, cairo_t *cr,
-			 int64_t x, int64_t y,
-			 struct _openslide_level *level,
-			 int32_t w, int32_t h,
-			 GError **err) {
+static bool read_tile(openslide_t *osr,
+                      cairo_t *cr,
+                      struct _openslide_level *level G_GNUC_UNUSED,
+                      int64_t tile_col, int64_t tile_row,
+                      void *arg,
+                      GError **err) {
+  struct read_tile_args *args = arg;
+  struct area *area = args->area;
+
+  if (!args->plane_crs) {
+    return paint_plane_tile(osr, cr, args->tiff, &area->tiffl,
+                            tile_col, tile_row, err);
+  }
+
+  // the grid has positioned cr, which is plane 0's; put every plane's
+  // tile at the same place
+  cairo_matrix_t matrix;
+  cairo_get_matrix(cr, &matrix);
+  for (int32_t p = 0; p < args->plane_count; p++) {
+    cairo_t *plane_cr = args->plane_crs[p];
+    struct _openslide_tiff_level *tiffl =
+      p ? &area->extra_planes[p - 1] : &area->tiffl;
+    cairo_save(plane_cr);
+    cairo_set_matrix(plane_cr, &matrix);
+    bool success = paint_plane_tile(osr, plane_cr, args->tiff, tiffl,
+                                    tile_col, tile_row, err);
+    cairo_restore(plane_cr);
+    if (!success) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool paint_area_planes(openslide_t *osr, cairo_t **crs,
+                              int32_t plane_count,
+                              int64_t x, int64_t y,
+                              struct _openslide_level *level,
+                              int32_t w, int32_t h,
+                              GError **err) {
   struct leica_ops_data *data = osr->data;
   struct level *l = (struct level *) level;
   bool success = true;
@@ -220,10 +265,12 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
     struct read_tile_args args = {
       .tiff = tiff,
       .area = area,
+      .plane_crs = plane_count > 1 ? crs : NULL,
+      .plane_count = plane_count,
     };
     int64_t ax = x / l->base.downsample - area->offset_x;
     int64_t ay = y / l->base.downsample - area->offset_y;
-    success = _openslide_grid_paint_region(area->grid, cr, &args,
+    success = _openslide_grid_paint_region(area->grid, crs[0], &args,
                                            ax, ay, level, w, h,
                                            err);
     if (!success) {
@@ -235,13 +282,46 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static bool paint_region(openslide_t *osr, cairo_t *cr,
+			 int64_t x, int64_t y,
+			 struct _openslide_level *level,
+			 int32_t w, int32_t h,
+			 GError **err) {
+  return paint_area_planes(osr, &cr, 1, x, y, level, w, h, err);
+}
+
+static bool paint_region_planes(openslide_t *osr, cairo_t **crs,
+                                int64_t x, int64_t y,
+                                struct _openslide_level *level,
+                                int32_t w, int32_t h,
+                                GError **err) {
+  struct leica_ops_data *data = osr->data;
+  return paint_area_planes(osr, crs, data->plane_count,
+                           x, y, level, w, h, err);
+}
+
+static int32_t get_idle_handle_count(openslide_t *osr) {
+  struct leica_ops_data *data = osr->data;
+  return _openslide_tiffcache_get_idle_count(data->tc);
+}
+
+static void release_idle_handles(openslide_t *osr) {
+  struct leica_ops_data *data = osr->data;
+  _openslide_tiffcache_release_idle(data->tc);
+}
+
 static const struct _openslide_ops leica_ops = {
   .paint_region = paint_region,
+  .paint_region_planes = paint_region_planes,
+  .get_idle_handle_count = get_idle_handle_count,
+  .release_idle_handles = release_idle_handles,
   .destroy = destroy,
 };
 
 static bool leica_detect(const char *filename G_GNUC_UNUSED,
-                         struct _openslide_tifflike *tl, GError **err) {
+                         struct _openslide_tifflike *tl,
+                         struct _openslide_detect_context *dc,
+                         GError **err) {
   // ensure we have a TIFF
   if (!tl) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -286,7 +366,9 @@ static bool leica_detect(const char *filename G_GNUC_UNUSED,
     return false;
   }
 
-  xmlFreeDoc(doc);
+  // keep the document for leica_open
+  _openslide_detect_context_put(dc, LEICA_DETECT_XML, doc,
+                                (GDestroyNotify) xmlFreeDoc);
   return true;
 }
 
@@ -303,6 +385,12 @@ static void collection_free(struct collection *collection) {
       g_slice_free(struct dimension, dimension);
     }
     g_ptr_array_free(image->dimensions, true);
+    for (uint32_t plane_num = 0; plane_num < image->planes->len;
+         plane_num++) {
+      struct dimension *dimension = image->planes->pdata[plane_num];
+      g_slice_free(struct dimension, dimension);
+    }
+    g_ptr_array_free(image->planes, true);
     g_free(image->creation_date);
     g_free(image->device_model);
     g_free(image->device_version);
@@ -385,7 +473,8 @@ static void set_region_bounds_props(openslide_t *osr,
                       g_strdup_printf("%"PRId64, y1 - y0));
 }
 
-static struct collection *parse_xml_description(const char *xml,
+// takes ownership of doc
+static struct collection *parse_xml_description(xmlDoc *doc,
                                                 GError **err) {
   xmlXPathContext *ctx = NULL;
   xmlXPathObject *images_result = NULL;
@@ -393,12 +482,6 @@ static struct collection *parse_xml_description(const char *xml,
   struct collection *collection = NULL;
   bool success = false;
 
-  // parse the xml
-  xmlDoc *doc = _openslide_xml_parse(xml, err);
-  if (doc == NULL) {
-    return false;
-  }
-
   // create XPATH context to query the document
   ctx = _openslide_xml_xpath_create(doc);
 
@@ -475,6 +558,8 @@ static struct collection *parse_xml_description(const char *xml,
     // create image struct
     struct image *image = g_slice_new0(struct image);
     image->dimensions = g_ptr_array_new();
+    image->planes = g_ptr_array_new();
+    image->z_count = 1;
     g_ptr_array_add(collection->images, image);
 
     image->creation_date = _openslide_xml_xpath_get_string(ctx, "d:creationDate/text()");
@@ -511,17 +596,30 @@ static struct collection *parse_xml_description(const char *xml,
     for (int i = 0; i < result->nodesetval->nodeNr; i++) {
       xmlNode *dimension_node = result->nodesetval->nodeTab[i];
 
-      // accept only dimensions from z-plane 0
-      // TODO: support multiple z-planes
-      xmlChar *z = xmlGetProp(dimension_node, BAD_CAST LEICA_ATTR_Z_PLANE);
-      if (z && strcmp((char *) z, "0")) {
-        xmlFree(z);
+      // the pyramid comes from z-plane 0; keep the others aside
+      int64_t z = 0;
+      if (xmlHasProp(dimension_node, BAD_CAST LEICA_ATTR_Z_PLANE)) {
+        GError *tmp_err = NULL;
+        z = _openslide_xml_parse_int_attr(dimension_node,
+                                          LEICA_ATTR_Z_PLANE, &tmp_err);
+        if (tmp_err) {
+          g_clear_error(&tmp_err);
+          z = -1;
+        }
+      }
+      if (z < 0 || z >= G_MAXINT32) {
+        // unusable; ignore it
         continue;
       }
-      xmlFree(z);
 
       struct dimension *dimension = g_slice_new0(struct dimension);
-      g_ptr_array_add(image->dimensions, dimension);
+      dimension->z = z;
+      if (z) {
+        g_ptr_array_add(image->planes, dimension);
+        image->z_count = MAX(image->z_count, z + 1);
+      } else {
+        g_ptr_array_add(image->dimensions, dimension);
+      }
 
       PARSE_INT_ATTRIBUTE_OR_FAIL(dimension_node, LEICA_ATTR_IFD,
                                   dimension->dir);
@@ -586,6 +684,51 @@ static bool should_use_legacy_quickhash(const struct collection *collection) {
   return (brightfield_main_images == 1 && macro_images <= 1);
 }
 
+static bool is_brightfield_main_image(const struct image *image) {
+  return !image->is_macro && image->illumination_source &&
+         !strcmp(image->illumination_source, LEICA_VALUE_BRIGHTFIELD);
+}
+
+// the directory of the z-plane with the same size as a z-plane 0 dimension
+static int64_t find_plane_dir(const struct image *image,
+                              const struct dimension *dimension,
+                              int64_t z) {
+  for (uint32_t plane_num = 0; plane_num < image->planes->len; plane_num++) {
+    struct dimension *plane = image->planes->pdata[plane_num];
+    if (plane->z == z &&
+        plane->width == dimension->width &&
+        plane->height == dimension->height) {
+      return plane->dir;
+    }
+  }
+  return -1;
+}
+
+// the z-planes 0..n-1 that every dimension of every main image has
+static int32_t count_planes(const struct collection *collection) {
+  int32_t count = G_MAXINT32;
+  for (uint32_t image_num = 0; image_num < collection->images->len;
+       image_num++) {
+    struct image *image = collection->images->pdata[image_num];
+    if (!is_brightfield_main_image(image)) {
+      continue;
+    }
+    int32_t image_count = image->z_count;
+    for (uint32_t dimension_num = 0; dimension_num < image->dimensions->len;
+         dimension_num++) {
+      struct dimension *dimension = image->dimensions->pdata[dimension_num];
+      for (int32_t z = 1; z < image_count; z++) {
+        if (find_plane_dir(image, dimension, z) == -1) {
+          image_count = z;
+          break;
+        }
+      }
+    }
+    count = MIN(count, image_count);
+  }
+  return count == G_MAXINT32 ? 1 : count;
+}
+
 // parent must free levels on failure
 static bool create_levels_from_collection(openslide_t *osr,
                                           struct _openslide_tiffcache *tc,
@@ -593,8 +736,10 @@ static bool create_levels_from_collection(openslide_t *osr,
                                           struct collection *collection,
                                           GPtrArray *levels,
                                           int64_t *quickhash_dir,
+                                          int32_t *plane_count,
                                           GError **err) {
   *quickhash_dir = -1;
+  *plane_count = count_planes(collection);
 
   // set barcode property
   set_prop(osr, "leica.barcode", collection->barcode);
@@ -710,6 +855,30 @@ static bool create_levels_from_collection(openslide_t *osr,
         return false;
       }
 
+      // examine the other z-planes
+      if (*plane_count > 1) {
+        area->extra_planes = g_new0(struct _openslide_tiff_level,
+                                    *plane_count - 1);
+      }
+      for (int32_t z = 1; z < *plane_count; z++) {
+        struct _openslide_tiff_level *plane = &area->extra_planes[z - 1];
+        if (!_openslide_tiff_level_init(tiff,
+                                        find_plane_dir(image, dimension, z),
+                                        NULL, plane,
+                                        err)) {
+          return false;
+        }
+        // the planes share the grid
+        if (plane->tile_w != tiffl->tile_w ||
+            plane->tile_h != tiffl->tile_h ||
+            plane->tiles_across != tiffl->tiles_across ||
+            plane->tiles_down != tiffl->tiles_down) {
+          g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                      "Inconsistent z-plane tile geometry");
+          return false;
+        }
+      }
+
       // create grid
       area->grid = _openslide_grid_create_simple(osr,
                                                  tiffl->tiles_across,
@@ -748,6 +917,9 @@ static bool create_levels_from_collection(openslide_t *osr,
       area->offset_x = area->offset_x / l->nm_per_pixel;
       area->offset_y = area->offset_y / l->nm_per_pixel;
     }
+
+    // multiple areas may overlap
+    l->base.simple_grid = (l->areas->len == 1);
   }
 
   // process macro image
@@ -801,6 +973,7 @@ static bool create_levels_from_collection(openslide_t *osr,
 
 static bool leica_open(openslide_t *osr, const char *filename,
                        struct _openslide_tifflike *tl,
+                       struct _openslide_detect_context *dc,
                        struct _openslide_hash *quickhash1, GError **err) {
   GPtrArray *level_array = g_ptr_array_new();
 
@@ -811,24 +984,33 @@ static bool leica_open(openslide_t *osr, const char *filename,
     goto FAIL;
   }
 
-  // get the xml description
-  char *image_desc;
-  if (!TIFFGetField(tiff, TIFFTAG_IMAGEDESCRIPTION, &image_desc)) {
-    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                "Couldn't read ImageDescription");
-    goto FAIL;
+  // get the xml description, unless detection already parsed it
+  xmlDoc *doc = _openslide_detect_context_steal(dc, LEICA_DETECT_XML);
+  if (!doc) {
+    char *image_desc;
+    if (!TIFFGetField(tiff, TIFFTAG_IMAGEDESCRIPTION, &image_desc)) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Couldn't read ImageDescription");
+      goto FAIL;
+    }
+    doc = _openslide_xml_parse(image_desc, err);
+    if (!doc) {
+      goto FAIL;
+    }
   }
 
   // read XML
-  struct collection *collection = parse_xml_description(image_desc, err);
+  struct collection *collection = parse_xml_description(doc, err);
   if (!collection) {
     goto FAIL;
   }
 
   // initialize and verify levels
   int64_t quickhash_dir;
+  int32_t plane_count;
   if (!create_levels_from_collection(osr, tc, tiff, collection,
-                                     level_array, &quickhash_dir, err)) {
+                                     level_array, &quickhash_dir,
+                                     &plane_count, err)) {
     collection_free(collection);
     goto FAIL;
   }
@@ -871,12 +1053,14 @@ static bool leica_open(openslide_t *osr, const char *filename,
 
   // allocate private data
   struct leica_ops_data *data = g_slice_new0(struct leica_ops_data);
+  data->plane_count = plane_count;
 
   // store osr data
   g_assert(osr->data == NULL);
   g_assert(osr->levels == NULL);
   osr->levels = (struct _openslide_level **) levels;
   osr->level_count = level_count;
+  osr->focal_plane_count = plane_count;
   osr->data = data;
   osr->ops = &leica_ops;
 
@@ -178,7 +178,7 @@ struct image {
   int32_t start_in_file;
   int32_t length;
   int32_t imageno;   // used only for cache lookup
-  int refcount;
+  int32_t file_order;  // index in mirax_ops_data.images
 };
 
 struct tile {
@@ -201,20 +201,172 @@ struct level {
   double tile_h;
 };
 
+// maximum idle handles to keep per datafile
+#define DATAFILE_HANDLES_MAX 8
+
 struct mirax_ops_data {
   gchar **datafile_paths;
+  int32_t datafile_count;
+
+  // idle FILE handles for each datafile, most recently used first
+  GQueue **datafile_handles;
+  GMutex *handle_lock;
+
+  // all images, by file and then offset
+  struct image **images;
+  int32_t image_count;
+  struct _openslide_readahead readahead;
+};
+
+// on-disk index cache entry: a header, then for each image an image
+// record followed by its tile records, in hier page order.  Fields are
+// in host byte order; a foreign entry fails the version check.
+#define INDEX_CACHE_MAGIC "MRXI"
+#define INDEX_CACHE_VERSION 1
+
+struct index_cache_header {
+  char magic[4];
+  uint32_t version;
+  int32_t zoom_levels;
+  int32_t reserved;
+};
+
+struct index_cache_image {
+  int32_t zoom_level;
+  int32_t fileno;
+  int32_t start_in_file;
+  int32_t length;
+  int32_t imageno;
+  int32_t tile_count;
+};
+
+struct index_cache_tile {
+  double pos_x;
+  double pos_y;
+  double src_x;
+  double src_y;
+  int32_t tile_x;
+  int32_t tile_y;
 };
 
-static void image_unref(struct image *image) {
-  if (!--image->refcount) {
-    g_slice_free(struct image, image);
+static gint image_compare_file_order(gconstpointer a, gconstpointer b) {
+  const struct image *ia = *(const struct image * const *) a;
+  const struct image *ib = *(const struct image * const *) b;
+  if (ia->fileno != ib->fileno) {
+    return ia->fileno < ib->fileno ? -1 : 1;
+  } else if (ia->start_in_file != ib->start_in_file) {
+    return ia->start_in_file < ib->start_in_file ? -1 : 1;
   }
+  return 0;
 }
 
-static void tile_free(gpointer data) {
-  struct tile *tile = data;
-  image_unref(tile->image);
-  g_slice_free(struct tile, tile);
+// if images are being read in file order, queue the ones that follow
+static void image_readahead(openslide_t *osr, struct image *image) {
+  struct mirax_ops_data *data = osr->data;
+  int64_t start;
+  int64_t end;
+  if (!_openslide_readahead_check(osr, &data->readahead,
+                                  image->file_order, data->image_count,
+                                  &start, &end)) {
+    return;
+  }
+
+  struct _openslide_readahead_item *items =
+    g_new(struct _openslide_readahead_item, end - start);
+  int32_t count = 0;
+  for (int64_t i = start; i < end; i++) {
+    const struct image *next = data->images[i];
+    if (next->fileno != image->fileno) {
+      break;
+    }
+    if (next->length == 0) {
+      continue;
+    }
+    struct _openslide_readahead_item *item = &items[count++];
+    item->offset = next->start_in_file;
+    item->length = next->length;
+    item->x = next->fileno;
+    item->y = next->start_in_file;
+  }
+  _openslide_readahead_submit(osr, data->datafile_paths[image->fileno],
+                              data, items, count);
+}
+
+static FILE *datafile_get(struct mirax_ops_data *data, int32_t fileno,
+                          GError **err) {
+  g_mutex_lock(data->handle_lock);
+  FILE *f = g_queue_pop_head(data->datafile_handles[fileno]);
+  g_mutex_unlock(data->handle_lock);
+  if (f) {
+    _openslide_persistent_file_release();
+    return f;
+  }
+  return _openslide_fopen(data->datafile_paths[fileno], "rb", err);
+}
+
+// keep the handle for the next read, within the persistent file budget
+static void datafile_put(struct mirax_ops_data *data, int32_t fileno,
+                         FILE *f) {
+  g_mutex_lock(data->handle_lock);
+  GQueue *handles = data->datafile_handles[fileno];
+  if (g_queue_get_length(handles) < DATAFILE_HANDLES_MAX &&
+      _openslide_persistent_file_acquire()) {
+    g_queue_push_head(handles, f);
+    f = NULL;
+  }
+  g_mutex_unlock(data->handle_lock);
+
+  if (f) {
+    fclose(f);
+  }
+}
+
+// get the compressed image, possibly from the compressed-data cache.
+// the entry must be unreffed when the caller is done with the data.
+static void *read_image_data(openslide_t *osr,
+                             struct image *image,
+                             struct _openslide_cache_entry **entry,
+                             GError **err) {
+  struct mirax_ops_data *data = osr->data;
+
+  image_readahead(osr, image);
+
+  // byte ranges are unique within the slide
+  void *buf = _openslide_cache_get(osr->compressed_cache,
+                                   data,
+                                   image->fileno,
+                                   image->start_in_file,
+                                   entry);
+  if (buf) {
+    return buf;
+  }
+
+  if (image->length == 0) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Image data is empty");
+    return NULL;
+  }
+
+  FILE *f = datafile_get(data, image->fileno, err);
+  if (!f) {
+    return NULL;
+  }
+  buf = g_slice_alloc(image->length);
+  size_t count = _openslide_fread_at(f, buf, image->length,
+                                     image->start_in_file);
+  datafile_put(data, image->fileno, f);
+  if (count != (size_t) image->length) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Cannot read image data");
+    g_slice_free1(image->length, buf);
+    return NULL;
+  }
+
+  _openslide_cache_put(osr->compressed_cache,
+                       data, image->fileno, image->start_in_file,
+                       buf, image->length,
+                       entry);
+  return buf;
 }
 
 static uint32_t *read_image(openslide_t *osr,
@@ -222,38 +374,40 @@ static uint32_t *read_image(openslide_t *osr,
                             enum image_format format,
                             int w, int h,
                             GError **err) {
-  struct mirax_ops_data *data = osr->data;
-  bool result = false;
+  struct _openslide_cache_entry *entry;
+  void *buf = read_image_data(osr, image, &entry, err);
+  if (!buf) {
+    return NULL;
+  }
 
-  uint32_t *dest = g_slice_alloc(w * h * 4);
+  uint32_t *dest = _openslide_buffer_alloc(w * h * 4);
+  bool result = false;
 
   switch (format) {
   case FORMAT_JPEG:
-    result = _openslide_jpeg_read(data->datafile_paths[image->fileno],
-                                  image->start_in_file,
-                                  dest, w, h,
-                                  err);
+    result = _openslide_jpeg_decode_buffer(buf, image->length,
+                                           dest, w, h,
+                                           err);
     break;
   case FORMAT_PNG:
-    result = _openslide_png_read(data->datafile_paths[image->fileno],
-                                 image->start_in_file,
-                                 dest, w, h,
-                                 err);
+    result = _openslide_png_decode_buffer(buf, image->length,
+                                          dest, w, h,
+                                          err);
     break;
   case FORMAT_BMP:
-    result = _openslide_gdkpixbuf_read("bmp",
-                                       data->datafile_paths[image->fileno],
-                                       image->start_in_file, image->length,
-                                       dest, w, h,
-                                       err);
+    result = _openslide_gdkpixbuf_decode_buffer("bmp",
+                                                buf, image->length,
+                                                dest, w, h,
+                                                err);
     break;
   case FORMAT_UNKNOWN:
   default:
     g_assert_not_reached();
   }
+  _openslide_cache_entry_unref(entry);
 
   if (!result) {
-    g_slice_free1(w * h * 4, dest);
+    _openslide_buffer_free(w * h * 4, dest);
     return NULL;
   }
   return dest;
@@ -269,7 +423,6 @@ static bool read_tile(openslide_t *osr,
                       GError **err) {
   struct level *l = (struct level *) level;
   struct tile *tile = data;
-  bool success = true;
 
   int iw = l->image_width;
   int ih = l->image_height;
@@ -297,42 +450,14 @@ static bool read_tile(openslide_t *osr,
                          &cache_entry);
   }
 
-  // draw it
-  cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiledata,
-                                                                 CAIRO_FORMAT_RGB24,
-                                                                 iw, ih,
-                                                                 iw * 4);
-
-  // if we are drawing a subregion of the tile, we must do an additional copy,
-  // because cairo lacks source clipping
-  if ((l->image_width > l->tile_w) ||
-      (l->image_height > l->tile_h)) {
-    cairo_surface_t *surface2 = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-                                                           ceil(l->tile_w),
-                                                           ceil(l->tile_h));
-    cairo_t *cr2 = cairo_create(surface2);
-    cairo_set_source_surface(cr2, surface, -tile->src_x, -tile->src_y);
-
-    // replace original image surface
-    cairo_surface_destroy(surface);
-    surface = surface2;
-
-    cairo_rectangle(cr2, 0, 0,
-                    ceil(l->tile_w),
-                    ceil(l->tile_h));
-    cairo_fill(cr2);
-    success = _openslide_check_cairo_status(cr2, err);
-    cairo_destroy(cr2);
-  }
-
-  cairo_set_source_surface(cr, surface, 0, 0);
-  cairo_surface_destroy(surface);
-  cairo_paint(cr);
+  // draw it, clipping to the tile if the image is larger
+  _openslide_paint_subimage(cr, tiledata, CAIRO_FORMAT_RGB24, iw, ih,
+                            tile->src_x, tile->src_y, l->tile_w, l->tile_h);
 
   // done with the cache entry, release it
   _openslide_cache_entry_unref(cache_entry);
 
-  return success;
+  return true;
 }
 
 static bool paint_region(openslide_t *osr G_GNUC_UNUSED, cairo_t *cr,
@@ -349,6 +474,20 @@ static bool paint_region(openslide_t *osr G_GNUC_UNUSED, cairo_t *cr,
                                       err);
 }
 
+static bool clear_empty_tiles(openslide_t *osr G_GNUC_UNUSED,
+                              struct _openslide_level *level,
+                              uint8_t *nonempty,
+                              int64_t tiles_across, int64_t tiles_down,
+                              GError **err G_GNUC_UNUSED) {
+  struct level *l = (struct level *) level;
+
+  // the position map only lists stored images
+  _openslide_grid_clear_empty_tiles(l->grid, nonempty,
+                                    tiles_across, tiles_down,
+                                    l->base.tile_w, l->base.tile_h);
+  return true;
+}
+
 static void destroy(openslide_t *osr) {
   struct mirax_ops_data *data = osr->data;
 
@@ -363,16 +502,59 @@ static void destroy(openslide_t *osr) {
   g_free(osr->levels);
 
   // the ops data
+  for (int32_t i = 0; i < data->datafile_count; i++) {
+    FILE *f;
+    while ((f = g_queue_pop_head(data->datafile_handles[i])) != NULL) {
+      fclose(f);
+      _openslide_persistent_file_release();
+    }
+    g_queue_free(data->datafile_handles[i]);
+  }
+  g_free(data->datafile_handles);
+  g_mutex_free(data->handle_lock);
   g_strfreev(data->datafile_paths);
+  g_free(data->images);
   g_slice_free(struct mirax_ops_data, data);
 }
 
+static int32_t get_idle_handle_count(openslide_t *osr) {
+  struct mirax_ops_data *data = osr->data;
+  int32_t count = 0;
+  g_mutex_lock(data->handle_lock);
+  for (int32_t i = 0; i < data->datafile_count; i++) {
+    count += g_queue_get_length(data->datafile_handles[i]);
+  }
+  g_mutex_unlock(data->handle_lock);
+  return count;
+}
+
+static void release_idle_handles(openslide_t *osr) {
+  struct mirax_ops_data *data = osr->data;
+  GList *idle = NULL;
+  g_mutex_lock(data->handle_lock);
+  for (int32_t i = 0; i < data->datafile_count; i++) {
+    idle = g_list_concat(idle, data->datafile_handles[i]->head);
+    g_queue_init(data->datafile_handles[i]);
+  }
+  g_mutex_unlock(data->handle_lock);
+
+  for (GList *cur = idle; cur; cur = cur->next) {
+    fclose(cur->data);
+    _openslide_persistent_file_release();
+  }
+  g_list_free(idle);
+}
+
 static const struct _openslide_ops mirax_ops = {
   .paint_region = paint_region,
+  .clear_empty_tiles = clear_empty_tiles,
+  .get_idle_handle_count = get_idle_handle_count,
+  .release_idle_handles = release_idle_handles,
   .destroy = destroy,
 };
 
 static bool mirax_detect(const char *filename, struct _openslide_tifflike *tl,
+                         struct _openslide_detect_context *dc G_GNUC_UNUSED,
                          GError **err) {
   // reject TIFFs
   if (tl) {
@@ -389,7 +571,7 @@ static bool mirax_detect(const char *filename, struct _openslide_tifflike *tl,
   }
 
   // verify existence
-  if (!g_file_test(filename, G_FILE_TEST_EXISTS)) {
+  if (!_openslide_fexists(filename)) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "File does not exist");
     return false;
@@ -398,7 +580,7 @@ static bool mirax_detect(const char *filename, struct _openslide_tifflike *tl,
   // verify slidedat exists
   char *dirname = g_strndup(filename, strlen(filename) - strlen(MRXS_EXT));
   char *slidedat_path = g_build_filename(dirname, SLIDEDAT_INI, NULL);
-  bool ok = g_file_test(slidedat_path, G_FILE_TEST_EXISTS);
+  bool ok = _openslide_fexists(slidedat_path);
   g_free(slidedat_path);
   g_free(dirname);
   if (!ok) {
@@ -562,18 +744,16 @@ static bool read_nonhier_record(FILE *f,
 }
 
 
-static void insert_tile(struct level *l,
+static void insert_tile(openslide_t *osr,
+                        struct level *l,
                         const struct slide_zoom_level_params *lp,
                         struct image *image,
                         double pos_x, double pos_y,
                         double src_x, double src_y,
                         int tile_x, int tile_y,
                         int zoom_level) {
-  // increment image refcount
-  image->refcount++;
-
-  // generate tile
-  struct tile *tile = g_slice_new0(struct tile);
+  // generate tile; tiles and images live until the slide is closed
+  struct tile *tile = _openslide_arena_alloc(osr->arena, sizeof(*tile));
   tile->image = image;
   tile->src_x = src_x;
   tile->src_y = src_y;
@@ -676,7 +856,8 @@ static bool get_tile_position(int32_t *slide_positions,
   }
 }
 
-static bool process_hier_data_pages_from_indexfile(FILE *f,
+static bool process_hier_data_pages_from_indexfile(openslide_t *osr,
+						   FILE *f,
 						   int64_t seek_location,
 						   int datafile_count,
 						   char **datafile_paths,
@@ -688,6 +869,8 @@ static bool process_hier_data_pages_from_indexfile(FILE *f,
 						   const struct slide_zoom_level_params *slide_zoom_level_params,
 						   int32_t *slide_positions,
 						   struct _openslide_hash *quickhash1,
+						   GPtrArray *images,
+						   GByteArray *index_out,
 						   GError **err) {
   int32_t image_number = 0;
 
@@ -697,6 +880,10 @@ static bool process_hier_data_pages_from_indexfile(FILE *f,
   GHashTable *active_positions = g_hash_table_new_full(g_int_hash, g_int_equal,
 						       g_free, NULL);
 
+  // lowest-res images, hashed once the index has been walked
+  struct _openslide_hash_batch *hash_batch =
+    _openslide_hash_batch_create(quickhash1);
+
   for (int zoom_level = 0; zoom_level < zoom_levels; zoom_level++) {
     struct level *l = levels[zoom_level];
     const struct slide_zoom_level_params *lp = slide_zoom_level_params +
@@ -828,20 +1015,34 @@ static bool process_hier_data_pages_from_indexfile(FILE *f,
 
 	// hash in the lowest-res images
 	if (zoom_level == zoom_levels - 1) {
-	  if (!_openslide_hash_file_part(quickhash1, datafile_paths[fileno],
-	                                 offset, length, err)) {
-            g_prefix_error(err, "Can't hash images: ");
-            goto DONE;
-	  }
+	  _openslide_hash_batch_add(hash_batch, datafile_paths[fileno],
+	                            offset, length);
 	}
 
 	// populate the image structure
-	struct image *image = g_slice_new0(struct image);
+	struct image *image = _openslide_arena_alloc(osr->arena,
+	                                             sizeof(*image));
 	image->fileno = fileno;
 	image->start_in_file = offset;
 	image->length = length;
 	image->imageno = image_number++;
-	image->refcount = 1;
+	g_ptr_array_add(images, image);
+
+	// record the image for the index cache; tile_count is filled in
+	// after the tiles are generated
+	guint cache_image_offset = 0;
+	struct index_cache_image cache_image = {
+	  .zoom_level = zoom_level,
+	  .fileno = fileno,
+	  .start_in_file = offset,
+	  .length = length,
+	  .imageno = image->imageno,
+	};
+	if (index_out) {
+	  cache_image_offset = index_out->len;
+	  g_byte_array_append(index_out, (const guint8 *) &cache_image,
+	                      sizeof(cache_image));
+	}
 
 	/*
 	g_debug("image_concat: %d, tiles_per_image: %d",
@@ -887,18 +1088,34 @@ static bool process_hier_data_pages_from_indexfile(FILE *f,
 
 	    //g_debug("pos0: %d %d, pos: %g %g", pos0_x, pos0_y, pos_x, pos_y);
 
-	    insert_tile(l, lp,
+	    insert_tile(osr, l, lp,
                         image,
                         pos_x, pos_y,
                         l->tile_w * xi, l->tile_h * yi,
                         x / lp->tile_count_divisor + xi,
                         y / lp->tile_count_divisor + yi,
                         zoom_level);
+
+	    if (index_out) {
+	      struct index_cache_tile cache_tile = {
+	        .pos_x = pos_x,
+	        .pos_y = pos_y,
+	        .src_x = l->tile_w * xi,
+	        .src_y = l->tile_h * yi,
+	        .tile_x = x / lp->tile_count_divisor + xi,
+	        .tile_y = y / lp->tile_count_divisor + yi,
+	      };
+	      g_byte_array_append(index_out, (const guint8 *) &cache_tile,
+	                          sizeof(cache_tile));
+	      cache_image.tile_count++;
+	    }
 	  }
 	}
 
-	// drop initial reference, possibly free
-	image_unref(image);
+	if (index_out) {
+	  memcpy(index_out->data + cache_image_offset, &cache_image,
+	         sizeof(cache_image));
+	}
       }
     } while (next_ptr != 0);
 
@@ -906,14 +1123,127 @@ static bool process_hier_data_pages_from_indexfile(FILE *f,
     seek_location += 4;
   }
 
+  if (!_openslide_hash_batch_run(hash_batch, err)) {
+    g_prefix_error(err, "Can't hash images: ");
+    goto DONE;
+  }
+
   success = true;
 
  DONE:
+  _openslide_hash_batch_destroy(hash_batch);
   g_hash_table_unref(active_positions);
 
   return success;
 }
 
+// check that an index cache entry is complete and consistent with the
+// slide before anything is inserted into the grids
+static bool validate_cached_index(const char *buf, gsize len,
+                                  int zoom_levels, int datafile_count) {
+  struct index_cache_header hdr;
+  if (len < sizeof(hdr)) {
+    return false;
+  }
+  memcpy(&hdr, buf, sizeof(hdr));
+  if (memcmp(hdr.magic, INDEX_CACHE_MAGIC, sizeof(hdr.magic)) ||
+      hdr.version != INDEX_CACHE_VERSION ||
+      hdr.zoom_levels != zoom_levels) {
+    return false;
+  }
+
+  gsize pos = sizeof(hdr);
+  while (pos < len) {
+    struct index_cache_image ci;
+    if (len - pos < sizeof(ci)) {
+      return false;
+    }
+    memcpy(&ci, buf + pos, sizeof(ci));
+    pos += sizeof(ci);
+    if (ci.zoom_level < 0 || ci.zoom_level >= zoom_levels ||
+        ci.fileno < 0 || ci.fileno >= datafile_count ||
+        ci.start_in_file < 0 || ci.length < 0 || ci.tile_count < 0 ||
+        (len - pos) / sizeof(struct index_cache_tile) <
+        (gsize) ci.tile_count) {
+      return false;
+    }
+    pos += ci.tile_count * sizeof(struct index_cache_tile);
+  }
+  return pos == len;
+}
+
+// try to populate the grids from the index cache.  returns false with
+// *hit == false on a miss.
+static bool load_cached_index(openslide_t *osr,
+                              const char *path,
+                              int datafile_count,
+                              char **datafile_paths,
+                              int zoom_levels,
+                              struct level **levels,
+                              const struct slide_zoom_level_params *slide_zoom_level_params,
+                              struct _openslide_hash *quickhash1,
+                              GPtrArray *images,
+                              bool *hit,
+                              GError **err) {
+  *hit = false;
+
+  GMappedFile *map = _openslide_index_cache_load(path);
+  if (!map) {
+    return false;
+  }
+  const char *buf = g_mapped_file_get_contents(map);
+  gsize len = g_mapped_file_get_length(map);
+  if (!validate_cached_index(buf, len, zoom_levels, datafile_count)) {
+    g_mapped_file_unref(map);
+    return false;
+  }
+  *hit = true;
+
+  struct _openslide_hash_batch *hash_batch =
+    _openslide_hash_batch_create(quickhash1);
+  gsize pos = sizeof(struct index_cache_header);
+  while (pos < len) {
+    struct index_cache_image ci;
+    memcpy(&ci, buf + pos, sizeof(ci));
+    pos += sizeof(ci);
+
+    // hash in the lowest-res images, as when parsing
+    if (ci.zoom_level == zoom_levels - 1) {
+      _openslide_hash_batch_add(hash_batch, datafile_paths[ci.fileno],
+                                ci.start_in_file, ci.length);
+    }
+
+    struct image *image = _openslide_arena_alloc(osr->arena,
+                                                 sizeof(*image));
+    image->fileno = ci.fileno;
+    image->start_in_file = ci.start_in_file;
+    image->length = ci.length;
+    image->imageno = ci.imageno;
+    g_ptr_array_add(images, image);
+
+    for (int32_t j = 0; j < ci.tile_count; j++) {
+      struct index_cache_tile ct;
+      memcpy(&ct, buf + pos, sizeof(ct));
+      pos += sizeof(ct);
+      insert_tile(osr, levels[ci.zoom_level],
+                  slide_zoom_level_params + ci.zoom_level,
+                  image,
+                  ct.pos_x, ct.pos_y,
+                  ct.src_x, ct.src_y,
+                  ct.tile_x, ct.tile_y,
+                  ci.zoom_level);
+    }
+  }
+
+  bool success = _openslide_hash_batch_run(hash_batch, err);
+  if (!success) {
+    g_prefix_error(err, "Can't hash images: ");
+  }
+  _openslide_hash_batch_destroy(hash_batch);
+  g_mapped_file_unref(map);
+  return success;
+}
+
 static void *inflate_buffer(const void *src,
                             int64_t src_len,
                             int64_t dst_len,
@@ -1096,8 +1426,10 @@ static bool process_indexfile(openslide_t *osr,
 			      int image_divisions,
 			      const struct slide_zoom_level_params *slide_zoom_level_params,
 			      FILE *indexfile,
+			      const char *index_cache_path,
 			      struct level **levels,
 			      struct _openslide_hash *quickhash1,
+			      GPtrArray *images,
 			      GError **err) {
   char *teststr = NULL;
   bool match;
@@ -1114,6 +1446,7 @@ static bool process_indexfile(openslide_t *osr,
   bool success = false;
 
   int32_t *slide_positions = NULL;
+  GByteArray *index_out = NULL;
 
   rewind(indexfile);
 
@@ -1140,6 +1473,61 @@ static bool process_indexfile(openslide_t *osr,
     goto DONE;
   }
 
+  // read in the associated images
+  if (!add_associated_image(osr,
+                            indexfile,
+                            nonhier_root,
+                            datafile_count,
+                            datafile_paths,
+                            "macro",
+                            macro_record,
+                            err)) {
+    goto DONE;
+  }
+  if (!add_associated_image(osr,
+                            indexfile,
+                            nonhier_root,
+                            datafile_count,
+                            datafile_paths,
+                            "label",
+                            label_record,
+                            err)) {
+    goto DONE;
+  }
+  if (!add_associated_image(osr,
+                            indexfile,
+                            nonhier_root,
+                            datafile_count,
+                            datafile_paths,
+                            "thumbnail",
+                            thumbnail_record,
+                            err)) {
+    goto DONE;
+  }
+
+  // the tile geometry may already be in the index cache
+  if (index_cache_path) {
+    bool hit;
+    if (load_cached_index(osr, index_cache_path,
+                          datafile_count, datafile_paths,
+                          zoom_levels, levels, slide_zoom_level_params,
+                          quickhash1, images, &hit, err)) {
+      success = true;
+      goto DONE;
+    } else if (hit) {
+      goto DONE;
+    }
+
+    // miss: collect the geometry as we parse it
+    struct index_cache_header hdr = {
+      .version = INDEX_CACHE_VERSION,
+      .zoom_levels = zoom_levels,
+    };
+    memcpy(hdr.magic, INDEX_CACHE_MAGIC, sizeof(hdr.magic));
+    index_out = g_byte_array_new();
+    g_byte_array_append(index_out, (const guint8 *) &hdr, sizeof(hdr));
+  }
+
   // If we have individual slide positioning information as part of the
   // non-hier data, read the position information.
   if (vimslide_position_record != -1) {
@@ -1224,38 +1612,6 @@ static bool process_indexfile(openslide_t *osr,
     }
   }
 
-  // read in the associated images
-  if (!add_associated_image(osr,
-                            indexfile,
-                            nonhier_root,
-                            datafile_count,
-                            datafile_paths,
-                            "macro",
-                            macro_record,
-                            err)) {
-    goto DONE;
-  }
-  if (!add_associated_image(osr,
-                            indexfile,
-                            nonhier_root,
-                            datafile_count,
-                            datafile_paths,
-                            "label",
-                            label_record,
-                            err)) {
-    goto DONE;
-  }
-  if (!add_associated_image(osr,
-                            indexfile,
-                            nonhier_root,
-                            datafile_count,
-                            datafile_paths,
-                            "thumbnail",
-                            thumbnail_record,
-                            err)) {
-    goto DONE;
-  }
-
   // read hierarchical sections
   if (fseeko(indexfile, hier_root, SEEK_SET) == -1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -1271,7 +1627,8 @@ static bool process_indexfile(openslide_t *osr,
   }
 
   // read these pages in
-  if (!process_hier_data_pages_from_indexfile(indexfile,
+  if (!process_hier_data_pages_from_indexfile(osr,
+					      indexfile,
 					      ptr,
 					      datafile_count,
 					      datafile_paths,
@@ -1283,15 +1640,25 @@ static bool process_indexfile(openslide_t *osr,
 					      slide_zoom_level_params,
 					      slide_positions,
 					      quickhash1,
+					      images,
+					      index_out,
 					      err)) {
     goto DONE;
   }
 
+  if (index_out) {
+    _openslide_index_cache_store(index_cache_path,
+                                 index_out->data, index_out->len);
+  }
+
   success = true;
 
  DONE:
   // deallocate
   g_free(slide_positions);
+  if (index_out) {
+    g_byte_array_free(index_out, true);
+  }
 
   return success;
 }
@@ -1484,6 +1851,7 @@ static int get_associated_image_nonhier_offset(GKeyFile *keyfile,
 
 static bool mirax_open(openslide_t *osr, const char *filename,
                        struct _openslide_tifflike *tl G_GNUC_UNUSED,
+                       struct _openslide_detect_context *dc G_GNUC_UNUSED,
                        struct _openslide_hash *quickhash1, GError **err) {
   struct level **levels = NULL;
 
@@ -1524,12 +1892,15 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   char **datafile_paths = NULL;
 
   FILE *indexfile = NULL;
+  char *index_cache_path = NULL;
 
   int64_t base_w = 0;
   int64_t base_h = 0;
 
   int total_concat_exponent = 0;
 
+  GPtrArray *images = g_ptr_array_new();
+
   // get directory from filename
   dirname = g_strndup(filename, strlen(filename) - strlen(MRXS_EXT));
 
@@ -1655,6 +2026,7 @@ static bool mirax_open(openslide_t *osr, const char *filename,
     gchar *name;
     READ_KEY_OR_FAIL(name, slidedat, GROUP_DATAFILE, tmp, value);
     datafile_paths[i] = g_build_filename(dirname, name, NULL);
+    _openslide_add_source_file(osr, datafile_paths[i]);
     g_free(name);
 
     g_free(tmp);
@@ -1780,6 +2152,25 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   // read indexfile
   tmp = g_build_filename(dirname, index_filename, NULL);
   indexfile = _openslide_fopen(tmp, "rb", err);
+  if (indexfile) {
+    // the tile geometry depends on Slidedat.ini, Index.dat, and the
+    // slide position map, which is stored in one of the datafiles
+    char *slidedat_path = g_build_filename(dirname, SLIDEDAT_INI, NULL);
+    GPtrArray *index_sources = g_ptr_array_new();
+    g_ptr_array_add(index_sources, slidedat_path);
+    g_ptr_array_add(index_sources, tmp);
+    for (int i = 0; i < datafile_count; i++) {
+      g_ptr_array_add(index_sources, datafile_paths[i]);
+    }
+    g_ptr_array_add(index_sources, NULL);
+    index_cache_path =
+      _openslide_index_cache_path("mirax", slide_id,
+                                  (const char * const *) index_sources->pdata);
+    g_ptr_array_free(index_sources, true);
+    _openslide_add_source_file(osr, slidedat_path);
+    _openslide_add_source_file(osr, tmp);
+    g_free(slidedat_path);
+  }
   g_free(tmp);
   tmp = NULL;
 
@@ -1931,7 +2322,7 @@ static bool mirax_open(openslide_t *osr, const char *filename,
     l->grid = _openslide_grid_create_tilemap(osr,
                                              lp->tile_advance_x,
                                              lp->tile_advance_y,
-                                             read_tile, tile_free);
+                                             read_tile, NULL);
 
     //g_debug("level %d tile advance %.10g %.10g, dim %"PRId64" %"PRId64", image size %d %d, tile %g %g, image_concat %d, tile_count_divisor %d, positions_per_tile %d", i, lp->tile_advance_x, lp->tile_advance_y, l->base.w, l->base.h, l->image_width, l->image_height, l->tile_w, l->tile_h, lp->image_concat, lp->tile_count_divisor, lp->positions_per_tile);
   }
@@ -1952,8 +2343,10 @@ static bool mirax_open(openslide_t *osr, const char *filename,
 			 image_divisions,
 			 slide_zoom_level_params,
 			 indexfile,
+			 index_cache_path,
 			 levels,
 			 quickhash1,
+			 images,
 			 err)) {
     goto FAIL;
   }
@@ -2010,6 +2403,20 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   struct mirax_ops_data *data = g_slice_new0(struct mirax_ops_data);
   data->datafile_paths = datafile_paths;
   datafile_paths = NULL;
+  data->datafile_count = datafile_count;
+  data->datafile_handles = g_new(GQueue *, datafile_count);
+  for (int i = 0; i < datafile_count; i++) {
+    data->datafile_handles[i] = g_queue_new();
+  }
+  data->handle_lock = g_mutex_new();
+  g_ptr_array_sort(images, image_compare_file_order);
+  for (guint i = 0; i < images->len; i++) {
+    struct image *image = images->pdata[i];
+    image->file_order = i;
+  }
+  data->image_count = images->len;
+  data->images = (struct image **) g_ptr_array_free(images, false);
+  images = NULL;
   osr->data = data;
 
   // set ops
@@ -2038,6 +2445,7 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   g_free(slide_version);
   g_free(slide_id);
   g_free(index_filename);
+  g_free(index_cache_path);
   g_strfreev(datafile_paths);
   g_strfreev(slide_zoom_level_section_names);
   g_free(slide_zoom_level_sections);
@@ -2051,6 +2459,9 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   if (indexfile) {
     fclose(indexfile);
   }
+  if (images) {
+    g_ptr_array_free(images, true);
+  }
 
   return success;
 }
@@ -41,6 +41,7 @@
 #include <tiffio.h>
 
 static const char PHILIPS_SOFTWARE[] = "Philips";
+static const char PHILIPS_DETECT_XML[] = "philips-xml";
 static const char XML_ROOT[] = "DataObject";
 static const char XML_ROOT_TYPE_ATTR[] = "ObjectType";
 static const char XML_ROOT_TYPE_VALUE[] = "DPUfsImport";
@@ -75,8 +76,10 @@ struct level {
 
 struct xml_associated_image {
   struct _openslide_associated_image base;
-  struct _openslide_tiffcache *tc;
-  const char *xpath;  // static string; do not free
+  // the JPEG, decoded from base64 once at open time, rather than
+  // reparsing the whole ImageDescription on each read
+  void *data;
+  gsize len;
 };
 
 static void destroy(openslide_t *osr) {
@@ -92,15 +95,15 @@ static void destroy(openslide_t *osr) {
   g_free(osr->levels);
 }
 
-static bool read_tile(openslide_t *osr,
-                      cairo_t *cr,
-                      struct _openslide_level *level,
-                      int64_t tile_col, int64_t tile_row,
-                      void *arg,
-                      GError **err) {
+// the decoded, clipped tile, held by *_cache_entry; NULL on error
+static uint32_t *get_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          TIFF *tiff,
+                          int64_t tile_col, int64_t tile_row,
+                          struct _openslide_cache_entry **_cache_entry,
+                          GError **err) {
   struct level *l = (struct level *) level;
   struct _openslide_tiff_level *tiffl = &l->tiffl;
-  TIFF *tiff = arg;
 
   // tile size
   int64_t tw = tiffl->tile_w;
@@ -117,20 +120,21 @@ static bool read_tile(openslide_t *osr,
     if (!_openslide_tiff_check_missing_tile(tiffl, tiff,
                                             tile_col, tile_row,
                                             &is_missing, err)) {
-      return false;
+      return NULL;
     }
 
     if (is_missing) {
-      // fill with transparent
-      tiledata = g_slice_alloc0(tw * th * 4);
-
+      // transparent, without pixel storage
+      tiledata = _openslide_cache_put_constant(osr->cache, level,
+                                               tile_col, tile_row,
+                                               0, &cache_entry);
     } else {
-      tiledata = g_slice_alloc(tw * th * 4);
-      if (!_openslide_tiff_read_tile(tiffl, tiff,
+      tiledata = _openslide_buffer_alloc(tw * th * 4);
+      if (!_openslide_tiff_read_tile(osr, tiffl, tiff,
                                      tiledata, tile_col, tile_row,
                                      err)) {
-        g_slice_free1(tw * th * 4, tiledata);
-        return false;
+        _openslide_buffer_free(tw * th * 4, tiledata);
+        return NULL;
       }
 
       // clip, if necessary
@@ -139,18 +143,49 @@ static bool read_tile(openslide_t *osr,
                                 l->base.w - tile_col * tw,
                                 l->base.h - tile_row * th,
                                 err)) {
-        g_slice_free1(tw * th * 4, tiledata);
-        return false;
+        _openslide_buffer_free(tw * th * 4, tiledata);
+        return NULL;
       }
+
+      // put it in the cache
+      _openslide_cache_put(osr->cache, level, tile_col, tile_row,
+                           tiledata, tw * th * 4,
+                           &cache_entry);
     }
+  }
+
+  *_cache_entry = cache_entry;
+  return tiledata;
+}
+
+static bool read_tile(openslide_t *osr,
+                      cairo_t *cr,
+                      struct _openslide_level *level,
+                      int64_t tile_col, int64_t tile_row,
+                      void *arg,
+                      GError **err) {
+  struct level *l = (struct level *) level;
+  TIFF *tiff = arg;
 
-    // put it in the cache
-    _openslide_cache_put(osr->cache, level, tile_col, tile_row,
-                         tiledata, tw * th * 4,
-                         &cache_entry);
+  // tile size
+  int64_t tw = l->tiffl.tile_w;
+  int64_t th = l->tiffl.tile_h;
+
+  // get the tile, possibly from cache
+  struct _openslide_cache_entry *cache_entry;
+  uint32_t *tiledata = get_tile(osr, level, tiff, tile_col, tile_row,
+                                &cache_entry, err);
+  if (!tiledata) {
+    return false;
   }
 
   // draw it
+  uint32_t pixel;
+  if (_openslide_cache_entry_get_constant(cache_entry, &pixel)) {
+    _openslide_paint_constant(cr, pixel, tw, th);
+    _openslide_cache_entry_unref(cache_entry);
+    return true;
+  }
   cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiledata,
                                                                  CAIRO_FORMAT_ARGB32,
                                                                  tw, th,
@@ -188,13 +223,79 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static bool read_raw_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          int64_t tile_col, int64_t tile_row,
+                          void **buf, int32_t *len,
+                          const char **codec,
+                          GError **err) {
+  struct philips_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+  bool success = _openslide_tiff_read_raw_tile(osr, &l->tiffl, tiff,
+                                               tile_col, tile_row,
+                                               buf, len, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+  *codec = "jpeg";
+  return success;
+}
+
+static bool acquire_tile(openslide_t *osr,
+                         struct _openslide_level *level,
+                         int64_t tile_col, int64_t tile_row,
+                         uint32_t **tiledata,
+                         struct _openslide_cache_entry **cache_entry,
+                         GError **err) {
+  struct philips_ops_data *data = osr->data;
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+  *tiledata = get_tile(osr, level, tiff, tile_col, tile_row,
+                       cache_entry, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+  return *tiledata != NULL;
+}
+
+static bool clear_empty_tiles(openslide_t *osr,
+                              struct _openslide_level *level,
+                              uint8_t *nonempty,
+                              int64_t tiles_across, int64_t tiles_down,
+                              GError **err) {
+  struct philips_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+  return _openslide_tiff_clear_empty_tiles(&l->tiffl, data->tc, nonempty,
+                                           tiles_across, tiles_down, err);
+}
+
+static int32_t get_idle_handle_count(openslide_t *osr) {
+  struct philips_ops_data *data = osr->data;
+  return _openslide_tiffcache_get_idle_count(data->tc);
+}
+
+static void release_idle_handles(openslide_t *osr) {
+  struct philips_ops_data *data = osr->data;
+  _openslide_tiffcache_release_idle(data->tc);
+}
+
 static const struct _openslide_ops philips_ops = {
   .paint_region = paint_region,
+  .read_raw_tile = read_raw_tile,
+  .acquire_tile = acquire_tile,
+  .clear_empty_tiles = clear_empty_tiles,
+  .get_idle_handle_count = get_idle_handle_count,
+  .release_idle_handles = release_idle_handles,
   .destroy = destroy,
 };
 
 static bool philips_detect(const char *filename G_GNUC_UNUSED,
                            struct _openslide_tifflike *tl,
+                           struct _openslide_detect_context *dc,
                            GError **err) {
   // ensure we have a TIFF
   if (!tl) {
@@ -249,7 +350,9 @@ static bool philips_detect(const char *filename G_GNUC_UNUSED,
   }
   xmlFree(type);
 
-  xmlFreeDoc(doc);
+  // keep the document for philips_open
+  _openslide_detect_context_put(dc, PHILIPS_DETECT_XML, doc,
+                                (GDestroyNotify) xmlFreeDoc);
   return true;
 }
 
@@ -289,40 +392,15 @@ static bool get_xml_associated_image_data(struct _openslide_associated_image *_i
                                           uint32_t *dest,
                                           GError **err) {
   struct xml_associated_image *img = (struct xml_associated_image *) _img;
-  void *data = NULL;
-  bool success = false;
-
-  TIFF *tiff = _openslide_tiffcache_get(img->tc, err);
-  if (!tiff) {
-    return false;
-  }
-
-  xmlDoc *doc = parse_xml(tiff, err);
-  if (!doc) {
-    goto DONE;
-  }
 
-  gsize len;
-  if (!get_compressed_xml_associated_image_data(doc, img->xpath,
-                                                &data, &len, err)) {
-    goto DONE;
-  }
-
-  success = _openslide_jpeg_decode_buffer(data, len, dest,
-                                          img->base.w, img->base.h, err);
-
-DONE:
-  g_free(data);
-  if (doc) {
-    xmlFreeDoc(doc);
-  }
-  _openslide_tiffcache_put(img->tc, tiff);
-  return success;
+  return _openslide_jpeg_decode_buffer(img->data, img->len, dest,
+                                       img->base.w, img->base.h, err);
 }
 
 static void destroy_xml_associated_image(struct _openslide_associated_image *_img) {
   struct xml_associated_image *img = (struct xml_associated_image *) _img;
 
+  g_free(img->data);
   g_slice_free(struct xml_associated_image, img);
 }
 
@@ -331,9 +409,7 @@ static const struct _openslide_associated_image_ops philips_xml_associated_ops =
   .destroy = destroy_xml_associated_image,
 };
 
-// xpath is not copied (must be a static string)
 static bool maybe_add_xml_associated_image(openslide_t *osr,
-                                           struct _openslide_tiffcache *tc,
                                            xmlDoc *doc,
                                            const char *name,
                                            const char *xpath,
@@ -352,10 +428,8 @@ static bool maybe_add_xml_associated_image(openslide_t *osr,
   }
 
   int32_t w, h;
-  bool success =
-    _openslide_jpeg_decode_buffer_dimensions(data, len, &w, &h, err);
-  g_free(data);
-  if (!success) {
+  if (!_openslide_jpeg_decode_buffer_dimensions(data, len, &w, &h, err)) {
+    g_free(data);
     g_prefix_error(err, "Can't decode %s associated image: ", name);
     return false;
   }
@@ -365,8 +439,8 @@ static bool maybe_add_xml_associated_image(openslide_t *osr,
   img->base.ops = &philips_xml_associated_ops;
   img->base.w = w;
   img->base.h = h;
-  img->tc = tc;
-  img->xpath = xpath;
+  img->data = data;
+  img->len = len;
 
   g_hash_table_insert(osr->associated_images, g_strdup(name), img);
 
@@ -548,9 +622,35 @@ static bool verify_main_image_count(xmlDoc *doc, GError **err) {
   return true;
 }
 
+// a level decoded at reduced scale between the physical ones
+static struct _openslide_level *create_scaled_level(openslide_t *osr,
+                                                    struct _openslide_level *level,
+                                                    struct _openslide_level *next,
+                                                    int32_t scale_denom,
+                                                    void *data G_GNUC_UNUSED) {
+  struct level *l = (struct level *) level;
+  int64_t next_w = next ? ((struct level *) next)->tiffl.image_w : 0;
+  if (!_openslide_tiff_level_can_scale(&l->tiffl, scale_denom, next_w)) {
+    return NULL;
+  }
+  struct level *sd_l = g_slice_new0(struct level);
+  struct _openslide_tiff_level *tiffl = &sd_l->tiffl;
+  _openslide_tiff_level_init_scaled(level, &l->tiffl, scale_denom,
+                                    (struct _openslide_level *) sd_l,
+                                    tiffl);
+  sd_l->grid = _openslide_grid_create_simple(osr,
+                                             tiffl->tiles_across,
+                                             tiffl->tiles_down,
+                                             tiffl->tile_w,
+                                             tiffl->tile_h,
+                                             read_tile);
+  return (struct _openslide_level *) sd_l;
+}
+
 static bool philips_open(openslide_t *osr,
                          const char *filename,
                          struct _openslide_tifflike *tl,
+                         struct _openslide_detect_context *dc,
                          struct _openslide_hash *quickhash1,
                          GError **err) {
   GPtrArray *level_array = g_ptr_array_new();
@@ -564,10 +664,17 @@ static bool philips_open(openslide_t *osr,
     goto FAIL;
   }
 
-  // parse XML document
-  doc = parse_xml(tiff, err);
-  if (doc == NULL) {
-    goto FAIL;
+  // parse XML document, unless detection already did
+  doc = _openslide_detect_context_steal(dc, PHILIPS_DETECT_XML);
+  if (doc) {
+    if (!_openslide_tiff_set_dir(tiff, 0, err)) {
+      goto FAIL;
+    }
+  } else {
+    doc = parse_xml(tiff, err);
+    if (doc == NULL) {
+      goto FAIL;
+    }
   }
 
   // ensure there is only one WSI DPScannedImage in the XML
@@ -629,6 +736,7 @@ static bool philips_open(openslide_t *osr,
                                               tiffl->tile_w,
                                               tiffl->tile_h,
                                               read_tile);
+      l->base.simple_grid = true;
 
       // add to array
       g_ptr_array_add(level_array, l);
@@ -691,11 +799,15 @@ static bool philips_open(openslide_t *osr,
 
   // add associated images from XML
   // errors are non-fatal
-  maybe_add_xml_associated_image(osr, tc, doc,
+  maybe_add_xml_associated_image(osr, doc,
                                  "label", LABEL_DATA_XPATH, NULL);
-  maybe_add_xml_associated_image(osr, tc, doc,
+  maybe_add_xml_associated_image(osr, doc,
                                  "macro", MACRO_DATA_XPATH, NULL);
 
+  // synthesize JPEG levels from the DCT
+  level_array = _openslide_tiff_add_scaled_levels(osr, level_array,
+                                                  create_scaled_level, NULL);
+
   // unwrap level array
   int32_t level_count = level_array->len;
   struct level **levels =
@@ -42,6 +42,7 @@
 #include <errno.h>
 
 static const char MAGIC_BYTES[] = "SVGigaPixelImage";
+static const char SAKURA_DETECT_DB[] = "sakura-db";
 
 static const struct property {
   const char *table;
@@ -67,6 +68,12 @@ enum color_index {
   NUM_INDEXES = 3,
 };
 
+// enough for "T;x|y;downsample;color;focal_plane" with 64-bit fields
+#define TILEID_BUF_SIZE 96
+
+// worker threads shared by all slides for decoding color planes
+#define PLANE_DECODE_THREADS 4
+
 #define PREPARE_OR_FAIL(DEST, DB, SQL) do {				\
     DEST = _openslide_sqlite_prepare(DB, SQL, err);			\
     if (!DEST) {							\
@@ -87,16 +94,47 @@ enum color_index {
     }									\
   } while (0)
 
+// maximum number of idle connections to keep
+#define CONNECTION_CACHE_MAX 8
+
 struct sakura_ops_data {
   char *filename;
   char *data_sql;
+  char *planes_sql;  // every focal plane
   int32_t tile_size;
   int32_t focal_plane;
+  int32_t focal_planes;
+
+  // idle connections, most recently used first
+  GQueue *connections;
+  GMutex *lock;
+};
+
+// a database handle with data_sql already prepared
+struct connection {
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  sqlite3_stmt *planes_stmt;  // planes_sql, or NULL until needed
 };
 
 struct level {
   struct _openslide_level base;
   struct _openslide_grid *grid;
+
+  // whether the chosen focal plane has any planes of each tile
+  uint8_t *stored_tiles;
+  int64_t tiles_across;
+  int64_t tiles_down;
+
+  // cache planes of the other focal planes
+  uint8_t *plane_keys;
+};
+
+// a tile ID of the chosen focal plane, seen while loading levels
+struct stored_tile {
+  int64_t x;
+  int64_t y;
+  int64_t downsample;
 };
 
 struct associated_image {
@@ -128,7 +166,9 @@ FAIL:
 }
 
 static bool sakura_detect(const char *filename,
-                          struct _openslide_tifflike *tl, GError **err) {
+                          struct _openslide_tifflike *tl,
+                          struct _openslide_detect_context *dc,
+                          GError **err) {
   sqlite3_stmt *stmt = NULL;
   char *unique_table_name = NULL;
   char *sql = NULL;
@@ -171,19 +211,85 @@ FAIL:
   sqlite3_finalize(stmt);
   g_free(sql);
   g_free(unique_table_name);
-  _openslide_sqlite_close(db);
+  if (result) {
+    // keep the connection for sakura_open
+    _openslide_detect_context_put(dc, SAKURA_DETECT_DB, db,
+                                  (GDestroyNotify) _openslide_sqlite_close);
+  } else {
+    _openslide_sqlite_close(db);
+  }
   return result;
 }
 
 static void destroy_level(struct level *l) {
   _openslide_grid_destroy(l->grid);
+  g_free(l->stored_tiles);
+  g_free(l->plane_keys);
   g_slice_free(struct level, l);
 }
 
+static void connection_destroy(struct connection *conn) {
+  sqlite3_finalize(conn->stmt);
+  sqlite3_finalize(conn->planes_stmt);
+  _openslide_sqlite_close(conn->db);
+  g_slice_free(struct connection, conn);
+}
+
+static struct connection *connection_get(struct sakura_ops_data *data,
+                                         GError **err) {
+  g_mutex_lock(data->lock);
+  struct connection *conn = g_queue_pop_head(data->connections);
+  g_mutex_unlock(data->lock);
+  if (conn) {
+    return conn;
+  }
+
+  sqlite3 *db = _openslide_sqlite_open(data->filename, err);
+  if (!db) {
+    return NULL;
+  }
+  _openslide_sqlite_tune_for_reads(db, CONNECTION_CACHE_MAX);
+  sqlite3_stmt *stmt = _openslide_sqlite_prepare(db, data->data_sql, err);
+  if (!stmt) {
+    _openslide_sqlite_close(db);
+    return NULL;
+  }
+
+  conn = g_slice_new0(struct connection);
+  conn->db = db;
+  conn->stmt = stmt;
+  return conn;
+}
+
+static void connection_put(struct sakura_ops_data *data,
+                           struct connection *conn) {
+  // end the read transaction so the idle connection holds no lock
+  sqlite3_reset(conn->stmt);
+  sqlite3_reset(conn->planes_stmt);
+
+  g_mutex_lock(data->lock);
+  if (g_queue_get_length(data->connections) < CONNECTION_CACHE_MAX) {
+    g_queue_push_head(data->connections, conn);
+    conn = NULL;
+  }
+  g_mutex_unlock(data->lock);
+
+  if (conn) {
+    connection_destroy(conn);
+  }
+}
+
 static void destroy(openslide_t *osr) {
   struct sakura_ops_data *data = osr->data;
+  struct connection *conn;
+  while ((conn = g_queue_pop_head(data->connections)) != NULL) {
+    connection_destroy(conn);
+  }
+  g_queue_free(data->connections);
+  g_mutex_free(data->lock);
   g_free(data->filename);
   g_free(data->data_sql);
+  g_free(data->planes_sql);
   g_slice_free(struct sakura_ops_data, data);
 
   for (int32_t i = 0; i < osr->level_count; i++) {
@@ -192,13 +298,23 @@ static void destroy(openslide_t *osr) {
   g_free(osr->levels);
 }
 
+static void format_tileid(char *buf,
+                          int64_t x, int64_t y,
+                          int64_t downsample,
+                          enum color_index color,
+                          int32_t focal_plane) {
+  // T;x|y;downsample;color;0
+  g_snprintf(buf, TILEID_BUF_SIZE, "T;%"PRId64"|%"PRId64";%"PRId64";%d;%d",
+             x, y, downsample, color, focal_plane);
+}
+
 static char *make_tileid(int64_t x, int64_t y,
                          int64_t downsample,
                          enum color_index color,
                          int32_t focal_plane) {
-  // T;x|y;downsample;color;0
-  return g_strdup_printf("T;%"PRId64"|%"PRId64";%"PRId64";%d;%d",
-                         x, y, downsample, color, focal_plane);
+  char buf[TILEID_BUF_SIZE];
+  format_tileid(buf, x, y, downsample, color, focal_plane);
+  return g_strdup(buf);
 }
 
 static bool _parse_tileid_column(const char *tileid, const char *col,
@@ -288,77 +404,384 @@ OUT:
   return success;
 }
 
-static bool read_channel(uint8_t *channeldata,
+// one color plane of a tile
+struct plane {
+  struct _openslide_cache_entry *cache_entry;
+  const void *buf;
+  int32_t buflen;
+  uint8_t *dest;
+  int32_t tile_size;
+
+  struct plane_group *group;
+  gint claimed;
+  bool done;  // protected by group->mutex
+  bool success;
+  GError *err;
+};
+
+// the planes of a tile, shared between the reader and the plane workers
+struct plane_group {
+  gint refcount;
+  GMutex *mutex;
+  GCond *cond;
+  struct plane planes[NUM_INDEXES];
+
+  // owned by the reader
+  void *key;
+  int32_t focal_plane;
+  bool absent;  // some color plane isn't stored
+};
+
+static GOnce plane_pool_once = G_ONCE_INIT;
+
+static void plane_group_unref(struct plane_group *group) {
+  if (!g_atomic_int_dec_and_test(&group->refcount)) {
+    return;
+  }
+  for (int i = 0; i < NUM_INDEXES; i++) {
+    struct plane *plane = &group->planes[i];
+    if (plane->cache_entry) {
+      _openslide_cache_entry_unref(plane->cache_entry);
+    }
+    g_clear_error(&plane->err);
+  }
+  g_cond_free(group->cond);
+  g_mutex_free(group->mutex);
+  g_slice_free(struct plane_group, group);
+}
+
+static void decode_plane(struct plane *plane) {
+  plane->success =
+    _openslide_jpeg_decode_buffer_gray(plane->buf, plane->buflen,
+                                       plane->dest,
+                                       plane->tile_size, plane->tile_size,
+                                       &plane->err);
+}
+
+static void plane_worker(gpointer data, gpointer user_data G_GNUC_UNUSED) {
+  struct plane *plane = data;
+  struct plane_group *group = plane->group;
+
+  // the reader may have gotten here first
+  if (g_atomic_int_compare_and_exchange(&plane->claimed, 0, 1)) {
+    decode_plane(plane);
+    g_mutex_lock(group->mutex);
+    plane->done = true;
+    g_cond_broadcast(group->cond);
+    g_mutex_unlock(group->mutex);
+  }
+  plane_group_unref(group);
+}
+
+static void *create_plane_pool(void *arg G_GNUC_UNUSED) {
+  return g_thread_pool_new(plane_worker, NULL, PLANE_DECODE_THREADS,
+                           false, NULL);
+}
+
+// the cache plane of a focal plane of a level; the chosen focal plane
+// uses the level itself
+static void *get_plane_key(struct sakura_ops_data *data,
+                           struct level *l,
+                           int32_t focal_plane) {
+  if (focal_plane == data->focal_plane) {
+    return l;
+  }
+  return &l->plane_keys[focal_plane];
+}
+
+static struct plane_group *plane_group_new(openslide_t *osr,
+                                           void *key,
+                                           int32_t focal_plane,
+                                           int64_t tile_col, int64_t tile_row,
+                                           int32_t tile_size) {
+  struct plane_group *group = g_slice_new0(struct plane_group);
+  group->refcount = 1;
+  group->mutex = g_mutex_new();
+  group->cond = g_cond_new();
+  group->key = key;
+  group->focal_plane = focal_plane;
+  for (int i = 0; i < NUM_INDEXES; i++) {
+    struct plane *plane = &group->planes[i];
+    plane->group = group;
+    plane->tile_size = tile_size;
+    plane->dest = g_slice_alloc(tile_size * tile_size);
+
+    // check the compressed-data cache
+    plane->buf = _openslide_cache_get(osr->compressed_cache,
+                                      key,
+                                      tile_col * NUM_INDEXES + i,
+                                      tile_row,
+                                      &plane->cache_entry);
+    if (plane->buf) {
+      plane->buflen = _openslide_cache_entry_get_size(plane->cache_entry);
+    }
+  }
+  return group;
+}
+
+static void plane_group_free(struct plane_group *group) {
+  // workers are done with the destination buffers, but may still hold
+  // a reference to the group
+  for (int i = 0; i < NUM_INDEXES; i++) {
+    struct plane *plane = &group->planes[i];
+    g_slice_free1(plane->tile_size * plane->tile_size, plane->dest);
+  }
+  plane_group_unref(group);
+}
+
+// fetch the compressed planes of the non-NULL groups that are not already
+// in the cache, in one query; stmt has NUM_INDEXES placeholders per group.
+// groups missing a plane are marked absent.
+static bool fetch_planes(openslide_t *osr,
+                         struct plane_group **groups,
+                         int32_t group_count,
                          int64_t tile_col, int64_t tile_row,
                          int64_t downsample,
-                         enum color_index color,
-                         int32_t focal_plane,
                          int32_t tile_size,
                          sqlite3_stmt *stmt,
                          GError **err) {
-  // compute tile id
-  char *tileid = make_tileid(tile_col * tile_size * downsample,
-                             tile_row * tile_size * downsample,
-                             downsample, color, focal_plane);
+  char (*tileids)[TILEID_BUF_SIZE] =
+    g_malloc(group_count * NUM_INDEXES * TILEID_BUF_SIZE);
+  int missing = 0;
+  bool success = false;
 
-  // retrieve compressed tile
   sqlite3_reset(stmt);
-  BIND_TEXT_OR_FAIL(stmt, 1, tileid);
-  STEP_OR_FAIL(stmt);
-  const void *buf = sqlite3_column_blob(stmt, 0);
-  int buflen = sqlite3_column_bytes(stmt, 0);
-  g_free(tileid);
+  for (int32_t g = 0; g < group_count; g++) {
+    for (int i = 0; i < NUM_INDEXES; i++) {
+      int n = g * NUM_INDEXES + i;
+      if (!groups[g] || groups[g]->planes[i].buf) {
+        // a NULL never matches
+        sqlite3_bind_null(stmt, n + 1);
+        continue;
+      }
+      format_tileid(tileids[n],
+                    tile_col * tile_size * downsample,
+                    tile_row * tile_size * downsample,
+                    downsample, i, groups[g]->focal_plane);
+      BIND_TEXT_OR_FAIL(stmt, n + 1, tileids[n]);
+      missing++;
+    }
+  }
 
-  // decompress
-  return _openslide_jpeg_decode_buffer_gray(buf, buflen, channeldata,
-                                            tile_size, tile_size, err);
+  int rc = SQLITE_DONE;
+  while (missing && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *tileid = (const char *) sqlite3_column_text(stmt, 0);
+    for (int n = 0; tileid && n < group_count * NUM_INDEXES; n++) {
+      struct plane_group *group = groups[n / NUM_INDEXES];
+      if (!group) {
+        continue;
+      }
+      struct plane *plane = &group->planes[n % NUM_INDEXES];
+      if (plane->buf || strcmp(tileid, tileids[n])) {
+        continue;
+      }
+      // the blob is only valid until the next step, so cache a copy
+      // and hold it until the plane is decoded
+      const void *blob = sqlite3_column_blob(stmt, 1);
+      int bloblen = sqlite3_column_bytes(stmt, 1);
+      if (bloblen <= 0) {
+        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                    "Empty data for tile %s", tileid);
+        goto FAIL;
+      }
+      void *copy = g_slice_copy(bloblen, blob);
+      _openslide_cache_put(osr->compressed_cache,
+                           group->key,
+                           tile_col * NUM_INDEXES + n % NUM_INDEXES, tile_row,
+                           copy, bloblen,
+                           &plane->cache_entry);
+      plane->buf = copy;
+      plane->buflen = bloblen;
+      missing--;
+      break;
+    }
+  }
+  if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+    _openslide_sqlite_propagate_stmt_error(stmt, err);
+    goto FAIL;
+  }
+
+  for (int32_t g = 0; g < group_count; g++) {
+    for (int i = 0; groups[g] && i < NUM_INDEXES; i++) {
+      if (!groups[g]->planes[i].buf) {
+        groups[g]->absent = true;
+      }
+    }
+  }
+  success = true;
 
 FAIL:
-  g_free(tileid);
-  return false;
+  g_free(tileids);
+  return success;
 }
 
-static bool read_image(uint32_t *tiledata,
-                       int64_t tile_col, int64_t tile_row,
-                       int64_t downsample,
-                       int32_t focal_plane,
-                       int32_t tile_size,
-                       sqlite3_stmt *stmt,
-                       GError **err) {
-  uint8_t *red_channel = g_slice_alloc(tile_size * tile_size);
-  uint8_t *green_channel = g_slice_alloc(tile_size * tile_size);
-  uint8_t *blue_channel = g_slice_alloc(tile_size * tile_size);
-  bool success = false;
-
-  if (!read_channel(red_channel, tile_col, tile_row, downsample,
-                    INDEX_RED, focal_plane, tile_size, stmt, err)) {
-    goto OUT;
+// decode the planes of every non-NULL group that isn't absent
+static bool decode_groups(struct plane_group **groups,
+                          int32_t group_count,
+                          GError **err) {
+  GThreadPool *pool = g_once(&plane_pool_once, create_plane_pool, NULL);
+
+  // decode all but the first plane of each group on the pool while we
+  // decode the first planes, then decode whatever the pool hasn't
+  // started
+  for (int32_t g = 0; g < group_count; g++) {
+    struct plane_group *group = groups[g];
+    if (!group || group->absent) {
+      continue;
+    }
+    for (int i = 1; i < NUM_INDEXES; i++) {
+      g_atomic_int_inc(&group->refcount);
+      g_thread_pool_push(pool, &group->planes[i], NULL);
+    }
   }
-  if (!read_channel(green_channel, tile_col, tile_row, downsample,
-                    INDEX_GREEN, focal_plane, tile_size, stmt, err)) {
-    goto OUT;
+  for (int32_t g = 0; g < group_count; g++) {
+    struct plane_group *group = groups[g];
+    if (!group || group->absent) {
+      continue;
+    }
+    for (int i = 0; i < NUM_INDEXES; i++) {
+      struct plane *plane = &group->planes[i];
+      if (g_atomic_int_compare_and_exchange(&plane->claimed, 0, 1)) {
+        decode_plane(plane);
+      } else {
+        g_mutex_lock(group->mutex);
+        while (!plane->done) {
+          g_cond_wait(group->cond, group->mutex);
+        }
+        g_mutex_unlock(group->mutex);
+      }
+    }
   }
-  if (!read_channel(blue_channel, tile_col, tile_row, downsample,
-                    INDEX_BLUE, focal_plane, tile_size, stmt, err)) {
-    goto OUT;
+  for (int32_t g = 0; g < group_count; g++) {
+    struct plane_group *group = groups[g];
+    for (int i = 0; group && !group->absent && i < NUM_INDEXES; i++) {
+      struct plane *plane = &group->planes[i];
+      if (!plane->success) {
+        g_propagate_error(err, plane->err);
+        plane->err = NULL;
+        return false;
+      }
+    }
   }
+  return true;
+}
 
-  for (int32_t i = 0; i < tile_size * tile_size; i++) {
-    tiledata[i] = 0xff000000 |
-                  (red_channel[i] << 16) |
-                  (green_channel[i] << 8) |
-                  blue_channel[i];
+// paint the tile of each of count consecutive focal planes onto its own
+// context, reading the ones not in the cache with stmt
+static bool paint_plane_tiles(openslide_t *osr,
+                              struct _openslide_level *level,
+                              cairo_t **crs,
+                              int32_t first_plane, int32_t count,
+                              int64_t tile_col, int64_t tile_row,
+                              sqlite3_stmt *stmt,
+                              GError **err) {
+  struct sakura_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+  int32_t tile_size = data->tile_size;
+  struct _openslide_cache_entry **cache_entries =
+    g_new0(struct _openslide_cache_entry *, count);
+  uint32_t **tiles = g_new0(uint32_t *, count);
+  struct plane_group **groups = g_new0(struct plane_group *, count);
+  bool missing = false;
+  bool success = false;
+
+  // cache
+  for (int32_t p = 0; p < count; p++) {
+    void *key = get_plane_key(data, l, first_plane + p);
+    tiles[p] = _openslide_cache_get(osr->cache, key, tile_col, tile_row,
+                                    &cache_entries[p]);
+    if (!tiles[p]) {
+      groups[p] = plane_group_new(osr, key, first_plane + p,
+                                  tile_col, tile_row, tile_size);
+      missing = true;
+    }
   }
 
+  // read tiles
+  if (missing) {
+    if (!fetch_planes(osr, groups, count, tile_col, tile_row,
+                      l->base.downsample, tile_size, stmt, err) ||
+        !decode_groups(groups, count, err)) {
+      goto OUT;
+    }
+    for (int32_t p = 0; p < count; p++) {
+      struct plane_group *group = groups[p];
+      if (!group) {
+        continue;
+      }
+      if (group->absent) {
+        // no such tile; remember that, so we don't query for it again
+        tiles[p] = _openslide_cache_put_constant(osr->cache, group->key,
+                                                 tile_col, tile_row,
+                                                 0, &cache_entries[p]);
+        continue;
+      }
+
+      uint32_t *tiledata = _openslide_buffer_alloc(tile_size * tile_size * 4);
+      _openslide_convert_planes_to_argb(tiledata,
+                                        group->planes[INDEX_RED].dest,
+                                        group->planes[INDEX_GREEN].dest,
+                                        group->planes[INDEX_BLUE].dest,
+                                        tile_size * tile_size);
+
+      // clip, if necessary
+      if (!_openslide_clip_tile(tiledata,
+                                tile_size, tile_size,
+                                l->base.w - tile_col * tile_size,
+                                l->base.h - tile_row * tile_size,
+                                err)) {
+        _openslide_buffer_free(tile_size * tile_size * 4, tiledata);
+        goto OUT;
+      }
+
+      // put it in the cache
+      _openslide_cache_put(osr->cache,
+                           group->key, tile_col, tile_row,
+                           tiledata, tile_size * tile_size * 4,
+                           &cache_entries[p]);
+      tiles[p] = tiledata;
+    }
+  }
+
+  // draw them
+  for (int32_t p = 0; p < count; p++) {
+    uint32_t pixel;
+    if (_openslide_cache_entry_get_constant(cache_entries[p], &pixel)) {
+      _openslide_paint_constant(crs[p], pixel, tile_size, tile_size);
+      continue;
+    }
+    cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiles[p],
+                                                                   CAIRO_FORMAT_ARGB32,
+                                                                   tile_size, tile_size,
+                                                                   tile_size * 4);
+    cairo_set_source_surface(crs[p], surface, 0, 0);
+    cairo_surface_destroy(surface);
+    cairo_paint(crs[p]);
+  }
   success = true;
 
 OUT:
-  g_slice_free1(tile_size * tile_size, red_channel);
-  g_slice_free1(tile_size * tile_size, green_channel);
-  g_slice_free1(tile_size * tile_size, blue_channel);
+  // done with the cache entries, release them
+  for (int32_t p = 0; p < count; p++) {
+    if (cache_entries[p]) {
+      _openslide_cache_entry_unref(cache_entries[p]);
+    }
+    if (groups[p]) {
+      plane_group_free(groups[p]);
+    }
+  }
+  g_free(groups);
+  g_free(tiles);
+  g_free(cache_entries);
   return success;
 }
 
+struct read_tile_args {
+  struct connection *conn;
+  // if painting every focal plane
+  cairo_t **plane_crs;
+};
+
 static bool read_tile(openslide_t *osr,
                       cairo_t *cr,
                       struct _openslide_level *level,
@@ -366,64 +789,29 @@ static bool read_tile(openslide_t *osr,
                       void *arg,
                       GError **err) {
   struct sakura_ops_data *data = osr->data;
-  struct level *l = (struct level *) level;
-  sqlite3_stmt *stmt = arg;
-  int32_t tile_size = data->tile_size;
-  GError *tmp_err = NULL;
-
-  // cache
-  struct _openslide_cache_entry *cache_entry;
-  uint32_t *tiledata = _openslide_cache_get(osr->cache,
-                                            level, tile_col, tile_row,
-                                            &cache_entry);
-  if (!tiledata) {
-    tiledata = g_slice_alloc(tile_size * tile_size * 4);
-
-    // read tile
-    if (!read_image(tiledata, tile_col, tile_row, l->base.downsample,
-                    data->focal_plane, tile_size, stmt, &tmp_err)) {
-      if (g_error_matches(tmp_err, OPENSLIDE_ERROR,
-                          OPENSLIDE_ERROR_NO_VALUE)) {
-        // no such tile
-        g_clear_error(&tmp_err);
-        return true;
-      } else {
-        g_propagate_error(err, tmp_err);
-        g_slice_free1(tile_size * tile_size * 4, tiledata);
-        return false;
-      }
-    }
+  struct read_tile_args *args = arg;
 
-    // clip, if necessary
-    if (!_openslide_clip_tile(tiledata,
-                              tile_size, tile_size,
-                              l->base.w - tile_col * tile_size,
-                              l->base.h - tile_row * tile_size,
-                              err)) {
-      g_slice_free1(tile_size * tile_size * 4, tiledata);
-      return false;
-    }
-
-    // put it in the cache
-    _openslide_cache_put(osr->cache,
-			 level, tile_col, tile_row,
-			 tiledata, tile_size * tile_size * 4,
-			 &cache_entry);
+  if (!args->plane_crs) {
+    return paint_plane_tiles(osr, level, &cr, data->focal_plane, 1,
+                             tile_col, tile_row, args->conn->stmt, err);
   }
 
-  // draw it
-  cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiledata,
-                                                                 CAIRO_FORMAT_ARGB32,
-                                                                 tile_size, tile_size,
-                                                                 tile_size * 4);
-  cairo_set_source_surface(cr, surface, 0, 0);
-  cairo_surface_destroy(surface);
-  cairo_paint(cr);
-
-  // done with the cache entry, release it
-  _openslide_cache_entry_unref(cache_entry);
-
-  return true;
+  // the grid has positioned cr, which is the chosen plane's; put every
+  // plane's tile at the same place
+  cairo_matrix_t matrix;
+  cairo_get_matrix(cr, &matrix);
+  for (int32_t p = 0; p < data->focal_planes; p++) {
+    cairo_save(args->plane_crs[p]);
+    cairo_set_matrix(args->plane_crs[p], &matrix);
+  }
+  bool success = paint_plane_tiles(osr, level, args->plane_crs,
+                                   0, data->focal_planes,
+                                   tile_col, tile_row,
+                                   args->conn->planes_stmt, err);
+  for (int32_t p = 0; p < data->focal_planes; p++) {
+    cairo_restore(args->plane_crs[p]);
+  }
+  return success;
 }
 
 static bool paint_region(openslide_t *osr, cairo_t *cr,
@@ -433,29 +821,105 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
                          GError **err) {
   struct sakura_ops_data *data = osr->data;
   struct level *l = (struct level *) level;
-  sqlite3_stmt *stmt = NULL;
-  bool success = false;
 
-  sqlite3 *db = _openslide_sqlite_open(data->filename, err);
-  if (!db) {
+  struct connection *conn = connection_get(data, err);
+  if (!conn) {
     return false;
   }
-  PREPARE_OR_FAIL(stmt, db, data->data_sql);
 
-  success = _openslide_grid_paint_region(l->grid, cr, stmt,
-                                         x / l->base.downsample,
-                                         y / l->base.downsample,
-                                         level, w, h,
-                                         err);
+  struct read_tile_args args = {
+    .conn = conn,
+  };
+  bool success = _openslide_grid_paint_region(l->grid, cr, &args,
+                                              x / l->base.downsample,
+                                              y / l->base.downsample,
+                                              level, w, h,
+                                              err);
 
-FAIL:
-  sqlite3_finalize(stmt);
-  _openslide_sqlite_close(db);
+  connection_put(data, conn);
+  return success;
+}
+
+static bool paint_region_planes(openslide_t *osr, cairo_t **crs,
+                                int64_t x, int64_t y,
+                                struct _openslide_level *level,
+                                int32_t w, int32_t h,
+                                GError **err) {
+  struct sakura_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  struct connection *conn = connection_get(data, err);
+  if (!conn) {
+    return false;
+  }
+
+  // most connections only read the chosen plane, so prepare on demand
+  if (!conn->planes_stmt) {
+    conn->planes_stmt = _openslide_sqlite_prepare(conn->db,
+                                                  data->planes_sql, err);
+    if (!conn->planes_stmt) {
+      connection_put(data, conn);
+      return false;
+    }
+  }
+
+  struct read_tile_args args = {
+    .conn = conn,
+    .plane_crs = crs,
+  };
+  bool success = _openslide_grid_paint_region(l->grid,
+                                              crs[data->focal_plane], &args,
+                                              x / l->base.downsample,
+                                              y / l->base.downsample,
+                                              level, w, h,
+                                              err);
+
+  connection_put(data, conn);
   return success;
 }
 
+static bool clear_empty_tiles(openslide_t *osr G_GNUC_UNUSED,
+                              struct _openslide_level *level,
+                              uint8_t *nonempty,
+                              int64_t tiles_across, int64_t tiles_down,
+                              GError **err G_GNUC_UNUSED) {
+  struct level *l = (struct level *) level;
+  if (tiles_across != l->tiles_across || tiles_down != l->tiles_down) {
+    return true;
+  }
+  for (int64_t i = 0; i < tiles_across * tiles_down; i++) {
+    nonempty[i] &= l->stored_tiles[i];
+  }
+  return true;
+}
+
+static int32_t get_idle_handle_count(openslide_t *osr) {
+  struct sakura_ops_data *data = osr->data;
+  g_mutex_lock(data->lock);
+  int32_t count = g_queue_get_length(data->connections);
+  g_mutex_unlock(data->lock);
+  return count;
+}
+
+static void release_idle_handles(openslide_t *osr) {
+  struct sakura_ops_data *data = osr->data;
+  g_mutex_lock(data->lock);
+  GList *idle = data->connections->head;
+  g_queue_init(data->connections);
+  g_mutex_unlock(data->lock);
+
+  for (GList *cur = idle; cur; cur = cur->next) {
+    connection_destroy(cur->data);
+  }
+  g_list_free(idle);
+}
+
 static const struct _openslide_ops sakura_ops = {
   .paint_region = paint_region,
+  .clear_empty_tiles = clear_empty_tiles,
+  .paint_region_planes = paint_region_planes,
+  .get_idle_handle_count = get_idle_handle_count,
+  .release_idle_handles = release_idle_handles,
   .destroy = destroy,
 };
 
@@ -798,6 +1262,9 @@ static void compute_quickhash1(struct _openslide_hash *quickhash1,
                                sqlite3 *db,
                                const char *unique_table_name,
                                GQueue *tileids) {
+  if (quickhash1 == NULL) {
+    return;
+  }
   if (!hash_columns(quickhash1, db, "SELECT SlideId, Date, Creator, "
                     "Description, Keywords FROM SVSlideDataXPO "
                     "ORDER BY OID", NULL)) {
@@ -837,6 +1304,7 @@ static void clear_tileids(GQueue *tileids) {
 
 static bool sakura_open(openslide_t *osr, const char *filename,
                         struct _openslide_tifflike *tl G_GNUC_UNUSED,
+                        struct _openslide_detect_context *dc,
                         struct _openslide_hash *quickhash1, GError **err) {
   struct level **levels = NULL;
   int32_t level_count = 0;
@@ -848,11 +1316,15 @@ static bool sakura_open(openslide_t *osr, const char *filename,
                           (GDestroyNotify) destroy_level);
   GQueue *quickhash_tileids = g_queue_new();
   int64_t quickhash_downsample = 0;
+  GArray *stored = g_array_new(false, false, sizeof(struct stored_tile));
   bool success = false;
   GError *tmp_err = NULL;
 
-  // open database
-  sqlite3 *db = _openslide_sqlite_open(filename, err);
+  // open database, unless detection already did
+  sqlite3 *db = _openslide_detect_context_steal(dc, SAKURA_DETECT_DB);
+  if (!db) {
+    db = _openslide_sqlite_open(filename, err);
+  }
   if (!db) {
     goto FAIL;
   }
@@ -875,6 +1347,12 @@ static bool sakura_open(openslide_t *osr, const char *filename,
     goto FAIL;
   }
 
+  if (focal_planes < 1) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Invalid focal plane count %d", focal_planes);
+    goto FAIL;
+  }
+
   // select middle focal plane
   int32_t chosen_focal_plane = (focal_planes / 2) + (focal_planes % 2) - 1;
   //g_debug("Using focal plane %d", chosen_focal_plane);
@@ -885,9 +1363,9 @@ static bool sakura_open(openslide_t *osr, const char *filename,
   int ret;
   while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
     const char *tileid = (const char *) sqlite3_column_text(stmt, 0);
-    int64_t downsample;
+    int64_t x, y, downsample;
     int32_t focal_plane;
-    if (!parse_tileid(tileid, NULL, NULL, &downsample, NULL, &focal_plane,
+    if (!parse_tileid(tileid, &x, &y, &downsample, NULL, &focal_plane,
                       &tmp_err)) {
       if (g_error_matches(tmp_err, OPENSLIDE_ERROR,
                           OPENSLIDE_ERROR_NO_VALUE)) {
@@ -924,11 +1402,22 @@ static bool sakura_open(openslide_t *osr, const char *filename,
                                               tiles_across, tiles_down,
                                               tile_size, tile_size,
                                               read_tile);
+      l->base.simple_grid = true;
+      l->stored_tiles = g_new0(uint8_t, tiles_across * tiles_down);
+      l->tiles_across = tiles_across;
+      l->tiles_down = tiles_down;
+      l->plane_keys = g_new0(uint8_t, focal_planes);
       int64_t *downsample_val = g_new(int64_t, 1);
       *downsample_val = downsample;
       g_hash_table_insert(level_hash, downsample_val, l);
     }
 
+    // the level may not exist yet, so record the tile for later
+    if (focal_plane == chosen_focal_plane) {
+      struct stored_tile tile = {x, y, downsample};
+      g_array_append_val(stored, tile);
+    }
+
     // save tileid if smallest level
     if (downsample > quickhash_downsample) {
       clear_tileids(quickhash_tileids);
@@ -947,6 +1436,20 @@ static bool sakura_open(openslide_t *osr, const char *filename,
   g_free(sql);
   sql = NULL;
 
+  // mark stored tiles
+  for (guint i = 0; i < stored->len; i++) {
+    struct stored_tile *tile = &g_array_index(stored, struct stored_tile, i);
+    struct level *l = g_hash_table_lookup(level_hash, &tile->downsample);
+    if (!l) {
+      continue;
+    }
+    int64_t col = tile->x / tile->downsample / tile_size;
+    int64_t row = tile->y / tile->downsample / tile_size;
+    if (col < l->tiles_across && row < l->tiles_down) {
+      l->stored_tiles[row * l->tiles_across + col] = 1;
+    }
+  }
+
   // move levels to level array
   level_count = g_hash_table_size(level_hash);
   if (level_count == 0) {
@@ -992,15 +1495,28 @@ static bool sakura_open(openslide_t *osr, const char *filename,
   struct sakura_ops_data *data = g_slice_new0(struct sakura_ops_data);
   data->filename = g_strdup(filename);
   data->data_sql =
-    g_strdup_printf("SELECT data FROM %s WHERE id=?", unique_table_name);
+    g_strdup_printf("SELECT id, data FROM %s WHERE id IN (?, ?, ?)",
+                    unique_table_name);
+  GString *planes_sql = g_string_new(NULL);
+  g_string_printf(planes_sql, "SELECT id, data FROM %s WHERE id IN (?",
+                  unique_table_name);
+  for (int32_t i = 1; i < focal_planes * NUM_INDEXES; i++) {
+    g_string_append(planes_sql, ", ?");
+  }
+  g_string_append(planes_sql, ")");
+  data->planes_sql = g_string_free(planes_sql, false);
   data->tile_size = tile_size;
   data->focal_plane = chosen_focal_plane;
+  data->focal_planes = focal_planes;
+  data->connections = g_queue_new();
+  data->lock = g_mutex_new();
 
   // commit
   g_assert(osr->data == NULL);
   g_assert(osr->levels == NULL);
   osr->levels = (struct _openslide_level **) levels;
   osr->level_count = level_count;
+  osr->focal_plane_count = focal_planes;
   osr->data = data;
   osr->ops = &sakura_ops;
 
@@ -1018,6 +1534,7 @@ FAIL:
   _openslide_sqlite_close(db);
   clear_tileids(quickhash_tileids);
   g_queue_free(quickhash_tileids);
+  g_array_free(stored, true);
   g_hash_table_destroy(level_hash);
   g_free(sql);
   g_free(unique_table_name);
@@ -52,6 +52,11 @@ struct level {
   struct _openslide_level base;
   struct _openslide_tiff_level tiffl;
   struct _openslide_grid *grid;
+
+  // with OPENSLIDE_OPEN_TRIM_OVERLAPS, the size of the cropped tiles of
+  // the simple grid; 0 otherwise
+  int64_t cell_w;
+  int64_t cell_h;
 };
 
 static void destroy_data(struct trestle_ops_data *data,
@@ -100,11 +105,11 @@ static bool read_tile(openslide_t *osr,
                                             level, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
-    if (!_openslide_tiff_read_tile(tiffl, tiff,
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
+    if (!_openslide_tiff_read_tile(osr, tiffl, tiff,
                                    tiledata, tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -112,7 +117,7 @@ static bool read_tile(openslide_t *osr,
     if (!_openslide_tiff_clip_tile(tiffl, tiledata,
                                    tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -137,6 +142,77 @@ static bool read_tile(openslide_t *osr,
   return true;
 }
 
+// the simple grid of cropped tiles.  Each cell is the top-left of the
+// TIFF tile at the same position, which is what the cairo operator
+// SATURATE would show for its overlaps; cells past the last tile of a
+// row or column are its remainder.
+static bool read_cell(openslide_t *osr,
+                      cairo_t *cr,
+                      struct _openslide_level *level,
+                      int64_t cell_col, int64_t cell_row,
+                      void *arg,
+                      GError **err) {
+  struct level *l = (struct level *) level;
+  struct _openslide_tiff_level *tiffl = &l->tiffl;
+  TIFF *tiff = arg;
+
+  int64_t tw = tiffl->tile_w;
+  int64_t th = tiffl->tile_h;
+  int64_t cw = l->cell_w;
+  int64_t ch = l->cell_h;
+
+  // cache
+  struct _openslide_cache_entry *cache_entry;
+  uint32_t *celldata = _openslide_cache_get(osr->cache,
+                                            level, cell_col, cell_row,
+                                            &cache_entry);
+  if (!celldata) {
+    int64_t tile_col = MIN(cell_col, tiffl->tiles_across - 1);
+    int64_t tile_row = MIN(cell_row, tiffl->tiles_down - 1);
+    uint32_t *tiledata = _openslide_buffer_alloc(tw * th * 4);
+    if (!_openslide_tiff_read_tile(osr, tiffl, tiff,
+                                   tiledata, tile_col, tile_row,
+                                   err)) {
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return false;
+    }
+
+    // clip, if necessary
+    if (!_openslide_tiff_clip_tile(tiffl, tiledata,
+                                   tile_col, tile_row,
+                                   err)) {
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return false;
+    }
+
+    // crop
+    celldata = _openslide_buffer_alloc(cw * ch * 4);
+    _openslide_crop_tile(celldata, cw, ch, tiledata, tw, tw, th,
+                         (cell_col - tile_col) * cw,
+                         (cell_row - tile_row) * ch);
+    _openslide_buffer_free(tw * th * 4, tiledata);
+
+    // put it in the cache
+    _openslide_cache_put(osr->cache, level, cell_col, cell_row,
+                         celldata, cw * ch * 4,
+                         &cache_entry);
+  }
+
+  // draw it
+  cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) celldata,
+                                                                 CAIRO_FORMAT_ARGB32,
+                                                                 cw, ch,
+                                                                 cw * 4);
+  cairo_set_source_surface(cr, surface, 0, 0);
+  cairo_surface_destroy(surface);
+  cairo_paint(cr);
+
+  // done with the cache entry, release it
+  _openslide_cache_entry_unref(cache_entry);
+
+  return true;
+}
+
 static bool paint_region(openslide_t *osr, cairo_t *cr,
                          int64_t x, int64_t y,
                          struct _openslide_level *level,
@@ -160,13 +236,26 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static int32_t get_idle_handle_count(openslide_t *osr) {
+  struct trestle_ops_data *data = osr->data;
+  return _openslide_tiffcache_get_idle_count(data->tc);
+}
+
+static void release_idle_handles(openslide_t *osr) {
+  struct trestle_ops_data *data = osr->data;
+  _openslide_tiffcache_release_idle(data->tc);
+}
+
 static const struct _openslide_ops trestle_ops = {
   .paint_region = paint_region,
+  .get_idle_handle_count = get_idle_handle_count,
+  .release_idle_handles = release_idle_handles,
   .destroy = destroy,
 };
 
 static bool trestle_detect(const char *filename G_GNUC_UNUSED,
                            struct _openslide_tifflike *tl,
+                           struct _openslide_detect_context *dc G_GNUC_UNUSED,
                            GError **err) {
   // ensure we have a TIFF
   if (!tl) {
@@ -295,6 +384,7 @@ static void add_associated_jpeg(openslide_t *osr, TIFF *tiff,
 
 static bool trestle_open(openslide_t *osr, const char *filename,
                          struct _openslide_tifflike *tl,
+                         struct _openslide_detect_context *dc G_GNUC_UNUSED,
                          struct _openslide_hash *quickhash1, GError **err) {
   struct trestle_ops_data *data = NULL;
   struct level **levels = NULL;
@@ -342,6 +432,7 @@ static bool trestle_open(openslide_t *osr, const char *filename,
 
   // create levels
   levels = g_new0(struct level *, level_count);
+  bool trim = osr->open_flags & OPENSLIDE_OPEN_TRIM_OVERLAPS;
   bool report_geometry = true;
   for (int32_t i = 0; i < level_count; i++) {
     struct level *l = g_slice_new0(struct level);
@@ -361,11 +452,15 @@ static bool trestle_open(openslide_t *osr, const char *filename,
     if (i < overlap_count) {
       overlap_x = overlaps[2 * i];
       overlap_y = overlaps[2 * i + 1];
-      // if any level has overlaps, reporting tile advances would mislead the
-      // application
-      if (overlap_x || overlap_y) {
-        report_geometry = false;
-      }
+    }
+    int64_t advance_x = tiffl->tile_w - overlap_x;
+    int64_t advance_y = tiffl->tile_h - overlap_y;
+    bool trim_level = trim && (overlap_x || overlap_y) &&
+                      advance_x > 0 && advance_y > 0;
+    // if any level has untrimmed overlaps, reporting tile advances would
+    // mislead the application
+    if ((overlap_x || overlap_y) && !trim_level) {
+      report_geometry = false;
     }
 
     // subtract out the overlaps (there are tiles-1 overlaps in each dimension)
@@ -377,19 +472,33 @@ static bool trestle_open(openslide_t *osr, const char *filename,
     }
 
     // create grid
-    l->grid = _openslide_grid_create_tilemap(osr,
-                                             tiffl->tile_w - overlap_x,
-                                             tiffl->tile_h - overlap_y,
-                                             read_tile, NULL);
-
-    // add tiles
-    for (int64_t y = 0; y < tiffl->tiles_down; y++) {
-      for (int64_t x = 0; x < tiffl->tiles_across; x++) {
-        _openslide_grid_tilemap_add_tile(l->grid,
-                                         x, y,
-                                         0, 0,
-                                         tiffl->tile_w, tiffl->tile_h,
-                                         NULL);
+    if (trim_level) {
+      l->cell_w = advance_x;
+      l->cell_h = advance_y;
+      l->base.tile_w = advance_x;
+      l->base.tile_h = advance_y;
+      l->grid = _openslide_grid_create_simple(osr,
+                                              (l->base.w + advance_x - 1) /
+                                              advance_x,
+                                              (l->base.h + advance_y - 1) /
+                                              advance_y,
+                                              advance_x, advance_y,
+                                              read_cell);
+      l->base.simple_grid = true;
+    } else {
+      l->grid = _openslide_grid_create_tilemap(osr,
+                                               advance_x, advance_y,
+                                               read_tile, NULL);
+
+      // add tiles
+      for (int64_t y = 0; y < tiffl->tiles_down; y++) {
+        for (int64_t x = 0; x < tiffl->tiles_across; x++) {
+          _openslide_grid_tilemap_add_tile(l->grid,
+                                           x, y,
+                                           0, 0,
+                                           tiffl->tile_w, tiffl->tile_h,
+                                           NULL);
+        }
       }
     }
   }
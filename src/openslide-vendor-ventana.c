@@ -41,6 +41,7 @@
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
 
+static const char VENTANA_DETECT_XML[] = "ventana-xml";
 static const char LEVEL_DESCRIPTION_TOKEN[] = "level=";
 static const char MACRO_DESCRIPTION[] = "Label Image";
 static const char MACRO_DESCRIPTION2[] = "Label_Image";
@@ -99,6 +100,21 @@ struct level {
   struct _openslide_tiff_level tiffl;
   struct _openslide_grid *grid;
   int64_t subtiles_per_tile;
+
+  // with OPENSLIDE_OPEN_TRIM_OVERLAPS, the size of the cropped subtiles
+  // of the simple grid, and the areas in subtile coordinates; 0 and NULL
+  // otherwise
+  int64_t cell_w;
+  int64_t cell_h;
+  struct cell_area *cell_areas;
+  int32_t cell_area_count;
+};
+
+struct cell_area {
+  int64_t start_col;
+  int64_t start_row;
+  int64_t cols;
+  int64_t rows;
 };
 
 // structs used during BIF open
@@ -140,6 +156,7 @@ static void destroy(openslide_t *osr) {
   for (int32_t i = 0; i < osr->level_count; i++) {
     struct level *l = (struct level *) osr->levels[i];
     _openslide_grid_destroy(l->grid);
+    g_free(l->cell_areas);
     g_slice_free(struct level, l);
   }
   g_free(osr->levels);
@@ -154,7 +171,6 @@ static bool read_subtile(openslide_t *osr,
   struct level *l = (struct level *) level;
   struct _openslide_tiff_level *tiffl = &l->tiffl;
   TIFF *tiff = arg;
-  bool success = true;
 
   // tile size and coordinates
   int64_t tile_col = subtile_col / l->subtiles_per_tile;
@@ -174,11 +190,11 @@ static bool read_subtile(openslide_t *osr,
                                             level, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
-    if (!_openslide_tiff_read_tile(tiffl, tiff,
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
+    if (!_openslide_tiff_read_tile(osr, tiffl, tiff,
                                    tiledata, tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -186,7 +202,7 @@ static bool read_subtile(openslide_t *osr,
     if (!_openslide_tiff_clip_tile(tiffl, tiledata,
                                    tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -196,41 +212,14 @@ static bool read_subtile(openslide_t *osr,
                          &cache_entry);
   }
 
-  // draw
-  cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiledata,
-                                                                 CAIRO_FORMAT_ARGB32,
-                                                                 tw, th,
-                                                                 tw * 4);
-
-  // if we are drawing a subtile, we must do an additional copy,
-  // because cairo lacks source clipping
-  if (l->subtiles_per_tile > 1) {
-    cairo_surface_t *surface2 = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-                                                           ceil(subtile_w),
-                                                           ceil(subtile_h));
-    cairo_t *cr2 = cairo_create(surface2);
-    cairo_set_source_surface(cr2, surface, -subtile_x, -subtile_y);
-
-    // replace original image surface
-    cairo_surface_destroy(surface);
-    surface = surface2;
-
-    cairo_rectangle(cr2, 0, 0,
-                    ceil(subtile_w),
-                    ceil(subtile_h));
-    cairo_fill(cr2);
-    success = _openslide_check_cairo_status(cr2, err);
-    cairo_destroy(cr2);
-  }
-
-  cairo_set_source_surface(cr, surface, 0, 0);
-  cairo_surface_destroy(surface);
-  cairo_paint(cr);
+  // draw, clipping to the subtile if necessary
+  _openslide_paint_subimage(cr, tiledata, CAIRO_FORMAT_ARGB32, tw, th,
+                            subtile_x, subtile_y, subtile_w, subtile_h);
 
   // done with the cache entry, release it
   _openslide_cache_entry_unref(cache_entry);
 
-  return success;
+  return true;
 }
 
 // read_subtile wrapper for BIF that drops the extra argument passed by
@@ -247,6 +236,161 @@ static bool read_subtile_tilemap(openslide_t *osr,
                       arg, err);
 }
 
+// find the subtile shown in a cell of the simple grid of cropped
+// subtiles, and the cell's offset within it.  Each cell is the top-left of
+// its own subtile, which is what the cairo operator SATURATE would show
+// for their overlaps, and cells just past an area are the remainder of
+// its last subtiles.
+static bool get_cell_source(const struct level *l,
+                            int64_t cell_col, int64_t cell_row,
+                            int64_t *subtile_col, int64_t *subtile_row,
+                            int64_t *offset_x, int64_t *offset_y) {
+  int64_t subtile_w = l->tiffl.tile_w / l->subtiles_per_tile;
+  int64_t subtile_h = l->tiffl.tile_h / l->subtiles_per_tile;
+  int64_t extra_cols = (subtile_w - 1) / l->cell_w;
+  int64_t extra_rows = (subtile_h - 1) / l->cell_h;
+
+  // a subtile of its own takes precedence over another's remainder
+  for (int pass = 0; pass < 2; pass++) {
+    for (int32_t i = 0; i < l->cell_area_count; i++) {
+      const struct cell_area *area = &l->cell_areas[i];
+      int64_t end_col = area->start_col + area->cols;
+      int64_t end_row = area->start_row + area->rows;
+      if (pass) {
+        end_col += extra_cols;
+        end_row += extra_rows;
+      }
+      if (cell_col >= area->start_col && cell_col < end_col &&
+          cell_row >= area->start_row && cell_row < end_row) {
+        *subtile_col = MIN(cell_col, area->start_col + area->cols - 1);
+        *subtile_row = MIN(cell_row, area->start_row + area->rows - 1);
+        *offset_x = (cell_col - *subtile_col) * l->cell_w;
+        *offset_y = (cell_row - *subtile_row) * l->cell_h;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// decode the TIFF tile holding a cell's subtile, crop every uncached cell
+// it shows into the cache, and return the requested one
+static bool decode_cells(openslide_t *osr,
+                         struct level *l,
+                         TIFF *tiff,
+                         int64_t cell_col, int64_t cell_row,
+                         int64_t subtile_col, int64_t subtile_row,
+                         uint32_t **celldata_OUT,
+                         struct _openslide_cache_entry **cache_entry_OUT,
+                         GError **err) {
+  struct _openslide_tiff_level *tiffl = &l->tiffl;
+  int64_t spt = l->subtiles_per_tile;
+  int64_t tile_col = subtile_col / spt;
+  int64_t tile_row = subtile_row / spt;
+  int64_t tw = tiffl->tile_w;
+  int64_t th = tiffl->tile_h;
+  int64_t subtile_w = tw / spt;
+  int64_t subtile_h = th / spt;
+  int64_t cw = l->cell_w;
+  int64_t ch = l->cell_h;
+
+  uint32_t *tiledata = _openslide_buffer_alloc(tw * th * 4);
+  if (!_openslide_tiff_read_tile(osr, tiffl, tiff,
+                                 tiledata, tile_col, tile_row,
+                                 err)) {
+    _openslide_buffer_free(tw * th * 4, tiledata);
+    return false;
+  }
+
+  // clip, if necessary
+  if (!_openslide_tiff_clip_tile(tiffl, tiledata,
+                                 tile_col, tile_row,
+                                 err)) {
+    _openslide_buffer_free(tw * th * 4, tiledata);
+    return false;
+  }
+
+  // the cells showing this tile, and the remainders past its last subtiles
+  int64_t end_col = (tile_col + 1) * spt + (subtile_w - 1) / cw;
+  int64_t end_row = (tile_row + 1) * spt + (subtile_h - 1) / ch;
+  for (int64_t row = tile_row * spt; row < end_row; row++) {
+    for (int64_t col = tile_col * spt; col < end_col; col++) {
+      int64_t sc, sr, ox, oy;
+      if (!get_cell_source(l, col, row, &sc, &sr, &ox, &oy) ||
+          sc / spt != tile_col || sr / spt != tile_row) {
+        continue;
+      }
+      bool requested = (col == cell_col && row == cell_row);
+      struct _openslide_cache_entry *cache_entry;
+      if (!requested &&
+          _openslide_cache_get(osr->cache, l, col, row, &cache_entry)) {
+        _openslide_cache_entry_unref(cache_entry);
+        continue;
+      }
+
+      uint32_t *celldata = _openslide_buffer_alloc(cw * ch * 4);
+      const uint32_t *subtile = tiledata + (sr % spt) * subtile_h * tw +
+                                (sc % spt) * subtile_w;
+      _openslide_crop_tile(celldata, cw, ch, subtile, tw,
+                           subtile_w, subtile_h, ox, oy);
+      _openslide_cache_put(osr->cache, l, col, row,
+                           celldata, cw * ch * 4,
+                           &cache_entry);
+      if (requested) {
+        *celldata_OUT = celldata;
+        *cache_entry_OUT = cache_entry;
+      } else {
+        _openslide_cache_entry_unref(cache_entry);
+      }
+    }
+  }
+  _openslide_buffer_free(tw * th * 4, tiledata);
+  return true;
+}
+
+static bool read_cell(openslide_t *osr,
+                      cairo_t *cr,
+                      struct _openslide_level *level,
+                      int64_t cell_col, int64_t cell_row,
+                      void *arg,
+                      GError **err) {
+  struct level *l = (struct level *) level;
+  TIFF *tiff = arg;
+
+  int64_t subtile_col, subtile_row, offset_x, offset_y;
+  if (!get_cell_source(l, cell_col, cell_row,
+                       &subtile_col, &subtile_row, &offset_x, &offset_y)) {
+    // outside every area
+    return true;
+  }
+
+  struct _openslide_cache_entry *cache_entry;
+  uint32_t *celldata = _openslide_cache_get(osr->cache,
+                                            level, cell_col, cell_row,
+                                            &cache_entry);
+  if (!celldata &&
+      !decode_cells(osr, l, tiff, cell_col, cell_row,
+                    subtile_col, subtile_row,
+                    &celldata, &cache_entry, err)) {
+    return false;
+  }
+
+  // draw it
+  cairo_surface_t *surface =
+    cairo_image_surface_create_for_data((unsigned char *) celldata,
+                                        CAIRO_FORMAT_ARGB32,
+                                        l->cell_w, l->cell_h,
+                                        l->cell_w * 4);
+  cairo_set_source_surface(cr, surface, 0, 0);
+  cairo_surface_destroy(surface);
+  cairo_paint(cr);
+
+  // done with the cache entry, release it
+  _openslide_cache_entry_unref(cache_entry);
+
+  return true;
+}
+
 static bool paint_region(openslide_t *osr, cairo_t *cr,
                          int64_t x, int64_t y,
                          struct _openslide_level *level,
@@ -270,8 +414,20 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static int32_t get_idle_handle_count(openslide_t *osr) {
+  struct ventana_ops_data *data = osr->data;
+  return _openslide_tiffcache_get_idle_count(data->tc);
+}
+
+static void release_idle_handles(openslide_t *osr) {
+  struct ventana_ops_data *data = osr->data;
+  _openslide_tiffcache_release_idle(data->tc);
+}
+
 static const struct _openslide_ops ventana_ops = {
   .paint_region = paint_region,
+  .get_idle_handle_count = get_idle_handle_count,
+  .release_idle_handles = release_idle_handles,
   .destroy = destroy,
 };
 
@@ -301,6 +457,7 @@ static xmlNode *get_initial_xml_iscan(xmlDoc *doc, GError **err) {
 
 static bool ventana_detect(const char *filename G_GNUC_UNUSED,
                            struct _openslide_tifflike *tl,
+                           struct _openslide_detect_context *dc,
                            GError **err) {
   // ensure we have a TIFF
   if (!tl) {
@@ -335,7 +492,9 @@ static bool ventana_detect(const char *filename G_GNUC_UNUSED,
     return false;
   }
 
-  xmlFreeDoc(doc);
+  // keep the document for ventana_open
+  _openslide_detect_context_put(dc, VENTANA_DETECT_XML, doc,
+                                (GDestroyNotify) xmlFreeDoc);
   return true;
 }
 
@@ -368,14 +527,9 @@ static int width_compare(gconstpointer a, gconstpointer b) {
   }
 }
 
-static bool parse_initial_xml(openslide_t *osr, const char *xml,
+// takes ownership of doc
+static bool parse_initial_xml(openslide_t *osr, xmlDoc *doc,
                               GError **err) {
-  // parse
-  xmlDoc *doc = _openslide_xml_parse(xml, err);
-  if (!doc) {
-    return false;
-  }
-
   // get iScan element
   xmlNode *iscan = get_initial_xml_iscan(doc, err);
   if (!iscan) {
@@ -763,6 +917,68 @@ static struct _openslide_grid *create_bif_grid(openslide_t *osr,
   return grid;
 }
 
+// with whole-pixel advances and areas aligned to them, lay the level out
+// as a simple grid of subtiles cropped to the advance
+static bool create_bif_trimmed_grid(openslide_t *osr,
+                                    struct bif *bif,
+                                    struct level *l,
+                                    double downsample) {
+  int64_t spt = l->subtiles_per_tile;
+  int64_t tile_w = l->tiffl.tile_w;
+  int64_t tile_h = l->tiffl.tile_h;
+  if (spt < 1 || tile_w % spt || tile_h % spt) {
+    return false;
+  }
+  int64_t subtile_w = tile_w / spt;
+  int64_t subtile_h = tile_h / spt;
+  double advance_x = bif->tile_advance_x / downsample;
+  double advance_y = bif->tile_advance_y / downsample;
+  int64_t cell_w = round(advance_x);
+  int64_t cell_h = round(advance_y);
+  if (fabs(advance_x - cell_w) > 1e-6 || fabs(advance_y - cell_h) > 1e-6 ||
+      cell_w < 1 || cell_h < 1 || cell_w > subtile_w || cell_h > subtile_h) {
+    return false;
+  }
+  for (int32_t i = 0; i < bif->num_areas; i++) {
+    struct area *area = bif->areas[i];
+    if (fabs(area->x - area->start_col * bif->tile_advance_x) > 1e-6 ||
+        fabs(area->y - area->start_row * bif->tile_advance_y) > 1e-6) {
+      return false;
+    }
+  }
+
+  l->cell_w = cell_w;
+  l->cell_h = cell_h;
+  l->cell_area_count = bif->num_areas;
+  l->cell_areas = g_new(struct cell_area, bif->num_areas);
+  int64_t w = 0;
+  int64_t h = 0;
+  for (int32_t i = 0; i < bif->num_areas; i++) {
+    struct area *area = bif->areas[i];
+    struct cell_area *cell_area = &l->cell_areas[i];
+    cell_area->start_col = area->start_col;
+    cell_area->start_row = area->start_row;
+    cell_area->cols = area->tiles_across;
+    cell_area->rows = area->tiles_down;
+    // as for the bounds of the overlapping subtiles
+    w = MAX(w, (area->start_col + area->tiles_across - 1) * cell_w +
+               subtile_w);
+    h = MAX(h, (area->start_row + area->tiles_down - 1) * cell_h +
+               subtile_h);
+  }
+  l->base.w = w;
+  l->base.h = h;
+  l->base.tile_w = cell_w;
+  l->base.tile_h = cell_h;
+  l->grid = _openslide_grid_create_simple(osr,
+                                          (w + cell_w - 1) / cell_w,
+                                          (h + cell_h - 1) / cell_h,
+                                          cell_w, cell_h,
+                                          read_cell);
+  l->base.simple_grid = true;
+  return true;
+}
+
 static void set_region_props(openslide_t *osr, struct bif *bif,
                              struct level *level0) {
   for (int32_t i = 0; i < bif->num_areas; i++) {
@@ -784,6 +1000,7 @@ static void set_region_props(openslide_t *osr, struct bif *bif,
 
 static bool ventana_open(openslide_t *osr, const char *filename,
                          struct _openslide_tifflike *tl,
+                         struct _openslide_detect_context *dc,
                          struct _openslide_hash *quickhash1, GError **err) {
   GPtrArray *level_array = g_ptr_array_new();
   struct bif *bif = NULL;
@@ -796,13 +1013,20 @@ static bool ventana_open(openslide_t *osr, const char *filename,
     goto FAIL;
   }
 
-  // parse initial XML
-  const char *xml = _openslide_tifflike_get_buffer(tl, 0, TIFFTAG_XMLPACKET,
-                                                   err);
-  if (!xml) {
-    goto FAIL;
+  // parse initial XML, unless detection already did
+  xmlDoc *initial_doc = _openslide_detect_context_steal(dc, VENTANA_DETECT_XML);
+  if (!initial_doc) {
+    const char *xml = _openslide_tifflike_get_buffer(tl, 0, TIFFTAG_XMLPACKET,
+                                                     err);
+    if (!xml) {
+      goto FAIL;
+    }
+    initial_doc = _openslide_xml_parse(xml, err);
+    if (!initial_doc) {
+      goto FAIL;
+    }
   }
-  if (!parse_initial_xml(osr, xml, err)) {
+  if (!parse_initial_xml(osr, initial_doc, err)) {
     goto FAIL;
   }
 
@@ -851,8 +1075,8 @@ static bool ventana_open(openslide_t *osr, const char *filename,
       // if first level, parse tile info
       if (level == 0) {
         // get XML
-        xml = _openslide_tifflike_get_buffer(tl, dir, TIFFTAG_XMLPACKET,
-                                             &tmp_err);
+        const char *xml =
+          _openslide_tifflike_get_buffer(tl, dir, TIFFTAG_XMLPACKET, &tmp_err);
         if (xml) {
           // get tile size
           struct _openslide_tiff_level tiffl;
@@ -909,19 +1133,22 @@ static bool ventana_open(openslide_t *osr, const char *filename,
       }
       l->base.downsample = downsample;
       if (bif) {
-        l->grid = create_bif_grid(osr, bif,
-                                  downsample,
-                                  tiffl->tile_w, tiffl->tile_h);
         l->subtiles_per_tile = downsample;
-        // the format doesn't seem to record the level size, so make it
-        // large enough for all the pixels
-        double x, y, w, h;
-        _openslide_grid_get_bounds(l->grid, &x, &y, &w, &h);
-        l->base.w = ceil(x + w);
-        l->base.h = ceil(y + h);
-        // clear tile size hints set by _openslide_tiff_level_init()
-        l->base.tile_w = 0;
-        l->base.tile_h = 0;
+        if (!(osr->open_flags & OPENSLIDE_OPEN_TRIM_OVERLAPS) ||
+            !create_bif_trimmed_grid(osr, bif, l, downsample)) {
+          l->grid = create_bif_grid(osr, bif,
+                                    downsample,
+                                    tiffl->tile_w, tiffl->tile_h);
+          // the format doesn't seem to record the level size, so make it
+          // large enough for all the pixels
+          double x, y, w, h;
+          _openslide_grid_get_bounds(l->grid, &x, &y, &w, &h);
+          l->base.w = ceil(x + w);
+          l->base.h = ceil(y + h);
+          // clear tile size hints set by _openslide_tiff_level_init()
+          l->base.tile_w = 0;
+          l->base.tile_h = 0;
+        }
       } else {
         l->grid = _openslide_grid_create_simple(osr,
                                                 tiffl->tiles_across,
@@ -929,6 +1156,7 @@ static bool ventana_open(openslide_t *osr, const char *filename,
                                                 tiffl->tile_w,
                                                 tiffl->tile_h,
                                                 read_subtile);
+        l->base.simple_grid = true;
         l->subtiles_per_tile = 1;
       }
       //g_debug("level %"PRId64": magnification %g, downsample %g, size %"PRId64" %"PRId64, level, magnification, downsample, l->base.w, l->base.h);
@@ -974,6 +1202,18 @@ static bool ventana_open(openslide_t *osr, const char *filename,
   }
   struct level *level0 = level_array->pdata[0];
 
+  // tile size hints are for all levels or none
+  bool have_geometry = true;
+  for (uint32_t n = 0; n < level_array->len; n++) {
+    struct level *l = level_array->pdata[n];
+    have_geometry = have_geometry && l->base.tile_w > 0;
+  }
+  for (uint32_t n = 0; n < level_array->len && !have_geometry; n++) {
+    struct level *l = level_array->pdata[n];
+    l->base.tile_w = 0;
+    l->base.tile_h = 0;
+  }
+
   // set region properties
   if (bif) {
     set_region_props(osr, bif, level0);
@@ -1023,6 +1263,7 @@ FAIL:
     for (uint32_t n = 0; n < level_array->len; n++) {
       struct level *l = level_array->pdata[n];
       _openslide_grid_destroy(l->grid);
+      g_free(l->cell_areas);
       g_slice_free(struct level, l);
     }
     g_ptr_array_free(level_array, true);
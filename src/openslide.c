@@ -22,12 +22,15 @@
 #include <config.h>
 
 #include "openslide-private.h"
+#include "openslide-decode-jp2k.h"
 #include "openslide-decode-tifflike.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <glib-object.h>
 #include <libxml/parser.h>
 
@@ -38,6 +41,23 @@ const char _openslide_release_info[] = "OpenSlide " SUFFIXED_VERSION ", copyrigh
 
 static const char * const EMPTY_STRING_ARRAY[] = { NULL };
 
+// maximum concurrent openslide_read_region_async() requests per slide
+#define ASYNC_THREADS 4
+
+// unused slides kept parsed for OPENSLIDE_OPEN_SHARED
+#define DEFAULT_SHARED_SLIDE_LIMIT 16
+
+// level pixels on a side of each chunk of a region read
+#define READ_CHUNK_PIXELS 4096
+// pixels per band of openslide_read_region_format() conversion
+#define FORMAT_BAND_PIXELS (256 * 1024)
+// level pixels on a side of each chunk that a prewarm paints at once
+#define PREWARM_CHUNK_PIXELS 4096
+// longest side of the thumbnail examined by OPENSLIDE_TILE_ITER_TISSUE
+#define TISSUE_THUMBNAIL_PIXELS 2048
+// unpremultiplied channel value below which a pixel may be tissue
+#define TISSUE_MAX_BRIGHTNESS 220
+
 static const struct _openslide_format *formats[] = {
   &_openslide_format_mirax,
   &_openslide_format_hamamatsu_vms_vmu,
@@ -70,6 +90,14 @@ static void __attribute__((constructor)) _openslide_init(void) {
   xmlInitParser();
   // parse debug options
   _openslide_debug_init();
+  // check for mapped I/O
+  _openslide_mmap_init();
+  // check for an index cache directory
+  _openslide_index_cache_init();
+  // check for OpenJPEG threading
+  _openslide_jp2k_init();
+  // set up per-thread slide tracking
+  _openslide_trace_init();
   openslide_was_dynamically_loaded = true;
 }
 
@@ -91,18 +119,70 @@ static bool level_in_range(openslide_t *osr, int32_t level) {
   return true;
 }
 
+static void run_async_request(gpointer data, gpointer user_data);
+
 static openslide_t *create_osr(void) {
   openslide_t *osr = g_slice_new0(openslide_t);
+  osr->arena = _openslide_arena_create();
+  osr->focal_plane_count = 1;
+  osr->source_files = g_ptr_array_new();
   osr->properties = g_hash_table_new_full(g_str_hash, g_str_equal,
                                           g_free, g_free);
   osr->associated_images = g_hash_table_new_full(g_str_hash, g_str_equal,
                                                  g_free,
                                                  destroy_associated_image);
+  // threads are started on demand
+  osr->async_pool = g_thread_pool_new(run_async_request, osr,
+                                      ASYNC_THREADS, false, NULL);
+  osr->counters = _openslide_counters_create();
+
+  // start caches; the compressed tier may already be used by the opener
+  struct _openslide_cache *cache =
+    _openslide_cache_create(_OPENSLIDE_USEFUL_CACHE_SIZE);
+  //struct _openslide_cache *cache = _openslide_cache_create(0);
+  osr->cache = _openslide_cache_binding_create(cache,
+                                               OPENSLIDE_COUNTER_CACHE_HITS);
+  _openslide_cache_release(cache);
+  cache = _openslide_cache_create(_OPENSLIDE_USEFUL_COMPRESSED_CACHE_SIZE);
+  osr->compressed_cache =
+    _openslide_cache_binding_create(cache,
+                                    OPENSLIDE_COUNTER_COMPRESSED_CACHE_HITS);
+  _openslide_cache_release(cache);
   return osr;
 }
 
+// a name for the slide that is the same in every process opening it, for
+// caches shared between processes.  Prefer quickhash1, which doesn't
+// depend on the path; lazy opens don't have it yet.
+static void set_cache_identity(openslide_t *osr, const char *filename) {
+  char *identity;
+  const char *hash = g_hash_table_lookup(osr->properties,
+                                         OPENSLIDE_PROPERTY_NAME_QUICKHASH1);
+  if (hash && hash[0]) {
+    identity = g_strdup_printf("quickhash1\n%s", hash);
+  } else {
+    struct stat st;
+    if (g_stat(filename, &st)) {
+      return;
+    }
+    identity = g_strdup_printf("file\n%s\n%"PRId64"\n%"PRId64, filename,
+                               (int64_t) st.st_size, (int64_t) st.st_mtime);
+  }
+  if (osr->open_flags & OPENSLIDE_OPEN_TRIM_OVERLAPS) {
+    // trimmed levels have different tiles
+    char *trimmed = g_strdup_printf("%s\ntrimmed", identity);
+    g_free(identity);
+    identity = trimmed;
+  }
+  _openslide_cache_binding_set_identity(osr->cache, identity,
+                                        osr->levels, osr->level_count);
+  g_free(identity);
+}
+
+// if dc_OUT is given, objects the detector opened are kept for the opener
 static const struct _openslide_format *detect_format(const char *filename,
-                                                     struct _openslide_tifflike **tl_OUT) {
+                                                     struct _openslide_tifflike **tl_OUT,
+                                                     struct _openslide_detect_context **dc_OUT) {
   GError *tmp_err = NULL;
 
   struct _openslide_tifflike *tl = _openslide_tifflike_create(filename,
@@ -114,21 +194,31 @@ static const struct _openslide_format *detect_format(const char *filename,
     g_clear_error(&tmp_err);
   }
 
+  struct _openslide_detect_context *dc = NULL;
+  if (dc_OUT) {
+    dc = _openslide_detect_context_create();
+  }
+
   for (const struct _openslide_format **cur = formats; *cur; cur++) {
     const struct _openslide_format *format = *cur;
 
     g_assert(format->name && format->vendor &&
              format->detect && format->open);
 
-    if (format->detect(filename, tl, &tmp_err)) {
+    if (format->detect(filename, tl, dc, &tmp_err)) {
       // success!
       if (tl_OUT) {
         *tl_OUT = tl;
       } else {
         _openslide_tifflike_destroy(tl);
       }
+      if (dc_OUT) {
+        *dc_OUT = dc;
+      }
       return format;
     }
+    // don't let a failed detector's objects reach another format
+    _openslide_detect_context_clear(dc);
 
     // reset for next format
     if (_openslide_debug(OPENSLIDE_DEBUG_DETECTION)) {
@@ -139,6 +229,7 @@ static const struct _openslide_format *detect_format(const char *filename,
 
   // no match
   _openslide_tifflike_destroy(tl);
+  _openslide_detect_context_destroy(dc);
   return NULL;
 }
 
@@ -146,15 +237,18 @@ static bool open_backend(openslide_t *osr,
                          const struct _openslide_format *format,
                          const char *filename,
                          struct _openslide_tifflike *tl,
+                         struct _openslide_detect_context *dc,
                          struct _openslide_hash **quickhash1_OUT,
                          GError **err) {
   if (quickhash1_OUT) {
     *quickhash1_OUT = _openslide_hash_quickhash1_create();
   }
 
-  bool result = format->open(osr, filename, tl,
+  openslide_t *prev = _openslide_slide_enter(osr);
+  bool result = format->open(osr, filename, tl, dc,
                              quickhash1_OUT ? *quickhash1_OUT : NULL,
                              err);
+  _openslide_slide_leave(prev);
 
   // check for error-handling bugs in open function
   if (!result && err && !*err) {
@@ -179,7 +273,7 @@ static bool open_backend(openslide_t *osr,
 const char *openslide_detect_vendor(const char *filename) {
   g_assert(openslide_was_dynamically_loaded);
 
-  const struct _openslide_format *format = detect_format(filename, NULL);
+  const struct _openslide_format *format = detect_format(filename, NULL, NULL);
   if (!format) {
     return NULL;
   }
@@ -191,15 +285,22 @@ bool openslide_can_open(const char *filename) {
 
   // detect format
   struct _openslide_tifflike *tl;
-  const struct _openslide_format *format = detect_format(filename, &tl);
+  struct _openslide_detect_context *dc;
+  const struct _openslide_format *format = detect_format(filename, &tl, &dc);
   if (!format) {
     return false;
   }
 
-  // try opening
+  // try opening; hashing reads the files, so it validates them too
   openslide_t *osr = create_osr();
-  bool success = open_backend(osr, format, filename, tl, NULL, NULL);
+  struct _openslide_hash *quickhash1 = NULL;
+  bool success = open_backend(osr, format, filename, tl, dc,
+                              &quickhash1, NULL);
+  if (success) {
+    _openslide_hash_destroy(quickhash1);
+  }
   _openslide_tifflike_destroy(tl);
+  _openslide_detect_context_destroy(dc);
   openslide_close(osr);
   return success;
 }
@@ -235,13 +336,16 @@ static const char **strv_from_hashtable_keys(GHashTable *h) {
 }
 
 openslide_t *openslide_open(const char *filename) {
-  GError *tmp_err = NULL;
+  return openslide_open_with_flags(filename, 0);
+}
 
-  g_assert(openslide_was_dynamically_loaded);
+static openslide_t *open_slide(const char *filename, uint32_t flags) {
+  GError *tmp_err = NULL;
 
   // detect format
   struct _openslide_tifflike *tl;
-  const struct _openslide_format *format = detect_format(filename, &tl);
+  struct _openslide_detect_context *dc;
+  const struct _openslide_format *format = detect_format(filename, &tl, &dc);
   if (!format) {
     // not a slide file
     return NULL;
@@ -249,12 +353,16 @@ openslide_t *openslide_open(const char *filename) {
 
   // alloc memory
   openslide_t *osr = create_osr();
+  osr->open_flags = flags;
+  bool lazy = flags & OPENSLIDE_OPEN_LAZY;
 
   // open backend
   struct _openslide_hash *quickhash1 = NULL;
-  bool success = open_backend(osr, format, filename, tl, &quickhash1,
+  bool success = open_backend(osr, format, filename, tl, dc,
+                              lazy ? NULL : &quickhash1,
                               &tmp_err);
   _openslide_tifflike_destroy(tl);
+  _openslide_detect_context_destroy(dc);
   if (!success) {
     // failed to read slide
     _openslide_propagate_error(osr, tmp_err);
@@ -286,19 +394,30 @@ openslide_t *openslide_open(const char *filename) {
       g_warning("Downsampled images not correctly ordered: %g < %g",
 		osr->levels[i]->downsample, osr->levels[i - 1]->downsample);
       openslide_close(osr);
-      _openslide_hash_destroy(quickhash1);
+      if (quickhash1) {
+        _openslide_hash_destroy(quickhash1);
+      }
       return NULL;
     }
   }
 
   // set hash property
-  const char *hash_str = _openslide_hash_get_string(quickhash1);
-  if (hash_str != NULL) {
+  if (lazy) {
+    // placeholder, so the name is listed; the value comes from
+    // compute_lazy_quickhash1()
+    osr->lazy_filename = g_strdup(filename);
     g_hash_table_insert(osr->properties,
                         g_strdup(OPENSLIDE_PROPERTY_NAME_QUICKHASH1),
-                        g_strdup(hash_str));
+                        g_strdup(""));
+  } else {
+    const char *hash_str = _openslide_hash_get_string(quickhash1);
+    if (hash_str != NULL) {
+      g_hash_table_insert(osr->properties,
+                          g_strdup(OPENSLIDE_PROPERTY_NAME_QUICKHASH1),
+                          g_strdup(hash_str));
+    }
+    _openslide_hash_destroy(quickhash1);
   }
-  _openslide_hash_destroy(quickhash1);
 
   // set other properties
   g_hash_table_insert(osr->properties,
@@ -343,32 +462,335 @@ openslide_t *openslide_open(const char *filename) {
   osr->associated_image_names = strv_from_hashtable_keys(osr->associated_images);
   osr->property_names = strv_from_hashtable_keys(osr->properties);
 
-  // start cache
-  osr->cache = _openslide_cache_create(_OPENSLIDE_USEFUL_CACHE_SIZE);
-  //osr->cache = _openslide_cache_create(0);
+  set_cache_identity(osr, filename);
+
+  return osr;
+}
+
+// A slide opened with OPENSLIDE_OPEN_SHARED is a view of an owner object
+// that is never returned to the application.  Views borrow the owner's
+// levels, vendor data and tables, and read through cache bindings with
+// the owner's binding IDs, so they share its tiles.  Grids pass the
+// slide being read, not the owner, to the read callbacks.
+struct _openslide_shared_slide {
+  openslide_t *owner;
+  char *key;  // in shared_slides; NULL once the file has changed
+  int32_t refcount;  // views
+  GList *idle_link;  // in idle_shared_slides while there are no views
+
+  // identity of the slide's files at open
+  char *identity;
+};
+
+// all fields of shared slides are protected by the lock
+G_LOCK_DEFINE_STATIC(shared_slides);
+static GHashTable *shared_slides;  // key -> struct _openslide_shared_slide
+static GQueue *idle_shared_slides;  // most recent at head
+static int32_t shared_slide_limit = DEFAULT_SHARED_SLIDE_LIMIT;
+
+static void append_file_identity(GString *identity, const char *filename) {
+  struct stat st;
+  if (g_stat(filename, &st)) {
+    g_string_append(identity, "missing\n");
+    return;
+  }
+  g_string_append_printf(identity, "%"PRIu64" %"PRIu64" %"PRId64" %"PRId64"\n",
+                         (uint64_t) st.st_dev, (uint64_t) st.st_ino,
+                         (int64_t) st.st_size, (int64_t) st.st_mtime);
+}
+
+// the device, inode, size and modification time of the opened file and
+// each of the owner's source files
+static char *get_shared_slide_identity(const char *filename,
+                                       openslide_t *owner) {
+  GString *identity = g_string_new(NULL);
+  append_file_identity(identity, filename);
+  for (guint i = 0; i < owner->source_files->len; i++) {
+    append_file_identity(identity, owner->source_files->pdata[i]);
+  }
+  return g_string_free(identity, false);
+}
+
+// lock must be held.  returns dead, plus ss if it is now unused.
+static GSList *shared_slide_unregister(struct _openslide_shared_slide *ss,
+                                       GSList *dead) {
+  if (ss->key) {
+    g_hash_table_remove(shared_slides, ss->key);
+    g_free(ss->key);
+    ss->key = NULL;
+  }
+  if (ss->idle_link) {
+    g_queue_delete_link(idle_shared_slides, ss->idle_link);
+    ss->idle_link = NULL;
+    dead = g_slist_prepend(dead, ss);
+  }
+  return dead;
+}
+
+// lock must be held.  returns dead, plus the unused slides over the limit.
+static GSList *trim_idle_shared_slides(GSList *dead) {
+  while (idle_shared_slides &&
+         g_queue_get_length(idle_shared_slides) >
+         (guint) shared_slide_limit) {
+    dead = shared_slide_unregister(idle_shared_slides->tail->data, dead);
+  }
+  return dead;
+}
+
+// lock must not be held
+static void free_shared_slides(GSList *dead) {
+  for (GSList *cur = dead; cur; cur = cur->next) {
+    struct _openslide_shared_slide *ss = cur->data;
+    openslide_close(ss->owner);
+    g_free(ss->identity);
+    g_slice_free(struct _openslide_shared_slide, ss);
+  }
+  g_slist_free(dead);
+}
+
+static void shared_slide_unref(struct _openslide_shared_slide *ss) {
+  GSList *dead = NULL;
+  G_LOCK(shared_slides);
+  g_assert(ss->refcount > 0);
+  if (--ss->refcount == 0) {
+    if (ss->key) {
+      g_queue_push_head(idle_shared_slides, ss);
+      ss->idle_link = idle_shared_slides->head;
+      dead = trim_idle_shared_slides(dead);
+    } else {
+      dead = g_slist_prepend(dead, ss);
+    }
+  }
+  G_UNLOCK(shared_slides);
+  free_shared_slides(dead);
+}
 
+// takes the caller's reference to ss
+static openslide_t *create_view(struct _openslide_shared_slide *ss) {
+  openslide_t *owner = ss->owner;
+  openslide_t *osr = g_slice_new0(openslide_t);
+  osr->shared = ss;
+  osr->ops = owner->ops;
+  osr->levels = owner->levels;
+  osr->data = owner->data;
+  osr->level_count = owner->level_count;
+  osr->focal_plane_count = owner->focal_plane_count;
+  osr->open_flags = owner->open_flags | OPENSLIDE_OPEN_SHARED;
+  osr->arena = owner->arena;
+  osr->associated_images = g_hash_table_ref(owner->associated_images);
+  osr->associated_image_names = owner->associated_image_names;
+  osr->properties = g_hash_table_ref(owner->properties);
+  osr->property_names = owner->property_names;
+  // threads are started on demand
+  osr->async_pool = g_thread_pool_new(run_async_request, osr,
+                                      ASYNC_THREADS, false, NULL);
+  osr->counters = _openslide_counters_create();
+  osr->cache = _openslide_cache_binding_create_alias(owner->cache);
+  osr->compressed_cache =
+    _openslide_cache_binding_create_alias(owner->compressed_cache);
   return osr;
 }
 
+static openslide_t *open_shared(const char *filename, uint32_t flags) {
+  struct stat st;
+  if (g_stat(filename, &st)) {
+    // not a local file, so we can't tell whether it has changed
+    return open_slide(filename, flags);
+  }
+  char *key = g_strdup_printf("%u\n%s", flags, filename);
+
+  // look for a parsed copy of the current file
+  GSList *dead = NULL;
+  G_LOCK(shared_slides);
+  if (!shared_slides) {
+    shared_slides = g_hash_table_new(g_str_hash, g_str_equal);
+    idle_shared_slides = g_queue_new();
+  }
+  struct _openslide_shared_slide *ss = g_hash_table_lookup(shared_slides,
+                                                           key);
+  if (ss) {
+    // the owner's source files don't change after open
+    char *identity = get_shared_slide_identity(filename, ss->owner);
+    if (strcmp(identity, ss->identity)) {
+      // a file changed; existing views keep the old copy
+      dead = shared_slide_unregister(ss, dead);
+      ss = NULL;
+    }
+    g_free(identity);
+  }
+  if (ss) {
+    if (ss->idle_link) {
+      g_queue_delete_link(idle_shared_slides, ss->idle_link);
+      ss->idle_link = NULL;
+    }
+    ss->refcount++;
+  }
+  G_UNLOCK(shared_slides);
+  free_shared_slides(dead);
+  if (ss) {
+    g_free(key);
+    return create_view(ss);
+  }
+
+  // parse it
+  openslide_t *owner = open_slide(filename, flags);
+  if (!owner || openslide_get_error(owner)) {
+    g_free(key);
+    return owner;
+  }
+  ss = g_slice_new0(struct _openslide_shared_slide);
+  ss->owner = owner;
+  ss->key = key;
+  ss->refcount = 1;
+  ss->identity = get_shared_slide_identity(filename, owner);
+
+  // register it, replacing any copy opened concurrently
+  dead = NULL;
+  G_LOCK(shared_slides);
+  struct _openslide_shared_slide *old = g_hash_table_lookup(shared_slides,
+                                                            key);
+  if (old) {
+    dead = shared_slide_unregister(old, dead);
+  }
+  g_hash_table_insert(shared_slides, ss->key, ss);
+  G_UNLOCK(shared_slides);
+  free_shared_slides(dead);
+
+  return create_view(ss);
+}
+
+openslide_t *openslide_open_with_flags(const char *filename,
+                                       uint32_t flags) {
+  g_assert(openslide_was_dynamically_loaded);
+
+  if (flags & OPENSLIDE_OPEN_SHARED) {
+    return open_shared(filename, flags & ~OPENSLIDE_OPEN_SHARED);
+  }
+  return open_slide(filename, flags);
+}
+
+void openslide_set_shared_slide_limit(int32_t limit) {
+  g_return_if_fail(limit >= 0);
+  G_LOCK(shared_slides);
+  shared_slide_limit = limit;
+  GSList *dead = trim_idle_shared_slides(NULL);
+  G_UNLOCK(shared_slides);
+  free_shared_slides(dead);
+}
+
 
 void openslide_close(openslide_t *osr) {
-  if (osr->ops) {
+  // finish outstanding async requests; they may use the decode pool
+  g_thread_pool_free(osr->async_pool, false, true);
+
+  // readahead jobs use the vendor data
+  if (osr->readahead_pool) {
+    g_thread_pool_free(osr->readahead_pool, false, true);
+  }
+
+  if (osr->decode_pool) {
+    g_thread_pool_free(osr->decode_pool, true, true);
+  }
+
+  // views leave the shared state to its owner
+  struct _openslide_shared_slide *shared = osr->shared;
+  if (osr->ops && !shared) {
     (osr->ops->destroy)(osr);
   }
 
   g_hash_table_unref(osr->associated_images);
   g_hash_table_unref(osr->properties);
 
-  g_free(osr->associated_image_names);
-  g_free(osr->property_names);
+  if (!shared) {
+    g_free(osr->associated_image_names);
+    g_free(osr->property_names);
+    for (guint i = 0; i < osr->source_files->len; i++) {
+      g_free(osr->source_files->pdata[i]);
+    }
+    g_ptr_array_free(osr->source_files, true);
+  }
 
   if (osr->cache) {
-    _openslide_cache_destroy(osr->cache);
+    _openslide_cache_binding_destroy(osr->cache);
+  }
+  if (osr->compressed_cache) {
+    _openslide_cache_binding_destroy(osr->compressed_cache);
   }
 
   g_free(g_atomic_pointer_get(&osr->error));
 
+  if (osr->quickhash1_once.status == G_ONCE_STATUS_READY) {
+    g_free(osr->quickhash1_once.retval);
+  }
+  g_free(osr->lazy_filename);
+
+  // grids and vendor data may point into the arena
+  if (!shared) {
+    _openslide_arena_destroy(osr->arena);
+  }
+
+  _openslide_counters_destroy(osr->counters);
+  if (osr->trace_callback) {
+    g_atomic_int_add(&_openslide_trace_count, -1);
+  }
+
   g_slice_free(openslide_t, osr);
+
+  if (shared) {
+    shared_slide_unref(shared);
+  }
+}
+
+
+void openslide_set_cache(openslide_t *osr, openslide_cache_t *cache) {
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  _openslide_cache_binding_set(osr->cache, cache);
+}
+
+void openslide_set_compressed_cache(openslide_t *osr,
+                                    openslide_cache_t *cache) {
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  _openslide_cache_binding_set(osr->compressed_cache, cache);
+}
+
+void openslide_set_cache_priority(openslide_t *osr,
+                                  openslide_cache_priority_t priority) {
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  bool low = priority == OPENSLIDE_CACHE_PRIORITY_LOW;
+  _openslide_cache_binding_set_low_priority(osr->cache, low);
+  _openslide_cache_binding_set_low_priority(osr->compressed_cache, low);
+}
+
+void openslide_get_memory_usage(openslide_t *osr,
+                                openslide_memory_usage_t *usage) {
+  memset(usage, 0, sizeof(*usage));
+  usage->cache_bytes = _openslide_cache_binding_get_size(osr->cache);
+  usage->compressed_cache_bytes =
+    _openslide_cache_binding_get_size(osr->compressed_cache);
+  // grids charge the slide that built them
+  openslide_t *owner = osr->shared ? osr->shared->owner : osr;
+  usage->metadata_bytes = _openslide_arena_get_size(osr->arena) +
+                          __sync_fetch_and_add(&owner->grid_size, 0);
+  if (osr->ops && osr->ops->get_idle_handle_count) {
+    usage->idle_handles = osr->ops->get_idle_handle_count(osr);
+  }
+}
+
+void openslide_release_memory(openslide_t *osr) {
+  _openslide_cache_binding_clear(osr->cache);
+  _openslide_cache_binding_clear(osr->compressed_cache);
+  if (osr->ops && osr->ops->release_idle_handles) {
+    osr->ops->release_idle_handles(osr);
+  }
 }
 
 
@@ -479,32 +901,212 @@ void openslide_cancel_prefetch_hint(openslide_t *osr G_GNUC_UNUSED,
   g_warning("openslide_cancel_prefetch_hint has never been implemented and should not be called");
 }
 
+// a unit of work for osr->decode_pool
+struct worker_job {
+  // runs in a worker thread; must free the job
+  bool (*run)(struct worker_job *job, GError **err);
+  struct worker_group *group;
+};
+
+// a set of jobs that a caller waits for
+struct worker_group {
+  GMutex *mutex;
+  GCond *cond;
+  int outstanding;
+  GError *err;  // first error
+  struct _openslide_interrupt *interrupt;  // the caller's; may be NULL
+};
+
+static void worker_group_init(struct worker_group *group) {
+  group->mutex = g_mutex_new();
+  group->cond = g_cond_new();
+  group->outstanding = 0;
+  group->err = NULL;
+  group->interrupt = _openslide_interrupt_current();
+}
+
+static void worker_group_push(openslide_t *osr,
+                              struct worker_group *group,
+                              struct worker_job *job) {
+  job->group = group;
+  g_mutex_lock(group->mutex);
+  group->outstanding++;
+  g_mutex_unlock(group->mutex);
+  g_thread_pool_push(osr->decode_pool, job, NULL);
+}
+
+// waits for all jobs and frees the group
+static bool worker_group_finish(struct worker_group *group, GError **err) {
+  g_mutex_lock(group->mutex);
+  while (group->outstanding) {
+    g_cond_wait(group->cond, group->mutex);
+  }
+  g_mutex_unlock(group->mutex);
+
+  g_cond_free(group->cond);
+  g_mutex_free(group->mutex);
+
+  if (group->err) {
+    g_propagate_error(err, group->err);
+    return false;
+  }
+  return true;
+}
+
+static void run_worker_job(gpointer data, gpointer user_data G_GNUC_UNUSED) {
+  struct worker_job *job = data;
+  struct worker_group *group = job->group;
+  GError *tmp_err = NULL;
+
+  // the caller waits for the group, so its interrupt outlives the job
+  struct _openslide_interrupt *prev_interrupt =
+    _openslide_interrupt_enter(group->interrupt);
+  bool success = job->run(job, &tmp_err);
+  _openslide_interrupt_leave(prev_interrupt);
+
+  g_mutex_lock(group->mutex);
+  if (!success && !group->err) {
+    group->err = tmp_err;
+  } else {
+    g_clear_error(&tmp_err);
+  }
+  if (--group->outstanding == 0) {
+    g_cond_signal(group->cond);
+  }
+  g_mutex_unlock(group->mutex);
+}
+
+struct prefetch_job {
+  struct worker_job base;
+
+  openslide_t *osr;
+  struct _openslide_level *level;
+  int64_t x;  // level 0 plane
+  int64_t y;
+};
+
+static bool prefetch_tile(struct worker_job *_job, GError **err) {
+  struct prefetch_job *job = (struct prefetch_job *) _job;
+
+  // paint one pixel of the tile into a scratch surface; the format
+  // driver decodes the tile into the cache along the way
+  cairo_surface_t *surface =
+    cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+  cairo_t *cr = cairo_create(surface);
+  cairo_surface_destroy(surface);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SATURATE);
+  openslide_t *prev = _openslide_slide_enter(job->osr);
+  bool success = job->osr->ops->paint_region(job->osr, cr,
+                                             job->x, job->y,
+                                             job->level, 1, 1,
+                                             err);
+  _openslide_slide_leave(prev);
+  cairo_destroy(cr);
+  g_slice_free(struct prefetch_job, job);
+  return success;
+}
+
+// decode the tiles of a region in parallel, so that painting it only
+// hits the cache
+// x and y are in the level 0 plane, w and h in the level plane
+static bool prefetch_region(openslide_t *osr,
+                            struct _openslide_level *l,
+                            int64_t x, int64_t y,
+                            int64_t w, int64_t h,
+                            GError **err) {
+  // only levels with tile geometry hints
+  int64_t tw = l->tile_w;
+  int64_t th = l->tile_h;
+  if (tw <= 0 || th <= 0) {
+    return true;
+  }
+
+  double ds = l->downsample;
+  int64_t lx = x / ds;
+  int64_t ly = y / ds;
+  int64_t start_col = lx / tw;
+  int64_t start_row = ly / th;
+  int64_t end_col = (MIN(lx + w, l->w) + tw - 1) / tw;
+  int64_t end_row = (MIN(ly + h, l->h) + th - 1) / th;
+  if ((end_col - start_col) * (end_row - start_row) < 2) {
+    // nothing to overlap
+    return true;
+  }
+
+  struct worker_group group;
+  worker_group_init(&group);
+  for (int64_t row = start_row; row < end_row; row++) {
+    for (int64_t col = start_col; col < end_col; col++) {
+      struct prefetch_job *job = g_slice_new(struct prefetch_job);
+      job->base.run = prefetch_tile;
+      job->osr = osr;
+      job->level = l;
+      // center of the tile, to avoid rounding into a neighbor
+      job->x = (col * tw + tw / 2) * ds;
+      job->y = (row * th + th / 2) * ds;
+      worker_group_push(osr, &group, &job->base);
+    }
+  }
+  return worker_group_finish(&group, err);
+}
+
+// true if the region can be painted by copying tiles straight into a
+// cleared destination surface, skipping the intermediate group
+static bool can_paint_direct(openslide_t *osr,
+                             int64_t x, int64_t y,
+                             int32_t level) {
+  if (!level_in_range(osr, level)) {
+    return false;
+  }
+  struct _openslide_level *l = osr->levels[level];
+  if (!l->simple_grid) {
+    return false;
+  }
+  // tiles must land on whole pixels
+  double ds = l->downsample;
+  return (x < 0 || x / ds == floor(x / ds)) &&
+         (y < 0 || y / ds == floor(y / ds));
+}
+
+// if direct, cr must target a cleared image surface and the region must
+// pass can_paint_direct()
+// parallel must be false when running on the decode pool
 static bool read_region(openslide_t *osr,
 			cairo_t *cr,
 			int64_t x, int64_t y,
 			int32_t level,
 			int64_t w, int64_t h,
+			bool direct,
+			bool parallel,
 			GError **err) {
   bool success = true;
+  openslide_t *prev = _openslide_slide_enter(osr);
+  struct _openslide_level *l =
+    level_in_range(osr, level) ? osr->levels[level] : NULL;
+  _openslide_trace(OPENSLIDE_TRACE_REGION, true, l, -1, -1, 0, NULL);
 
   // save the old pattern, it's the only thing push/pop won't restore
   cairo_pattern_t *old_source = cairo_get_source(cr);
   cairo_pattern_reference(old_source);
 
-  // push, so that saturate works with all sorts of backends
-  cairo_push_group(cr);
-
-  // clear to set the bounds of the group (seems to be a recent cairo bug)
-  cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
-  cairo_rectangle(cr, 0, 0, w, h);
-  cairo_fill(cr);
-
-  // saturate those seams away!
-  cairo_set_operator(cr, CAIRO_OPERATOR_SATURATE);
-
-  if (level_in_range(osr, level)) {
-    struct _openslide_level *l = osr->levels[level];
+  if (direct) {
+    // simple grid tiles never overlap, so there are no seams to
+    // saturate; the grid clips each tile and copies it into place
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  } else {
+    // push, so that saturate works with all sorts of backends
+    cairo_push_group(cr);
+
+    // clear to set the bounds of the group (seems to be a recent cairo bug)
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_rectangle(cr, 0, 0, w, h);
+    cairo_fill(cr);
+
+    // saturate those seams away!
+    cairo_set_operator(cr, CAIRO_OPERATOR_SATURATE);
+  }
 
+  if (l) {
     // offset if given negative coordinates
     double ds = l->downsample;
     int64_t tx = 0;
@@ -521,23 +1123,34 @@ static bool read_region(openslide_t *osr,
     }
     cairo_translate(cr, tx, ty);
 
+    // decode in parallel, then composite in the usual order
+    if (w > 0 && h > 0 && parallel && osr->decode_pool) {
+      success = prefetch_region(osr, l, x, y, w, h, err);
+    }
+
     // paint
-    if (w > 0 && h > 0) {
+    if (success && w > 0 && h > 0) {
       success = osr->ops->paint_region(osr, cr, x, y, l, w, h, err);
     }
   }
 
-  cairo_pop_group_to_source(cr);
+  if (!direct) {
+    _openslide_trace(OPENSLIDE_TRACE_COMPOSITE, true, l, -1, -1, 0, NULL);
+    cairo_pop_group_to_source(cr);
 
-  if (success) {
-    // commit, nothing went wrong
-    cairo_paint(cr);
+    if (success) {
+      // commit, nothing went wrong
+      cairo_paint(cr);
+    }
+    _openslide_trace(OPENSLIDE_TRACE_COMPOSITE, false, l, -1, -1, 0, NULL);
   }
 
   // restore old source
   cairo_set_source(cr, old_source);
   cairo_pattern_destroy(old_source);
 
+  _openslide_trace(OPENSLIDE_TRACE_REGION, false, l, -1, -1, 0, NULL);
+  _openslide_slide_leave(prev);
   return success;
 }
 
@@ -553,27 +1166,100 @@ static bool ensure_nonnegative_dimensions(openslide_t *osr, int64_t w, int64_t h
   return true;
 }
 
-void openslide_read_region(openslide_t *osr,
-			   uint32_t *dest,
-			   int64_t x, int64_t y,
-			   int32_t level,
-			   int64_t w, int64_t h) {
-  GError *tmp_err = NULL;
 
-  if (!ensure_nonnegative_dimensions(osr, w, h)) {
+void openslide_set_decode_threads(openslide_t *osr, int32_t threads) {
+  if (openslide_get_error(osr)) {
     return;
   }
 
-  // clear the dest
+  if (threads <= 1) {
+    if (osr->decode_pool) {
+      g_thread_pool_free(osr->decode_pool, true, true);
+      osr->decode_pool = NULL;
+    }
+  } else if (osr->decode_pool) {
+    g_thread_pool_set_max_threads(osr->decode_pool, threads, NULL);
+  } else {
+    osr->decode_pool = g_thread_pool_new(run_worker_job, NULL,
+                                         threads, false, NULL);
+  }
+}
+
+
+// paint one piece of a large region into dest, whose rows are stride
+// pixels apart, shifted up by offset_y level rows (less than one) to
+// place it between the whole level 0 rows
+static bool read_chunk(openslide_t *osr,
+                       uint32_t *dest, int64_t stride,
+                       int64_t x, int64_t y,
+                       int32_t level,
+                       int64_t w, int64_t h,
+                       double offset_y,
+                       bool parallel,
+                       GError **err) {
+  // even a chunk painted from cached tiles stops a cancelled read
+  if (_openslide_check_interrupt(err)) {
+    return false;
+  }
+
+  // create the cairo surface for the dest
+  cairo_surface_t *surface;
   if (dest) {
-    memset(dest, 0, w * h * 4);
+    surface = cairo_image_surface_create_for_data((unsigned char *) dest,
+                                                  CAIRO_FORMAT_ARGB32,
+                                                  w, h, stride * 4);
+  } else {
+    // nil surface
+    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
   }
 
-  // now that it's cleared, return if an error occurred
-  if (openslide_get_error(osr)) {
-    return;
+  // create the cairo context
+  cairo_t *cr = cairo_create(surface);
+  cairo_surface_destroy(surface);
+
+  // paint, with an extra row to fill the bottom of a shifted chunk
+  bool direct = dest && offset_y == 0 && can_paint_direct(osr, x, y, level);
+  if (offset_y != 0) {
+    cairo_translate(cr, 0, -offset_y);
+    h++;
   }
+  bool success = read_region(osr, cr, x, y, level, w, h, direct, parallel,
+                             err) &&
+                 _openslide_check_cairo_status(cr, err);
+  cairo_destroy(cr);
+  return success;
+}
+
+struct chunk_job {
+  struct worker_job base;
+
+  openslide_t *osr;
+  uint32_t *dest;
+  int64_t stride;
+  int64_t x;  // level 0 plane
+  int64_t y;
+  int32_t level;
+  int64_t w;  // level plane
+  int64_t h;
+};
+
+static bool read_chunk_job(struct worker_job *_job, GError **err) {
+  struct chunk_job *job = (struct chunk_job *) _job;
+  bool success = read_chunk(job->osr, job->dest, job->stride,
+                            job->x, job->y, job->level, job->w, job->h,
+                            0, false, err);
+  g_slice_free(struct chunk_job, job);
+  return success;
+}
 
+// dest must already be cleared
+static bool read_region_to_buffer(openslide_t *osr,
+                                  uint32_t *dest,
+                                  int64_t x, int64_t y,
+                                  int32_t level,
+                                  int64_t w, int64_t h,
+                                  bool parallel,
+                                  GError **err) {
   // Break the work into smaller pieces if the region is large, because:
   // 1. Cairo will not allow surfaces larger than 32767 pixels on a side.
   // 2. cairo_push_group() creates an intermediate surface backed by a
@@ -581,49 +1267,77 @@ void openslide_read_region(openslide_t *osr,
   //    be addressable in 31 bits.
   // 3. We would like to constrain the intermediate surface to a reasonable
   //    amount of RAM.
-  const int64_t d = 4096;
+  const int64_t d = READ_CHUNK_PIXELS;
   double ds = openslide_get_level_downsample(osr, level);
-  for (int64_t row = 0; row < (h + d - 1) / d; row++) {
-    for (int64_t col = 0; col < (w + d - 1) / d; col++) {
+  int64_t rows = (h + d - 1) / d;
+  int64_t cols = (w + d - 1) / d;
+
+  // the pieces write disjoint parts of dest, so paint them concurrently
+  // if there are several; a single piece decodes its tiles concurrently
+  // instead
+  struct worker_group group;
+  bool chunked = dest && parallel && osr->decode_pool && rows * cols > 1;
+  if (chunked) {
+    worker_group_init(&group);
+  }
+
+  for (int64_t row = 0; row < rows; row++) {
+    for (int64_t col = 0; col < cols; col++) {
       // calculate surface coordinates and size
       int64_t sx = x + col * d * ds;     // level 0 plane
       int64_t sy = y + row * d * ds;     // level 0 plane
       int64_t sw = MIN(w - col * d, d);  // level plane
       int64_t sh = MIN(h - row * d, d);  // level plane
-
-      // create the cairo surface for the dest
-      cairo_surface_t *surface;
-      if (dest) {
-        surface = cairo_image_surface_create_for_data(
-                (unsigned char *) (dest + w * row * d + col * d),
-                CAIRO_FORMAT_ARGB32, sw, sh, w * 4);
-      } else {
-        // nil surface
-        surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
+      uint32_t *sdest = dest ? dest + w * row * d + col * d : NULL;
+
+      if (chunked) {
+        struct chunk_job *job = g_slice_new(struct chunk_job);
+        job->base.run = read_chunk_job;
+        job->osr = osr;
+        job->dest = sdest;
+        job->stride = w;
+        job->x = sx;
+        job->y = sy;
+        job->level = level;
+        job->w = sw;
+        job->h = sh;
+        worker_group_push(osr, &group, &job->base);
+      } else if (!read_chunk(osr, sdest, w, sx, sy, level, sw, sh,
+                             0, parallel, err)) {
+        return false;
       }
+    }
+  }
 
-      // create the cairo context
-      cairo_t *cr = cairo_create(surface);
-      cairo_surface_destroy(surface);
+  if (chunked) {
+    return worker_group_finish(&group, err);
+  }
+  return true;
+}
 
-      // paint
-      if (!read_region(osr, cr, sx, sy, level, sw, sh, &tmp_err)) {
-        cairo_destroy(cr);
-        goto OUT;
-      }
+void openslide_read_region(openslide_t *osr,
+			   uint32_t *dest,
+			   int64_t x, int64_t y,
+			   int32_t level,
+			   int64_t w, int64_t h) {
+  GError *tmp_err = NULL;
 
-      // done
-      if (!_openslide_check_cairo_status(cr, &tmp_err)) {
-        cairo_destroy(cr);
-        goto OUT;
-      }
+  if (!ensure_nonnegative_dimensions(osr, w, h)) {
+    return;
+  }
 
-      cairo_destroy(cr);
-    }
+  // clear the dest
+  if (dest) {
+    memset(dest, 0, w * h * 4);
   }
 
-OUT:
-  if (tmp_err) {
+  // now that it's cleared, return if an error occurred
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  if (!read_region_to_buffer(osr, dest, x, y, level, w, h, true,
+                             &tmp_err)) {
     _openslide_propagate_error(osr, tmp_err);
     if (dest) {
       // ensure we don't return a partial result
@@ -632,33 +1346,715 @@ OUT:
   }
 }
 
-
-void openslide_cairo_read_region(openslide_t *osr,
-				 cairo_t *cr,
-				 int64_t x, int64_t y,
-				 int32_t level,
-				 int64_t w, int64_t h) {
+openslide_read_status_t openslide_read_region_with_deadline(openslide_t *osr,
+                                                            uint32_t *dest,
+                                                            int64_t x,
+                                                            int64_t y,
+                                                            int32_t level,
+                                                            int64_t w,
+                                                            int64_t h,
+                                                            int64_t timeout_usec,
+                                                            volatile int32_t *cancel) {
   GError *tmp_err = NULL;
 
   if (!ensure_nonnegative_dimensions(osr, w, h)) {
-    return;
+    return OPENSLIDE_READ_ERROR;
+  }
+
+  // clear the dest
+  if (dest) {
+    memset(dest, 0, w * h * 4);
   }
 
+  // now that it's cleared, return if an error occurred
   if (openslide_get_error(osr)) {
-    return;
+    return OPENSLIDE_READ_ERROR;
   }
 
-  if (read_region(osr, cr, x, y, level, w, h, &tmp_err)) {
-    _openslide_check_cairo_status(cr, &tmp_err);
+  struct _openslide_interrupt intr = {
+    .deadline = -1,
+    .cancel = cancel,
+  };
+  if (timeout_usec >= 0) {
+    intr.deadline = _openslide_get_clock() + timeout_usec;
+  }
+  struct _openslide_interrupt *prev = _openslide_interrupt_enter(&intr);
+  bool success = read_region_to_buffer(osr, dest, x, y, level, w, h, true,
+                                       &tmp_err);
+  _openslide_interrupt_leave(prev);
+  if (success) {
+    return OPENSLIDE_READ_OK;
   }
 
-  if (tmp_err) {
-    _openslide_propagate_error(osr, tmp_err);
+  if (dest) {
+    // ensure we don't return a partial result
+    memset(dest, 0, w * h * 4);
+  }
+  if (g_error_matches(tmp_err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_CANCELLED)) {
+    // not sticky; the slide is fine
+    g_error_free(tmp_err);
+    return OPENSLIDE_READ_CANCELLED;
   }
+  _openslide_propagate_error(osr, tmp_err);
+  return OPENSLIDE_READ_ERROR;
 }
 
-
-const char * const *openslide_get_property_names(openslide_t *osr) {
+int32_t openslide_get_focal_plane_count(openslide_t *osr) {
+  if (openslide_get_error(osr)) {
+    return -1;
+  }
+  return osr->focal_plane_count;
+}
+
+// paint one piece of a large region into each plane's dest, whose rows
+// are stride pixels apart
+static bool read_planes_chunk(openslide_t *osr,
+                              uint32_t **dest, int64_t offset,
+                              int64_t stride,
+                              int64_t x, int64_t y,
+                              struct _openslide_level *l,
+                              int64_t w, int64_t h,
+                              GError **err) {
+  int32_t count = osr->focal_plane_count;
+  cairo_t **crs = g_new(cairo_t *, count);
+  for (int32_t p = 0; p < count; p++) {
+    cairo_surface_t *surface;
+    if (dest[p]) {
+      surface =
+        cairo_image_surface_create_for_data((unsigned char *)
+                                            (dest[p] + offset),
+                                            CAIRO_FORMAT_ARGB32,
+                                            w, h, stride * 4);
+    } else {
+      // nil surface
+      surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
+    }
+    crs[p] = cairo_create(surface);
+    cairo_surface_destroy(surface);
+  }
+
+  // offset if given negative coordinates
+  double ds = l->downsample;
+  int64_t tx = 0;
+  int64_t ty = 0;
+  if (x < 0) {
+    tx = (-x) / ds;
+    x = 0;
+    w -= tx;
+  }
+  if (y < 0) {
+    ty = (-y) / ds;
+    y = 0;
+    h -= ty;
+  }
+
+  // composite each plane as read_region() does
+  for (int32_t p = 0; p < count; p++) {
+    cairo_push_group(crs[p]);
+    cairo_set_operator(crs[p], CAIRO_OPERATOR_CLEAR);
+    cairo_rectangle(crs[p], 0, 0, w + tx, h + ty);
+    cairo_fill(crs[p]);
+    cairo_set_operator(crs[p], CAIRO_OPERATOR_SATURATE);
+    cairo_translate(crs[p], tx, ty);
+  }
+
+  bool success = true;
+  if (w > 0 && h > 0) {
+    openslide_t *prev = _openslide_slide_enter(osr);
+    success = osr->ops->paint_region_planes(osr, crs, x, y, l, w, h, err);
+    _openslide_slide_leave(prev);
+  }
+
+  for (int32_t p = 0; p < count; p++) {
+    cairo_pop_group_to_source(crs[p]);
+    if (success) {
+      cairo_paint(crs[p]);
+      success = _openslide_check_cairo_status(crs[p], err);
+    }
+    cairo_destroy(crs[p]);
+  }
+  g_free(crs);
+  return success;
+}
+
+void openslide_read_region_planes(openslide_t *osr,
+                                  uint32_t **dest,
+                                  int64_t x, int64_t y,
+                                  int32_t level,
+                                  int64_t w, int64_t h) {
+  GError *tmp_err = NULL;
+
+  if (!ensure_nonnegative_dimensions(osr, w, h)) {
+    return;
+  }
+
+  // clear the dest
+  int32_t count = osr->focal_plane_count;
+  for (int32_t p = 0; p < count; p++) {
+    if (dest[p]) {
+      memset(dest[p], 0, w * h * 4);
+    }
+  }
+
+  // now that it's cleared, return if an error occurred
+  if (openslide_get_error(osr) || !level_in_range(osr, level)) {
+    return;
+  }
+
+  // nothing to share across one plane
+  if (!osr->ops->paint_region_planes) {
+    openslide_read_region(osr, dest[0], x, y, level, w, h);
+    return;
+  }
+
+  // in pieces, for the reasons given in read_region_to_buffer()
+  const int64_t d = 4096;
+  struct _openslide_level *l = osr->levels[level];
+  for (int64_t row = 0; row < (h + d - 1) / d; row++) {
+    for (int64_t col = 0; col < (w + d - 1) / d; col++) {
+      if (!read_planes_chunk(osr, dest, w * row * d + col * d, w,
+                             x + col * d * l->downsample,
+                             y + row * d * l->downsample,
+                             l, MIN(w - col * d, d), MIN(h - row * d, d),
+                             &tmp_err)) {
+        _openslide_propagate_error(osr, tmp_err);
+        // ensure we don't return a partial result
+        for (int32_t p = 0; p < count; p++) {
+          if (dest[p]) {
+            memset(dest[p], 0, w * h * 4);
+          }
+        }
+        return;
+      }
+    }
+  }
+}
+
+static int32_t get_pixel_size(openslide_pixel_format_t format) {
+  switch (format) {
+  case OPENSLIDE_PIXEL_FORMAT_ARGB32:
+  case OPENSLIDE_PIXEL_FORMAT_RGBA:
+  case OPENSLIDE_PIXEL_FORMAT_BGRA:
+    return 4;
+  case OPENSLIDE_PIXEL_FORMAT_RGB:
+    return 3;
+  default:
+    return 0;
+  }
+}
+
+static void convert_row(openslide_pixel_format_t format,
+                        uint8_t *dest, const uint32_t *src, int64_t w) {
+  switch (format) {
+  case OPENSLIDE_PIXEL_FORMAT_ARGB32:
+    memcpy(dest, src, w * 4);
+    break;
+  case OPENSLIDE_PIXEL_FORMAT_RGBA:
+    _openslide_convert_argb_to_rgba(dest, src, w, false);
+    break;
+  case OPENSLIDE_PIXEL_FORMAT_BGRA:
+    _openslide_convert_argb_to_rgba(dest, src, w, true);
+    break;
+  case OPENSLIDE_PIXEL_FORMAT_RGB:
+    _openslide_convert_argb_to_rgb(dest, src, w);
+    break;
+  }
+}
+
+static void clear_rows(uint8_t *dest, int64_t stride,
+                       int64_t row_bytes, int64_t h) {
+  for (int64_t row = 0; row < h; row++) {
+    memset(dest + row * stride, 0, row_bytes);
+  }
+}
+
+void openslide_read_region_format(openslide_t *osr,
+                                  void *dest,
+                                  int64_t stride,
+                                  openslide_pixel_format_t format,
+                                  int64_t x, int64_t y,
+                                  int32_t level,
+                                  int64_t w, int64_t h) {
+  GError *tmp_err = NULL;
+
+  if (!ensure_nonnegative_dimensions(osr, w, h)) {
+    return;
+  }
+  int64_t row_bytes = w * get_pixel_size(format);
+  if (stride == 0) {
+    stride = row_bytes;
+  }
+  if (get_pixel_size(format) == 0 || stride < row_bytes) {
+    tmp_err = g_error_new(OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                          "Invalid pixel format %d or stride %"PRId64,
+                          format, stride);
+    _openslide_propagate_error(osr, tmp_err);
+    return;
+  }
+
+  // clear the dest
+  if (dest) {
+    clear_rows(dest, stride, row_bytes, h);
+  }
+
+  // now that it's cleared, return if an error occurred
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  // the native format needs no conversion
+  if (format == OPENSLIDE_PIXEL_FORMAT_ARGB32 && stride == w * 4) {
+    if (!read_region_to_buffer(osr, dest, x, y, level, w, h, true,
+                               &tmp_err)) {
+      _openslide_propagate_error(osr, tmp_err);
+      if (dest) {
+        memset(dest, 0, w * h * 4);
+      }
+    }
+    return;
+  }
+
+  // otherwise read bands of rows small enough to stay in cache, and
+  // convert each into dest as it is read.  each band is placed exactly
+  // as read_region_to_buffer() places its rows: from the origin of the
+  // chunk containing it, at a whole number of level rows below.  the
+  // band itself starts at a whole level 0 row, so any remainder is
+  // applied as a shift.
+  const int64_t d = READ_CHUNK_PIXELS;
+  int64_t band_rows = MAX(MIN(FORMAT_BAND_PIXELS / MAX(w, 1), h), 1);
+  uint32_t *buf = dest ? g_new(uint32_t, w * band_rows) : NULL;
+  double ds = openslide_get_level_downsample(osr, level);
+  int64_t rows;
+  for (int64_t row = 0; row < h; row += rows) {
+    int64_t chunk_row = row % d;
+    rows = MIN(MIN(band_rows, h - row), d - chunk_row);
+    int64_t chunk_y = y + (row - chunk_row) * ds;  // level 0 plane
+    int64_t skip = floor(chunk_row * ds);           // level 0 plane
+    int64_t band_y = chunk_y + skip;
+    double offset_y = band_y < 0 ? 0 : MAX(chunk_row - skip / ds, 0);
+    if (buf) {
+      memset(buf, 0, w * rows * 4);
+    }
+    bool success = true;
+    for (int64_t col = 0; success && col * d < w; col++) {
+      success = read_chunk(osr, buf ? buf + col * d : NULL, w,
+                           x + col * d * ds, band_y, level,
+                           MIN(w - col * d, d), rows, offset_y,
+                           true, &tmp_err);
+    }
+    if (!success) {
+      _openslide_propagate_error(osr, tmp_err);
+      if (dest) {
+        // ensure we don't return a partial result
+        clear_rows(dest, stride, row_bytes, h);
+      }
+      break;
+    }
+    if (dest) {
+      for (int64_t i = 0; i < rows; i++) {
+        convert_row(format, (uint8_t *) dest + (row + i) * stride,
+                    buf + i * w, w);
+      }
+    }
+  }
+  g_free(buf);
+}
+
+
+// a run of batch regions, in sorted order
+struct batch_job {
+  struct worker_job base;
+
+  openslide_t *osr;
+  openslide_region_t *regions;
+  const int32_t *order;
+  int32_t start;
+  int32_t end;
+};
+
+// reads regions[order[start..end)]; each region's dest must already be
+// cleared
+static bool read_batch_run(openslide_t *osr,
+                           openslide_region_t *regions,
+                           const int32_t *order,
+                           int32_t start, int32_t end,
+                           bool parallel,
+                           GError **err) {
+  bool success = true;
+  for (int32_t i = start; i < end; i++) {
+    openslide_region_t *r = &regions[order[i]];
+    GError *tmp_err = NULL;
+    r->success = read_region_to_buffer(osr, r->dest, r->x, r->y, r->level,
+                                       r->w, r->h, parallel, &tmp_err);
+    if (!r->success) {
+      if (r->dest) {
+        // ensure we don't return a partial result
+        memset(r->dest, 0, r->w * r->h * 4);
+      }
+      if (success) {
+        g_propagate_error(err, tmp_err);
+        success = false;
+      } else {
+        g_clear_error(&tmp_err);
+      }
+    }
+  }
+  return success;
+}
+
+static bool read_batch_job(struct worker_job *_job, GError **err) {
+  struct batch_job *job = (struct batch_job *) _job;
+  bool success = read_batch_run(job->osr, job->regions, job->order,
+                                job->start, job->end, false, err);
+  g_slice_free(struct batch_job, job);
+  return success;
+}
+
+// order by level, then row, then column, so that regions sharing tiles
+// are read together
+static gint batch_order_compare(gconstpointer a, gconstpointer b,
+                                gpointer data) {
+  const openslide_region_t *regions = data;
+  const openslide_region_t *ra = &regions[*(const int32_t *) a];
+  const openslide_region_t *rb = &regions[*(const int32_t *) b];
+
+  if (ra->level != rb->level) {
+    return ra->level < rb->level ? -1 : 1;
+  }
+  if (ra->y != rb->y) {
+    return ra->y < rb->y ? -1 : 1;
+  }
+  if (ra->x != rb->x) {
+    return ra->x < rb->x ? -1 : 1;
+  }
+  return 0;
+}
+
+void openslide_read_regions(openslide_t *osr,
+                            openslide_region_t *regions,
+                            int32_t count) {
+  GError *tmp_err = NULL;
+
+  // clear the dests of every region with valid dimensions, even if
+  // another region's are invalid
+  bool valid = true;
+  for (int32_t i = 0; i < count; i++) {
+    openslide_region_t *r = &regions[i];
+    r->success = false;
+    if (r->w < 0 || r->h < 0) {
+      valid = false;
+    } else if (r->dest) {
+      memset(r->dest, 0, r->w * r->h * 4);
+    }
+  }
+  for (int32_t i = 0; !valid && i < count; i++) {
+    if (!ensure_nonnegative_dimensions(osr, regions[i].w, regions[i].h)) {
+      return;
+    }
+  }
+
+  // now that they're cleared, return if an error occurred
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  int32_t *order = g_new(int32_t, count);
+  for (int32_t i = 0; i < count; i++) {
+    order[i] = i;
+  }
+  g_qsort_with_data(order, count, sizeof(*order), batch_order_compare,
+                    regions);
+
+  bool success;
+  if (osr->decode_pool && count > 1) {
+    // split into contiguous runs, a few per thread, so each tile is
+    // usually decoded by only one of them
+    int32_t runs = MIN(count,
+                       4 * g_thread_pool_get_max_threads(osr->decode_pool));
+    struct worker_group group;
+    worker_group_init(&group);
+    for (int32_t i = 0; i < runs; i++) {
+      struct batch_job *job = g_slice_new(struct batch_job);
+      job->base.run = read_batch_job;
+      job->osr = osr;
+      job->regions = regions;
+      job->order = order;
+      job->start = (int64_t) count * i / runs;
+      job->end = (int64_t) count * (i + 1) / runs;
+      worker_group_push(osr, &group, &job->base);
+    }
+    success = worker_group_finish(&group, &tmp_err);
+  } else {
+    success = read_batch_run(osr, regions, order, 0, count, true, &tmp_err);
+  }
+  g_free(order);
+
+  if (!success) {
+    _openslide_propagate_error(osr, tmp_err);
+  }
+}
+
+
+enum request_state {
+  REQUEST_QUEUED,
+  REQUEST_RUNNING,
+  REQUEST_DONE,
+};
+
+struct _openslide_request {
+  gint refcount;  // atomic ops only
+  volatile int32_t cancelled;  // atomic ops only
+
+  // immutable
+  uint32_t *dest;
+  int64_t x;
+  int64_t y;
+  int32_t level;
+  int64_t w;
+  int64_t h;
+  openslide_request_callback_fn callback;
+  void *callback_data;
+  bool prewarm;  // decode into the cache rather than reading
+  bool pin;
+
+  // mutex protects
+  GMutex *mutex;
+  GCond *cond;
+  enum request_state state;
+  bool success;
+};
+
+static void request_unref(openslide_request_t *req) {
+  if (g_atomic_int_dec_and_test(&req->refcount)) {
+    g_cond_free(req->cond);
+    g_mutex_free(req->mutex);
+    g_slice_free(openslide_request_t, req);
+  }
+}
+
+static bool request_cancelled(openslide_request_t *req) {
+  return g_atomic_int_get(&req->cancelled);
+}
+
+// decode the tiles of a region into the cache by painting it, a chunk
+// at a time, onto a single pixel.  The grid still reads every tile of
+// the chunk, and a cancelled request stops between chunks.
+static bool prewarm_region(openslide_t *osr, openslide_request_t *req,
+                           GError **err) {
+  g_assert(level_in_range(osr, req->level));
+  struct _openslide_level *l = osr->levels[req->level];
+  double ds = l->downsample;
+  int64_t start_x = MAX(req->x / ds, 0);
+  int64_t start_y = MAX(req->y / ds, 0);
+  int64_t end_x = MIN(req->x / ds + req->w, l->w);
+  int64_t end_y = MIN(req->y / ds + req->h, l->h);
+
+  cairo_surface_t *surface =
+    cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+  cairo_t *cr = cairo_create(surface);
+  cairo_surface_destroy(surface);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SATURATE);
+
+  openslide_t *prev = _openslide_slide_enter(osr);
+  if (req->pin) {
+    _openslide_cache_pin_begin(osr->cache);
+  }
+  bool success = true;
+  for (int64_t y = start_y; success && y < end_y; y += PREWARM_CHUNK_PIXELS) {
+    for (int64_t x = start_x; success && x < end_x;
+         x += PREWARM_CHUNK_PIXELS) {
+      if (request_cancelled(req)) {
+        success = false;
+        break;
+      }
+      success = osr->ops->paint_region(osr, cr, x * ds, y * ds, l,
+                                       MIN(end_x - x, PREWARM_CHUNK_PIXELS),
+                                       MIN(end_y - y, PREWARM_CHUNK_PIXELS),
+                                       err);
+    }
+  }
+  if (req->pin) {
+    _openslide_cache_pin_end(osr->cache);
+  }
+  _openslide_slide_leave(prev);
+
+  if (success) {
+    success = _openslide_check_cairo_status(cr, err);
+  }
+  cairo_destroy(cr);
+  return success;
+}
+
+static void run_async_request(gpointer data, gpointer user_data) {
+  openslide_request_t *req = data;
+  openslide_t *osr = user_data;
+  bool success = false;
+
+  g_mutex_lock(req->mutex);
+  req->state = REQUEST_RUNNING;
+  g_mutex_unlock(req->mutex);
+
+  if (request_cancelled(req)) {
+    // nothing to do
+  } else if (req->prewarm) {
+    // an invalid level fails the request, without an error in osr
+    GError *tmp_err = NULL;
+    if (!openslide_get_error(osr) &&
+        level_in_range(osr, req->level) &&
+        ensure_nonnegative_dimensions(osr, req->w, req->h)) {
+      success = prewarm_region(osr, req, &tmp_err);
+      if (tmp_err) {
+        _openslide_propagate_error(osr, tmp_err);
+      }
+    }
+  } else {
+    // the decode pool is safe to use from here; we are not one of its
+    // workers.  Cancelling stops the read without an error in osr.
+    success = openslide_read_region_with_deadline(osr, req->dest,
+                                                  req->x, req->y,
+                                                  req->level,
+                                                  req->w, req->h,
+                                                  -1, &req->cancelled) ==
+              OPENSLIDE_READ_OK;
+  }
+
+  // before completion, so openslide_request_wait() also waits for it
+  if (req->callback) {
+    req->callback(req, success, req->callback_data);
+  }
+
+  g_mutex_lock(req->mutex);
+  req->success = success;
+  req->state = REQUEST_DONE;
+  g_cond_broadcast(req->cond);
+  g_mutex_unlock(req->mutex);
+
+  // drop the queue's reference
+  request_unref(req);
+}
+
+static openslide_request_t *request_new(uint32_t *dest,
+                                        int64_t x, int64_t y,
+                                        int32_t level,
+                                        int64_t w, int64_t h,
+                                        openslide_request_callback_fn callback,
+                                        void *callback_data) {
+  openslide_request_t *req = g_slice_new0(openslide_request_t);
+  // one ref for the caller, one for the queue
+  req->refcount = 2;
+  req->dest = dest;
+  req->x = x;
+  req->y = y;
+  req->level = level;
+  req->w = w;
+  req->h = h;
+  req->callback = callback;
+  req->callback_data = callback_data;
+  req->mutex = g_mutex_new();
+  req->cond = g_cond_new();
+  req->state = REQUEST_QUEUED;
+  return req;
+}
+
+openslide_request_t *openslide_read_region_async(openslide_t *osr,
+                                                 uint32_t *dest,
+                                                 int64_t x, int64_t y,
+                                                 int32_t level,
+                                                 int64_t w, int64_t h,
+                                                 openslide_request_callback_fn callback,
+                                                 void *callback_data) {
+  openslide_request_t *req = request_new(dest, x, y, level, w, h,
+                                         callback, callback_data);
+  g_thread_pool_push(osr->async_pool, req, NULL);
+  return req;
+}
+
+openslide_request_t *openslide_prewarm_region_async(openslide_t *osr,
+                                                    int64_t x, int64_t y,
+                                                    int32_t level,
+                                                    int64_t w, int64_t h,
+                                                    bool pin,
+                                                    openslide_request_callback_fn callback,
+                                                    void *callback_data) {
+  openslide_request_t *req = request_new(NULL, x, y, level, w, h,
+                                         callback, callback_data);
+  req->prewarm = true;
+  req->pin = pin;
+  g_thread_pool_push(osr->async_pool, req, NULL);
+  return req;
+}
+
+openslide_request_t *openslide_prewarm_level_async(openslide_t *osr,
+                                                   int32_t level,
+                                                   bool pin,
+                                                   openslide_request_callback_fn callback,
+                                                   void *callback_data) {
+  int64_t w = 0;
+  int64_t h = 0;
+  if (level_in_range(osr, level)) {
+    w = osr->levels[level]->w;
+    h = osr->levels[level]->h;
+  }
+  return openslide_prewarm_region_async(osr, 0, 0, level, w, h, pin,
+                                        callback, callback_data);
+}
+
+void openslide_unpin_tiles(openslide_t *osr) {
+  _openslide_cache_binding_unpin(osr->cache);
+}
+
+void openslide_request_cancel(openslide_request_t *req) {
+  g_atomic_int_set(&req->cancelled, 1);
+}
+
+bool openslide_request_is_done(openslide_request_t *req) {
+  g_mutex_lock(req->mutex);
+  bool done = req->state == REQUEST_DONE;
+  g_mutex_unlock(req->mutex);
+  return done;
+}
+
+bool openslide_request_wait(openslide_request_t *req) {
+  g_mutex_lock(req->mutex);
+  while (req->state != REQUEST_DONE) {
+    g_cond_wait(req->cond, req->mutex);
+  }
+  bool success = req->success;
+  g_mutex_unlock(req->mutex);
+  return success;
+}
+
+void openslide_request_release(openslide_request_t *req) {
+  request_unref(req);
+}
+
+
+void openslide_cairo_read_region(openslide_t *osr,
+				 cairo_t *cr,
+				 int64_t x, int64_t y,
+				 int32_t level,
+				 int64_t w, int64_t h) {
+  GError *tmp_err = NULL;
+
+  if (!ensure_nonnegative_dimensions(osr, w, h)) {
+    return;
+  }
+
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  if (read_region(osr, cr, x, y, level, w, h, false, true, &tmp_err)) {
+    _openslide_check_cairo_status(cr, &tmp_err);
+  }
+
+  if (tmp_err) {
+    _openslide_propagate_error(osr, tmp_err);
+  }
+}
+
+
+const char * const *openslide_get_property_names(openslide_t *osr) {
   if (openslide_get_error(osr)) {
     return EMPTY_STRING_ARRAY;
   }
@@ -666,11 +2062,45 @@ const char * const *openslide_get_property_names(openslide_t *osr) {
   return osr->property_names;
 }
 
+// reopen the slide with hashing, and return the hash string or NULL
+static gpointer compute_lazy_quickhash1(gpointer data) {
+  openslide_t *osr = data;
+
+  struct _openslide_tifflike *tl;
+  struct _openslide_detect_context *dc;
+  const struct _openslide_format *format = detect_format(osr->lazy_filename,
+                                                         &tl, &dc);
+  if (!format) {
+    return NULL;
+  }
+
+  // don't start background work in the throwaway object
+  openslide_t *tmp = create_osr();
+  tmp->open_flags = OPENSLIDE_OPEN_LAZY;
+  struct _openslide_hash *quickhash1 = NULL;
+  char *result = NULL;
+  if (open_backend(tmp, format, osr->lazy_filename, tl, dc,
+                   &quickhash1, NULL)) {
+    result = g_strdup(_openslide_hash_get_string(quickhash1));
+    _openslide_hash_destroy(quickhash1);
+  }
+  _openslide_tifflike_destroy(tl);
+  _openslide_detect_context_destroy(dc);
+  openslide_close(tmp);
+  return result;
+}
+
 const char *openslide_get_property_value(openslide_t *osr, const char *name) {
   if (openslide_get_error(osr)) {
     return NULL;
   }
 
+  // views share the owner's hash
+  openslide_t *owner = osr->shared ? osr->shared->owner : osr;
+  if (owner->lazy_filename &&
+      g_str_equal(name, OPENSLIDE_PROPERTY_NAME_QUICKHASH1)) {
+    return g_once(&owner->quickhash1_once, compute_lazy_quickhash1, owner);
+  }
   return g_hash_table_lookup(osr->properties, name);
 }
 
@@ -711,21 +2141,327 @@ void openslide_read_associated_image(openslide_t *osr,
   struct _openslide_associated_image *img = g_hash_table_lookup(osr->associated_images,
 								name);
   if (img) {
+    // decoded images are cached under the image's own coordinate plane.
     // this function is documented to do nothing on failure, so we need an
     // extra memcpy
-    size_t pixels = img->w * img->h;
-    uint32_t *buf = g_new(uint32_t, pixels);
-
-    if (img->ops->get_argb_data(img, buf, &tmp_err)) {
-      if (dest) {
-        memcpy(dest, buf, pixels * sizeof(uint32_t));
+    int64_t size = img->w * img->h * 4;
+    struct _openslide_cache_entry *entry;
+    uint32_t *buf = _openslide_cache_get(osr->cache, img, 0, 0, &entry);
+    if (!buf) {
+      buf = _openslide_buffer_alloc(size);
+      openslide_t *prev = _openslide_slide_enter(osr);
+      bool success = img->ops->get_argb_data(img, buf, &tmp_err);
+      _openslide_slide_leave(prev);
+      if (!success) {
+        _openslide_buffer_free(size, buf);
+        _openslide_propagate_error(osr, tmp_err);
+        return;
       }
+      _openslide_cache_put(osr->cache, img, 0, 0, buf, size, &entry);
+    }
+
+    if (dest) {
+      memcpy(dest, buf, size);
+    }
+    _openslide_cache_entry_unref(entry);
+  }
+}
+
+static struct _openslide_level *get_tile_level(openslide_t *osr,
+                                               int32_t level,
+                                               int64_t tile_col,
+                                               int64_t tile_row) {
+  if (level < 0 || level >= osr->level_count) {
+    return NULL;
+  }
+  struct _openslide_level *l = osr->levels[level];
+  if (l->tile_w <= 0 || l->tile_h <= 0 ||
+      tile_col < 0 || tile_col * l->tile_w >= l->w ||
+      tile_row < 0 || tile_row * l->tile_h >= l->h) {
+    return NULL;
+  }
+  return l;
+}
+
+openslide_raw_tile_t *openslide_read_raw_tile(openslide_t *osr,
+                                              int32_t level,
+                                              int64_t tile_col,
+                                              int64_t tile_row) {
+  if (openslide_get_error(osr) || osr->ops->read_raw_tile == NULL) {
+    return NULL;
+  }
+  struct _openslide_level *l = get_tile_level(osr, level,
+                                              tile_col, tile_row);
+  if (l == NULL) {
+    return NULL;
+  }
+
+  void *buf;
+  int32_t len;
+  const char *codec;
+  GError *tmp_err = NULL;
+  openslide_t *prev = _openslide_slide_enter(osr);
+  bool success = osr->ops->read_raw_tile(osr, l, tile_col, tile_row,
+                                         &buf, &len, &codec, &tmp_err);
+  _openslide_slide_leave(prev);
+  if (!success) {
+    if (g_error_matches(tmp_err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE)) {
+      g_clear_error(&tmp_err);
     } else {
       _openslide_propagate_error(osr, tmp_err);
     }
+    return NULL;
+  }
+
+  openslide_raw_tile_t *tile = g_slice_new(openslide_raw_tile_t);
+  tile->data = buf;
+  tile->size = len;
+  tile->codec = codec;
+  tile->x = tile_col * l->tile_w;
+  tile->y = tile_row * l->tile_h;
+  tile->w = l->tile_w;
+  tile->h = l->tile_h;
+  tile->visible_w = MIN(l->tile_w, l->w - tile->x);
+  tile->visible_h = MIN(l->tile_h, l->h - tile->y);
+  return tile;
+}
+
+void openslide_raw_tile_free(openslide_raw_tile_t *tile) {
+  if (tile == NULL) {
+    return;
+  }
+  g_free((void *) tile->data);
+  g_slice_free(openslide_raw_tile_t, tile);
+}
+
+// the public tile, and what keeps its pixels alive
+struct tile_handle {
+  openslide_tile_t tile;
+  struct _openslide_cache_entry *entry;  // or NULL if buf is owned
+  uint32_t *buf;
+};
+
+openslide_tile_t *openslide_acquire_tile(openslide_t *osr,
+                                         int32_t level,
+                                         int64_t tile_col,
+                                         int64_t tile_row) {
+  if (openslide_get_error(osr)) {
+    return NULL;
+  }
+  struct _openslide_level *l = get_tile_level(osr, level,
+                                              tile_col, tile_row);
+  if (l == NULL) {
+    return NULL;
+  }
+
+  struct tile_handle *handle = g_slice_new0(struct tile_handle);
+  openslide_tile_t *tile = &handle->tile;
+  tile->x = tile_col * l->tile_w;
+  tile->y = tile_row * l->tile_h;
+  tile->w = l->tile_w;
+  tile->h = l->tile_h;
+  tile->visible_w = MIN(l->tile_w, l->w - tile->x);
+  tile->visible_h = MIN(l->tile_h, l->h - tile->y);
+
+  GError *tmp_err = NULL;
+  bool success;
+  if (osr->ops->acquire_tile) {
+    uint32_t *tiledata;
+    openslide_t *prev = _openslide_slide_enter(osr);
+    success = osr->ops->acquire_tile(osr, l, tile_col, tile_row,
+                                     &tiledata, &handle->entry, &tmp_err);
+    _openslide_slide_leave(prev);
+    uint32_t pixel;
+    if (success &&
+        _openslide_cache_entry_get_constant(handle->entry, &pixel)) {
+      // expand it, and let the cache drop the entry
+      handle->buf = g_new(uint32_t, tile->w * tile->h);
+      for (int64_t i = 0; i < tile->w * tile->h; i++) {
+        handle->buf[i] = pixel;
+      }
+      _openslide_cache_entry_unref(handle->entry);
+      handle->entry = NULL;
+      tiledata = handle->buf;
+    }
+    tile->data = tiledata;
+  } else {
+    // composite it, as for any other region
+    handle->buf = g_new0(uint32_t, tile->w * tile->h);
+    success = read_region_to_buffer(osr, handle->buf,
+                                    tile->x * l->downsample,
+                                    tile->y * l->downsample,
+                                    level, tile->w, tile->h, true,
+                                    &tmp_err);
+    tile->data = handle->buf;
+  }
+  if (!success) {
+    _openslide_propagate_error(osr, tmp_err);
+    g_free(handle->buf);
+    g_slice_free(struct tile_handle, handle);
+    return NULL;
+  }
+  return tile;
+}
+
+void openslide_tile_release(openslide_tile_t *tile) {
+  if (tile == NULL) {
+    return;
+  }
+  struct tile_handle *handle = (struct tile_handle *) tile;
+  if (handle->entry) {
+    _openslide_cache_entry_unref(handle->entry);
+  }
+  g_free(handle->buf);
+  g_slice_free(struct tile_handle, handle);
+}
+
+bool openslide_read_tile(openslide_t *osr,
+                         uint32_t *dest,
+                         int32_t level,
+                         int64_t tile_col,
+                         int64_t tile_row) {
+  openslide_tile_t *tile = openslide_acquire_tile(osr, level,
+                                                  tile_col, tile_row);
+  if (tile == NULL) {
+    // clear the caller's tile-sized buffer.  a level without a tile
+    // grid has no tile size property, so its buffer is zero bytes.
+    if (level >= 0 && level < osr->level_count) {
+      struct _openslide_level *l = osr->levels[level];
+      int64_t size = MAX(l->tile_w, 0) * MAX(l->tile_h, 0) * 4;
+      if (size && dest) {
+        memset(dest, 0, size);
+      }
+    }
+    return false;
+  }
+  memcpy(dest, tile->data, tile->w * tile->h * 4);
+  openslide_tile_release(tile);
+  return true;
+}
+
+struct _openslide_tile_iter {
+  uint8_t *nonempty;  // per tile, row-major
+  int64_t tiles_across;
+  int64_t count;
+  int64_t next;
+};
+
+static bool is_tissue(uint32_t pixel) {
+  uint32_t a = pixel >> 24;
+  uint32_t r = (pixel >> 16) & 0xff;
+  uint32_t g = (pixel >> 8) & 0xff;
+  uint32_t b = pixel & 0xff;
+  // premultiplied, so compare against the scaled threshold
+  return a && MIN(MIN(r, g), b) * 255 < TISSUE_MAX_BRIGHTNESS * a;
+}
+
+// clear the tiles of level l with no tissue pixel of the thumbnail,
+// or of its neighbors, in their area
+static void clear_background_tiles(openslide_t *osr,
+                                   struct _openslide_level *l,
+                                   uint8_t *nonempty,
+                                   int64_t tiles_across,
+                                   int64_t tiles_down) {
+  struct _openslide_level *l0 = osr->levels[0];
+  struct _openslide_level *smallest = osr->levels[osr->level_count - 1];
+  double ds = MAX(smallest->downsample,
+                  (double) MAX(l0->w, l0->h) / TISSUE_THUMBNAIL_PIXELS);
+  int64_t w = MAX(ceil(l0->w / ds), 1);
+  int64_t h = MAX(ceil(l0->h / ds), 1);
+  uint32_t *thumb = g_new(uint32_t, w * h);
+  openslide_read_region_scaled(osr, thumb, 0, 0, ds, w, h);
+  if (openslide_get_error(osr)) {
+    g_free(thumb);
+    return;
+  }
+
+  // level pixels per thumbnail pixel
+  double scale = ds / l->downsample;
+  uint8_t *tissue = g_new0(uint8_t, tiles_across * tiles_down);
+  for (int64_t y = 0; y < h; y++) {
+    for (int64_t x = 0; x < w; x++) {
+      if (!is_tissue(thumb[y * w + x])) {
+        continue;
+      }
+      int64_t col0 = MAX(floor((x - 1) * scale / l->tile_w), 0);
+      int64_t row0 = MAX(floor((y - 1) * scale / l->tile_h), 0);
+      int64_t col1 = MIN(ceil((x + 2) * scale / l->tile_w), tiles_across);
+      int64_t row1 = MIN(ceil((y + 2) * scale / l->tile_h), tiles_down);
+      for (int64_t row = row0; row < row1; row++) {
+        memset(tissue + row * tiles_across + col0, 1,
+               MAX(col1 - col0, 0));
+      }
+    }
+  }
+  for (int64_t i = 0; i < tiles_across * tiles_down; i++) {
+    nonempty[i] &= tissue[i];
+  }
+  g_free(tissue);
+  g_free(thumb);
+}
+
+openslide_tile_iter_t *openslide_tile_iter_create(openslide_t *osr,
+                                                  int32_t level,
+                                                  uint32_t flags) {
+  if (openslide_get_error(osr) || level < 0 || level >= osr->level_count) {
+    return NULL;
+  }
+  struct _openslide_level *l = osr->levels[level];
+  if (l->tile_w <= 0 || l->tile_h <= 0) {
+    return NULL;
+  }
+  int64_t tiles_across = (l->w + l->tile_w - 1) / l->tile_w;
+  int64_t tiles_down = (l->h + l->tile_h - 1) / l->tile_h;
+
+  openslide_tile_iter_t *iter = g_slice_new0(openslide_tile_iter_t);
+  iter->tiles_across = tiles_across;
+  iter->count = tiles_across * tiles_down;
+  iter->nonempty = g_malloc(iter->count);
+  memset(iter->nonempty, 1, iter->count);
+
+  if (osr->ops->clear_empty_tiles) {
+    GError *tmp_err = NULL;
+    openslide_t *prev = _openslide_slide_enter(osr);
+    bool success = osr->ops->clear_empty_tiles(osr, l, iter->nonempty,
+                                               tiles_across, tiles_down,
+                                               &tmp_err);
+    _openslide_slide_leave(prev);
+    if (!success) {
+      _openslide_propagate_error(osr, tmp_err);
+      openslide_tile_iter_free(iter);
+      return NULL;
+    }
+  }
+  if (flags & OPENSLIDE_TILE_ITER_TISSUE) {
+    clear_background_tiles(osr, l, iter->nonempty, tiles_across, tiles_down);
+    if (openslide_get_error(osr)) {
+      openslide_tile_iter_free(iter);
+      return NULL;
+    }
+  }
+  return iter;
+}
 
-    g_free(buf);
+bool openslide_tile_iter_next(openslide_tile_iter_t *iter,
+                              int64_t *tile_col,
+                              int64_t *tile_row) {
+  while (iter->next < iter->count) {
+    int64_t i = iter->next++;
+    if (iter->nonempty[i]) {
+      *tile_col = i % iter->tiles_across;
+      *tile_row = i / iter->tiles_across;
+      return true;
+    }
+  }
+  return false;
+}
+
+void openslide_tile_iter_free(openslide_tile_iter_t *iter) {
+  if (iter == NULL) {
+    return;
   }
+  g_free(iter->nonempty);
+  g_slice_free(openslide_tile_iter_t, iter);
 }
 
 const char *openslide_get_version(void) {
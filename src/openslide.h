@@ -23,8 +23,9 @@
  * @file openslide.h
  * The API for the OpenSlide library.
  *
- * All functions except openslide_close() are thread-safe.
- * See the openslide_close() documentation for its restrictions.
+ * All functions except openslide_close(), openslide_set_cache(),
+ * openslide_set_compressed_cache(), and openslide_set_decode_threads()
+ * are thread-safe.  See their documentation for their restrictions.
  */
 
 #ifndef OPENSLIDE_OPENSLIDE_H_
@@ -32,6 +33,7 @@
 
 #include "openslide-features.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -43,6 +45,12 @@ extern "C" {
  */
 typedef struct _openslide openslide_t;
 
+/**
+ * An OpenSlide tile cache.
+ * @since 3.5.0
+ */
+typedef struct _openslide_cache openslide_cache_t;
+
 
 /**
  * @name Basic Usage
@@ -89,6 +97,82 @@ OPENSLIDE_PUBLIC()
 openslide_t *openslide_open(const char *filename);
 
 
+/**
+ * Build complete tile indexes before returning from
+ * openslide_open_with_flags().
+ *
+ * Some formats (currently Hamamatsu VMS, VMU, and some NDPI) index tile
+ * positions in the background after the slide is opened, so reads are
+ * slower until indexing finishes.  With this flag, indexing is done
+ * during open.
+ * This is useful for batch jobs that will read the whole slide.
+ * @since 3.5.0
+ */
+#define OPENSLIDE_OPEN_FULL_INDEX (1 << 0)
+
+/**
+ * Put off work in openslide_open_with_flags() that is only needed for
+ * reading pixels or for the openslide.quickhash-1 property.
+ *
+ * This is meant for programs that read properties and level geometry
+ * from many slides but few or no pixels.  The quickhash, which can
+ * require reading several megabytes of image data, is computed by
+ * reopening the slide the first time its value is requested; until then
+ * it is listed by openslide_get_property_names() without being computed,
+ * and its value is NULL if the slide turns out to be unhashable.
+ * Background tile indexing, where a format has it, starts with the first
+ * read.  OPENSLIDE_OPEN_FULL_INDEX takes precedence over this flag.
+ * @since 3.5.0
+ */
+#define OPENSLIDE_OPEN_LAZY (1 << 1)
+
+/**
+ * Lay out levels with uniformly overlapping tiles as grids of
+ * non-overlapping tiles.
+ *
+ * Some formats (currently Trestle and Ventana BIF) store tiles that
+ * overlap their neighbors, and by default each tile is composited at its
+ * offset.  With this flag, levels whose overlaps are uniform and
+ * whole-pixel have each tile cropped to its share of the level when it
+ * is decoded, are read as fast as levels of non-overlapping tiles, and
+ * report tile geometry.  Where tiles overlap, the pixels of a different
+ * tile may be shown.  Level dimensions are unchanged.
+ * @since 3.5.0
+ */
+#define OPENSLIDE_OPEN_TRIM_OVERLAPS (1 << 2)
+
+/**
+ * Share the parsed slide with other objects opened with this flag.
+ *
+ * For programs that open the same slide repeatedly.  The first open
+ * parses the slide as usual; later opens of the same path with the same
+ * flags, while the size, modification time and inode of each of the
+ * slide's files are unchanged, reuse its levels, tables and file
+ * handles, and attach to its tile cache, so they return almost
+ * immediately.  Each object still has its own error state, counters and
+ * settings, and unpins only the tiles it pinned.  The parsed slide is
+ * kept for a while after the last such object is closed; see
+ * openslide_set_shared_slide_limit().  Slides that fail to open are not
+ * shared.
+ * @since 3.5.0
+ */
+#define OPENSLIDE_OPEN_SHARED (1 << 3)
+
+/**
+ * Open a whole slide image, with options.
+ *
+ * Equivalent to openslide_open() when @p flags is 0.
+ *
+ * @param filename The filename to open.  On Windows, this must be in UTF-8.
+ * @param flags A bitwise OR of OPENSLIDE_OPEN_* flags.
+ * @return As for openslide_open().
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_t *openslide_open_with_flags(const char *filename,
+                                       uint32_t flags);
+
+
 /**
  * Get the number of levels in the whole slide image.
  *
@@ -179,9 +263,242 @@ void openslide_read_region(openslide_t *osr,
 			   int64_t w, int64_t h);
 
 
+/**
+ * Output pixel formats for openslide_read_region_format().
+ * @since 3.5.0
+ */
+typedef enum {
+  /** Pre-multiplied ARGB in native-endian 32-bit words, as written by
+      openslide_read_region(). */
+  OPENSLIDE_PIXEL_FORMAT_ARGB32,
+  /** Non-premultiplied R, G, B, A bytes. */
+  OPENSLIDE_PIXEL_FORMAT_RGBA,
+  /** Non-premultiplied B, G, R, A bytes. */
+  OPENSLIDE_PIXEL_FORMAT_BGRA,
+  /** R, G, B bytes, composited onto black. */
+  OPENSLIDE_PIXEL_FORMAT_RGB,
+} openslide_pixel_format_t;
+
+/**
+ * Copy data from a whole slide image in a chosen pixel format.
+ *
+ * Equivalent to openslide_read_region() followed by a conversion of
+ * each pixel, but without a second pass over a full-size ARGB buffer.
+ * Row @p i of the region starts at byte (@p i * @p stride) of @p dest.
+ * If an error occurs or has occurred, then the pixels of the region in
+ * @p dest will be cleared.
+ *
+ * @param osr The OpenSlide object.
+ * @param dest The destination buffer, at least (@p h * @p stride) bytes
+ *             in length.
+ * @param stride The distance between rows of @p dest, in bytes, or 0
+ *               for rows with no padding.  Must be at least the width
+ *               of a row.
+ * @param format The pixel format of @p dest.
+ * @param x The top left x-coordinate, in the level 0 reference frame.
+ * @param y The top left y-coordinate, in the level 0 reference frame.
+ * @param level The desired level.
+ * @param w The width of the region. Must be non-negative.
+ * @param h The height of the region. Must be non-negative.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_read_region_format(openslide_t *osr,
+                                  void *dest,
+                                  int64_t stride,
+                                  openslide_pixel_format_t format,
+                                  int64_t x, int64_t y,
+                                  int32_t level,
+                                  int64_t w, int64_t h);
+
+
+/**
+ * Copy pre-multiplied ARGB data from a whole slide image at any
+ * downsample.
+ *
+ * The region is read from the level returned by
+ * openslide_get_best_level_for_downsample() and reduced to the
+ * requested size with an area filter, so each output pixel is the
+ * average of the level pixels it covers.  If @p downsample is the
+ * downsample of a level, this is equivalent to openslide_read_region()
+ * on that level.  If an error occurs or has occurred, then the memory
+ * pointed to by @p dest will be cleared.
+ *
+ * @param osr The OpenSlide object.
+ * @param dest The destination buffer for the ARGB data, at least
+ *             (@p w * @p h * 4) bytes in length.
+ * @param x The top left x-coordinate, in the level 0 reference frame.
+ * @param y The top left y-coordinate, in the level 0 reference frame.
+ * @param downsample The downsampling factor of the output, relative to
+ *                   level 0.  Must be positive.
+ * @param w The width of the output. Must be non-negative.
+ * @param h The height of the output. Must be non-negative.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_read_region_scaled(openslide_t *osr,
+                                  uint32_t *dest,
+                                  int64_t x, int64_t y,
+                                  double downsample,
+                                  int64_t w, int64_t h);
+
+
+/**
+ * Outcomes of openslide_read_region_with_deadline().
+ * @since 3.5.0
+ */
+typedef enum {
+  /** The region was read. */
+  OPENSLIDE_READ_OK,
+  /** The read was abandoned at its deadline or by its cancellation
+      flag.  The OpenSlide object is unaffected. */
+  OPENSLIDE_READ_CANCELLED,
+  /** An error occurred or has occurred; see openslide_get_error(). */
+  OPENSLIDE_READ_ERROR,
+} openslide_read_status_t;
+
+/**
+ * Copy pre-multiplied ARGB data from a whole slide image, giving up
+ * after a time limit or on request.
+ *
+ * Equivalent to openslide_read_region(), except that the read stops
+ * early once @p timeout_usec microseconds have passed or once
+ * @p *cancel becomes nonzero.  The deadline and the flag are checked
+ * before the read starts, between tiles, and periodically while
+ * decoding a large image, so a read may overrun its deadline by the
+ * time needed to decode one tile.  A read that is already cancelled or
+ * has a zero timeout returns #OPENSLIDE_READ_CANCELLED without reading
+ * anything, except that a zero-sized region always succeeds.  A read
+ * that stops early clears @p dest and returns
+ * #OPENSLIDE_READ_CANCELLED without setting an error, so the OpenSlide
+ * object can be used again, for example to read a fallback region at a
+ * lower resolution.  Tiles decoded before the read stopped remain in
+ * the cache.
+ *
+ * @param osr The OpenSlide object.
+ * @param dest The destination buffer for the ARGB data, as for
+ *             openslide_read_region().
+ * @param x The top left x-coordinate, in the level 0 reference frame.
+ * @param y The top left y-coordinate, in the level 0 reference frame.
+ * @param level The desired level.
+ * @param w The width of the region. Must be non-negative.
+ * @param h The height of the region. Must be non-negative.
+ * @param timeout_usec The time allowed for the read, in microseconds,
+ *                     or -1 for no limit.
+ * @param cancel A flag that another thread may set to nonzero to
+ *               cancel the read, or NULL.
+ * @return The outcome of the read.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_read_status_t openslide_read_region_with_deadline(openslide_t *osr,
+                                                            uint32_t *dest,
+                                                            int64_t x,
+                                                            int64_t y,
+                                                            int32_t level,
+                                                            int64_t w,
+                                                            int64_t h,
+                                                            int64_t timeout_usec,
+                                                            volatile int32_t *cancel);
+
+
+/**
+ * Get the number of focal planes in a whole slide image.
+ *
+ * Slides scanned at several focal depths (a Z-stack) have more than
+ * one plane; all other slides have one.  openslide_read_region() and
+ * the other read functions return the format's default plane, and
+ * openslide_read_region_planes() returns all of them.
+ *
+ * @param osr The OpenSlide object.
+ * @return The number of focal planes, or -1 if an error occurred.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+int32_t openslide_get_focal_plane_count(openslide_t *osr);
+
+
+/**
+ * Copy pre-multiplied ARGB data from every focal plane of a whole slide
+ * image.
+ *
+ * Equivalent to reading the region from each plane in turn, but the
+ * tile lookups and file handles are shared between the planes, and
+ * formats that store a tile's planes together fetch them at once.  If
+ * an error occurs or has occurred, then the memory pointed to by every
+ * buffer in @p dest will be cleared.
+ *
+ * @param osr The OpenSlide object.
+ * @param dest An array of openslide_get_focal_plane_count() destination
+ *             buffers, in plane order, each at least (@p w * @p h * 4)
+ *             bytes in length.  A NULL buffer discards its plane, as
+ *             a NULL @p dest does in openslide_read_region().
+ * @param x The top left x-coordinate, in the level 0 reference frame.
+ * @param y The top left y-coordinate, in the level 0 reference frame.
+ * @param level The desired level.
+ * @param w The width of the region. Must be non-negative.
+ * @param h The height of the region. Must be non-negative.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_read_region_planes(openslide_t *osr,
+                                  uint32_t **dest,
+                                  int64_t x, int64_t y,
+                                  int32_t level,
+                                  int64_t w, int64_t h);
+
+
+/**
+ * A region to read with openslide_read_regions().
+ * @since 3.5.0
+ */
+typedef struct {
+  /** The destination buffer, at least (@p w * @p h * 4) bytes long. */
+  uint32_t *dest;
+  /** The top left x-coordinate, in the level 0 reference frame. */
+  int64_t x;
+  /** The top left y-coordinate, in the level 0 reference frame. */
+  int64_t y;
+  /** The desired level. */
+  int32_t level;
+  /** The width of the region.  Must be non-negative. */
+  int64_t w;
+  /** The height of the region.  Must be non-negative. */
+  int64_t h;
+  /** Set on return: whether this region was read successfully. */
+  bool success;
+} openslide_region_t;
+
+
+/**
+ * Copy pre-multiplied ARGB data for many regions of a whole slide image.
+ *
+ * Equivalent to calling openslide_read_region() for each region, but
+ * cheaper for large numbers of small regions.  Regions are read in tile
+ * order so that tiles shared between them are decoded once, and if
+ * decode threads have been enabled with openslide_set_decode_threads(),
+ * the regions are read in parallel.
+ *
+ * If any region fails, the object moves into an error state as with
+ * openslide_read_region(), but the other regions are still read.  Each
+ * region's destination buffer is valid exactly when its @p success flag
+ * is set; the buffers of failed regions are cleared.
+ *
+ * @param osr The OpenSlide object.
+ * @param regions The regions to read.
+ * @param count The number of regions.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_read_regions(openslide_t *osr,
+                            openslide_region_t *regions,
+                            int32_t count);
+
+
 /**
  * Close an OpenSlide object.
- * No other threads may be using the object.
+ * No other threads may be using the object.  Outstanding asynchronous
+ * requests are completed first; cancel them to avoid the wait.
  * After this call returns, the object cannot be used anymore.
  *
  * @param osr The OpenSlide object.
@@ -190,6 +507,636 @@ OPENSLIDE_PUBLIC()
 void openslide_close(openslide_t *osr);
 //@}
 
+/**
+ * @name Asynchronous Reads
+ * Reading regions without blocking the caller.
+ */
+//@{
+
+/**
+ * An asynchronous read request.
+ * @since 3.5.0
+ */
+typedef struct _openslide_request openslide_request_t;
+
+/**
+ * A function called when an asynchronous read request completes.
+ *
+ * It is called from an OpenSlide worker thread, just before the request
+ * is marked complete.  It may call openslide_request_release(), but
+ * must not wait for @p req or call openslide_close().
+ *
+ * @param req The request.
+ * @param success True if the region was read, false if the request was
+ *                cancelled or an error occurred.
+ * @param data The data pointer passed to openslide_read_region_async().
+ * @since 3.5.0
+ */
+typedef void (*openslide_request_callback_fn)(openslide_request_t *req,
+                                              bool success,
+                                              void *data);
+
+/**
+ * Start reading a region in the background.
+ *
+ * The read has the same effect as openslide_read_region() with the same
+ * arguments, and runs on a small per-object pool of worker threads.
+ * Queued tiles are added to the tile cache, so a request with a NULL
+ * @p dest can warm the cache for a region that will be read soon.
+ *
+ * @p dest must remain valid until the request completes.  The returned
+ * request must be freed with openslide_request_release().
+ *
+ * @param osr The OpenSlide object.
+ * @param dest The destination buffer for the ARGB data, or NULL.
+ * @param x The top left x-coordinate, in the level 0 reference frame.
+ * @param y The top left y-coordinate, in the level 0 reference frame.
+ * @param level The desired level.
+ * @param w The width of the region. Must be non-negative.
+ * @param h The height of the region. Must be non-negative.
+ * @param callback A function to call on completion, or NULL.
+ * @param data An argument for @p callback.
+ * @return A new request.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_request_t *openslide_read_region_async(openslide_t *osr,
+                                                 uint32_t *dest,
+                                                 int64_t x, int64_t y,
+                                                 int32_t level,
+                                                 int64_t w, int64_t h,
+                                                 openslide_request_callback_fn callback,
+                                                 void *data);
+
+/**
+ * Cancel an asynchronous read request.
+ *
+ * A request that has not started will complete without reading, and
+ * its destination buffer is left untouched.  A read that is already
+ * running stops early and clears its destination buffer.  Either way
+ * the request fails without recording an error in the OpenSlide object,
+ * and the completion callback is called.
+ *
+ * @param req The request.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_request_cancel(openslide_request_t *req);
+
+/**
+ * Start decoding the tiles of a region into the tile cache.
+ *
+ * The request decodes every tile that openslide_read_region() would
+ * read for the region, without compositing them.  If @p pin is true,
+ * the tiles are pinned: they are never evicted until they are
+ * unpinned with openslide_unpin_tiles(), so a viewer's overview levels
+ * stay cached through heavy panning.  Tiles beyond the pinned share of
+ * the cache capacity are cached without pinning, and a region larger
+ * than the cache evicts its own earlier tiles.
+ *
+ * A running prewarm request stops early if it is cancelled.  The
+ * request completes successfully if every tile was decoded.  It fails
+ * without recording an error if @p level is out of range.  An error is
+ * recorded in @p osr as for openslide_read_region().
+ *
+ * @param osr The OpenSlide object.
+ * @param x The top left x-coordinate, in the level 0 reference frame.
+ * @param y The top left y-coordinate, in the level 0 reference frame.
+ * @param level The desired level.
+ * @param w The width of the region. Must be non-negative.
+ * @param h The height of the region. Must be non-negative.
+ * @param pin Whether to pin the tiles in the cache.
+ * @param callback A function to call on completion, or NULL.
+ * @param data An argument for @p callback.
+ * @return A new request, to be freed with openslide_request_release().
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_request_t *openslide_prewarm_region_async(openslide_t *osr,
+                                                    int64_t x, int64_t y,
+                                                    int32_t level,
+                                                    int64_t w, int64_t h,
+                                                    bool pin,
+                                                    openslide_request_callback_fn callback,
+                                                    void *data);
+
+/**
+ * Start decoding a whole level into the tile cache.
+ *
+ * Equivalent to openslide_prewarm_region_async() for the level's full
+ * extent.
+ *
+ * @param osr The OpenSlide object.
+ * @param level The desired level.
+ * @param pin Whether to pin the tiles in the cache.
+ * @param callback A function to call on completion, or NULL.
+ * @param data An argument for @p callback.
+ * @return A new request, to be freed with openslide_request_release().
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_request_t *openslide_prewarm_level_async(openslide_t *osr,
+                                                   int32_t level,
+                                                   bool pin,
+                                                   openslide_request_callback_fn callback,
+                                                   void *data);
+
+/**
+ * Check whether an asynchronous read request has completed.
+ *
+ * @param req The request.
+ * @return True if the request has completed.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+bool openslide_request_is_done(openslide_request_t *req);
+
+/**
+ * Wait for an asynchronous read request to complete.
+ *
+ * @param req The request.
+ * @return True if the region was read, false if it was cancelled or an
+ *         error occurred.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+bool openslide_request_wait(openslide_request_t *req);
+
+/**
+ * Release an asynchronous read request.
+ *
+ * This does not cancel the request.  If it has not completed, it will
+ * still run and its callback will still be called.
+ *
+ * @param req The request.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_request_release(openslide_request_t *req);
+//@}
+
+/**
+ * @name Resource Limits
+ * Controlling process-wide resource usage.
+ */
+//@{
+
+/**
+ * Set the maximum number of files OpenSlide will keep open between reads.
+ *
+ * To avoid reopening slide files on every read, OpenSlide keeps file
+ * descriptors open for the lifetime of its internal file handles.  This
+ * limit applies across all OpenSlide objects in the process.  Once it is
+ * reached, further handles open and close the file on every access, which
+ * is slower but consumes no additional descriptors.  Lowering the limit
+ * does not close descriptors that are already open.
+ *
+ * The default limit is 256.
+ *
+ * @param limit The maximum number of persistent file descriptors.  0
+ *              disables persistent descriptors.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_persistent_file_limit(int32_t limit);
+
+/**
+ * Set the number of unused shared slides OpenSlide will keep parsed.
+ *
+ * A slide opened with ::OPENSLIDE_OPEN_SHARED stays parsed after its
+ * last OpenSlide object is closed, so the next open is fast.  Beyond
+ * this many such slides, the least recently used are freed.  Lowering
+ * the limit frees the excess immediately.
+ *
+ * The default limit is 16.
+ *
+ * @param limit The maximum number of unused shared slides.  0 frees
+ *              shared slides as soon as they are unused.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_shared_slide_limit(int32_t limit);
+//@}
+
+/**
+ * @name Custom I/O
+ * Reading slide files from somewhere other than the local filesystem.
+ */
+//@{
+
+/**
+ * One byte range of a vectored read.
+ */
+typedef struct _openslide_io_range {
+  /** The offset of the range in the file. */
+  int64_t offset;
+  /** The length of the range, in bytes. */
+  int64_t length;
+  /** The buffer that receives the range, of at least @p length bytes. */
+  void *buf;
+} openslide_io_range_t;
+
+/**
+ * Callbacks for reading slide files.
+ *
+ * Every callback except @p preadv is required.  Each receives the
+ * @p data pointer passed to openslide_set_io().  Callbacks can be
+ * invoked from any thread, and concurrently for different handles or
+ * for the same handle.
+ */
+typedef struct _openslide_io {
+  /**
+   * Open a file for reading.  @p path is the path passed to
+   * openslide_open(), or one derived from it for formats spanning
+   * several files.  Return an opaque handle, or NULL with errno set if
+   * the file cannot be opened.
+   */
+  void *(*open)(const char *path, void *data);
+  /** Return the size of the file in bytes, or -1 with errno set. */
+  int64_t (*size)(void *handle, void *data);
+  /**
+   * Read up to @p size bytes at @p offset.  Return the number of bytes
+   * read, 0 at end of file, or -1 with errno set.
+   */
+  int64_t (*pread)(void *handle, void *buf, int64_t size, int64_t offset,
+                   void *data);
+  /**
+   * Read several ranges, sorted by offset, at once.  Return true if
+   * every range was read in full.  Optional; OpenSlide calls @p pread
+   * for each range if this is NULL.
+   */
+  bool (*preadv)(void *handle, const openslide_io_range_t *ranges,
+                 int32_t count, void *data);
+  /** Close a handle returned by @p open. */
+  void (*close)(void *handle, void *data);
+} openslide_io_t;
+
+/**
+ * Read slide files through application callbacks.
+ *
+ * Once set, files opened by OpenSlide are read with @p io instead of
+ * the local filesystem, so slides can be served from object storage
+ * with range requests.  Files that are already open keep the callbacks
+ * they were opened with.  Neighbouring ranges read ahead of the
+ * application are coalesced, and passed together to @p preadv if it is
+ * provided.
+ *
+ * Sakura slides are read directly by SQLite and are not supported
+ * through custom I/O.  Memory-mapped reads and the index cache are
+ * disabled while custom I/O is set.
+ *
+ * @param io The callbacks to use, which are copied, or NULL to use the
+ *           local filesystem again.
+ * @param data An argument passed to each callback.
+ * @return True on success, or false if this platform cannot support
+ *         custom I/O.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+bool openslide_set_io(const openslide_io_t *io, void *data);
+//@}
+
+/**
+ * @name Caching
+ * Sharing a tile cache between OpenSlide objects.
+ *
+ * By default, each OpenSlide object has a private cache of decoded tiles
+ * with a fixed size.  A program that opens many slides can instead
+ * create one cache with a global size limit and attach every slide to
+ * it, so that frequently-read slides can use space not needed by others.
+ *
+ * Each object also has a second cache holding the compressed tile data
+ * read from the slide files, so that a tile evicted from the decoded
+ * cache can be decoded again without disk I/O.  Since compressed tiles
+ * are many times smaller, this cache holds many more of them.
+ */
+//@{
+
+/**
+ * Create a new tile cache.
+ *
+ * The cache may be attached to any number of OpenSlide objects with
+ * openslide_set_cache().  It is safe to use from multiple threads.
+ *
+ * @param capacity The capacity of the cache, in bytes.
+ * @return A new cache.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_cache_t *openslide_cache_create(size_t capacity);
+
+/**
+ * Create a tile cache whose contents are shared between processes.
+ *
+ * Decoded tiles are kept in the named POSIX shared memory segment
+ * @p name, which is created if it does not exist.  Every process that
+ * creates a shared cache with the same name, capacity, and entry size,
+ * such as the workers of a prefork server, sees the tiles decoded by the
+ * others, so each tile is decoded and stored once per host.  Processes
+ * forked after the cache is created share it as well.  Tiles are found
+ * by the slide's quickhash1, or by its path, size, and modification
+ * time if it was opened with ::OPENSLIDE_OPEN_LAZY.
+ *
+ * Each process also keeps a small private cache of recently used
+ * tiles.  Tiles larger than @p entry_size, and tiles of some formats
+ * that are not stored by level, are only cached privately.  The segment
+ * persists after every process has released the cache, until it is
+ * removed with shm_unlink().
+ *
+ * @param name The name of the shared memory segment, beginning with "/".
+ * @param capacity The size of the segment, in bytes.
+ * @param entry_size The largest tile the segment will hold, in bytes.
+ *                   Each entry occupies this much of the capacity, so it
+ *                   should match the tile size of the slides being read:
+ *                   4 bytes per pixel.
+ * @return A new cache, or NULL if the segment could not be created or
+ *         attached, or has a different capacity or entry size.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_cache_t *openslide_cache_create_shared(const char *name,
+                                                 size_t capacity,
+                                                 size_t entry_size);
+
+/**
+ * Keep a copy of a cache's tiles in a local directory.
+ *
+ * Decoded tiles added to the cache are also written to files in
+ * @p dirname, in the background, and tiles missing from the cache are
+ * looked for there before they are read from the slide.  The files
+ * outlive the process, so a new process using the same directory starts
+ * with a warm cache.  Tiles are found by the slide's quickhash1, or by
+ * its path, size, and modification time if it was opened with
+ * ::OPENSLIDE_OPEN_LAZY, and are stored only for slides the cache could
+ * share between processes.  The least recently used files are deleted
+ * to keep the directory within @p capacity.  The directory may be
+ * shared, but each process only counts the files it knows about, so its
+ * size may exceed @p capacity.  Use a fast local disk; a directory on
+ * the same network storage as the slides gains little.
+ *
+ * Must be called before the cache is attached to any OpenSlide object,
+ * and at most once per cache.  Calling it after the cache has been
+ * attached fails, or has undefined results if the application has
+ * already released its reference.
+ *
+ * @param cache The cache.
+ * @param dirname The directory, which is created if necessary.
+ * @param capacity The most bytes of tiles to keep in the directory.
+ * @return True on success, false if the directory could not be created
+ *         or read, or the cache is already attached.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+bool openslide_cache_add_disk_tier(openslide_cache_t *cache,
+                                   const char *dirname,
+                                   size_t capacity);
+
+/**
+ * Attach a cache to an OpenSlide object.
+ *
+ * The object's previous cache is released.  The object takes its own
+ * reference to @p cache, so the caller may release the cache at any time
+ * after this call.  No other threads may be using @p osr during this
+ * call.
+ *
+ * @param osr The OpenSlide object.
+ * @param cache The cache to attach.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_cache(openslide_t *osr, openslide_cache_t *cache);
+
+/**
+ * Attach a compressed-data cache to an OpenSlide object.
+ *
+ * Like openslide_set_cache(), but for the cache of compressed tile data
+ * that backs the decoded-tile cache.  A cache may not usefully serve as
+ * both kinds at once, since the two compete for the same capacity.  No
+ * other threads may be using @p osr during this call.
+ *
+ * @param osr The OpenSlide object.
+ * @param cache The cache to attach.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_compressed_cache(openslide_t *osr,
+                                    openslide_cache_t *cache);
+
+/**
+ * Enable or disable readahead for sequential reads.
+ *
+ * With readahead enabled, OpenSlide watches for reads that walk through
+ * a level's tiles in the order they are stored, as a full-slide scan
+ * does, and fetches the compressed data of the tiles that follow in the
+ * background, merging neighbouring tiles into a few large reads.  This
+ * helps most when the slide is on network storage.  The data is kept in
+ * the compressed-data cache, which must be large enough to hold it until
+ * it is used.  Readahead is disabled by default.  It currently applies
+ * to TIFF-based and MIRAX slides, and does nothing for TIFF-based slides
+ * read through a memory mapping.
+ *
+ * No other threads may be using @p osr during this call.
+ *
+ * @param osr The OpenSlide object.
+ * @param enabled Whether to read ahead.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_readahead(openslide_t *osr, bool enabled);
+
+/**
+ * Cache replacement policies, for openslide_cache_set_policy().
+ * @since 3.5.0
+ */
+typedef enum {
+  /** Evict the least recently used tiles, approximately.  The default. */
+  OPENSLIDE_CACHE_POLICY_LRU,
+  /** Segmented LRU.  Tiles are added to a probationary segment and move
+      to a protected segment, holding up to 80% of the capacity, if they
+      are read again before being evicted.  Tiles are evicted from the
+      probationary segment first, so a single pass over many tiles
+      cannot flush tiles that are read repeatedly. */
+  OPENSLIDE_CACHE_POLICY_SEGMENTED,
+} openslide_cache_policy_t;
+
+/**
+ * Set the replacement policy of a cache.
+ *
+ * Capacity is accounted the same way under every policy.  The policy
+ * may be changed at any time, and applies to later evictions.
+ *
+ * @param cache The cache.
+ * @param policy The replacement policy.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cache_set_policy(openslide_cache_t *cache,
+                                openslide_cache_policy_t policy);
+
+/**
+ * Cache priorities of an OpenSlide object's reads, for
+ * openslide_set_cache_priority().
+ * @since 3.5.0
+ */
+typedef enum {
+  /** Reads count as use of the tiles they hit.  The default. */
+  OPENSLIDE_CACHE_PRIORITY_NORMAL,
+  /** Reads don't count as use of the tiles they hit, so those tiles
+      age out as if they had not been read again.  Intended for
+      sequential scans. */
+  OPENSLIDE_CACHE_PRIORITY_LOW,
+} openslide_cache_priority_t;
+
+/**
+ * Set the cache priority of reads through an OpenSlide object.
+ *
+ * A batch job scanning a slide whose cache it shares with an
+ * interactive viewer should open its own OpenSlide object, attach the
+ * shared cache, and set low priority.  Combined with
+ * ::OPENSLIDE_CACHE_POLICY_SEGMENTED, the scan then cycles through the
+ * probationary segment without evicting the viewer's working set.  The
+ * priority applies to both the decoded and the compressed-data caches.
+ * No other threads may be using @p osr during this call.
+ *
+ * @param osr The OpenSlide object.
+ * @param priority The priority.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_cache_priority(openslide_t *osr,
+                                  openslide_cache_priority_t priority);
+
+/**
+ * Unpin the tiles pinned by an OpenSlide object's prewarm requests.
+ *
+ * The tiles stay in the cache, and are evicted as though they had just
+ * been added.  Tiles are also unpinned when the object is closed or
+ * attached to a different cache.
+ *
+ * @param osr The OpenSlide object.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_unpin_tiles(openslide_t *osr);
+
+/**
+ * Get the number of bytes of pinned tiles in a cache.
+ *
+ * Pinned tiles count toward the capacity of the cache, and may occupy
+ * up to half of it.
+ *
+ * @param cache The cache.
+ * @return The size of the pinned tiles, in bytes.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+int64_t openslide_cache_get_pinned_size(openslide_cache_t *cache);
+
+/**
+ * Release the caller's reference to a cache.
+ *
+ * The cache is freed once it has also been released by every OpenSlide
+ * object it is attached to.
+ *
+ * @param cache The cache.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cache_release(openslide_cache_t *cache);
+//@}
+
+/**
+ * @name Threading
+ * Using multiple cores for a single read.
+ */
+//@{
+
+/**
+ * Set the number of threads used to decode tiles for one read.
+ *
+ * By default, openslide_read_region() decodes the tiles of a region one
+ * at a time in the calling thread.  With more than one decode thread,
+ * the tiles of a region are decoded concurrently into the tile cache
+ * and then painted as usual, so the output is unchanged.  This helps
+ * most with large reads that miss the cache; make sure the cache is
+ * large enough to hold the tiles of one region.  Only levels that report
+ * tile geometry in the openslide.level[].tile-width and
+ * openslide.level[].tile-height properties are decoded concurrently.
+ * Regions larger than 4096 pixels on a side are painted in pieces, and
+ * with more than one decode thread the pieces are painted concurrently
+ * on any level.
+ *
+ * No other threads may be using @p osr during this call.
+ *
+ * @param osr The OpenSlide object.
+ * @param threads The number of decode threads.  0 or 1 disables
+ *                concurrent decoding.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_decode_threads(openslide_t *osr, int32_t threads);
+//@}
+
+/**
+ * @name Memory Use
+ * Measuring and trimming the memory held by an open slide.
+ */
+//@{
+
+/**
+ * The memory held by an OpenSlide object, as returned by
+ * openslide_get_memory_usage().
+ *
+ * @since 3.5.0
+ */
+typedef struct {
+  /** Bytes of the object's decoded tiles in its tile cache. */
+  int64_t cache_bytes;
+  /** Bytes of the object's tile data in its compressed-data cache. */
+  int64_t compressed_cache_bytes;
+  /** Bytes of tile grids and tile tables built when the slide was opened. */
+  int64_t metadata_bytes;
+  /** Idle file handles kept open for later reads. */
+  int32_t idle_handles;
+} openslide_memory_usage_t;
+
+/**
+ * Get the memory held by an OpenSlide object.
+ *
+ * The cache sizes count only this object's tiles, even if the cache is
+ * shared with other objects, and not the tiles held in a cache shared
+ * between processes.  Objects opened with #OPENSLIDE_OPEN_SHARED share
+ * their tiles, metadata and file handles, so each reports the whole
+ * shared slide.  Metadata sizes are estimates.  The call scans the
+ * caches, so it should not be made for every read.
+ *
+ * @param osr The OpenSlide object.
+ * @param[out] usage The memory use.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_get_memory_usage(openslide_t *osr,
+                                openslide_memory_usage_t *usage);
+
+/**
+ * Release the memory an OpenSlide object holds only to speed up reads.
+ *
+ * Drops the object's tiles from its caches, including pinned tiles, and
+ * closes its idle file handles.  Later reads reopen files and decode
+ * tiles again as needed, so this is most useful for objects that are
+ * kept open but have not been read from recently.  Reads in progress
+ * in other threads are not affected.  For objects opened with
+ * #OPENSLIDE_OPEN_SHARED, the tiles and handles are those of the shared
+ * slide, so they are released for every object sharing it, except for
+ * tiles that other objects have pinned.
+ *
+ * @param osr The OpenSlide object.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_release_memory(openslide_t *osr);
+//@}
+
 /**
  * @name Error Handling
  * A simple mechanism for detecting errors.
@@ -424,6 +1371,437 @@ void openslide_read_associated_image(openslide_t *osr,
 				     uint32_t *dest);
 //@}
 
+/**
+ * @name Raw Tiles
+ * Reading tiles as stored, without decoding them.
+ */
+//@{
+
+/**
+ * A compressed tile, as returned by openslide_read_raw_tile().
+ *
+ * @since 3.5.0
+ */
+typedef struct {
+  /** The encoded tile, a complete file in the format named by @p codec. */
+  const void *data;
+  /** The length of @p data in bytes. */
+  int64_t size;
+  /** The encoding of @p data.  Currently always "jpeg". */
+  const char *codec;
+  /** The level x coordinate of the tile's top-left pixel. */
+  int64_t x;
+  /** The level y coordinate of the tile's top-left pixel. */
+  int64_t y;
+  /** The width of the encoded image. */
+  int64_t w;
+  /** The height of the encoded image. */
+  int64_t h;
+  /** The width of the part of the image that lies within the level. */
+  int64_t visible_w;
+  /** The height of the part of the image that lies within the level. */
+  int64_t visible_h;
+} openslide_raw_tile_t;
+
+/**
+ * Read a tile's compressed data as stored in the slide.
+ *
+ * Tiles are numbered by the grid given by the
+ * openslide.level[N].tile-width and openslide.level[N].tile-height
+ * properties.  JPEG tables shared by the tiles of a level are merged
+ * into the returned data, so it can be served or decoded as is.  The
+ * visible part of the tile is exactly what openslide_read_region()
+ * returns for that area.
+ *
+ * Only some formats and levels store tiles that can be returned this
+ * way.  Callers must fall back to openslide_read_region() when this
+ * function returns NULL without setting an error.  This happens for
+ * missing tiles, tiles outside the level and unsupported levels.
+ *
+ * @param osr The OpenSlide object.
+ * @param level The desired level.
+ * @param tile_col The tile column.
+ * @param tile_row The tile row.
+ * @return The tile, to be freed with openslide_raw_tile_free(), or NULL.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_raw_tile_t *openslide_read_raw_tile(openslide_t *osr,
+                                              int32_t level,
+                                              int64_t tile_col,
+                                              int64_t tile_row);
+
+/**
+ * Free a tile returned by openslide_read_raw_tile().
+ *
+ * @param tile The tile, or NULL.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_raw_tile_free(openslide_raw_tile_t *tile);
+//@}
+
+/**
+ * @name Decoded Tiles
+ * Reading whole tiles by their position in the tile grid.
+ */
+//@{
+
+/**
+ * A decoded tile, as returned by openslide_acquire_tile().
+ *
+ * @since 3.5.0
+ */
+typedef struct {
+  /** The pixels, @p w * @p h premultiplied ARGB. */
+  const uint32_t *data;
+  /** The level x coordinate of the tile's top-left pixel. */
+  int64_t x;
+  /** The level y coordinate of the tile's top-left pixel. */
+  int64_t y;
+  /** The width of the tile. */
+  int64_t w;
+  /** The height of the tile. */
+  int64_t h;
+  /** The width of the part of the tile that lies within the level. */
+  int64_t visible_w;
+  /** The height of the part of the tile that lies within the level. */
+  int64_t visible_h;
+} openslide_tile_t;
+
+/**
+ * Get a decoded tile, sharing its pixels with the tile cache.
+ *
+ * Tiles are numbered by the grid given by the
+ * openslide.level[N].tile-width and openslide.level[N].tile-height
+ * properties.  The pixels are those openslide_read_region() would
+ * return for the tile's area, with the part outside the level
+ * transparent.  Where the slide format allows, they are read straight
+ * from the tile cache without any compositing, and stay valid until
+ * the tile is released even if the cache evicts them.
+ *
+ * Returns NULL without setting an error if the level has no tile grid
+ * or the tile lies outside the level.
+ *
+ * @param osr The OpenSlide object.
+ * @param level The desired level.
+ * @param tile_col The tile column.
+ * @param tile_row The tile row.
+ * @return The tile, to be released with openslide_tile_release(), or NULL.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_tile_t *openslide_acquire_tile(openslide_t *osr,
+                                         int32_t level,
+                                         int64_t tile_col,
+                                         int64_t tile_row);
+
+/**
+ * Release a tile returned by openslide_acquire_tile().
+ *
+ * @param tile The tile, or NULL.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_tile_release(openslide_tile_t *tile);
+
+/**
+ * Copy a decoded tile into a caller buffer.
+ *
+ * Equivalent to openslide_acquire_tile() followed by a copy of the
+ * pixels.  If the tile can't be read, @p dest is cleared.  A level
+ * without a tile grid has no tiles, so the call always fails, and
+ * @p dest may be NULL since there is nothing to clear.
+ *
+ * @param osr The OpenSlide object.
+ * @param dest The destination buffer for the ARGB data.  Must be
+ *             openslide.level[N].tile-width *
+ *             openslide.level[N].tile-height * 4 bytes.
+ * @param level The desired level.
+ * @param tile_col The tile column.
+ * @param tile_row The tile row.
+ * @return Whether the tile was read.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+bool openslide_read_tile(openslide_t *osr,
+                         uint32_t *dest,
+                         int32_t level,
+                         int64_t tile_col,
+                         int64_t tile_row);
+
+/**
+ * An iterator over the non-empty tiles of a level.
+ * @since 3.5.0
+ */
+typedef struct _openslide_tile_iter openslide_tile_iter_t;
+
+/**
+ * Skip tiles that the thumbnail shows to be background.
+ *
+ * The smallest level is read at a size of at most a few thousand
+ * pixels on a side, and tiles are skipped unless they lie near a
+ * thumbnail pixel that is neither transparent nor close to white.
+ * Very faint tissue, and structures smaller than a thumbnail pixel,
+ * may be skipped along with the background.
+ * @since 3.5.0
+ */
+#define OPENSLIDE_TILE_ITER_TISSUE (1 << 0)
+
+/**
+ * Start iterating over the non-empty tiles of a level.
+ *
+ * Tiles are numbered as for openslide_acquire_tile().  The iterator
+ * skips tiles that the slide format records as empty, such as missing
+ * tiles and tiles outside the scanned areas, without reading their
+ * pixels.  Which tiles are recorded this way depends on the format; in
+ * the worst case, every tile of the level is returned.
+ *
+ * Returns NULL without setting an error if the level has no tile grid.
+ *
+ * @param osr The OpenSlide object.
+ * @param level The desired level.
+ * @param flags A bitwise OR of OPENSLIDE_TILE_ITER_* flags.
+ * @return The iterator, to be freed with openslide_tile_iter_free(), or
+ *         NULL.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_tile_iter_t *openslide_tile_iter_create(openslide_t *osr,
+                                                  int32_t level,
+                                                  uint32_t flags);
+
+/**
+ * Get the next non-empty tile, in row-major order.
+ *
+ * @param iter The iterator.
+ * @param[out] tile_col The tile column.
+ * @param[out] tile_row The tile row.
+ * @return False if there are no more tiles.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+bool openslide_tile_iter_next(openslide_tile_iter_t *iter,
+                              int64_t *tile_col,
+                              int64_t *tile_row);
+
+/**
+ * Free an iterator returned by openslide_tile_iter_create().
+ *
+ * @param iter The iterator, or NULL.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_tile_iter_free(openslide_tile_iter_t *iter);
+//@}
+
+/**
+ * @name Tile Decoders
+ * Decoding compressed tiles with an application-supplied decoder, such
+ * as one using a GPU or a hardware codec.
+ */
+//@{
+
+/**
+ * A compression format that can be decoded by the application.
+ *
+ * @since 3.5.0
+ */
+typedef enum {
+  /** Baseline JPEG, as a complete JFIF stream. */
+  OPENSLIDE_CODEC_JPEG = 0,
+  /** A JPEG 2000 codestream with RGB components. */
+  OPENSLIDE_CODEC_JPEG2000 = 1,
+} openslide_codec_t;
+
+/**
+ * One tile to be decoded.
+ *
+ * @since 3.5.0
+ */
+typedef struct _openslide_decode_job {
+  /** The compressed tile, a complete stream. */
+  const void *data;
+  /** The length of the compressed tile, in bytes. */
+  int64_t length;
+  /** The buffer for the decoded tile, @p w * @p h premultiplied ARGB. */
+  uint32_t *dest;
+  /** The width of the tile. */
+  int32_t w;
+  /** The height of the tile. */
+  int32_t h;
+  /** Set by the decoder if it decoded the tile into @p dest. */
+  bool success;
+} openslide_decode_job_t;
+
+/**
+ * A decoder for a batch of tiles.
+ *
+ * @param codec The format of every tile in the batch.
+ * @param jobs The tiles to decode.  @p success is false on entry.
+ * @param count The number of tiles.
+ * @param data The argument passed to openslide_set_decoder().
+ * @since 3.5.0
+ */
+typedef void (*openslide_decode_fn)(openslide_codec_t codec,
+                                     openslide_decode_job_t *jobs,
+                                     int32_t count,
+                                     void *data);
+
+/**
+ * Decode tiles of one format with an application decoder.
+ *
+ * Tiles in @p codec format are passed to @p decode before OpenSlide's
+ * own decoder; OpenSlide decodes any tile whose @p success is left
+ * false.  When a region read needs several tiles that aren't cached,
+ * some slide formats submit them to @p decode together, so a decoder
+ * with a high fixed cost per call, such as a GPU, can decode them in
+ * one pass.  The decoder may be called from any thread, and
+ * concurrently.
+ *
+ * Only tiles that OpenSlide would decode at full resolution are
+ * passed to the decoder.  The decoded pixels must be written to host
+ * memory.
+ *
+ * @param codec The format to decode.
+ * @param decode The decoder, or NULL to use OpenSlide's own decoder.
+ * @param data An argument passed to @p decode, which must remain valid
+ *             until the decoder is replaced and reads using it have
+ *             finished.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_decoder(openslide_codec_t codec,
+                           openslide_decode_fn decode,
+                           void *data);
+//@}
+
+/**
+ * @name Performance Counters
+ * Inspecting where the time goes.
+ */
+//@{
+
+/**
+ * Get the names of the performance counters.
+ *
+ * Counter names are dotted strings such as "cache.hits",
+ * "compressed-cache.misses", "tiff.tiles-libtiff", "io.bytes-read", or
+ * "decode.jpeg.usec".  The set of counters may change between releases.
+ *
+ * @return A NULL-terminated string array of counter names.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+const char * const *openslide_get_counter_names(void);
+
+/**
+ * Get the value of a performance counter.
+ *
+ * Counters start at zero and only increase.  A slide's counters include
+ * work done for it by internal threads, such as decode and readahead
+ * workers.  The global counters include the work of every slide, open
+ * or closed.  Counters are updated without locking, so values read
+ * while other threads are using the library may be slightly stale.
+ *
+ * @param osr The OpenSlide object, or NULL for the global counters.
+ * @param name The name of the counter.
+ * @return The value of the counter, or -1 if there is no such counter.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+int64_t openslide_get_counter_value(openslide_t *osr, const char *name);
+//@}
+
+/**
+ * @name Tracing
+ * Following the stages of a read.
+ */
+//@{
+
+/**
+ * A stage of work reported to a trace callback.
+ * @since 3.5.0
+ */
+typedef enum {
+  /** One call to openslide_read_region(), or a piece of a large one. */
+  OPENSLIDE_TRACE_REGION,
+  /** Finding and painting the tiles of a region in one tile grid. */
+  OPENSLIDE_TRACE_GRID,
+  /** Painting one tile, including its cache lookups, reads and decode. */
+  OPENSLIDE_TRACE_TILE,
+  /** A tile cache lookup. */
+  OPENSLIDE_TRACE_CACHE,
+  /** Reading raw data from the slide. */
+  OPENSLIDE_TRACE_READ,
+  /** Decoding compressed image data. */
+  OPENSLIDE_TRACE_DECODE,
+  /** Compositing painted tiles into the caller's buffer. */
+  OPENSLIDE_TRACE_COMPOSITE,
+} openslide_trace_stage_t;
+
+/**
+ * An event reported to a trace callback.
+ * @since 3.5.0
+ */
+typedef struct {
+  /** The OpenSlide object doing the work. */
+  openslide_t *osr;
+  /** The stage. */
+  openslide_trace_stage_t stage;
+  /** True when the stage begins, false when it ends. */
+  bool begin;
+  /** The level, or -1 if the stage does not know it. */
+  int32_t level;
+  /**
+   * The tile column, or -1.  For a cache lookup, the cache coordinate.
+   * For slides whose tiles are not on a grid, a tile number.
+   */
+  int64_t tile_col;
+  /** The tile row, or -1.  For a cache lookup, the cache coordinate. */
+  int64_t tile_row;
+  /**
+   * At the end of a read, the number of bytes read.  At the end of a
+   * cache hit, the size of the entry.  Otherwise 0.
+   */
+  int64_t bytes;
+  /** For a decode, the codec name, such as "jpeg".  Otherwise NULL. */
+  const char *codec;
+} openslide_trace_event_t;
+
+/**
+ * A function called at the beginning and end of each stage of a read.
+ *
+ * Events of one thread nest, so the enclosing TILE event of a DECODE
+ * event identifies the tile.  The callback may be called concurrently
+ * from the calling thread and from OpenSlide worker threads.  It must
+ * be fast and must not call back into OpenSlide with the same object.
+ *
+ * @param event The event, valid only during the call.
+ * @param data The data pointer passed to openslide_set_trace_callback().
+ * @since 3.5.0
+ */
+typedef void (*openslide_trace_callback_fn)(const openslide_trace_event_t *event,
+                                            void *data);
+
+/**
+ * Set a function to receive trace events for an OpenSlide object.
+ *
+ * With no trace callback set on any object, tracing costs one atomic
+ * load per stage.  No other threads may be using @p osr during this
+ * call.
+ *
+ * @param osr The OpenSlide object.
+ * @param callback The callback, or NULL to disable tracing.
+ * @param data A pointer to pass to @p callback.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_trace_callback(openslide_t *osr,
+                                  openslide_trace_callback_fn callback,
+                                  void *data);
+//@}
+
 /**
  * @name Miscellaneous
  * Utility functions.
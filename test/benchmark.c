@@ -0,0 +1,322 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2015 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Run a set of region-read scenarios against a slide and report wall-clock
+   throughput and latency percentiles as JSON.
+
+   Each scenario is run cold, on a freshly opened slide with empty caches,
+   and then warm, by repeating the same reads on the same object.  The OS
+   page cache is not flushed, so cold numbers measure OpenSlide's own
+   caches rather than the disk.  The hit ratio is that of the decoded-tile
+   cache during the run. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include <openslide.h>
+#include "openslide-common.h"
+
+#define REGION_SIZE 512
+#define VIEW_WIDTH 1024
+#define VIEW_HEIGHT 768
+#define PAN_STEP 64
+// cap on reads per scenario, to bound the runtime on large levels
+#define MAX_REQUESTS 256
+#define DEFAULT_THREADS 4
+#define RANDOM_SEED 1
+
+struct region {
+  int64_t x;  // level 0 coordinates
+  int64_t y;
+  int64_t w;  // level coordinates
+  int64_t h;
+};
+
+struct scenario {
+  const char *name;
+  int32_t level;
+  int threads;
+  struct region *regions;
+  int count;
+};
+
+struct run {
+  openslide_t *osr;
+  const struct scenario *sc;
+  double *latencies;
+  GMutex *lock;
+  int next;
+};
+
+static void print_json_string(const char *str) {
+  putchar('"');
+  for (const char *p = str; *p; p++) {
+    if (*p == '"' || *p == '\\') {
+      printf("\\%c", *p);
+    } else if ((unsigned char) *p < 0x20) {
+      printf("\\u%04x", (unsigned char) *p);
+    } else {
+      putchar(*p);
+    }
+  }
+  putchar('"');
+}
+
+static void *read_thread(void *data) {
+  struct run *run = data;
+  const struct scenario *sc = run->sc;
+  uint32_t *buf = g_new(uint32_t, MAX(VIEW_WIDTH * VIEW_HEIGHT,
+                                      REGION_SIZE * REGION_SIZE));
+  GTimer *timer = g_timer_new();
+
+  while (true) {
+    g_mutex_lock(run->lock);
+    int i = run->next++;
+    g_mutex_unlock(run->lock);
+    if (i >= sc->count) {
+      break;
+    }
+
+    const struct region *r = &sc->regions[i];
+    g_timer_start(timer);
+    openslide_read_region(run->osr, buf, r->x, r->y, sc->level, r->w, r->h);
+    run->latencies[i] = g_timer_elapsed(timer, NULL);
+  }
+
+  g_timer_destroy(timer);
+  g_free(buf);
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double da = *(const double *) a;
+  double db = *(const double *) b;
+  return (da > db) - (da < db);
+}
+
+static double percentile(const double *sorted, int count, double p) {
+  return sorted[MIN((int) (p * count), count - 1)];
+}
+
+// returns false on a slide error
+static bool run_scenario(openslide_t *osr, const struct scenario *sc,
+                         const char *cache, bool *first) {
+  struct run run = {
+    .osr = osr,
+    .sc = sc,
+    .latencies = g_new0(double, sc->count),
+    .lock = g_mutex_new(),
+  };
+
+  int64_t hits = openslide_get_counter_value(osr, "cache.hits");
+  int64_t misses = openslide_get_counter_value(osr, "cache.misses");
+  GTimer *timer = g_timer_new();
+  if (sc->threads == 1) {
+    read_thread(&run);
+  } else {
+    GThread **threads = g_new(GThread *, sc->threads);
+    for (int i = 0; i < sc->threads; i++) {
+      threads[i] = g_thread_create(read_thread, &run, TRUE, NULL);
+      if (threads[i] == NULL) {
+        common_fail("Couldn't start thread");
+      }
+    }
+    for (int i = 0; i < sc->threads; i++) {
+      g_thread_join(threads[i]);
+    }
+    g_free(threads);
+  }
+  double seconds = g_timer_elapsed(timer, NULL);
+  g_timer_destroy(timer);
+  hits = openslide_get_counter_value(osr, "cache.hits") - hits;
+  misses = openslide_get_counter_value(osr, "cache.misses") - misses;
+
+  const char *error = openslide_get_error(osr);
+  if (error) {
+    fprintf(stderr, "%s: %s\n", sc->name, error);
+  } else {
+    int64_t pixels = 0;
+    for (int i = 0; i < sc->count; i++) {
+      pixels += sc->regions[i].w * sc->regions[i].h;
+    }
+    qsort(run.latencies, sc->count, sizeof(double), compare_doubles);
+
+    printf("%s\n    {\"scenario\": ", *first ? "" : ",");
+    print_json_string(sc->name);
+    printf(", \"level\": %d, \"cache\": \"%s\", \"threads\": %d,\n"
+           "     \"requests\": %d, \"seconds\": %.6f, "
+           "\"megapixels_per_second\": %.3f,\n"
+           "     \"p50_ms\": %.3f, \"p99_ms\": %.3f, "
+           "\"cache_hit_ratio\": %.3f}",
+           sc->level, cache, sc->threads,
+           sc->count, seconds, pixels / seconds / 1e6,
+           percentile(run.latencies, sc->count, 0.5) * 1000,
+           percentile(run.latencies, sc->count, 0.99) * 1000,
+           hits + misses ? (double) hits / (hits + misses) : 0.0);
+    *first = false;
+  }
+
+  g_mutex_free(run.lock);
+  g_free(run.latencies);
+  return error == NULL;
+}
+
+static int make_raster(struct region *regions, int64_t lw, int64_t lh,
+                       double downsample) {
+  int count = 0;
+  for (int64_t y = 0; y < lh && count < MAX_REQUESTS; y += REGION_SIZE) {
+    for (int64_t x = 0; x < lw && count < MAX_REQUESTS; x += REGION_SIZE) {
+      struct region *r = &regions[count++];
+      r->x = x * downsample;
+      r->y = y * downsample;
+      r->w = MIN(REGION_SIZE, lw - x);
+      r->h = MIN(REGION_SIZE, lh - y);
+    }
+  }
+  return count;
+}
+
+static int make_random(struct region *regions, int64_t lw, int64_t lh,
+                       double downsample) {
+  GRand *rand = g_rand_new_with_seed(RANDOM_SEED);
+  for (int i = 0; i < MAX_REQUESTS; i++) {
+    struct region *r = &regions[i];
+    r->w = MIN(REGION_SIZE, lw);
+    r->h = MIN(REGION_SIZE, lh);
+    r->x = g_rand_int_range(rand, 0, lw - r->w + 1) * downsample;
+    r->y = g_rand_int_range(rand, 0, lh - r->h + 1) * downsample;
+  }
+  g_rand_free(rand);
+  return MAX_REQUESTS;
+}
+
+// sweep a viewport across the level in a serpentine, as a viewer would
+static int make_pan(struct region *regions, int64_t lw, int64_t lh,
+                    double downsample) {
+  int64_t vw = MIN(VIEW_WIDTH, lw);
+  int64_t vh = MIN(VIEW_HEIGHT, lh);
+  int64_t x = 0;
+  int64_t y = 0;
+  int64_t dx = PAN_STEP;
+  int count = 0;
+  while (count < MAX_REQUESTS) {
+    struct region *r = &regions[count++];
+    r->x = x * downsample;
+    r->y = y * downsample;
+    r->w = vw;
+    r->h = vh;
+
+    if (x + dx < 0 || x + dx + vw > lw) {
+      // reached the edge; move down half a screen and reverse
+      if (y + vh >= lh) {
+        break;
+      }
+      y = MIN(y + vh / 2, lh - vh);
+      dx = -dx;
+    } else {
+      x += dx;
+    }
+  }
+  return count;
+}
+
+int main(int argc, char **argv) {
+  common_fix_argv(&argc, &argv);
+  if (argc < 2 || argc > 3) {
+    printf("Usage: %s <file> [threads]\n", argv[0]);
+    return 2;
+  }
+  const char *filename = argv[1];
+  int threads = argc > 2 ? atoi(argv[2]) : DEFAULT_THREADS;
+  if (threads < 1) {
+    printf("Invalid thread count\n");
+    return 2;
+  }
+
+  openslide_t *osr = openslide_open(filename);
+  if (!osr) {
+    common_fail("Unrecognized file");
+  }
+  if (openslide_get_error(osr)) {
+    common_fail("%s", openslide_get_error(osr));
+  }
+  int32_t levels = openslide_get_level_count(osr);
+  openslide_close(osr);
+
+  printf("{\"slide\": ");
+  print_json_string(filename);
+  printf(", \"vendor\": ");
+  const char *vendor = openslide_detect_vendor(filename);
+  print_json_string(vendor ? vendor : "");
+  printf(", \"openslide_version\": ");
+  print_json_string(openslide_get_version());
+  printf(",\n  \"results\": [");
+
+  static const struct {
+    const char *name;
+    int (*make)(struct region *regions, int64_t lw, int64_t lh,
+                double downsample);
+    bool all_levels;
+    bool threaded;
+  } kinds[] = {
+    {"raster", make_raster, true, false},
+    {"random", make_random, true, false},
+    {"pan", make_pan, true, false},
+    {"contention", make_random, false, true},
+  };
+
+  struct region *regions = g_new(struct region, MAX_REQUESTS);
+  bool first = true;
+  bool ok = true;
+  for (guint k = 0; k < G_N_ELEMENTS(kinds); k++) {
+    for (int32_t level = 0; level < levels; level++) {
+      if (level > 0 && !kinds[k].all_levels) {
+        break;
+      }
+
+      // fresh object, so the cold run starts with empty caches
+      osr = openslide_open(filename);
+      if (!osr || openslide_get_error(osr)) {
+        common_fail("Couldn't reopen slide");
+      }
+      int64_t lw, lh;
+      openslide_get_level_dimensions(osr, level, &lw, &lh);
+      double downsample = openslide_get_level_downsample(osr, level);
+
+      struct scenario sc = {
+        .name = kinds[k].name,
+        .level = level,
+        .threads = kinds[k].threaded ? threads : 1,
+        .regions = regions,
+        .count = kinds[k].make(regions, lw, lh, downsample),
+      };
+      ok = run_scenario(osr, &sc, "cold", &first) &&
+           run_scenario(osr, &sc, "warm", &first) && ok;
+      openslide_close(osr);
+    }
+  }
+  g_free(regions);
+
+  printf("\n  ]\n}\n");
+  return ok ? 0 : 1;
+}
@@ -21,16 +21,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <inttypes.h>
 
 #ifndef WIN32
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #endif
 
 #include <glib.h>
+#include <jpeglib.h>
+#include <tiffio.h>
 #include <openslide.h>
 #include "openslide-common.h"
 #include "config.h"
@@ -53,6 +58,857 @@ static void test_image_fetch(openslide_t *osr,
   }
 }
 
+static void test_batch_fetch(openslide_t *osr, int64_t x, int64_t y) {
+  enum { count = 16 };
+  const int64_t size = 224;
+  openslide_region_t regions[count];
+  uint32_t *buf = g_new(uint32_t, size * size);
+
+  // overlapping patches, deliberately out of order
+  for (int i = 0; i < count; i++) {
+    regions[i] = (openslide_region_t) {
+      .dest = g_new(uint32_t, size * size),
+      .x = x + ((count - i) % 4) * size / 2,
+      .y = y + ((count - i) / 4) * size / 2,
+      .level = i % openslide_get_level_count(osr),
+      .w = size,
+      .h = size,
+    };
+  }
+  openslide_read_regions(osr, regions, count);
+
+  for (int i = 0; i < count; i++) {
+    openslide_region_t *r = &regions[i];
+    if (!r->success) {
+      common_fail("Batch read failed: %s", openslide_get_error(osr));
+    }
+    openslide_read_region(osr, buf, r->x, r->y, r->level, r->w, r->h);
+    if (memcmp(buf, r->dest, size * size * 4)) {
+      common_fail("Batch read differs: %"PRId64" %"PRId64" %d",
+                  r->x, r->y, r->level);
+    }
+    g_free(r->dest);
+  }
+  g_free(buf);
+}
+
+static void async_callback(openslide_request_t *req G_GNUC_UNUSED,
+                           bool success G_GNUC_UNUSED,
+                           void *data) {
+  g_atomic_int_inc((gint *) data);
+}
+
+static void test_async_fetch(openslide_t *osr, int64_t x, int64_t y) {
+  const int64_t size = 300;
+  uint32_t *expected = g_new(uint32_t, size * size);
+  uint32_t *buf = g_new(uint32_t, size * size);
+  gint callbacks = 0;
+
+  openslide_read_region(osr, expected, x, y, 0, size, size);
+
+  // prefetch, then read
+  openslide_request_t *prefetch =
+    openslide_read_region_async(osr, NULL, x, y, 0, size, size,
+                                async_callback, &callbacks);
+  openslide_request_t *req =
+    openslide_read_region_async(osr, buf, x, y, 0, size, size,
+                                async_callback, &callbacks);
+  if (!openslide_request_wait(req) || !openslide_request_is_done(req)) {
+    common_fail("Async read failed: %s", openslide_get_error(osr));
+  }
+  if (memcmp(buf, expected, size * size * 4)) {
+    common_fail("Async read differs");
+  }
+  openslide_request_wait(prefetch);
+  openslide_request_release(prefetch);
+  openslide_request_release(req);
+
+  // cancel; either outcome is fine, but it must complete
+  req = openslide_read_region_async(osr, buf, x + size, y, 0, size, size,
+                                    async_callback, &callbacks);
+  openslide_request_cancel(req);
+  openslide_request_wait(req);
+  openslide_request_release(req);
+  if (openslide_get_error(osr)) {
+    common_fail("Cancelled async read set an error: %s",
+                openslide_get_error(osr));
+  }
+
+  if (g_atomic_int_get(&callbacks) != 3) {
+    common_fail("Missing async callbacks");
+  }
+  g_free(buf);
+  g_free(expected);
+}
+
+// single-threaded reads only
+static void trace_callback(const openslide_trace_event_t *event,
+                           void *data) {
+  int *depth = data;
+  if (event->begin) {
+    (*depth)++;
+  } else if (--*depth < 0) {
+    common_fail("Unbalanced trace event");
+  }
+}
+
+static void test_trace(openslide_t *osr, int64_t x, int64_t y) {
+  int depth = 0;
+  openslide_set_trace_callback(osr, trace_callback, &depth);
+  test_image_fetch(osr, x, y, 500, 500);
+  openslide_set_trace_callback(osr, NULL, NULL);
+  if (depth != 0) {
+    common_fail("Unfinished trace event");
+  }
+}
+
+static void test_raw_tile(openslide_t *osr) {
+  // not all slides have raw tiles, but any we get must be well-formed
+  openslide_raw_tile_t *tile = openslide_read_raw_tile(osr, 0, 0, 0);
+  if (tile) {
+    const uint8_t *data = tile->data;
+    if (tile->size < 4 || data[0] != 0xff || data[1] != 0xd8 ||
+        strcmp(tile->codec, "jpeg") ||
+        tile->x != 0 || tile->y != 0 ||
+        tile->visible_w <= 0 || tile->visible_w > tile->w ||
+        tile->visible_h <= 0 || tile->visible_h > tile->h) {
+      common_fail("Bad raw tile");
+    }
+    openslide_raw_tile_free(tile);
+  }
+  if (openslide_read_raw_tile(osr, 0, -1, 0) ||
+      openslide_read_raw_tile(osr, openslide_get_level_count(osr), 0, 0)) {
+    common_fail("Raw tile outside the slide");
+  }
+  if (openslide_get_error(osr)) {
+    common_fail("Raw tile read failed: %s", openslide_get_error(osr));
+  }
+}
+
+static void test_tile(openslide_t *osr) {
+  // a decoded tile must match the same area of the level
+  openslide_tile_t *tile = openslide_acquire_tile(osr, 0, 0, 0);
+  if (tile) {
+    uint32_t *buf = g_new(uint32_t, tile->visible_w * tile->visible_h);
+    openslide_read_region(osr, buf, 0, 0, 0,
+                          tile->visible_w, tile->visible_h);
+    for (int64_t y = 0; y < tile->visible_h; y++) {
+      if (memcmp(buf + y * tile->visible_w, tile->data + y * tile->w,
+                 tile->visible_w * 4)) {
+        common_fail("Tile doesn't match region");
+      }
+    }
+    g_free(buf);
+
+    buf = g_new(uint32_t, tile->w * tile->h);
+    if (!openslide_read_tile(osr, buf, 0, 0, 0) ||
+        memcmp(buf, tile->data, tile->w * tile->h * 4)) {
+      common_fail("Copied tile doesn't match");
+    }
+    g_free(buf);
+    openslide_tile_release(tile);
+  }
+  if (openslide_acquire_tile(osr, 0, 0, -1) ||
+      openslide_acquire_tile(osr, -1, 0, 0)) {
+    common_fail("Tile outside the slide");
+  }
+  if (openslide_get_error(osr)) {
+    common_fail("Tile read failed: %s", openslide_get_error(osr));
+  }
+}
+
+static void test_tile_iter(openslide_t *osr) {
+  // the tissue filter only removes tiles
+  int32_t level = openslide_get_level_count(osr) - 1;
+  openslide_tile_iter_t *all = openslide_tile_iter_create(osr, level, 0);
+  openslide_tile_iter_t *tissue =
+    openslide_tile_iter_create(osr, level, OPENSLIDE_TILE_ITER_TISSUE);
+  if (all && tissue) {
+    int64_t col, row, tissue_col, tissue_row;
+    bool more = openslide_tile_iter_next(tissue, &tissue_col, &tissue_row);
+    while (openslide_tile_iter_next(all, &col, &row)) {
+      if (more && col == tissue_col && row == tissue_row) {
+        more = openslide_tile_iter_next(tissue, &tissue_col, &tissue_row);
+      }
+    }
+    if (more) {
+      common_fail("Tissue tile not among non-empty tiles");
+    }
+  } else if (all || tissue) {
+    common_fail("Tile iterator created inconsistently");
+  }
+  openslide_tile_iter_free(tissue);
+  openslide_tile_iter_free(all);
+  if (openslide_get_error(osr)) {
+    common_fail("Tile iteration failed: %s", openslide_get_error(osr));
+  }
+}
+
+static void test_pixel_formats(openslide_t *osr) {
+  const int64_t w = 16;
+  const int64_t h = 8;
+  const int64_t stride = w * 4 + 12;
+  uint32_t argb[16 * 8];
+  uint8_t buf[8 * (16 * 4 + 12)];
+  openslide_read_region(osr, argb, 0, 0, 0, w, h);
+
+  // RGB is the premultiplied color, and opaque BGRA pixels keep theirs
+  openslide_read_region_format(osr, buf, stride, OPENSLIDE_PIXEL_FORMAT_RGB,
+                               0, 0, 0, w, h);
+  for (int64_t i = 0; i < w * h; i++) {
+    const uint8_t *p = buf + (i / w) * stride + (i % w) * 3;
+    uint32_t px = argb[i];
+    if (p[0] != ((px >> 16) & 0xff) || p[1] != ((px >> 8) & 0xff) ||
+        p[2] != (px & 0xff)) {
+      common_fail("Bad RGB pixel");
+    }
+  }
+  openslide_read_region_format(osr, buf, stride, OPENSLIDE_PIXEL_FORMAT_BGRA,
+                               0, 0, 0, w, h);
+  for (int64_t i = 0; i < w * h; i++) {
+    const uint8_t *p = buf + (i / w) * stride + (i % w) * 4;
+    uint32_t px = argb[i];
+    if (p[3] != px >> 24 ||
+        (p[3] == 255 && (p[0] != (px & 0xff) || p[1] != ((px >> 8) & 0xff) ||
+                         p[2] != ((px >> 16) & 0xff)))) {
+      common_fail("Bad BGRA pixel");
+    }
+  }
+
+  // a region converted in several bands must match the ARGB read, even
+  // at a fractional downsample
+  const int64_t bw = 2048;
+  const int64_t bh = 300;
+  int32_t level = openslide_get_level_count(osr) - 1;
+  uint32_t *band_argb = g_new(uint32_t, bw * bh);
+  uint8_t *band_rgb = g_malloc(bw * bh * 3);
+  openslide_read_region(osr, band_argb, 0, 0, level, bw, bh);
+  openslide_read_region_format(osr, band_rgb, 0, OPENSLIDE_PIXEL_FORMAT_RGB,
+                               0, 0, level, bw, bh);
+  for (int64_t i = 0; i < bw * bh; i++) {
+    const uint8_t *p = band_rgb + i * 3;
+    uint32_t px = band_argb[i];
+    if (p[0] != ((px >> 16) & 0xff) || p[1] != ((px >> 8) & 0xff) ||
+        p[2] != (px & 0xff)) {
+      common_fail("Banded RGB pixel %"PRId64" differs", i);
+    }
+  }
+  g_free(band_rgb);
+  g_free(band_argb);
+
+  if (openslide_get_error(osr)) {
+    common_fail("Pixel format read failed: %s", openslide_get_error(osr));
+  }
+}
+
+static void test_scaled(openslide_t *osr) {
+  // at a level's own downsample, a scaled read is a plain one
+  int32_t level = openslide_get_level_count(osr) - 1;
+  double ds = openslide_get_level_downsample(osr, level);
+  uint32_t expected[32 * 32];
+  uint32_t buf[32 * 32];
+  openslide_read_region(osr, expected, 0, 0, level, 32, 32);
+  openslide_read_region_scaled(osr, buf, 0, 0, ds, 32, 32);
+  if (memcmp(buf, expected, sizeof(buf))) {
+    common_fail("Scaled read at level downsample doesn't match");
+  }
+
+  // fully transparent input stays transparent
+  openslide_read_region_scaled(osr, buf, -1000 * ds, -1000 * ds,
+                               ds * 2.5, 32, 32);
+  for (int i = 0; i < 32 * 32; i++) {
+    if (buf[i]) {
+      common_fail("Scaled read outside slide isn't transparent");
+    }
+  }
+  openslide_read_region_scaled(osr, buf, 0, 0, 1.7, 32, 32);
+
+  // a reduction too large for one source chunk per output pixel
+  openslide_read_region_scaled(osr, buf, 0, 0, ds * 3000, 2, 2);
+  if (openslide_get_error(osr)) {
+    common_fail("Scaled read failed: %s", openslide_get_error(osr));
+  }
+}
+
+static void test_focal_planes(openslide_t *osr, int64_t x, int64_t y) {
+  // one of the planes is the default one
+  int32_t count = openslide_get_focal_plane_count(osr);
+  if (count < 1) {
+    common_fail("Bad focal plane count %d", count);
+  }
+  uint32_t expected[16 * 16];
+  openslide_read_region(osr, expected, x, y, 0, 16, 16);
+  uint32_t **dest = g_new(uint32_t *, count);
+  for (int32_t p = 0; p < count; p++) {
+    dest[p] = g_new(uint32_t, 16 * 16);
+  }
+  openslide_read_region_planes(osr, dest, x, y, 0, 16, 16);
+  bool found = false;
+  for (int32_t p = 0; p < count; p++) {
+    found |= !memcmp(dest[p], expected, sizeof(expected));
+    g_free(dest[p]);
+  }
+  g_free(dest);
+  if (openslide_get_error(osr)) {
+    common_fail("Focal plane read failed: %s", openslide_get_error(osr));
+  }
+  if (!found) {
+    common_fail("No focal plane matches the default one");
+  }
+}
+
+#ifndef WIN32
+static void *io_open(const char *path, void *data G_GNUC_UNUSED) {
+  int fd = open(path, O_RDONLY);
+  return fd == -1 ? NULL : GINT_TO_POINTER(fd + 1);
+}
+
+static int64_t io_size(void *handle, void *data G_GNUC_UNUSED) {
+  struct stat st;
+  if (fstat(GPOINTER_TO_INT(handle) - 1, &st)) {
+    return -1;
+  }
+  return st.st_size;
+}
+
+static int64_t io_pread(void *handle, void *buf, int64_t size,
+                        int64_t offset, void *data) {
+  g_atomic_int_inc((gint *) data);
+  return pread(GPOINTER_TO_INT(handle) - 1, buf, size, offset);
+}
+
+static void io_close(void *handle, void *data G_GNUC_UNUSED) {
+  close(GPOINTER_TO_INT(handle) - 1);
+}
+
+static void test_custom_io(const char *path) {
+  // read by SQLite, which doesn't use custom I/O
+  const char *vendor = openslide_detect_vendor(path);
+  if (vendor && !strcmp(vendor, "sakura")) {
+    return;
+  }
+
+  static const openslide_io_t io = {
+    .open = io_open,
+    .size = io_size,
+    .pread = io_pread,
+    .close = io_close,
+  };
+  gint reads = 0;
+  if (!openslide_set_io(&io, &reads)) {
+    return;  // unsupported on this platform
+  }
+  openslide_t *osr = openslide_open(path);
+  if (!osr || openslide_get_error(osr)) {
+    common_fail("Open with custom I/O failed");
+  }
+  test_image_fetch(osr, 0, 0, 500, 500);
+  openslide_close(osr);
+  openslide_set_io(NULL, NULL);
+  if (!g_atomic_int_get(&reads)) {
+    common_fail("Custom I/O callbacks were not used");
+  }
+}
+#endif
+
+#ifndef WIN32
+static void test_shared_cache(openslide_t *osr, const char *path,
+                              int64_t x, int64_t y) {
+  // attach the segment twice, as two worker processes would
+  char *name = g_strdup_printf("/openslide-test-%d", (int) getpid());
+  openslide_cache_t *cache = openslide_cache_create_shared(name,
+                                                           64 * 1024 * 1024,
+                                                           4 * 1024 * 1024);
+  if (cache == NULL) {
+    g_free(name);
+    return;  // no shared memory here
+  }
+  openslide_cache_t *cache2 = openslide_cache_create_shared(name,
+                                                            64 * 1024 * 1024,
+                                                            4 * 1024 * 1024);
+  shm_unlink(name);
+  g_free(name);
+  if (cache2 == NULL) {
+    common_fail("Couldn't attach shared cache");
+  }
+
+  openslide_t *osr2 = openslide_open(path);
+  if (!osr2 || openslide_get_error(osr2)) {
+    common_fail("Open for shared cache failed");
+  }
+  openslide_set_cache(osr, cache);
+  openslide_set_cache(osr2, cache2);
+  openslide_cache_release(cache);
+  openslide_cache_release(cache2);
+
+  const int64_t w = 300, h = 300;
+  uint32_t *buf = g_new(uint32_t, w * h);
+  uint32_t *buf2 = g_new(uint32_t, w * h);
+  openslide_read_region(osr, buf, x, y, 0, w, h);
+  openslide_read_region(osr2, buf2, x, y, 0, w, h);
+  if (memcmp(buf, buf2, w * h * 4)) {
+    common_fail("Shared cache returned different pixels");
+  }
+  g_free(buf2);
+  g_free(buf);
+  openslide_close(osr2);
+
+  const char *err = openslide_get_error(osr);
+  if (err) {
+    common_fail("Read through shared cache failed: %s", err);
+  }
+}
+
+static void remove_dir(const char *dirname) {
+  GDir *dir = g_dir_open(dirname, 0, NULL);
+  if (dir) {
+    const char *name;
+    while ((name = g_dir_read_name(dir)) != NULL) {
+      char *path = g_build_filename(dirname, name, NULL);
+      unlink(path);
+      g_free(path);
+    }
+    g_dir_close(dir);
+  }
+  rmdir(dirname);
+}
+
+static void test_disk_cache(const char *path, int64_t x, int64_t y) {
+  char *dirname = g_build_filename(g_get_tmp_dir(),
+                                   "openslide-test-XXXXXX", NULL);
+  if (!mkdtemp(dirname)) {
+    common_fail("Couldn't create directory for disk cache");
+  }
+
+  const int64_t w = 300, h = 300;
+  uint32_t *bufs[2] = { g_new(uint32_t, w * h), g_new(uint32_t, w * h) };
+  // the second object reads what the first left on disk
+  for (int i = 0; i < 2; i++) {
+    openslide_t *osr = openslide_open(path);
+    if (!osr || openslide_get_error(osr)) {
+      common_fail("Open for disk cache failed");
+    }
+    openslide_cache_t *cache = openslide_cache_create(16 * 1024 * 1024);
+    if (!openslide_cache_add_disk_tier(cache, dirname, 64 * 1024 * 1024)) {
+      common_fail("Couldn't add disk cache tier");
+    }
+    openslide_set_cache(osr, cache);
+    openslide_cache_release(cache);
+    openslide_read_region(osr, bufs[i], x, y, 0, w, h);
+    const char *err = openslide_get_error(osr);
+    if (err) {
+      common_fail("Read through disk cache failed: %s", err);
+    }
+    if (i > 0 && openslide_get_counter_value(osr, "disk-cache.hits") <= 0) {
+      common_fail("Second read didn't use the disk cache");
+    }
+    // flushes the queued writes
+    openslide_close(osr);
+  }
+  if (memcmp(bufs[0], bufs[1], w * h * 4)) {
+    common_fail("Disk cache returned different pixels");
+  }
+  g_free(bufs[1]);
+  g_free(bufs[0]);
+
+  remove_dir(dirname);
+  g_free(dirname);
+}
+#endif
+
+static void decline_decode(openslide_codec_t codec G_GNUC_UNUSED,
+                           openslide_decode_job_t *jobs G_GNUC_UNUSED,
+                           int32_t count,
+                           void *data) {
+  // leave every tile to the built-in decoder
+  g_atomic_int_add((gint *) data, count);
+}
+
+static void mem_init_source(j_decompress_ptr cinfo G_GNUC_UNUSED) {
+}
+
+static boolean mem_fill_input_buffer(j_decompress_ptr cinfo) {
+  // premature end of stream; insert an EOI marker
+  static const JOCTET eoi[] = {0xFF, JPEG_EOI};
+  cinfo->src->next_input_byte = eoi;
+  cinfo->src->bytes_in_buffer = sizeof(eoi);
+  return TRUE;
+}
+
+static void mem_skip_input_data(j_decompress_ptr cinfo, long num_bytes) {
+  struct jpeg_source_mgr *src = cinfo->src;
+  if (num_bytes > (long) src->bytes_in_buffer) {
+    mem_fill_input_buffer(cinfo);
+  } else if (num_bytes > 0) {
+    src->next_input_byte += num_bytes;
+    src->bytes_in_buffer -= num_bytes;
+  }
+}
+
+static void mem_term_source(j_decompress_ptr cinfo G_GNUC_UNUSED) {
+}
+
+// an application decoder that really decodes, with libjpeg's defaults
+static void libjpeg_decode(openslide_codec_t codec G_GNUC_UNUSED,
+                           openslide_decode_job_t *jobs,
+                           int32_t count,
+                           void *data) {
+  for (int32_t i = 0; i < count; i++) {
+    openslide_decode_job_t *job = &jobs[i];
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct jpeg_source_mgr src = {
+      .next_input_byte = job->data,
+      .bytes_in_buffer = job->length,
+      .init_source = mem_init_source,
+      .fill_input_buffer = mem_fill_input_buffer,
+      .skip_input_data = mem_skip_input_data,
+      .resync_to_restart = jpeg_resync_to_restart,
+      .term_source = mem_term_source,
+    };
+
+    // the default error handler exits
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    cinfo.src = &src;
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    if (cinfo.num_components == 3 &&
+        (int32_t) cinfo.output_width == job->w &&
+        (int32_t) cinfo.output_height == job->h) {
+      JSAMPLE *row = g_new(JSAMPLE, job->w * 3);
+      while (cinfo.output_scanline < cinfo.output_height) {
+        uint32_t *out = job->dest + (int64_t) cinfo.output_scanline * job->w;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+        for (int32_t x = 0; x < job->w; x++) {
+          out[x] = 0xFF000000 | row[3 * x] << 16 | row[3 * x + 1] << 8 |
+                   row[3 * x + 2];
+        }
+      }
+      g_free(row);
+      job->success = true;
+      g_atomic_int_inc((gint *) data);
+    }
+    jpeg_destroy_decompress(&cinfo);
+  }
+}
+
+static void test_prewarm(openslide_t *osr) {
+  const int64_t capacity = 16 * 1024 * 1024;
+  openslide_cache_t *cache = openslide_cache_create(capacity);
+  openslide_set_cache(osr, cache);
+
+  int32_t level = openslide_get_level_count(osr) - 1;
+  openslide_request_t *req = openslide_prewarm_level_async(osr, level, true,
+                                                           NULL, NULL);
+  if (!openslide_request_wait(req)) {
+    common_fail("Prewarm request failed");
+  }
+  openslide_request_release(req);
+  int64_t pinned = openslide_cache_get_pinned_size(cache);
+  if (pinned <= 0 || pinned > capacity / 2) {
+    common_fail("Bad pinned size %"PRId64, pinned);
+  }
+
+  // a cancelled prewarm stops early and pins nothing
+  req = openslide_prewarm_level_async(osr, 0, false, NULL, NULL);
+  openslide_request_cancel(req);
+  if (openslide_request_wait(req)) {
+    common_fail("Cancelled prewarm succeeded");
+  }
+  if (!openslide_request_is_done(req)) {
+    common_fail("Cancelled prewarm not done after wait");
+  }
+  openslide_request_release(req);
+  if (openslide_cache_get_pinned_size(cache) != pinned) {
+    common_fail("Cancelled prewarm changed the pinned size");
+  }
+
+  // an invalid level fails the request, not the slide
+  req = openslide_prewarm_level_async(osr, -1, true, NULL, NULL);
+  if (openslide_request_wait(req)) {
+    common_fail("Prewarm of invalid level succeeded");
+  }
+  openslide_request_release(req);
+
+  openslide_unpin_tiles(osr);
+  if (openslide_cache_get_pinned_size(cache) != 0) {
+    common_fail("Tiles still pinned");
+  }
+  openslide_cache_release(cache);
+
+  const char *err = openslide_get_error(osr);
+  if (err) {
+    common_fail("Prewarm failed: %s", err);
+  }
+}
+
+static void test_memory_usage(openslide_t *osr, int64_t x, int64_t y) {
+  test_image_fetch(osr, x, y, 500, 500);
+  openslide_memory_usage_t usage;
+  openslide_get_memory_usage(osr, &usage);
+  if (usage.cache_bytes <= 0 || usage.compressed_cache_bytes < 0 ||
+      usage.metadata_bytes <= 0 || usage.idle_handles < 0) {
+    common_fail("Bad memory usage");
+  }
+
+  openslide_release_memory(osr);
+  openslide_get_memory_usage(osr, &usage);
+  if (usage.cache_bytes || usage.compressed_cache_bytes ||
+      usage.idle_handles) {
+    common_fail("Memory not released");
+  }
+
+  // released resources come back on demand
+  test_image_fetch(osr, x, y, 500, 500);
+  const char *err = openslide_get_error(osr);
+  if (err) {
+    common_fail("Read after release failed: %s", err);
+  }
+}
+
+static void test_deadline(openslide_t *osr, int64_t x, int64_t y) {
+  const int64_t w = 500, h = 500;
+  uint32_t *buf = g_new(uint32_t, w * h);
+  uint32_t *buf2 = g_new(uint32_t, w * h);
+  openslide_read_region(osr, buf, x, y, 0, w, h);
+
+  // a read cancelled or expired before it starts paints nothing
+  int32_t cancel = 1;
+  openslide_read_status_t status =
+    openslide_read_region_with_deadline(osr, buf2, x, y, 0, w, h, -1, &cancel);
+  if (status != OPENSLIDE_READ_CANCELLED) {
+    common_fail("Cancelled read returned %d", status);
+  }
+  for (int64_t i = 0; i < w * h; i++) {
+    if (buf2[i]) {
+      common_fail("Cancelled read left pixels");
+    }
+  }
+  status = openslide_read_region_with_deadline(osr, buf2, x, y, 0, w, h,
+                                               0, NULL);
+  if (status != OPENSLIDE_READ_CANCELLED) {
+    common_fail("Expired read returned %d", status);
+  }
+  if (openslide_get_error(osr)) {
+    common_fail("Cancelled read set error: %s", openslide_get_error(osr));
+  }
+
+  // the slide is still usable
+  cancel = 0;
+  status = openslide_read_region_with_deadline(osr, buf2, x, y, 0, w, h,
+                                               -1, &cancel);
+  if (status != OPENSLIDE_READ_OK) {
+    common_fail("Read with deadline failed: %s", openslide_get_error(osr));
+  }
+  if (memcmp(buf, buf2, w * h * 4)) {
+    common_fail("Read with deadline differs");
+  }
+  g_free(buf2);
+  g_free(buf);
+}
+
+static void test_shared_open(openslide_t *osr, const char *path,
+                             int64_t x, int64_t y) {
+  const int64_t w = 200, h = 200;
+  uint32_t *buf = g_new(uint32_t, w * h);
+  uint32_t *buf2 = g_new(uint32_t, w * h);
+  openslide_read_region(osr, buf, x, y, 0, w, h);
+
+  openslide_t *views[2];
+  for (int i = 0; i < 2; i++) {
+    int64_t opens = openslide_get_counter_value(NULL, "tiff.handle-opens");
+    views[i] = openslide_open_with_flags(path, OPENSLIDE_OPEN_SHARED);
+    if (!views[i] || openslide_get_error(views[i])) {
+      common_fail("Shared open failed");
+    }
+    // the second view reuses the first one's parsed slide
+    if (i > 0 &&
+        (openslide_get_counter_value(NULL, "tiff.handle-opens") != opens ||
+         openslide_get_property_names(views[i]) !=
+         openslide_get_property_names(views[0]))) {
+      common_fail("Shared open parsed the slide again");
+    }
+    if (g_strcmp0(openslide_get_property_value(osr, OPENSLIDE_PROPERTY_NAME_QUICKHASH1),
+                  openslide_get_property_value(views[i], OPENSLIDE_PROPERTY_NAME_QUICKHASH1))) {
+      common_fail("Shared quickhash mismatch");
+    }
+    openslide_read_region(views[i], buf2, x, y, 0, w, h);
+    if (memcmp(buf, buf2, w * h * 4)) {
+      common_fail("Shared read mismatch");
+    }
+  }
+  openslide_close(views[0]);
+  // the other view is unaffected
+  test_image_fetch(views[1], x, y, 500, 500);
+  openslide_close(views[1]);
+
+  // reopen from the unused slides, then free them
+  views[0] = openslide_open_with_flags(path, OPENSLIDE_OPEN_SHARED);
+  test_image_fetch(views[0], x, y, 500, 500);
+  openslide_set_shared_slide_limit(0);
+  openslide_close(views[0]);
+  openslide_set_shared_slide_limit(16);
+
+  g_free(buf2);
+  g_free(buf);
+}
+
+static void test_associated_direct(openslide_t *osr, const char *path) {
+  // associated images decoded directly must match libtiff's decoding of
+  // the same directory
+  TIFFErrorHandler handler = TIFFSetWarningHandler(NULL);
+  TIFFErrorHandler err_handler = TIFFSetErrorHandler(NULL);
+  TIFF *tiff = TIFFOpen(path, "r");
+  if (tiff == NULL) {
+    TIFFSetWarningHandler(handler);
+    TIFFSetErrorHandler(err_handler);
+    return;
+  }
+
+  for (const char * const *name = openslide_get_associated_image_names(osr);
+       *name; name++) {
+    int64_t w, h;
+    openslide_get_associated_image_dimensions(osr, *name, &w, &h);
+    if (w <= 0 || h <= 0) {
+      continue;
+    }
+
+    // find a stripped JPEG directory of the same size
+    bool found = false;
+    if (TIFFSetDirectory(tiff, 0)) {
+      do {
+        uint32_t tw, th;
+        uint16_t compression;
+        if (!TIFFIsTiled(tiff) &&
+            TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &tw) &&
+            TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &th) &&
+            TIFFGetField(tiff, TIFFTAG_COMPRESSION, &compression) &&
+            compression == COMPRESSION_JPEG && tw == w && th == h) {
+          found = true;
+          break;
+        }
+      } while (TIFFReadDirectory(tiff));
+    }
+    if (!found) {
+      continue;
+    }
+
+    uint32_t *expected = g_new(uint32_t, w * h);
+    uint32_t *actual = g_new(uint32_t, w * h);
+    if (TIFFReadRGBAImageOriented(tiff, w, h, expected, ORIENTATION_TOPLEFT,
+                                  0)) {
+      for (int64_t i = 0; i < w * h; i++) {
+        uint32_t p = expected[i];
+        expected[i] = TIFFGetA(p) << 24 | TIFFGetR(p) << 16 |
+                      TIFFGetG(p) << 8 | TIFFGetB(p);
+      }
+      openslide_read_associated_image(osr, *name, actual);
+      if (memcmp(expected, actual, w * h * 4)) {
+        common_fail("Associated image %s differs from libtiff decode",
+                    *name);
+      }
+    }
+    g_free(actual);
+    g_free(expected);
+  }
+
+  TIFFClose(tiff);
+  TIFFSetWarningHandler(handler);
+  TIFFSetErrorHandler(err_handler);
+}
+
+static void test_tiff_samples(openslide_t *osr, const char *path) {
+  // tiles decoded from libtiff's samples must match TIFFRGBAImage
+  const char *vendor = openslide_get_property_value(osr,
+        OPENSLIDE_PROPERTY_NAME_VENDOR);
+  if (!vendor || !g_str_equal(vendor, "generic-tiff")) {
+    return;
+  }
+  TIFFErrorHandler handler = TIFFSetWarningHandler(NULL);
+  TIFF *tiff = TIFFOpen(path, "r");
+  TIFFSetWarningHandler(handler);
+  if (tiff == NULL) {
+    common_fail("Couldn't open %s with libtiff", path);
+  }
+
+  uint32_t tw, th, iw, ih;
+  uint16_t compression;
+  if (TIFFIsTiled(tiff) &&
+      TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &tw) &&
+      TIFFGetField(tiff, TIFFTAG_TILELENGTH, &th) &&
+      TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &iw) &&
+      TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &ih) &&
+      TIFFGetField(tiff, TIFFTAG_COMPRESSION, &compression) &&
+      compression != COMPRESSION_JPEG && iw >= tw && ih >= th) {
+    uint32_t *expected = g_new(uint32_t, tw * th);
+    uint32_t *actual = g_new(uint32_t, tw * th);
+    if (!TIFFReadRGBATile(tiff, 0, 0, expected)) {
+      common_fail("TIFFReadRGBATile failed");
+    }
+    openslide_read_region(osr, actual, 0, 0, 0, tw, th);
+    // TIFFReadRGBATile() returns ABGR rows from the bottom up
+    for (uint32_t row = 0; row < th; row++) {
+      uint32_t *src = expected + (th - row - 1) * tw;
+      uint32_t *dst = actual + row * tw;
+      for (uint32_t col = 0; col < tw; col++) {
+        uint32_t p = src[col];
+        uint32_t argb = TIFFGetA(p) << 24 | TIFFGetR(p) << 16 |
+                        TIFFGetG(p) << 8 | TIFFGetB(p);
+        if (dst[col] != argb) {
+          common_fail("Tile pixel %u,%u differs from TIFFRGBAImage: "
+                      "%08x != %08x", col, row, dst[col], argb);
+        }
+      }
+    }
+    g_free(actual);
+    g_free(expected);
+  }
+  TIFFClose(tiff);
+}
+
+static void test_decoder(openslide_t *osr, int64_t x, int64_t y) {
+  // decode every tile on each read
+  openslide_cache_t *cache = openslide_cache_create(0);
+  openslide_set_cache(osr, cache);
+  openslide_cache_release(cache);
+
+  const int64_t w = 1000, h = 1000;
+  uint32_t *buf = g_new(uint32_t, w * h);
+  uint32_t *buf2 = g_new(uint32_t, w * h);
+  openslide_read_region(osr, buf, x, y, 0, w, h);
+  gint jobs = 0;
+  openslide_set_decoder(OPENSLIDE_CODEC_JPEG, decline_decode, &jobs);
+  openslide_set_decoder(OPENSLIDE_CODEC_JPEG2000, decline_decode, &jobs);
+  openslide_read_region(osr, buf2, x, y, 0, w, h);
+  openslide_set_decoder(OPENSLIDE_CODEC_JPEG, NULL, NULL);
+  openslide_set_decoder(OPENSLIDE_CODEC_JPEG2000, NULL, NULL);
+  if (memcmp(buf, buf2, w * h * 4)) {
+    common_fail("Declined decodes returned different pixels");
+  }
+
+  // an application decoder must produce the built-in decoder's pixels
+  gint decoded = 0;
+  openslide_set_decoder(OPENSLIDE_CODEC_JPEG, libjpeg_decode, &decoded);
+  openslide_read_region(osr, buf2, x, y, 0, w, h);
+  openslide_set_decoder(OPENSLIDE_CODEC_JPEG, NULL, NULL);
+  if (decoded && memcmp(buf, buf2, w * h * 4)) {
+    common_fail("Application decoder returned different pixels");
+  }
+  g_free(buf2);
+  g_free(buf);
+
+  const char *err = openslide_get_error(osr);
+  if (err) {
+    common_fail("Read with application decoder failed: %s", err);
+  }
+
+  cache = openslide_cache_create(4 * 1024 * 1024);
+  openslide_set_cache(osr, cache);
+  openslide_cache_release(cache);
+}
+
 #if !defined(NONATOMIC_CLOEXEC) && !defined(WIN32)
 static gint leak_test_running;  /* atomic ops only */
 
@@ -226,6 +1082,186 @@ int main(int argc, char **argv) {
   test_image_fetch(osr, w*2, h*2, 400, 400);
   test_image_fetch(osr, w - 20, 0, 40, 100);
   test_image_fetch(osr, 0, h - 20, 100, 40);
+  openslide_close(osr);
+
+  // without persistent file descriptors
+  openslide_set_persistent_file_limit(0);
+  osr = openslide_open(path);
+  if (!osr || openslide_get_error(osr)) {
+    common_fail("Reopen without persistent files failed");
+  }
+  test_image_fetch(osr, w/2, h/2, 500, 500);
+  openslide_set_persistent_file_limit(256);
+
+#ifndef WIN32
+  test_custom_io(path);
+#endif
+
+  // shared cache, with full indexing
+  openslide_t *osr2 = openslide_open_with_flags(path,
+                                                OPENSLIDE_OPEN_FULL_INDEX);
+  if (!osr2 || openslide_get_error(osr2)) {
+    common_fail("Second open failed");
+  }
+  openslide_cache_t *cache = openslide_cache_create(4 * 1024 * 1024);
+  openslide_cache_set_policy(cache, OPENSLIDE_CACHE_POLICY_SEGMENTED);
+  openslide_set_cache(osr, cache);
+  openslide_set_cache(osr2, cache);
+  openslide_set_cache_priority(osr2, OPENSLIDE_CACHE_PRIORITY_LOW);
+  test_image_fetch(osr, w/2, h/2, 500, 500);
+  test_image_fetch(osr2, w/2, h/2, 500, 500);
+  int64_t evictions = openslide_get_counter_value(NULL, "cache.evictions");
+  test_image_fetch(osr2, 0, 0, 1500, 1500);
+  // a scan larger than the cache must evict, and stay within capacity
+  if (MIN(w, 1500) * MIN(h, 1500) * 4 > 2 * 4 * 1024 * 1024 &&
+      openslide_get_counter_value(NULL, "cache.evictions") <= evictions) {
+    common_fail("Scan didn't evict from the segmented cache");
+  }
+  openslide_memory_usage_t usage;
+  openslide_get_memory_usage(osr2, &usage);
+  if (usage.cache_bytes > 4 * 1024 * 1024) {
+    common_fail("Segmented cache over capacity: %"PRId64" bytes",
+                usage.cache_bytes);
+  }
+  openslide_close(osr2);
+  test_image_fetch(osr, w/2, h/2, 500, 500);
+  openslide_cache_set_policy(cache, OPENSLIDE_CACHE_POLICY_LRU);
+  test_image_fetch(osr, 0, 0, 1500, 1500);
+  openslide_cache_release(cache);
+
+  // lazy open; the deferred quickhash must match
+  osr2 = openslide_open_with_flags(path, OPENSLIDE_OPEN_LAZY);
+  if (!osr2 || openslide_get_error(osr2)) {
+    common_fail("Lazy open failed");
+  }
+  if (g_strcmp0(openslide_get_property_value(osr, OPENSLIDE_PROPERTY_NAME_QUICKHASH1),
+                openslide_get_property_value(osr2, OPENSLIDE_PROPERTY_NAME_QUICKHASH1))) {
+    common_fail("Lazy quickhash mismatch");
+  }
+  test_image_fetch(osr2, w/2, h/2, 500, 500);
+  openslide_close(osr2);
+
+  // trimmed overlaps; level geometry must not change
+  osr2 = openslide_open_with_flags(path, OPENSLIDE_OPEN_TRIM_OVERLAPS);
+  if (!osr2 || openslide_get_error(osr2)) {
+    common_fail("Open with trimmed overlaps failed");
+  }
+  for (int32_t level = 0; level < openslide_get_level_count(osr); level++) {
+    int64_t lw, lh, lw2, lh2;
+    openslide_get_level_dimensions(osr, level, &lw, &lh);
+    openslide_get_level_dimensions(osr2, level, &lw2, &lh2);
+    if (lw != lw2 || lh != lh2) {
+      common_fail("Trimmed level %d dimensions differ", level);
+    }
+  }
+  // a tile-aligned region must match the untrimmed slide
+  openslide_tile_t *tile = openslide_acquire_tile(osr2, 0, 1, 1);
+  if (!tile) {
+    tile = openslide_acquire_tile(osr2, 0, 0, 0);
+  }
+  if (tile) {
+    int64_t tw = tile->visible_w, th = tile->visible_h;
+    uint32_t *buf = g_new(uint32_t, tw * th);
+    uint32_t *buf2 = g_new(uint32_t, tw * th);
+    openslide_read_region(osr, buf, tile->x, tile->y, 0, tw, th);
+    openslide_read_region(osr2, buf2, tile->x, tile->y, 0, tw, th);
+    if (memcmp(buf, buf2, tw * th * 4)) {
+      common_fail("Trimmed region differs from untrimmed slide");
+    }
+    g_free(buf2);
+    g_free(buf);
+    openslide_tile_release(tile);
+  }
+  test_image_fetch(osr2, w/2, h/2, 500, 500);
+  openslide_close(osr2);
+
+  // shared parsed slides
+  test_shared_open(osr, path, w/2, h/2);
+
+  // compressed tiles only
+  cache = openslide_cache_create(0);
+  openslide_set_cache(osr, cache);
+  openslide_cache_release(cache);
+  cache = openslide_cache_create(16 * 1024 * 1024);
+  openslide_set_compressed_cache(osr, cache);
+  openslide_cache_release(cache);
+  test_image_fetch(osr, w/2, h/2, 500, 500);
+  test_image_fetch(osr, w/2, h/2, 500, 500);
+  cache = openslide_cache_create(4 * 1024 * 1024);
+  openslide_set_cache(osr, cache);
+  openslide_cache_release(cache);
+
+#ifndef WIN32
+  // cache shared between processes
+  test_shared_cache(osr, path, w/2, h/2);
+  cache = openslide_cache_create(4 * 1024 * 1024);
+  openslide_set_cache(osr, cache);
+  openslide_cache_release(cache);
+
+  // disk cache tier
+  test_disk_cache(path, w/2, h/2);
+#endif
+
+  // direct associated image decoding
+  test_associated_direct(osr, path);
+
+  // non-JPEG TIFF tile decoding
+  test_tiff_samples(osr, path);
+
+  // application decoders
+  test_decoder(osr, w/2, h/2);
+
+  // batch reads
+  test_batch_fetch(osr, w/2, h/2);
+
+  // async reads
+  test_async_fetch(osr, w/2, h/2);
+
+  // prewarming and pinning
+  test_prewarm(osr);
+
+  // memory reporting and release
+  test_memory_usage(osr, w/2, h/2);
+
+  // deadlines and cancellation
+  test_deadline(osr, w/2, h/2);
+
+  // parallel decode
+  openslide_set_decode_threads(osr, 4);
+  test_image_fetch(osr, 0, 0, 1500, 1500);
+  test_batch_fetch(osr, w/2, h/2);
+  openslide_set_decode_threads(osr, 0);
+
+  // sequential readahead
+  openslide_set_readahead(osr, true);
+  test_image_fetch(osr, 0, 0, 1500, 1500);
+  test_image_fetch(osr, 1500, 0, 1500, 1500);
+  openslide_set_readahead(osr, false);
+
+  // tracing
+  test_trace(osr, w/2, h/2);
+  test_raw_tile(osr);
+  test_tile(osr);
+  test_tile_iter(osr);
+  test_pixel_formats(osr);
+  test_scaled(osr);
+  test_focal_planes(osr, w/2, h/2);
+
+  // performance counters
+  for (const char * const *name = openslide_get_counter_names();
+       *name; name++) {
+    int64_t value = openslide_get_counter_value(osr, *name);
+    if (value < 0 || value > openslide_get_counter_value(NULL, *name)) {
+      common_fail("Bad value for counter %s", *name);
+    }
+  }
+  if (openslide_get_counter_value(osr, "cache.hits") +
+      openslide_get_counter_value(osr, "cache.misses") == 0) {
+    common_fail("Cache lookups not counted");
+  }
+  if (openslide_get_counter_value(osr, "no-such-counter") != -1) {
+    common_fail("Nonexistent counter has a value");
+  }
 
   // active region
   const char *bounds_x = openslide_get_property_value(osr, OPENSLIDE_PROPERTY_NAME_BOUNDS_X);
@@ -0,0 +1,620 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2015 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Time the tile cache, the grids, the decoders, and the pixel conversion
+   kernels in isolation, on synthetic data, and report the results as
+   JSON.
+
+   This program is built from the library sources rather than linked
+   against the library, since it calls internal functions.  Iteration
+   counts and random seeds are fixed, so runs are comparable between
+   builds.  Build it with "make test/microbench". */
+
+#include <config.h>
+
+#include "openslide-private.h"
+#include "openslide-decode-jpeg.h"
+#include "openslide-decode-jp2k.h"
+#include "openslide-decode-png.h"
+#include "openslide-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <cairo.h>
+#include <jpeglib.h>
+#include <png.h>
+
+#ifdef HAVE_OPENJPEG2
+#include <openjpeg.h>
+#endif
+
+#define DEFAULT_THREADS 4
+#define RANDOM_SEED 1
+
+#define CACHE_TILE_BYTES (256 * 256 * 4)
+#define CACHE_CAPACITY_TILES 64
+// total across threads
+#define CACHE_OPS 200000
+
+#define GRID_TILE_SIZE 64
+#define GRID_REGION_SIZE 1024
+#define GRID_READS 2000
+#define GRID_SIMPLE_TILES 65536  // across and down
+#define GRID_TILEMAP_TILES 512  // across and down
+#define GRID_RANGE_TILES (512 * 512)
+
+#define DECODE_TILE_SIZE 256
+#define DECODE_JPEG_ITERATIONS 1000
+#define DECODE_PNG_ITERATIONS 300
+#define DECODE_JP2K_ITERATIONS 100
+
+#define CONVERT_PIXELS (256 * 256)
+#define CONVERT_ITERATIONS 2000
+
+static bool first_result = true;
+
+// extra is a JSON fragment of additional members, or NULL
+static void report(const char *name, const char *variant,
+                   int64_t ops, double seconds, const char *extra) {
+  printf("%s\n    {\"benchmark\": \"%s\", \"variant\": \"%s\", "
+         "\"ops\": %"PRId64", \"seconds\": %.6f, \"ns_per_op\": %.1f%s%s}",
+         first_result ? "" : ",", name, variant, ops, seconds,
+         ops ? seconds * 1e9 / ops : 0.0,
+         extra ? ", " : "", extra ? extra : "");
+  first_result = false;
+}
+
+static void check_error(GError *err) {
+  if (err) {
+    common_fail("%s", err->message);
+  }
+}
+
+
+/* Cache */
+
+struct cache_run {
+  struct _openslide_cache_binding *cb;
+  int64_t keys;
+  int64_t ops;
+  uint32_t seed;
+};
+
+static int cache_plane;
+
+static void cache_access(struct _openslide_cache_binding *cb, int64_t key) {
+  struct _openslide_cache_entry *entry;
+  if (!_openslide_cache_get(cb, &cache_plane, key, 0, &entry)) {
+    void *data = _openslide_buffer_alloc(CACHE_TILE_BYTES);
+    _openslide_cache_put(cb, &cache_plane, key, 0, data, CACHE_TILE_BYTES,
+                         &entry);
+  }
+  _openslide_cache_entry_unref(entry);
+}
+
+static void *cache_thread(void *data) {
+  struct cache_run *run = data;
+  GRand *rand = g_rand_new_with_seed(run->seed);
+  for (int64_t i = 0; i < run->ops; i++) {
+    cache_access(run->cb, g_rand_int_range(rand, 0, run->keys));
+  }
+  g_rand_free(rand);
+  return NULL;
+}
+
+// keys are drawn uniformly, so the hit ratio is about capacity / keys
+static void bench_cache(int threads, int64_t keys) {
+  struct _openslide_cache *cache =
+    _openslide_cache_create((int64_t) CACHE_CAPACITY_TILES * CACHE_TILE_BYTES);
+  struct _openslide_cache_binding *cb =
+    _openslide_cache_binding_create(cache, OPENSLIDE_COUNTER_CACHE_HITS);
+  _openslide_cache_release(cache);
+
+  // warm up
+  for (int64_t key = 0; key < MIN(keys, CACHE_CAPACITY_TILES); key++) {
+    cache_access(cb, key);
+  }
+
+  struct cache_run *runs = g_new(struct cache_run, threads);
+  GThread **workers = g_new(GThread *, threads);
+  int64_t hits = openslide_get_counter_value(NULL, "cache.hits");
+  int64_t misses = openslide_get_counter_value(NULL, "cache.misses");
+  GTimer *timer = g_timer_new();
+  for (int i = 0; i < threads; i++) {
+    runs[i].cb = cb;
+    runs[i].keys = keys;
+    runs[i].ops = CACHE_OPS / threads;
+    runs[i].seed = RANDOM_SEED + i;
+    workers[i] = g_thread_create(cache_thread, &runs[i], TRUE, NULL);
+    if (workers[i] == NULL) {
+      common_fail("Couldn't start thread");
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    g_thread_join(workers[i]);
+  }
+  double seconds = g_timer_elapsed(timer, NULL);
+  g_timer_destroy(timer);
+  hits = openslide_get_counter_value(NULL, "cache.hits") - hits;
+  misses = openslide_get_counter_value(NULL, "cache.misses") - misses;
+
+  char *variant = g_strdup_printf("threads=%d,keys=%"PRId64, threads, keys);
+  char *extra = g_strdup_printf("\"hit_ratio\": %.3f",
+                                hits + misses ?
+                                (double) hits / (hits + misses) : 0.0);
+  report("cache", variant, (int64_t) CACHE_OPS / threads * threads,
+         seconds, extra);
+  g_free(extra);
+  g_free(variant);
+
+  g_free(workers);
+  g_free(runs);
+  _openslide_cache_binding_destroy(cb);
+}
+
+
+/* Grids */
+
+// the callbacks only count tiles, so the traversal is all that's timed
+static bool simple_read(openslide_t *osr G_GNUC_UNUSED,
+                        cairo_t *cr G_GNUC_UNUSED,
+                        struct _openslide_level *level G_GNUC_UNUSED,
+                        int64_t tile_col G_GNUC_UNUSED,
+                        int64_t tile_row G_GNUC_UNUSED,
+                        void *arg,
+                        GError **err G_GNUC_UNUSED) {
+  (*(int64_t *) arg)++;
+  return true;
+}
+
+static bool tilemap_read(openslide_t *osr G_GNUC_UNUSED,
+                         cairo_t *cr G_GNUC_UNUSED,
+                         struct _openslide_level *level G_GNUC_UNUSED,
+                         int64_t tile_col G_GNUC_UNUSED,
+                         int64_t tile_row G_GNUC_UNUSED,
+                         void *tile G_GNUC_UNUSED,
+                         void *arg,
+                         GError **err G_GNUC_UNUSED) {
+  (*(int64_t *) arg)++;
+  return true;
+}
+
+static bool range_read(openslide_t *osr G_GNUC_UNUSED,
+                       cairo_t *cr G_GNUC_UNUSED,
+                       struct _openslide_level *level G_GNUC_UNUSED,
+                       int64_t tile_unique_id G_GNUC_UNUSED,
+                       void *tile G_GNUC_UNUSED,
+                       void *arg,
+                       GError **err G_GNUC_UNUSED) {
+  (*(int64_t *) arg)++;
+  return true;
+}
+
+static void bench_grid_paint(const char *variant,
+                             struct _openslide_grid *grid,
+                             struct _openslide_level *level) {
+  cairo_surface_t *surface =
+    cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                               GRID_REGION_SIZE, GRID_REGION_SIZE);
+  cairo_t *cr = cairo_create(surface);
+  cairo_surface_destroy(surface);
+  GRand *rand = g_rand_new_with_seed(RANDOM_SEED);
+  int64_t tiles = 0;
+  GError *err = NULL;
+
+  GTimer *timer = g_timer_new();
+  for (int i = 0; i < GRID_READS; i++) {
+    double x = g_rand_double_range(rand, 0, level->w - GRID_REGION_SIZE);
+    double y = g_rand_double_range(rand, 0, level->h - GRID_REGION_SIZE);
+    if (!_openslide_grid_paint_region(grid, cr, &tiles, x, y, level,
+                                      GRID_REGION_SIZE, GRID_REGION_SIZE,
+                                      &err)) {
+      check_error(err);
+    }
+  }
+  double seconds = g_timer_elapsed(timer, NULL);
+  g_timer_destroy(timer);
+
+  char *extra = g_strdup_printf("\"tiles_per_op\": %.1f",
+                                (double) tiles / GRID_READS);
+  report("grid-paint", variant, GRID_READS, seconds, extra);
+  g_free(extra);
+  g_rand_free(rand);
+  cairo_destroy(cr);
+}
+
+static void bench_grids(void) {
+  // grids allocate their tiles from the slide's arena
+  openslide_t *osr = g_slice_new0(openslide_t);
+  osr->arena = _openslide_arena_create();
+  GRand *rand = g_rand_new_with_seed(RANDOM_SEED);
+  GTimer *timer = g_timer_new();
+
+  // simple
+  struct _openslide_level level = {
+    .w = (int64_t) GRID_SIMPLE_TILES * GRID_TILE_SIZE,
+    .h = (int64_t) GRID_SIMPLE_TILES * GRID_TILE_SIZE,
+  };
+  struct _openslide_grid *grid =
+    _openslide_grid_create_simple(osr, GRID_SIMPLE_TILES, GRID_SIMPLE_TILES,
+                                  GRID_TILE_SIZE, GRID_TILE_SIZE,
+                                  simple_read);
+  bench_grid_paint("simple", grid, &level);
+  _openslide_grid_destroy(grid);
+
+  // tilemap, with overlapping tiles as in Hamamatsu VMS or MIRAX
+  level.w = level.h = (int64_t) GRID_TILEMAP_TILES * GRID_TILE_SIZE;
+  g_timer_start(timer);
+  grid = _openslide_grid_create_tilemap(osr, GRID_TILE_SIZE, GRID_TILE_SIZE,
+                                        tilemap_read, NULL);
+  for (int64_t row = 0; row < GRID_TILEMAP_TILES; row++) {
+    for (int64_t col = 0; col < GRID_TILEMAP_TILES; col++) {
+      _openslide_grid_tilemap_add_tile(grid, col, row,
+                                       g_rand_double_range(rand, -8, 8),
+                                       g_rand_double_range(rand, -8, 8),
+                                       GRID_TILE_SIZE + 8, GRID_TILE_SIZE + 8,
+                                       NULL);
+    }
+  }
+  report("grid-build", "tilemap",
+         (int64_t) GRID_TILEMAP_TILES * GRID_TILEMAP_TILES,
+         g_timer_elapsed(timer, NULL), NULL);
+  bench_grid_paint("tilemap", grid, &level);
+  _openslide_grid_destroy(grid);
+
+  // range, with tiles of varying size at arbitrary positions
+  g_timer_start(timer);
+  grid = _openslide_grid_create_range(osr, range_read, NULL);
+  for (int32_t i = 0; i < GRID_RANGE_TILES; i++) {
+    double w = g_rand_double_range(rand, GRID_TILE_SIZE, 2 * GRID_TILE_SIZE);
+    double h = g_rand_double_range(rand, GRID_TILE_SIZE, 2 * GRID_TILE_SIZE);
+    _openslide_grid_range_add_tile(grid,
+                                   g_rand_double_range(rand, 0, level.w - w),
+                                   g_rand_double_range(rand, 0, level.h - h),
+                                   w, h, NULL);
+  }
+  _openslide_grid_range_finish_adding_tiles(grid);
+  report("grid-build", "range", GRID_RANGE_TILES,
+         g_timer_elapsed(timer, NULL), NULL);
+  bench_grid_paint("range", grid, &level);
+  _openslide_grid_destroy(grid);
+
+  g_timer_destroy(timer);
+  g_rand_free(rand);
+  _openslide_arena_destroy(osr->arena);
+  g_slice_free(openslide_t, osr);
+}
+
+
+/* Decoders */
+
+// smooth gradients with a little noise, which compress about as well
+// as tissue
+static uint8_t *make_rgb_tile(int32_t w, int32_t h) {
+  uint8_t *rgb = g_malloc((gsize) w * h * 3);
+  GRand *rand = g_rand_new_with_seed(RANDOM_SEED);
+  for (int32_t y = 0; y < h; y++) {
+    for (int32_t x = 0; x < w; x++) {
+      uint8_t *p = rgb + ((int64_t) y * w + x) * 3;
+      int32_t noise = g_rand_int_range(rand, -8, 8);
+      p[0] = CLAMP(128 + 96 * x / w + noise, 0, 255);
+      p[1] = CLAMP(64 + 128 * y / h + noise, 0, 255);
+      p[2] = CLAMP(192 - 64 * (x + y) / (w + h) + noise, 0, 255);
+    }
+  }
+  g_rand_free(rand);
+  return rgb;
+}
+
+static void *read_back(FILE *f, int64_t *len) {
+  if (fflush(f) || fseeko(f, 0, SEEK_END)) {
+    common_fail("Couldn't seek temporary file");
+  }
+  *len = ftello(f);
+  rewind(f);
+  void *buf = g_malloc(*len);
+  if (*len <= 0 || fread(buf, *len, 1, f) != 1) {
+    common_fail("Couldn't read temporary file");
+  }
+  fclose(f);
+  return buf;
+}
+
+static void *encode_jpeg(const uint8_t *rgb, int32_t w, int32_t h,
+                         int64_t *len) {
+  FILE *f = tmpfile();
+  if (f == NULL) {
+    common_fail("Couldn't create temporary file");
+  }
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, f);
+  cinfo.image_width = w;
+  cinfo.image_height = h;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, 75, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+  for (int32_t y = 0; y < h; y++) {
+    JSAMPROW row = (JSAMPROW) (rgb + (int64_t) y * w * 3);
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  return read_back(f, len);
+}
+
+static void *encode_png(const uint8_t *rgb, int32_t w, int32_t h,
+                        int64_t *len) {
+  FILE *f = tmpfile();
+  if (f == NULL) {
+    common_fail("Couldn't create temporary file");
+  }
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                                NULL, NULL, NULL);
+  png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+  if (!info_ptr) {
+    common_fail("Couldn't initialize PNG");
+  }
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    common_fail("Error encoding PNG");
+  }
+  png_init_io(png_ptr, f);
+  png_set_IHDR(png_ptr, info_ptr, w, h, 8,
+               PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+  for (int32_t y = 0; y < h; y++) {
+    png_write_row(png_ptr, (png_bytep) (rgb + (int64_t) y * w * 3));
+  }
+  png_write_end(png_ptr, info_ptr);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  return read_back(f, len);
+}
+
+#ifdef HAVE_OPENJPEG2
+// a J2K codestream, as Aperio and Philips store them
+static void *encode_jp2k(const uint8_t *rgb, int32_t w, int32_t h,
+                         int64_t *len) {
+  opj_image_cmptparm_t comps[3];
+  memset(comps, 0, sizeof(comps));
+  for (int c = 0; c < 3; c++) {
+    comps[c].dx = 1;
+    comps[c].dy = 1;
+    comps[c].w = w;
+    comps[c].h = h;
+    comps[c].prec = 8;
+  }
+  opj_image_t *image = opj_image_create(3, comps, OPJ_CLRSPC_SRGB);
+  if (image == NULL) {
+    common_fail("Couldn't create JPEG 2000 image");
+  }
+  image->x1 = w;
+  image->y1 = h;
+  for (int64_t i = 0; i < (int64_t) w * h; i++) {
+    for (int c = 0; c < 3; c++) {
+      image->comps[c].data[i] = rgb[i * 3 + c];
+    }
+  }
+
+  opj_cparameters_t params;
+  opj_set_default_encoder_parameters(&params);
+  params.tcp_numlayers = 1;
+  params.tcp_rates[0] = 20;
+  params.cp_disto_alloc = 1;
+  params.irreversible = 1;
+  params.tcp_mct = 1;
+
+  int fd;
+  char *path;
+  GError *tmp_err = NULL;
+  fd = g_file_open_tmp("openslide-microbench-XXXXXX.j2k", &path, &tmp_err);
+  check_error(tmp_err);
+  close(fd);
+
+  opj_codec_t *codec = opj_create_compress(OPJ_CODEC_J2K);
+  opj_stream_t *stream = opj_stream_create_default_file_stream(path, false);
+  if (!stream || !opj_setup_encoder(codec, &params, image) ||
+      !opj_start_compress(codec, image, stream) ||
+      !opj_encode(codec, stream) ||
+      !opj_end_compress(codec, stream)) {
+    common_fail("Couldn't encode JPEG 2000 image");
+  }
+  opj_stream_destroy(stream);
+  opj_destroy_codec(codec);
+  opj_image_destroy(image);
+
+  gchar *buf;
+  gsize size;
+  if (!g_file_get_contents(path, &buf, &size, &tmp_err)) {
+    check_error(tmp_err);
+  }
+  g_unlink(path);
+  g_free(path);
+  *len = size;
+  return buf;
+}
+#endif
+
+static void bench_decoders(void) {
+  const int32_t w = DECODE_TILE_SIZE;
+  const int32_t h = DECODE_TILE_SIZE;
+  uint8_t *rgb = make_rgb_tile(w, h);
+  uint32_t *dest = g_new(uint32_t, w * h);
+  GError *err = NULL;
+  GTimer *timer = g_timer_new();
+  int64_t len;
+
+  void *jpeg = encode_jpeg(rgb, w, h, &len);
+  g_timer_start(timer);
+  for (int i = 0; i < DECODE_JPEG_ITERATIONS; i++) {
+    if (!_openslide_jpeg_decode_buffer(jpeg, len, dest, w, h, &err)) {
+      check_error(err);
+    }
+  }
+  report("decode", "jpeg", DECODE_JPEG_ITERATIONS,
+         g_timer_elapsed(timer, NULL), NULL);
+  g_free(jpeg);
+
+  void *png = encode_png(rgb, w, h, &len);
+  g_timer_start(timer);
+  for (int i = 0; i < DECODE_PNG_ITERATIONS; i++) {
+    if (!_openslide_png_decode_buffer(png, len, dest, w, h, &err)) {
+      check_error(err);
+    }
+  }
+  report("decode", "png", DECODE_PNG_ITERATIONS,
+         g_timer_elapsed(timer, NULL), NULL);
+  g_free(png);
+
+#ifdef HAVE_OPENJPEG2
+  void *jp2k = encode_jp2k(rgb, w, h, &len);
+  g_timer_start(timer);
+  for (int i = 0; i < DECODE_JP2K_ITERATIONS; i++) {
+    if (!_openslide_jp2k_decode_buffer(dest, w, h, w, h, 0, jp2k, len,
+                                       OPENSLIDE_JP2K_RGB, &err)) {
+      check_error(err);
+    }
+  }
+  report("decode", "jp2k", DECODE_JP2K_ITERATIONS,
+         g_timer_elapsed(timer, NULL), NULL);
+  g_free(jp2k);
+#else
+  // OpenJPEG 1 can't write to memory; skip rather than vendor an image
+  fprintf(stderr, "Skipping JPEG 2000: needs OpenJPEG 2\n");
+#endif
+
+  g_timer_destroy(timer);
+  g_free(dest);
+  g_free(rgb);
+}
+
+
+/* Pixel operations */
+
+static void bench_pixels(void) {
+  const int64_t n = CONVERT_PIXELS;
+  uint8_t *bytes = g_malloc(n * 4);
+  uint16_t *words = g_new(uint16_t, n * 3);
+  int32_t *samples = g_new(int32_t, n * 3);
+  uint32_t *argb = g_new(uint32_t, n);
+  uint8_t *out = g_malloc(n * 4);
+  GRand *rand = g_rand_new_with_seed(RANDOM_SEED);
+  for (int64_t i = 0; i < n * 4; i++) {
+    bytes[i] = g_rand_int(rand);
+  }
+  for (int64_t i = 0; i < n * 3; i++) {
+    words[i] = g_rand_int_range(rand, 0, 4096);
+    samples[i] = g_rand_int_range(rand, 0, 256);
+  }
+  for (int64_t i = 0; i < n; i++) {
+    argb[i] = 0xff000000 | g_rand_int(rand);
+  }
+  g_rand_free(rand);
+
+  GTimer *timer = g_timer_new();
+  GError *err = NULL;
+
+#define BENCH_PIXELS(variant, stmt) do {                                \
+    g_timer_start(timer);                                               \
+    for (int i = 0; i < CONVERT_ITERATIONS; i++) {                      \
+      stmt;                                                             \
+    }                                                                   \
+    report("pixels", variant, (int64_t) CONVERT_ITERATIONS * n,         \
+           g_timer_elapsed(timer, NULL), NULL);                         \
+  } while (0)
+
+  BENCH_PIXELS("abgr-to-argb",
+               _openslide_convert_abgr_to_argb(argb, n));
+  BENCH_PIXELS("rgb-to-argb",
+               _openslide_convert_rgb_to_argb(argb, bytes, n));
+  BENCH_PIXELS("rgb12-to-argb",
+               _openslide_convert_rgb12_to_argb(argb, words, n));
+  BENCH_PIXELS("planes-to-argb",
+               _openslide_convert_planes_to_argb(argb, bytes, bytes + n,
+                                                 bytes + 2 * n, n));
+  BENCH_PIXELS("gray-to-argb",
+               _openslide_convert_gray_to_argb(argb, bytes, n));
+  BENCH_PIXELS("rgba-to-argb",
+               _openslide_convert_rgba_to_argb(argb, bytes, n));
+  BENCH_PIXELS("ycbcr422-to-argb",
+               _openslide_convert_ycbcr422_row_to_argb(argb, samples,
+                                                       samples + n,
+                                                       samples + 2 * n, n));
+  BENCH_PIXELS("argb-to-rgba",
+               _openslide_convert_argb_to_rgba(out, argb, n, false));
+  BENCH_PIXELS("argb-to-rgb",
+               _openslide_convert_argb_to_rgb(out, argb, n));
+  // clear a partial right column and bottom row, as at a level's edge
+  BENCH_PIXELS("clip-tile",
+               if (!_openslide_clip_tile(argb, 256, n / 256,
+                                         200, n / 256 - 56, &err)) {
+                 check_error(err);
+               });
+
+#undef BENCH_PIXELS
+
+  g_timer_destroy(timer);
+  g_free(out);
+  g_free(argb);
+  g_free(samples);
+  g_free(words);
+  g_free(bytes);
+}
+
+
+int main(int argc, char **argv) {
+  common_fix_argv(&argc, &argv);
+  if (argc > 2) {
+    printf("Usage: %s [threads]\n", argv[0]);
+    return 2;
+  }
+  int threads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+  if (threads < 1) {
+    printf("Invalid thread count\n");
+    return 2;
+  }
+
+  printf("{\"openslide_version\": \"%s\",\n  \"results\": [",
+         openslide_get_version());
+
+  int64_t keys[] = {CACHE_CAPACITY_TILES / 2, CACHE_CAPACITY_TILES * 2,
+                    CACHE_CAPACITY_TILES * 8};
+  for (guint k = 0; k < G_N_ELEMENTS(keys); k++) {
+    bench_cache(1, keys[k]);
+    if (threads > 1) {
+      bench_cache(threads, keys[k]);
+    }
+  }
+  bench_grids();
+  bench_decoders();
+  bench_pixels();
+
+  printf("\n  ]\n}\n");
+  return 0;
+}
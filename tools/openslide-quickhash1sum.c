@@ -20,61 +20,133 @@
  */
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <glib.h>
 #include "openslide.h"
 #include "openslide-common.h"
 
-static gboolean process(const char *file) {
+struct result {
+  char *output;  // line for stdout, or NULL
+  char *error;   // line for stderr, or NULL
+  bool done;
+};
+
+static gint jobs = 1;
+
+static struct result *results;
+static GMutex *result_mutex;
+static GCond *result_cond;
+
+static void process(const char *file, struct result *result) {
   openslide_t *osr = openslide_open(file);
   if (osr == NULL) {
-    fprintf(stderr, "%s: %s: Not a file that OpenSlide can recognize\n",
-	    g_get_prgname(), file);
-    fflush(stderr);
-    return FALSE;
+    result->error = g_strdup_printf("%s: %s: Not a file that OpenSlide "
+                                    "can recognize\n",
+                                    g_get_prgname(), file);
+    return;
   }
 
   const char *err = openslide_get_error(osr);
   if (err) {
-    fprintf(stderr, "%s: %s: %s\n", g_get_prgname(), file, err);
-    fflush(stderr);
+    result->error = g_strdup_printf("%s: %s: %s\n", g_get_prgname(), file,
+                                    err);
     openslide_close(osr);
-    return FALSE;
+    return;
   }
 
   const char *hash = openslide_get_property_value(osr,
         "openslide.quickhash-1");
   if (hash != NULL) {
-    printf("%s  %s\n", hash, file);
+    result->output = g_strdup_printf("%s  %s\n", hash, file);
   } else {
-    fprintf(stderr, "%s: %s: No quickhash-1 available\n", g_get_prgname(),
-            file);
-    fflush(stderr);
-    openslide_close(osr);
-    return FALSE;
+    result->error = g_strdup_printf("%s: %s: No quickhash-1 available\n",
+                                    g_get_prgname(), file);
   }
 
   openslide_close(osr);
-  return TRUE;
 }
 
+// print and free a result; returns whether it was a success
+static gboolean report(struct result *result) {
+  gboolean ok = result->error == NULL;
+  if (result->output) {
+    printf("%s", result->output);
+  }
+  if (result->error) {
+    fprintf(stderr, "%s", result->error);
+    fflush(stderr);
+  }
+  g_free(result->output);
+  g_free(result->error);
+  return ok;
+}
+
+static void run_job(gpointer data, gpointer user_data) {
+  char **argv = user_data;
+  int i = GPOINTER_TO_INT(data);
+
+  struct result result = {0};
+  process(argv[i], &result);
+
+  g_mutex_lock(result_mutex);
+  results[i] = result;
+  results[i].done = true;
+  g_cond_broadcast(result_cond);
+  g_mutex_unlock(result_mutex);
+}
+
+static const GOptionEntry options[] = {
+  {"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+   "Hash N slides in parallel", "N"},
+  {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
 
 static const struct common_usage_info usage_info = {
   "FILE...",
   "Print OpenSlide quickhash-1 (256-bit) checksums.",
+  options,
 };
 
 int main (int argc, char **argv) {
   common_parse_commandline(&usage_info, &argc, &argv);
-  if (argc < 2) {
+  if (argc < 2 || jobs < 1) {
     common_usage(&usage_info);
   }
 
   int ret = 0;
+  if (jobs == 1) {
+    for (int i = 1; i < argc; i++) {
+      struct result result = {0};
+      process(argv[i], &result);
+      if (!report(&result)) {
+        ret = 1;
+      }
+    }
+    return ret;
+  }
+
+  // hash in parallel, but print in argument order
+  result_mutex = g_mutex_new();
+  result_cond = g_cond_new();
+  results = g_new0(struct result, argc);
+  GThreadPool *pool = g_thread_pool_new(run_job, argv, jobs, true, NULL);
   for (int i = 1; i < argc; i++) {
-    if (!process(argv[i])) {
+    g_thread_pool_push(pool, GINT_TO_POINTER(i), NULL);
+  }
+  for (int i = 1; i < argc; i++) {
+    g_mutex_lock(result_mutex);
+    while (!results[i].done) {
+      g_cond_wait(result_cond, result_mutex);
+    }
+    g_mutex_unlock(result_mutex);
+    if (!report(&results[i])) {
       ret = 1;
     }
   }
+  g_thread_pool_free(pool, false, true);
+  g_free(results);
+  g_cond_free(result_cond);
+  g_mutex_free(result_mutex);
 
   return ret;
 }
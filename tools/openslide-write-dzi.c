@@ -0,0 +1,447 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2015 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Write a Deep Zoom tile pyramid.
+
+   Level 0 of the slide is read once, in bands of whole tile rows.  Each
+   band is cut into rows of Deep Zoom tiles and also halved into the
+   rows of the next lower Deep Zoom level, and so on down, so no level
+   is read or decoded twice.  Slide tiles are decoded, and Deep Zoom
+   tiles encoded, on pools of worker threads sharing one slide handle
+   and its caches. */
+
+#include "openslide.h"
+#include "openslide-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <png.h>
+#include <jpeglib.h>
+
+#define DEFAULT_BAND_ROWS 256
+// encode jobs in flight per worker, to bound memory
+#define JOBS_PER_THREAD 4
+
+static gint tile_size = 254;
+static gint overlap = 1;
+static gint quality = 75;
+static gint threads = 1;
+static gchar *format = NULL;
+
+struct encoder {
+  GThreadPool *pool;
+  GMutex *lock;
+  GCond *cond;
+  int outstanding;
+  int limit;
+
+  char *files_dir;
+  const char *suffix;
+  bool png;
+  uint8_t background[3];
+};
+
+struct tile_job {
+  struct encoder *enc;
+  int32_t level;
+  int64_t col;
+  int64_t row;
+  int32_t w;
+  int32_t h;
+  uint32_t *pixels;  // premultiplied ARGB
+};
+
+// one Deep Zoom level, built a row at a time from the level above
+struct dz_level {
+  int32_t level;
+  int64_t w;
+  int64_t h;
+  int64_t tile_rows;
+  int64_t next_tile_row;
+
+  // rows [first, first + count) of the level
+  uint32_t *rows;
+  int64_t first;
+  int64_t count;
+  int64_t capacity;
+
+  // for the level below: an even row awaiting its partner
+  uint32_t *pending;
+  bool have_pending;
+  uint32_t *scratch;
+};
+
+static void write_jpeg(FILE *f, const struct tile_job *job) {
+  const struct encoder *enc = job->enc;
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+
+  // the default error handler exits
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, f);
+  cinfo.image_width = job->w;
+  cinfo.image_height = job->h;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+
+  uint8_t *line = g_malloc(job->w * 3);
+  for (int32_t y = 0; y < job->h; y++) {
+    const uint32_t *p = job->pixels + (size_t) y * job->w;
+    for (int32_t x = 0; x < job->w; x++) {
+      // composite over the background
+      uint32_t a = p[x] >> 24;
+      for (int c = 0; c < 3; c++) {
+        uint32_t value = (p[x] >> (16 - 8 * c)) & 0xFF;
+        line[x * 3 + c] =
+          value + (enc->background[c] * (255 - a) + 127) / 255;
+      }
+    }
+    JSAMPROW rowp = line;
+    jpeg_write_scanlines(&cinfo, &rowp, 1);
+  }
+  g_free(line);
+
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+}
+
+static void write_png(FILE *f, const struct tile_job *job) {
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                                NULL, NULL, NULL);
+  png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+  if (!info_ptr) {
+    common_fail("Could not initialize PNG");
+  }
+  uint8_t *line = g_malloc(job->w * 4);
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    common_fail("Error writing PNG");
+  }
+  png_init_io(png_ptr, f);
+  png_set_IHDR(png_ptr, info_ptr, job->w, job->h, 8,
+               PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+
+  for (int32_t y = 0; y < job->h; y++) {
+    const uint32_t *p = job->pixels + (size_t) y * job->w;
+    for (int32_t x = 0; x < job->w; x++) {
+      // un-premultiply
+      uint32_t a = p[x] >> 24;
+      for (int c = 0; c < 3; c++) {
+        uint32_t value = (p[x] >> (16 - 8 * c)) & 0xFF;
+        line[x * 4 + c] = a ? (value * 255 + a / 2) / a : 0;
+      }
+      line[x * 4 + 3] = a;
+    }
+    png_write_row(png_ptr, line);
+  }
+
+  png_write_end(png_ptr, info_ptr);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  g_free(line);
+}
+
+static void encode_tile(gpointer data, gpointer user_data G_GNUC_UNUSED) {
+  struct tile_job *job = data;
+  struct encoder *enc = job->enc;
+
+  char *path = g_strdup_printf("%s/%d/%"PRId64"_%"PRId64".%s",
+                               enc->files_dir, job->level,
+                               job->col, job->row, enc->suffix);
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    common_fail("Can't open %s for writing: %s", path, strerror(errno));
+  }
+  if (enc->png) {
+    write_png(f, job);
+  } else {
+    write_jpeg(f, job);
+  }
+  if (fclose(f)) {
+    common_fail("Can't write %s: %s", path, strerror(errno));
+  }
+  g_free(path);
+  g_free(job->pixels);
+  g_slice_free(struct tile_job, job);
+
+  g_mutex_lock(enc->lock);
+  enc->outstanding--;
+  g_cond_signal(enc->cond);
+  g_mutex_unlock(enc->lock);
+}
+
+static void submit_tile(struct encoder *enc, struct tile_job *job) {
+  g_mutex_lock(enc->lock);
+  while (enc->outstanding >= enc->limit) {
+    g_cond_wait(enc->cond, enc->lock);
+  }
+  enc->outstanding++;
+  g_mutex_unlock(enc->lock);
+  g_thread_pool_push(enc->pool, job, NULL);
+}
+
+// cut one row of tiles from the buffered rows, then drop the rows that
+// later tiles don't overlap
+static void emit_tile_row(struct encoder *enc, struct dz_level *l) {
+  int64_t r = l->next_tile_row++;
+  int64_t y0 = MAX(r * tile_size - overlap, 0);
+  int64_t y1 = MIN((r + 1) * tile_size + overlap, l->h);
+  g_assert(y0 >= l->first && y1 <= l->first + l->count);
+
+  for (int64_t c = 0; c * tile_size < l->w; c++) {
+    int64_t x0 = MAX(c * tile_size - overlap, 0);
+    int64_t x1 = MIN((c + 1) * tile_size + overlap, l->w);
+    struct tile_job *job = g_slice_new(struct tile_job);
+    job->enc = enc;
+    job->level = l->level;
+    job->col = c;
+    job->row = r;
+    job->w = x1 - x0;
+    job->h = y1 - y0;
+    job->pixels = g_malloc((size_t) job->w * job->h * 4);
+    for (int32_t y = 0; y < job->h; y++) {
+      memcpy(job->pixels + (size_t) y * job->w,
+             l->rows + (y0 - l->first + y) * l->w + x0,
+             job->w * 4);
+    }
+    submit_tile(enc, job);
+  }
+
+  int64_t keep = MAX((r + 1) * tile_size - overlap, l->first);
+  int64_t drop = MIN(keep - l->first, l->count);
+  memmove(l->rows, l->rows + drop * l->w,
+          (l->count - drop) * l->w * 4);
+  l->first += drop;
+  l->count -= drop;
+}
+
+// average premultiplied ARGB pixels, channel by channel
+static void halve_row(uint32_t *dest, int64_t dest_w,
+                      const uint32_t *a, const uint32_t *b, int64_t src_w) {
+  for (int64_t x = 0; x < dest_w; x++) {
+    // an odd last column is counted twice
+    int64_t x1 = MIN(2 * x + 1, src_w - 1);
+    uint32_t src[4] = {a[2 * x], a[x1], b ? b[2 * x] : 0, b ? b[x1] : 0};
+    int n = b ? 4 : 2;
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      uint32_t sum = 0;
+      for (int i = 0; i < n; i++) {
+        sum += (src[i] >> shift) & 0xFF;
+      }
+      out |= ((sum + n / 2) / n) << shift;
+    }
+    dest[x] = out;
+  }
+}
+
+static void add_row(struct encoder *enc, struct dz_level *levels,
+                    int32_t level, const uint32_t *row) {
+  struct dz_level *l = &levels[level];
+  g_assert(l->count < l->capacity);
+  memcpy(l->rows + l->count * l->w, row, l->w * 4);
+  l->count++;
+  int64_t received = l->first + l->count;
+
+  while (l->next_tile_row < l->tile_rows &&
+         received >= MIN((l->next_tile_row + 1) * tile_size + overlap,
+                         l->h)) {
+    emit_tile_row(enc, l);
+  }
+
+  if (level == 0) {
+    return;
+  }
+  struct dz_level *below = &levels[level - 1];
+  if (l->have_pending) {
+    halve_row(l->scratch, below->w, l->pending, row, l->w);
+    l->have_pending = false;
+    add_row(enc, levels, level - 1, l->scratch);
+  } else if (received == l->h) {
+    // odd last row
+    halve_row(l->scratch, below->w, row, NULL, l->w);
+    add_row(enc, levels, level - 1, l->scratch);
+  } else {
+    memcpy(l->pending, row, l->w * 4);
+    l->have_pending = true;
+  }
+}
+
+static void write_dzi(const char *path, const char *suffix,
+                      int64_t w, int64_t h) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    common_fail("Can't open %s for writing: %s", path, strerror(errno));
+  }
+  fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+          "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n"
+          "  Format=\"%s\" Overlap=\"%d\" TileSize=\"%d\">\n"
+          "  <Size Width=\"%"PRId64"\" Height=\"%"PRId64"\"/>\n"
+          "</Image>\n", suffix, overlap, tile_size, w, h);
+  if (fclose(f)) {
+    common_fail("Can't write %s: %s", path, strerror(errno));
+  }
+}
+
+static const GOptionEntry options[] = {
+  {"format", 'f', 0, G_OPTION_ARG_STRING, &format,
+   "Tile format, jpeg or png (default jpeg)", "FORMAT"},
+  {"quality", 'q', 0, G_OPTION_ARG_INT, &quality,
+   "JPEG quality, 1-100 (default 75)", "Q"},
+  {"tile-size", 's', 0, G_OPTION_ARG_INT, &tile_size,
+   "Tile size without overlap (default 254)", "PIXELS"},
+  {"overlap", 'e', 0, G_OPTION_ARG_INT, &overlap,
+   "Overlap between tiles (default 1)", "PIXELS"},
+  {"jobs", 'j', 0, G_OPTION_ARG_INT, &threads,
+   "Decode and encode with N threads", "N"},
+  {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const struct common_usage_info usage_info = {
+  "slide output",
+  "Write a Deep Zoom tile pyramid of a virtual slide to output.dzi and "
+  "output_files.",
+  options,
+};
+
+int main(int argc, char **argv) {
+  common_parse_commandline(&usage_info, &argc, &argv);
+  bool png = format && !strcmp(format, "png");
+  if (argc != 3 || (format && !png && strcmp(format, "jpeg")) ||
+      quality < 1 || quality > 100 || tile_size < 1 || overlap < 0 ||
+      overlap > tile_size || threads < 1) {
+    common_usage(&usage_info);
+  }
+  const char *slide = argv[1];
+  const char *output = argv[2];
+
+  openslide_t *osr = openslide_open(slide);
+  if (!osr) {
+    common_fail("%s: Not a file that OpenSlide can recognize", slide);
+  }
+  if (openslide_get_error(osr)) {
+    common_fail("%s: %s", slide, openslide_get_error(osr));
+  }
+  int64_t w, h;
+  openslide_get_level0_dimensions(osr, &w, &h);
+
+  // read bands of whole tile rows, so each tile is decoded once
+  const char *value =
+    openslide_get_property_value(osr, "openslide.level[0].tile-height");
+  int64_t band_rows = value ? g_ascii_strtoll(value, NULL, 10) : 0;
+  if (band_rows <= 0) {
+    band_rows = DEFAULT_BAND_ROWS;
+  }
+  band_rows = MIN(band_rows, h);
+  openslide_set_decode_threads(osr, threads);
+
+  struct encoder enc = {
+    .pool = g_thread_pool_new(encode_tile, NULL, threads, TRUE, NULL),
+    .lock = g_mutex_new(),
+    .cond = g_cond_new(),
+    .limit = threads * JOBS_PER_THREAD,
+    .files_dir = g_strdup_printf("%s_files", output),
+    .suffix = png ? "png" : "jpeg",
+    .png = png,
+  };
+  value = openslide_get_property_value(osr,
+                                       OPENSLIDE_PROPERTY_NAME_BACKGROUND_COLOR);
+  unsigned int r = 255, g = 255, b = 255;
+  if (value) {
+    sscanf(value, "%2x%2x%2x", &r, &g, &b);
+  }
+  enc.background[0] = r;
+  enc.background[1] = g;
+  enc.background[2] = b;
+
+  // set up levels; the last is full resolution
+  int32_t level_count = 1;
+  while ((1LL << (level_count - 1)) < MAX(w, h)) {
+    level_count++;
+  }
+  struct dz_level *levels = g_new0(struct dz_level, level_count);
+  for (int32_t i = 0; i < level_count; i++) {
+    struct dz_level *l = &levels[i];
+    int shift = level_count - 1 - i;
+    l->level = i;
+    l->w = (w + (1LL << shift) - 1) >> shift;
+    l->h = (h + (1LL << shift) - 1) >> shift;
+    l->tile_rows = (l->h + tile_size - 1) / tile_size;
+    l->capacity = MIN(tile_size + 2 * overlap, l->h);
+    l->rows = g_malloc(l->capacity * l->w * 4);
+    if (i > 0) {
+      l->pending = g_malloc(l->w * 4);
+      l->scratch = g_malloc(levels[i - 1].w * 4);
+    }
+
+    char *dir = g_strdup_printf("%s/%d", enc.files_dir, i);
+    if (g_mkdir_with_parents(dir, 0777)) {
+      common_fail("Can't create %s: %s", dir, strerror(errno));
+    }
+    g_free(dir);
+  }
+
+  // read the slide
+  uint32_t *band = g_malloc(w * band_rows * 4);
+  for (int64_t y = 0; y < h; y += band_rows) {
+    int64_t rows = MIN(band_rows, h - y);
+    openslide_read_region(osr, band, 0, y, 0, w, rows);
+    if (openslide_get_error(osr)) {
+      common_fail("%s", openslide_get_error(osr));
+    }
+    for (int64_t i = 0; i < rows; i++) {
+      add_row(&enc, levels, level_count - 1, band + i * w);
+    }
+  }
+  g_free(band);
+
+  // wait for the encoders
+  g_thread_pool_free(enc.pool, false, true);
+  for (int32_t i = 0; i < level_count; i++) {
+    g_assert(levels[i].next_tile_row == levels[i].tile_rows);
+    g_free(levels[i].rows);
+    g_free(levels[i].pending);
+    g_free(levels[i].scratch);
+  }
+  g_free(levels);
+
+  char *dzi = g_strdup_printf("%s.dzi", output);
+  write_dzi(dzi, enc.suffix, w, h);
+  g_free(dzi);
+
+  g_cond_free(enc.cond);
+  g_mutex_free(enc.lock);
+  g_free(enc.files_dir);
+  g_free(format);
+  openslide_close(osr);
+  return 0;
+}
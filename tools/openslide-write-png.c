@@ -59,6 +59,78 @@ static void fail(const char *format, ...) {
 }
 
 
+// bands of rows are read on one thread while the previous band is
+// compressed on another
+#define BANDS 2
+#define DEFAULT_BAND_MEMORY 64  // MiB, for all bands
+
+static gint band_memory = DEFAULT_BAND_MEMORY;
+static gint compression_level = -1;  // zlib default
+static gint decode_threads = 0;
+
+struct band {
+  uint32_t *buf;
+  int32_t rows;
+  bool failed;
+};
+
+struct band_reader {
+  openslide_t *osr;
+  int64_t x;
+  int32_t level;
+  int32_t w;
+  int64_t start_row;  // level coordinates
+  int64_t end_row;
+  int64_t band_rows;
+  GAsyncQueue *free_bands;
+  GAsyncQueue *full_bands;
+};
+
+// end bands on multiples of band_rows, so that each band reads whole
+// rows of tiles
+static int64_t next_band_start(int64_t row, int64_t band_rows) {
+  int64_t rem = ((row % band_rows) + band_rows) % band_rows;
+  return row - rem + band_rows;
+}
+
+static void *read_bands(void *data) {
+  struct band_reader *rd = data;
+  double ds = openslide_get_level_downsample(rd->osr, rd->level);
+
+  int64_t row = rd->start_row;
+  while (row < rd->end_row) {
+    struct band *band = g_async_queue_pop(rd->free_bands);
+    int64_t next = MIN(next_band_start(row, rd->band_rows), rd->end_row);
+    band->rows = next - row;
+    openslide_read_region_format(rd->osr, band->buf, 0,
+                                 OPENSLIDE_PIXEL_FORMAT_RGBA,
+                                 rd->x, row * ds, rd->level,
+                                 rd->w, band->rows);
+    band->failed = openslide_get_error(rd->osr) != NULL;
+    g_async_queue_push(rd->full_bands, band);
+    if (band->failed) {
+      break;
+    }
+    row = next;
+  }
+  return NULL;
+}
+
+// rows per band within the memory budget, rounded down to whole rows
+// of tiles when possible
+static int64_t get_band_rows(openslide_t *osr, int32_t level,
+                             int32_t w, int32_t h) {
+  int64_t rows = ((int64_t) band_memory << 20) / BANDS / ((int64_t) w * 4);
+  char *name = g_strdup_printf("openslide.level[%d].tile-height", level);
+  const char *value = openslide_get_property_value(osr, name);
+  g_free(name);
+  int64_t tile_h = value ? g_ascii_strtoll(value, NULL, 10) : 0;
+  if (tile_h > 0 && rows >= tile_h) {
+    rows -= rows % tile_h;
+  }
+  return MAX(MIN(rows, h), 1);
+}
+
 static void write_png(openslide_t *osr, FILE *f,
 		      int64_t x, int64_t y, int32_t level,
 		      int32_t w, const int32_t h) {
@@ -83,6 +155,9 @@ static void write_png(openslide_t *osr, FILE *f,
 	       PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
 	       PNG_COMPRESSION_TYPE_DEFAULT,
 	       PNG_FILTER_TYPE_DEFAULT);
+  if (compression_level >= 0) {
+    png_set_compression_level(png_ptr, compression_level);
+  }
 
   // text
   png_text text_ptr[1];
@@ -110,61 +185,50 @@ static void write_png(openslide_t *osr, FILE *f,
   // start writing
   png_write_info(png_ptr, info_ptr);
 
-  uint32_t *dest = g_malloc(w * 4);
-  int32_t lines_to_draw = h;
+  // start reading
   double ds = openslide_get_level_downsample(osr, level);
-  int32_t yy = y / ds;
-  while (lines_to_draw) {
-    openslide_read_region(osr, dest,
-			  x, yy * ds, level, w, 1);
-
-    const char *err = openslide_get_error(osr);
-    if (err) {
-      fail("%s", err);
-    }
+  struct band_reader rd = {
+    .osr = osr,
+    .x = x,
+    .level = level,
+    .w = w,
+    .start_row = y / ds,
+    .band_rows = get_band_rows(osr, level, w, h),
+    .free_bands = g_async_queue_new(),
+    .full_bands = g_async_queue_new(),
+  };
+  rd.end_row = rd.start_row + h;
+  struct band bands[BANDS];
+  for (int i = 0; i < BANDS; i++) {
+    bands[i].buf = g_malloc((size_t) w * rd.band_rows * 4);
+    g_async_queue_push(rd.free_bands, &bands[i]);
+  }
+  GThread *thread = g_thread_create(read_bands, &rd, TRUE, NULL);
+  if (!thread) {
+    fail("Couldn't start reader thread");
+  }
 
-    // un-premultiply alpha and pack into expected format
-    for (int i = 0; i < w; i++) {
-      uint32_t p = dest[i];
-      uint8_t *p8 = (uint8_t *) (dest + i);
-
-      uint8_t a = (p >> 24) & 0xFF;
-      uint8_t r = (p >> 16) & 0xFF;
-      uint8_t g = (p >> 8) & 0xFF;
-      uint8_t b = p & 0xFF;
-
-      switch (a) {
-      case 0:
-	r = 0;
-	b = 0;
-	g = 0;
-	break;
-
-      case 255:
-	// no action
-	break;
-
-      default:
-	r = (r * 255 + a / 2) / a;
-	g = (g * 255 + a / 2) / a;
-	b = (b * 255 + a / 2) / a;
-	break;
-      }
-
-      // write back
-      p8[0] = r;
-      p8[1] = g;
-      p8[2] = b;
-      p8[3] = a;
+  // compress each band as it arrives
+  int32_t rows_written = 0;
+  while (rows_written < h) {
+    struct band *band = g_async_queue_pop(rd.full_bands);
+    if (band->failed) {
+      fail("%s", openslide_get_error(osr));
     }
-
-    png_write_row(png_ptr, (png_bytep) dest);
-    yy++;
-    lines_to_draw--;
+    for (int32_t i = 0; i < band->rows; i++) {
+      png_write_row(png_ptr, (png_bytep) (band->buf + (size_t) i * w));
+    }
+    rows_written += band->rows;
+    g_async_queue_push(rd.free_bands, band);
   }
+  g_thread_join(thread);
 
   // end
-  g_free(dest);
+  for (int i = 0; i < BANDS; i++) {
+    g_free(bands[i].buf);
+  }
+  g_async_queue_unref(rd.free_bands);
+  g_async_queue_unref(rd.full_bands);
   g_free(key);
   g_free(text);
   png_write_end(png_ptr, info_ptr);
@@ -172,14 +236,27 @@ static void write_png(openslide_t *osr, FILE *f,
 }
 
 
+static const GOptionEntry options[] = {
+  {"memory", 'm', 0, G_OPTION_ARG_INT, &band_memory,
+   "Buffer up to N MiB of pixels (default 64)", "N"},
+  {"compression", 'z', 0, G_OPTION_ARG_INT, &compression_level,
+   "zlib compression level, 0-9", "LEVEL"},
+  {"threads", 'j', 0, G_OPTION_ARG_INT, &decode_threads,
+   "Decode tiles with N threads", "N"},
+  {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
 static const struct common_usage_info usage_info = {
   "slide x y level width height output.png",
   "Write a region of a virtual slide to a PNG.",
+  options,
 };
 
 int main (int argc, char **argv) {
   common_parse_commandline(&usage_info, &argc, &argv);
-  if (argc != 8) {
+  if (argc != 8 || band_memory < 1 || band_memory > 4096 ||
+      compression_level < -1 || compression_level > 9 ||
+      decode_threads < 0) {
     common_usage(&usage_info);
   }
 
@@ -204,6 +281,7 @@ int main (int argc, char **argv) {
   if (err) {
     fail("%s: %s", slide, err);
   }
+  openslide_set_decode_threads(osr, decode_threads);
 
   // validate args
   ENSURE_NONNEG(level);